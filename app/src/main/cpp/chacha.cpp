@@ -0,0 +1,572 @@
+// ChaCha20-Poly1305 of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "chacha.h"
+
+// Native C++
+# include <cstring>
+
+// SIMD engines
+# if defined(__x86_64__) || defined(__i386__)
+#   define CHACHA_X86
+#   include <cpuid.h>
+#   include <immintrin.h>
+# elif defined(__ARM_NEON)
+#   define CHACHA_NEON
+#   include <arm_neon.h>
+# endif
+
+// One keystream block: 'length' (up to 64) bytes of 'in' XORed with it go to 'out', or the keystream
+// itself without 'in'
+struct ChachaBlock {
+  u32 counter;
+  const u8 *nonce;
+  const u8 *in;
+  u8 *out;
+  u32 length;
+};
+
+// Engine: computes up to 'lanes' blocks per call
+struct ChachaEngine {
+  const char *name;
+  int lanes;
+  void (*blocks)(const ChachaKey &key, const ChachaBlock *blocks, int count);
+};
+
+static const ChachaEngine *engine;
+static const u32 sigma[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574}; // "expand 32-byte k"
+
+// Every supported ABI is little endian, and so is ChaCha
+static u32 load_le32(const u8 *ptr) {
+  u32 value;
+  memcpy(&value, ptr, 4);
+  return value;
+}
+
+static void store_le32(u8 *ptr, u32 value) {
+  memcpy(ptr, &value, 4);
+}
+
+// Quarter and double rounds over 16 state words or vectors, with the ADD, XOR and ROTL of an engine
+# define CHACHA_QUARTER(a, b, c, d) \
+  a = ADD(a, b); d = ROTL(XOR(d, a), 16); \
+  c = ADD(c, d); b = ROTL(XOR(b, c), 12); \
+  a = ADD(a, b); d = ROTL(XOR(d, a), 8);  \
+  c = ADD(c, d); b = ROTL(XOR(b, c), 7)
+
+# define CHACHA_DOUBLE_ROUND(x) \
+  CHACHA_QUARTER(x[0], x[4], x[8],  x[12]); \
+  CHACHA_QUARTER(x[1], x[5], x[9],  x[13]); \
+  CHACHA_QUARTER(x[2], x[6], x[10], x[14]); \
+  CHACHA_QUARTER(x[3], x[7], x[11], x[15]); \
+  CHACHA_QUARTER(x[0], x[5], x[10], x[15]); \
+  CHACHA_QUARTER(x[1], x[6], x[11], x[12]); \
+  CHACHA_QUARTER(x[2], x[7], x[8],  x[13]); \
+  CHACHA_QUARTER(x[3], x[4], x[9],  x[14])
+
+static void emit(const ChachaBlock &block, const u8 *stream) {
+  if (block.in == nullptr) {
+    memcpy(block.out, stream, block.length);
+    return;
+  }
+  u32 i = 0;
+  for (; i + 8 <= block.length; i += 8) {
+    u64 a, b;
+    memcpy(&a, block.in + i, 8);
+    memcpy(&b, stream + i, 8);
+    a ^= b;
+    memcpy(block.out + i, &a, 8);
+  }
+  for (; i < block.length; ++ i) {
+    block.out[i] = block.in[i] ^ stream[i];
+  }
+}
+
+# define ADD(a, b)  ((a) + (b))
+# define XOR(a, b)  ((a) ^ (b))
+# define ROTL(v, n) ((v) << (n) | (v) >> (32 - (n)))
+
+static void blocks_soft(const ChachaKey &key, const ChachaBlock *blocks, int count) {
+  for (int i = 0; i < count; ++ i) {
+    u32 state[16], x[16];
+    memcpy(state, sigma, 16);
+    memcpy(state + 4, key.words, 32);
+    state[12] = blocks[i].counter;
+    for (int j = 0; j < 3; ++ j) {
+      state[13 + j] = load_le32(blocks[i].nonce + j * 4);
+    }
+    memcpy(x, state, 64);
+    for (int round = 0; round < 10; ++ round) {
+      CHACHA_DOUBLE_ROUND(x);
+    }
+    u8 stream[64];
+    for (int j = 0; j < 16; ++ j) {
+      store_le32(stream + j * 4, x[j] + state[j]);
+    }
+    emit(blocks[i], stream);
+  }
+}
+
+# undef ADD
+# undef XOR
+# undef ROTL
+
+static const ChachaEngine soft_engine = {"portable", 1, blocks_soft};
+
+// Per-lane counters and nonces, lanes past 'count' repeat the first block
+static void lane_words(const ChachaBlock *blocks, int count, int lanes, u32 (*words)[CHACHA_MAX_LANES]) {
+  for (int i = 0; i < lanes; ++ i) {
+    const ChachaBlock &block = blocks[i < count ? i : 0];
+    words[0][i] = block.counter;
+    for (int j = 0; j < 3; ++ j) {
+      words[1 + j][i] = load_le32(block.nonce + j * 4);
+    }
+  }
+}
+
+# ifdef CHACHA_X86
+
+# define ADD(a, b)  _mm_add_epi32(a, b)
+# define XOR(a, b)  _mm_xor_si128(a, b)
+# define ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+__attribute__((target("sse2")))
+static void blocks_sse2(const ChachaKey &key, const ChachaBlock *blocks, int count) {
+  alignas(16) u32 words[4][CHACHA_MAX_LANES];
+  lane_words(blocks, count, 4, words);
+  __m128i state[16], x[16];
+  for (int i = 0; i < 4; ++ i) {
+    state[i] = _mm_set1_epi32(sigma[i]);
+    state[12 + i] = _mm_load_si128((const __m128i *) words[i]);
+  }
+  for (int i = 0; i < 8; ++ i) {
+    state[4 + i] = _mm_set1_epi32(key.words[i]);
+  }
+  memcpy(x, state, sizeof(x));
+  for (int round = 0; round < 10; ++ round) {
+    CHACHA_DOUBLE_ROUND(x);
+  }
+
+  // Transpose four words of every lane at a time
+  alignas(16) u8 stream[4][64];
+  for (int i = 0; i < 4; ++ i) {
+    __m128i a = ADD(x[i * 4], state[i * 4]), b = ADD(x[i * 4 + 1], state[i * 4 + 1]);
+    __m128i c = ADD(x[i * 4 + 2], state[i * 4 + 2]), d = ADD(x[i * 4 + 3], state[i * 4 + 3]);
+    __m128i ab_low = _mm_unpacklo_epi32(a, b), cd_low = _mm_unpacklo_epi32(c, d);
+    __m128i ab_high = _mm_unpackhi_epi32(a, b), cd_high = _mm_unpackhi_epi32(c, d);
+    _mm_store_si128((__m128i *) (stream[0] + i * 16), _mm_unpacklo_epi64(ab_low, cd_low));
+    _mm_store_si128((__m128i *) (stream[1] + i * 16), _mm_unpackhi_epi64(ab_low, cd_low));
+    _mm_store_si128((__m128i *) (stream[2] + i * 16), _mm_unpacklo_epi64(ab_high, cd_high));
+    _mm_store_si128((__m128i *) (stream[3] + i * 16), _mm_unpackhi_epi64(ab_high, cd_high));
+  }
+  for (int i = 0; i < count; ++ i) {
+    emit(blocks[i], stream[i]);
+  }
+}
+
+# undef ADD
+# undef XOR
+# undef ROTL
+
+# define ADD(a, b)  _mm256_add_epi32(a, b)
+# define XOR(a, b)  _mm256_xor_si256(a, b)
+# define ROTL(v, n) ((n) == 16 ? _mm256_shuffle_epi8(v, rotate16) : (n) == 8 ? _mm256_shuffle_epi8(v, rotate8) : \
+                     _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n))))
+
+__attribute__((target("avx2")))
+static void blocks_avx2(const ChachaKey &key, const ChachaBlock *blocks, int count) {
+  alignas(32) u32 words[4][CHACHA_MAX_LANES];
+  lane_words(blocks, count, 8, words);
+  const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                            2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                           3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+  __m256i state[16], x[16];
+  for (int i = 0; i < 4; ++ i) {
+    state[i] = _mm256_set1_epi32(sigma[i]);
+    state[12 + i] = _mm256_load_si256((const __m256i *) words[i]);
+  }
+  for (int i = 0; i < 8; ++ i) {
+    state[4 + i] = _mm256_set1_epi32(key.words[i]);
+  }
+  memcpy(x, state, sizeof(x));
+  for (int round = 0; round < 10; ++ round) {
+    CHACHA_DOUBLE_ROUND(x);
+  }
+
+  // Unpacking works within 128-bit halves, so the low half holds lanes 0 ~ 3 and the high half 4 ~ 7
+  alignas(32) u8 stream[8][64];
+  for (int i = 0; i < 4; ++ i) {
+    __m256i a = ADD(x[i * 4], state[i * 4]), b = ADD(x[i * 4 + 1], state[i * 4 + 1]);
+    __m256i c = ADD(x[i * 4 + 2], state[i * 4 + 2]), d = ADD(x[i * 4 + 3], state[i * 4 + 3]);
+    __m256i ab_low = _mm256_unpacklo_epi32(a, b), cd_low = _mm256_unpacklo_epi32(c, d);
+    __m256i ab_high = _mm256_unpackhi_epi32(a, b), cd_high = _mm256_unpackhi_epi32(c, d);
+    __m256i lanes[4] = {_mm256_unpacklo_epi64(ab_low, cd_low), _mm256_unpackhi_epi64(ab_low, cd_low),
+                        _mm256_unpacklo_epi64(ab_high, cd_high), _mm256_unpackhi_epi64(ab_high, cd_high)};
+    for (int j = 0; j < 4; ++ j) {
+      _mm_store_si128((__m128i *) (stream[j] + i * 16), _mm256_castsi256_si128(lanes[j]));
+      _mm_store_si128((__m128i *) (stream[j + 4] + i * 16), _mm256_extracti128_si256(lanes[j], 1));
+    }
+  }
+  for (int i = 0; i < count; ++ i) {
+    emit(blocks[i], stream[i]);
+  }
+}
+
+# undef ADD
+# undef XOR
+# undef ROTL
+
+static const ChachaEngine sse2_engine = {"SSE2", 4, blocks_sse2};
+static const ChachaEngine avx2_engine = {"AVX2", 8, blocks_avx2};
+
+// AVX2, with the YMM state enabled by the OS
+static bool avx2_supported() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) {
+    return false;
+  }
+  unsigned xcr0_low, xcr0_high;
+  __asm__ ("xgetbv" : "=a" (xcr0_low), "=d" (xcr0_high) : "c" (0));
+  if ((xcr0_low & 6) != 6) {
+    return false;
+  }
+  return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_AVX2);
+}
+# endif
+
+# ifdef CHACHA_NEON
+
+# define ADD(a, b)  vaddq_u32(a, b)
+# define XOR(a, b)  veorq_u32(a, b)
+# define ROTL(v, n) ((n) == 16 ? vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v))) : \
+                     vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - (n)))
+
+static void blocks_neon(const ChachaKey &key, const ChachaBlock *blocks, int count) {
+  u32 words[4][CHACHA_MAX_LANES];
+  lane_words(blocks, count, 4, words);
+  uint32x4_t state[16], x[16];
+  for (int i = 0; i < 4; ++ i) {
+    state[i] = vdupq_n_u32(sigma[i]);
+    state[12 + i] = vld1q_u32(words[i]);
+  }
+  for (int i = 0; i < 8; ++ i) {
+    state[4 + i] = vdupq_n_u32(key.words[i]);
+  }
+  memcpy(x, state, sizeof(x));
+  for (int round = 0; round < 10; ++ round) {
+    CHACHA_DOUBLE_ROUND(x);
+  }
+
+  // An interleaving store of four vectors lays out four words of every lane in turn
+  u32 stream[4][16];
+  for (int i = 0; i < 4; ++ i) {
+    uint32x4x4_t group;
+    group.val[0] = ADD(x[i * 4], state[i * 4]);
+    group.val[1] = ADD(x[i * 4 + 1], state[i * 4 + 1]);
+    group.val[2] = ADD(x[i * 4 + 2], state[i * 4 + 2]);
+    group.val[3] = ADD(x[i * 4 + 3], state[i * 4 + 3]);
+    u32 interleaved[16];
+    vst4q_u32(interleaved, group);
+    for (int j = 0; j < 4; ++ j) {
+      memcpy(stream[j] + i * 4, interleaved + j * 4, 16);
+    }
+  }
+  for (int i = 0; i < count; ++ i) {
+    emit(blocks[i], (const u8 *) stream[i]);
+  }
+}
+
+# undef ADD
+# undef XOR
+# undef ROTL
+
+// NEON is part of the arm64 and armeabi-v7a ABIs
+static const ChachaEngine neon_engine = {"NEON", 4, blocks_neon};
+# endif
+
+static void select_engine() {
+  if (engine) {
+    return;
+  }
+  engine = &soft_engine;
+# if defined(CHACHA_X86)
+  engine = avx2_supported() ? &avx2_engine : &sse2_engine;
+# elif defined(CHACHA_NEON)
+  engine = &neon_engine;
+# endif
+}
+
+const char* chacha_engine() {
+  select_engine();
+  return engine -> name;
+}
+
+int chacha_lanes() {
+  select_engine();
+  return engine -> lanes;
+}
+
+void chacha_init(ChachaKey &key, const u8 *bytes) {
+  select_engine();
+  for (int i = 0; i < 8; ++ i) {
+    key.words[i] = load_le32(bytes + i * 4);
+  }
+}
+
+// Blocks wait here until they fill the lanes of a pass
+struct Pass {
+  const ChachaKey &key;
+  ChachaBlock blocks[CHACHA_MAX_LANES];
+  int count;
+};
+
+static void flush(Pass &pass) {
+  if (pass.count) {
+    engine -> blocks(pass.key, pass.blocks, pass.count);
+    pass.count = 0;
+  }
+}
+
+static void push(Pass &pass, u32 counter, const u8 *nonce, const u8 *in, u8 *out, u32 length) {
+  pass.blocks[pass.count ++] = {counter, nonce, in, out, length};
+  if (pass.count == engine -> lanes) {
+    flush(pass);
+  }
+}
+
+// Poly1305 accumulator, with limbs that suit the word size
+# ifdef __SIZEOF_INT128__
+
+// 44-bit limbs and 128-bit products on 64-bit cores
+typedef unsigned __int128 u128;
+
+struct Poly {
+  u64 r0, r1, r2, s1, s2;
+  u64 h0, h1, h2;
+};
+
+static u64 load_le64(const u8 *ptr) {
+  u64 value;
+  memcpy(&value, ptr, 8);
+  return value;
+}
+
+static void poly_init(Poly &poly, const u8 *one_time) {
+  u64 t0 = load_le64(one_time), t1 = load_le64(one_time + 8);
+  poly.r0 = t0 & 0xffc0fffffff;
+  poly.r1 = (t0 >> 44 | t1 << 20) & 0xfffffc0ffff;
+  poly.r2 = (t1 >> 24) & 0x00ffffffc0f;
+  poly.s1 = poly.r1 * (5 << 2);
+  poly.s2 = poly.r2 * (5 << 2);
+  poly.h0 = poly.h1 = poly.h2 = 0;
+}
+
+static void poly_block(Poly &poly, const u8 *block) {
+  const u64 mask44 = 0xfffffffffff, mask42 = 0x3ffffffffff;
+  u64 t0 = load_le64(block), t1 = load_le64(block + 8);
+  u64 h0 = poly.h0 + (t0 & mask44);
+  u64 h1 = poly.h1 + ((t0 >> 44 | t1 << 20) & mask44);
+  u64 h2 = poly.h2 + ((t1 >> 24) & mask42) + ((u64) 1 << 40);
+  u128 d0 = (u128) h0 * poly.r0 + (u128) h1 * poly.s2 + (u128) h2 * poly.s1;
+  u128 d1 = (u128) h0 * poly.r1 + (u128) h1 * poly.r0 + (u128) h2 * poly.s2;
+  u128 d2 = (u128) h0 * poly.r2 + (u128) h1 * poly.r1 + (u128) h2 * poly.r0;
+  d1 += (u64) (d0 >> 44);
+  d2 += (u64) (d1 >> 44);
+  h0 = (u64) d0 & mask44;
+  h1 = (u64) d1 & mask44;
+  h2 = (u64) d2 & mask42;
+  h0 += (u64) (d2 >> 42) * 5;
+  h1 += h0 >> 44;
+  poly.h0 = h0 & mask44;
+  poly.h1 = h1;
+  poly.h2 = h2;
+}
+
+static void poly_finish(Poly &poly, const u8 *one_time, u8 *tag) {
+  const u64 mask44 = 0xfffffffffff, mask42 = 0x3ffffffffff;
+  u64 h0 = poly.h0, h1 = poly.h1, h2 = poly.h2, c;
+
+  // Full carry, then h - p if h >= p
+  c = h1 >> 44; h1 &= mask44; h2 += c;
+  c = h2 >> 42; h2 &= mask42; h0 += c * 5;
+  c = h0 >> 44; h0 &= mask44; h1 += c;
+  c = h1 >> 44; h1 &= mask44; h2 += c;
+  c = h2 >> 42; h2 &= mask42; h0 += c * 5;
+  c = h0 >> 44; h0 &= mask44; h1 += c;
+  u64 g0 = h0 + 5; c = g0 >> 44; g0 &= mask44;
+  u64 g1 = h1 + c; c = g1 >> 44; g1 &= mask44;
+  u64 g2 = h2 + c - ((u64) 1 << 42);
+  u64 select = (g2 >> 63) - 1;
+  h0 = (h0 & ~select) | (g0 & select);
+  h1 = (h1 & ~select) | (g1 & select);
+  h2 = (h2 & ~select) | (g2 & select);
+
+  // h + s mod 2^128
+  u64 t0 = load_le64(one_time + 16), t1 = load_le64(one_time + 24);
+  h0 += t0 & mask44; c = h0 >> 44; h0 &= mask44;
+  h1 += ((t0 >> 44 | t1 << 20) & mask44) + c; c = h1 >> 44; h1 &= mask44;
+  h2 += (t1 >> 24) + c;
+  u64 words[2] = {h0 | h1 << 44, h1 >> 20 | h2 << 24};
+  memcpy(tag, words, 16);
+}
+
+# else
+
+// 26-bit limbs on 32-bit cores
+struct Poly {
+  u32 r0, r1, r2, r3, r4, s1, s2, s3, s4;
+  u32 h0, h1, h2, h3, h4;
+};
+
+static void poly_init(Poly &poly, const u8 *one_time) {
+  poly.r0 = load_le32(one_time) & 0x3ffffff;
+  poly.r1 = (load_le32(one_time + 3) >> 2) & 0x3ffff03;
+  poly.r2 = (load_le32(one_time + 6) >> 4) & 0x3ffc0ff;
+  poly.r3 = (load_le32(one_time + 9) >> 6) & 0x3f03fff;
+  poly.r4 = (load_le32(one_time + 12) >> 8) & 0x00fffff;
+  poly.s1 = poly.r1 * 5;
+  poly.s2 = poly.r2 * 5;
+  poly.s3 = poly.r3 * 5;
+  poly.s4 = poly.r4 * 5;
+  poly.h0 = poly.h1 = poly.h2 = poly.h3 = poly.h4 = 0;
+}
+
+static void poly_block(Poly &poly, const u8 *block) {
+  const u32 mask = 0x3ffffff;
+  u32 h0 = poly.h0 + (load_le32(block) & mask);
+  u32 h1 = poly.h1 + ((load_le32(block + 3) >> 2) & mask);
+  u32 h2 = poly.h2 + ((load_le32(block + 6) >> 4) & mask);
+  u32 h3 = poly.h3 + ((load_le32(block + 9) >> 6) & mask);
+  u32 h4 = poly.h4 + ((load_le32(block + 12) >> 8) | (1 << 24));
+  u64 d0 = (u64) h0 * poly.r0 + (u64) h1 * poly.s4 + (u64) h2 * poly.s3 + (u64) h3 * poly.s2 + (u64) h4 * poly.s1;
+  u64 d1 = (u64) h0 * poly.r1 + (u64) h1 * poly.r0 + (u64) h2 * poly.s4 + (u64) h3 * poly.s3 + (u64) h4 * poly.s2;
+  u64 d2 = (u64) h0 * poly.r2 + (u64) h1 * poly.r1 + (u64) h2 * poly.r0 + (u64) h3 * poly.s4 + (u64) h4 * poly.s3;
+  u64 d3 = (u64) h0 * poly.r3 + (u64) h1 * poly.r2 + (u64) h2 * poly.r1 + (u64) h3 * poly.r0 + (u64) h4 * poly.s4;
+  u64 d4 = (u64) h0 * poly.r4 + (u64) h1 * poly.r3 + (u64) h2 * poly.r2 + (u64) h3 * poly.r1 + (u64) h4 * poly.r0;
+  d1 += d0 >> 26;
+  d2 += d1 >> 26;
+  d3 += d2 >> 26;
+  d4 += d3 >> 26;
+  h0 = ((u32) d0 & mask) + (u32) (d4 >> 26) * 5;
+  poly.h1 = ((u32) d1 & mask) + (h0 >> 26);
+  poly.h0 = h0 & mask;
+  poly.h2 = (u32) d2 & mask;
+  poly.h3 = (u32) d3 & mask;
+  poly.h4 = (u32) d4 & mask;
+}
+
+static void poly_finish(Poly &poly, const u8 *one_time, u8 *tag) {
+  const u32 mask = 0x3ffffff;
+  u32 h0 = poly.h0, h1 = poly.h1, h2 = poly.h2, h3 = poly.h3, h4 = poly.h4, c;
+
+  // Full carry, then h - p if h >= p
+  c = h1 >> 26; h1 &= mask; h2 += c;
+  c = h2 >> 26; h2 &= mask; h3 += c;
+  c = h3 >> 26; h3 &= mask; h4 += c;
+  c = h4 >> 26; h4 &= mask; h0 += c * 5;
+  c = h0 >> 26; h0 &= mask; h1 += c;
+  u32 g0 = h0 + 5; c = g0 >> 26; g0 &= mask;
+  u32 g1 = h1 + c; c = g1 >> 26; g1 &= mask;
+  u32 g2 = h2 + c; c = g2 >> 26; g2 &= mask;
+  u32 g3 = h3 + c; c = g3 >> 26; g3 &= mask;
+  u32 g4 = h4 + c - (1 << 26);
+  u32 select = (g4 >> 31) - 1;
+  h0 = (h0 & ~select) | (g0 & select);
+  h1 = (h1 & ~select) | (g1 & select);
+  h2 = (h2 & ~select) | (g2 & select);
+  h3 = (h3 & ~select) | (g3 & select);
+  h4 = (h4 & ~select) | (g4 & select);
+
+  // h + s mod 2^128
+  u32 words[4] = {h0 | h1 << 26, h1 >> 6 | h2 << 20, h2 >> 12 | h3 << 14, h3 >> 18 | h4 << 8};
+  u64 sum = 0;
+  for (int i = 0; i < 4; ++ i) {
+    sum += (u64) words[i] + load_le32(one_time + 16 + i * 4);
+    store_le32(tag + i * 4, (u32) sum);
+    sum >>= 32;
+  }
+}
+
+# endif
+
+// Poly1305 over the AAD and ciphertext (each zero padded) and their lengths, so every block is whole
+static void poly1305(const u8 *one_time, const u8 *aad, u32 aad_length, const u8 *data, u32 length, u8 *tag) {
+  Poly poly;
+  poly_init(poly, one_time);
+  const u8 *parts[2] = {aad, data};
+  u32 lengths[2] = {aad_length, length};
+  u8 block[16];
+  for (int i = 0; i < 2; ++ i) {
+    u32 whole = lengths[i] & ~15u;
+    for (u32 j = 0; j < whole; j += 16) {
+      poly_block(poly, parts[i] + j);
+    }
+    if (lengths[i] != whole) {
+      memset(block, 0, 16);
+      memcpy(block, parts[i] + whole, lengths[i] - whole);
+      poly_block(poly, block);
+    }
+  }
+  u64 sizes[2] = {aad_length, length};
+  memcpy(block, sizes, 16);
+  poly_block(poly, block);
+  poly_finish(poly, one_time, tag);
+}
+
+// Block 0 of every frame gives its one-time Poly1305 key, the data starts from block 1
+void chacha_seal(const ChachaKey &key, ChachaJob *jobs, int count) {
+  select_engine();
+  u8 one_time[CHACHA_GROUP][64];
+  for (int base = 0; base < count; base += CHACHA_GROUP) {
+    int group = count - base < CHACHA_GROUP ? count - base : CHACHA_GROUP;
+    ChachaJob *batch = jobs + base;
+    Pass pass = {key, {}, 0};
+    for (int i = 0; i < group; ++ i) {
+      push(pass, 0, batch[i].nonce, nullptr, one_time[i], 32);
+    }
+    for (int i = 0; i < group; ++ i) {
+      for (u32 offset = 0, counter = 1; offset < batch[i].length; offset += 64, ++ counter) {
+        u32 length = batch[i].length - offset < 64 ? batch[i].length - offset : 64;
+        push(pass, counter, batch[i].nonce, batch[i].data + offset, batch[i].data + offset, length);
+      }
+    }
+    flush(pass);
+    for (int i = 0; i < group; ++ i) {
+      poly1305(one_time[i], batch[i].aad, batch[i].aad_length, batch[i].data, batch[i].length, batch[i].tag);
+    }
+  }
+}
+
+// The first pass also decrypts the head of the frame aside, so short frames take a single pass and
+// nothing is written before the tag is checked
+bool chacha_open(const ChachaKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, u8 *data, u32 length, const u8 *tag) {
+  select_engine();
+  u8 one_time[64], head[(CHACHA_MAX_LANES - 1) * 64];
+  u32 head_length = (engine -> lanes - 1) * 64;
+  head_length = length < head_length ? length : head_length;
+
+  Pass pass = {key, {}, 0};
+  push(pass, 0, nonce, nullptr, one_time, 32);
+  for (u32 offset = 0, counter = 1; offset < head_length; offset += 64, ++ counter) {
+    push(pass, counter, nonce, data + offset, head + offset, head_length - offset < 64 ? head_length - offset : 64);
+  }
+  flush(pass);
+
+  u8 expected[CHACHA_TAG_LENGTH], difference = 0;
+  poly1305(one_time, aad, aad_length, data, length, expected);
+  for (int i = 0; i < CHACHA_TAG_LENGTH; ++ i) {
+    difference |= expected[i] ^ tag[i];
+  }
+  if (difference) {
+    return false;
+  }
+
+  memcpy(data, head, head_length);
+  for (u32 offset = head_length, counter = head_length / 64 + 1; offset < length; offset += 64, ++ counter) {
+    push(pass, counter, nonce, data + offset, data + offset, length - offset < 64 ? length - offset : 64);
+  }
+  flush(pass);
+  return true;
+}
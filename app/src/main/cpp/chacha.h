@@ -0,0 +1,43 @@
+// ChaCha20-Poly1305 of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define CHACHA_KEY_LENGTH            32
+# define CHACHA_NONCE_LENGTH          12
+# define CHACHA_TAG_LENGTH            16
+# define CHACHA_MAX_LANES             8     // blocks per pass of the widest engine
+# define CHACHA_GROUP                 16    // frames whose one-time keys are kept at a time
+
+// RFC 8439 AEAD. The engine (AVX2 with 8 lanes, SSE2 or NEON with 4, or portable C with 1) is
+// picked once from the CPU features at run time. A lane computes one 64-byte keystream block, and
+// the lanes of a pass are filled with blocks of several frames, so short frames still use all of
+// them; Poly1305 is scalar
+
+struct ChachaKey {
+  u32 words[8];
+};
+
+// One frame of a batch, encrypted in place
+struct ChachaJob {
+  const u8 *nonce;
+  const u8 *aad;
+  u32 aad_length;
+  u8 *data;
+  u32 length;
+  u8 *tag;
+};
+
+// Name of the engine in use, and the blocks it computes per pass
+const char* chacha_engine();
+int chacha_lanes();
+
+void chacha_init(ChachaKey &key, const u8 *bytes);
+
+// Seal a batch of frames; open returns false (and leaves 'data' untouched) if the tag does not match
+void chacha_seal(const ChachaKey &key, ChachaJob *jobs, int count);
+bool chacha_open(const ChachaKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, u8 *data, u32 length, const u8 *tag);
@@ -0,0 +1,28 @@
+// Common definitions of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+// Android Includes
+# include <android/log.h>
+
+// Native C++
+# include <time.h>
+
+// Defines & Macros
+# define debug(...) __android_log_print(ANDROID_LOG_DEBUG, __func__, __VA_ARGS__)
+# define error(...) __android_log_print(ANDROID_LOG_ERROR, __func__, __VA_ARGS__)
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef long long i64;
+
+// Utilities - monotonic clock in microseconds
+inline u64 now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
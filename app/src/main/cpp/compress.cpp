@@ -0,0 +1,380 @@
+// Payload compression of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "compress.h"
+# include "packet.h"
+
+// Native C++
+# include <cstring>
+
+// LZ4 block format: the last match starts at least LZ4_MATCH_LIMIT bytes before the end, and the
+// last LZ4_LAST_LITERALS bytes are always literals
+# define LZ4_MIN_MATCH                4
+# define LZ4_MATCH_LIMIT              12
+# define LZ4_LAST_LITERALS            5
+# define LZ4_SKIP_TRIGGER             6     // misses before the search step grows
+
+// What is known of a flow, by flow hash
+struct Verdict {
+  u32 flow;
+  u16 skip;    // frames still sent as they are
+  u16 backoff; // skip after the next miss
+};
+
+static const u32 accelerations[COMPRESS_LEVELS] = {1, 4, 16};
+static const u32 assumed_mbps[COMPRESS_LEVELS] = {2400, 4000, 6400}; // until measured
+
+static bool enabled;
+static Verdict verdicts[COMPRESS_FLOWS];
+static u64 sample_in[COMPRESS_LEVELS], sample_us[COMPRESS_LEVELS]; // packing since the last update (writer thread)
+
+// Statistics
+u32 compress_packed, compress_bypassed, compress_missed, compress_unpacked, compress_rejected;
+u64 compress_up_in, compress_up_out, compress_down_in, compress_down_out;
+u64 compress_up_cpu_us, compress_down_cpu_us;
+volatile int compress_level;
+u32 compress_link_mbps;
+u32 compress_level_mbps[COMPRESS_LEVELS];
+
+static inline u32 read32(const u8 *ptr) {
+  u32 value;
+  memcpy(&value, ptr, sizeof(u32));
+  return value;
+}
+
+static inline u32 hash_of(const u8 *ptr) {
+  return (read32(ptr) * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+}
+
+// Length beyond the 15 of a token nibble
+static u8* put_length(u8 *op, u32 length) {
+  for (; length >= 255; length -= 255) {
+    *op ++ = 255;
+  }
+  *op ++ = (u8) length;
+  return op;
+}
+
+static bool get_length(const u8 *&ip, const u8 *end, u32 &length) {
+  u8 byte;
+  do {
+    if (ip == end) {
+      return false;
+    }
+    byte = *ip ++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Compress a block (under 64 KBytes) into at most 'capacity' bytes, returns 0 if it does not fit. The
+// search step starts at 'acceleration' and grows while no match turns up
+static u32 lz4_compress(const u8 *src, u32 length, u8 *dst, u32 capacity, u32 acceleration) {
+  u16 table[1 << COMPRESS_HASH_BITS];
+  memset(table, 0, sizeof(table));
+  const u8 *ip = src + 1, *anchor = src, *end = src + length;
+  const u8 *start_limit = end - LZ4_MATCH_LIMIT, *match_limit = end - LZ4_LAST_LITERALS;
+  u8 *op = dst, *out_end = dst + capacity;
+  if (length <= LZ4_MATCH_LIMIT) {
+    goto last;
+  }
+  while (true) {
+    // Find a match (position 0 is in the zeroed table already)
+    const u8 *match;
+    for (u32 search = acceleration << LZ4_SKIP_TRIGGER; ; ip += search ++ >> LZ4_SKIP_TRIGGER) {
+      if (ip > start_limit) {
+        goto last;
+      }
+      u32 h = hash_of(ip);
+      match = src + table[h];
+      table[h] = (u16) (ip - src);
+      if (match < ip && read32(match) == read32(ip)) {
+        break;
+      }
+    }
+    while (ip > anchor && match > src && ip[-1] == match[-1]) {
+      -- ip;
+      -- match;
+    }
+
+    // Literals, then the match and any that follow at once
+    u32 literals = ip - anchor;
+    if (op + 1 + literals / 255 + 1 + literals + 2 > out_end) {
+      return 0;
+    }
+    u8 *token = op ++;
+    if (literals >= 15) {
+      *token = 15 << 4;
+      op = put_length(op, literals - 15);
+    } else {
+      *token = (u8) (literals << 4);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    while (true) {
+      u32 offset = ip - match;
+      *op ++ = (u8) offset;
+      *op ++ = (u8) (offset >> 8);
+      const u8 *from = ip;
+      ip += LZ4_MIN_MATCH;
+      match += LZ4_MIN_MATCH;
+      while (ip < match_limit && *ip == *match) {
+        ++ ip;
+        ++ match;
+      }
+      u32 extra = ip - from - LZ4_MIN_MATCH;
+      if (op + extra / 255 + 1 > out_end) {
+        return 0;
+      }
+      if (extra >= 15) {
+        *token |= 15;
+        op = put_length(op, extra - 15);
+      } else {
+        *token |= (u8) extra;
+      }
+      anchor = ip;
+      if (ip > start_limit) {
+        goto last;
+      }
+      table[hash_of(ip - 2)] = (u16) (ip - 2 - src);
+      u32 h = hash_of(ip);
+      match = src + table[h];
+      table[h] = (u16) (ip - src);
+      if (match >= ip || read32(match) != read32(ip)) {
+        break;
+      }
+      if (op + 3 > out_end) {
+        return 0;
+      }
+      token = op ++;
+      *token = 0;
+    }
+    ++ ip;
+  }
+
+last:
+  u32 literals = end - anchor;
+  if (op + 1 + literals / 255 + 1 + literals > out_end) {
+    return 0;
+  }
+  if (literals >= 15) {
+    *op ++ = 15 << 4;
+    op = put_length(op, literals - 15);
+  } else {
+    *op ++ = (u8) (literals << 4);
+  }
+  memcpy(op, anchor, literals);
+  return op + literals - dst;
+}
+
+// Decompress a block into at most 'capacity' bytes, returns its length or -1 if it is malformed or
+// does not fit
+static int lz4_decompress(const u8 *src, u32 length, u8 *dst, u32 capacity) {
+  const u8 *ip = src, *end = src + length;
+  u8 *op = dst, *out_end = dst + capacity;
+  while (ip < end) {
+    u32 token = *ip ++, literals = token >> 4;
+    if (literals == 15 && !get_length(ip, end, literals)) {
+      return -1;
+    }
+    if (literals > (u32) (end - ip) || literals > (u32) (out_end - op)) {
+      return -1;
+    }
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+
+    // The last sequence has no match
+    if (ip == end) {
+      return op - dst;
+    }
+    if (end - ip < 2) {
+      return -1;
+    }
+    u32 offset = ip[0] | ip[1] << 8, matched = token & 15;
+    ip += 2;
+    if (offset == 0 || offset > (u32) (op - dst)) {
+      return -1;
+    }
+    if (matched == 15 && !get_length(ip, end, matched)) {
+      return -1;
+    }
+    matched += LZ4_MIN_MATCH;
+    if (matched > (u32) (out_end - op)) {
+      return -1;
+    }
+    const u8 *from = op - offset;
+    if (offset >= matched) {
+      memcpy(op, from, matched);
+    } else {
+      for (u32 i = 0; i < matched; ++ i) {
+        op[i] = from[i];
+      }
+    }
+    op += matched;
+  }
+  return -1;
+}
+
+// Payload of a TCP/UDP packet (or of the IP packet), nullptr if there is none
+static const u8* payload_of(const u8 *packet, u32 length, u32 &size) {
+  if (!is_ipv4(packet, length)) {
+    return nullptr;
+  }
+  u32 offset = ipv4_header_length(packet);
+  const u8 *tcp = transport_header(packet, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  if (tcp) {
+    offset += (tcp[TCP_OFFSET] >> 4) * 4u;
+  } else if (transport_header(packet, length, IPPROTO_UDP, UDP_HEADER)) {
+    offset += UDP_HEADER;
+  }
+  size = length > offset ? length - offset : 0;
+  return size ? packet + offset : nullptr;
+}
+
+// Entropy probe, whether the payload is already encrypted or compressed: a TLS record, or a sample
+// with about as many distinct byte values as random data would have
+static bool incompressible(const u8 *packet, u32 length) {
+  u32 size;
+  const u8 *payload = payload_of(packet, length, size);
+  if (payload == nullptr) {
+    return false;
+  }
+  if (packet[IPV4_PROTOCOL] == IPPROTO_TCP && size >= 3 && payload[0] == 23 && payload[1] == 3 && payload[2] == 3) {
+    return true;
+  }
+  if (size < COMPRESS_PROBE_LENGTH) {
+    return false;
+  }
+  u64 seen[4] = {0};
+  u32 distinct = 0;
+  for (u32 i = 0; i < COMPRESS_PROBE_LENGTH; ++ i) {
+    u64 &word = seen[payload[i] >> 6];
+    u64 bit = (u64) 1 << (payload[i] & 63);
+    distinct += !(word & bit);
+    word |= bit;
+  }
+  return distinct >= COMPRESS_PROBE_DISTINCT;
+}
+
+bool compress_configure(bool enable) {
+  enabled = false;
+  if (!enable) {
+    return true;
+  }
+  memset(verdicts, 0, sizeof(verdicts));
+  memset(sample_in, 0, sizeof(sample_in));
+  memset(sample_us, 0, sizeof(sample_us));
+  memcpy(compress_level_mbps, assumed_mbps, sizeof(assumed_mbps));
+  compress_packed = compress_bypassed = compress_missed = compress_unpacked = compress_rejected = 0;
+  compress_up_in = compress_up_out = compress_down_in = compress_down_out = 0;
+  compress_up_cpu_us = compress_down_cpu_us = 0;
+  compress_level = 0;
+  compress_link_mbps = 0;
+  enabled = true;
+  return true;
+}
+
+bool compress_enabled() {
+  return enabled;
+}
+
+void compress_link(u64 rate) {
+  compress_link_mbps = rate * 8 / 1000000;
+  int level = -1;
+  for (int i = 0; i < COMPRESS_LEVELS && level < 0; ++ i) {
+    if (compress_level_mbps[i] >= (u64) COMPRESS_HEADROOM * compress_link_mbps) {
+      level = i;
+    }
+  }
+  if (level != compress_level) {
+    debug("Compression level %d for a %d Mbit/s link", level, compress_link_mbps);
+    compress_level = level;
+  }
+}
+
+// The codec never blocks, so the time it takes is CPU time, which also measures the level in use
+void compress_frames(Message **frames, int count) {
+  if (!enabled) {
+    return;
+  }
+  int level = compress_level;
+  u64 start = 0, sampled = 0;
+  u8 packed[DATA_MAX_LENGTH];
+  for (int i = 0; i < count; ++ i) {
+    Message &frame = *frames[i];
+    u32 length = frame.length - HEADER_LENGTH;
+    if ((frame.type != NET_REQUEST && frame.type != DEDUPED) || length < COMPRESS_MIN_LENGTH) {
+      continue;
+    }
+    compress_up_in += length;
+
+    // A DEDUPED frame is no packet: its flow is the one of the headers it carries after the inner
+    // type and their length, and its tokens are left to LZ4 rather than to the entropy probe
+    bool deduped = frame.type == DEDUPED;
+    u32 flow = !deduped ? flow_hash(frame.data, length, 0) : frame.data[1] <= length - 2 ? flow_hash(frame.data + 2, frame.data[1], 0) : 0;
+    Verdict &verdict = verdicts[flow & (COMPRESS_FLOWS - 1)];
+    if (level < 0 || (verdict.flow == flow && verdict.skip)) {
+      if (level >= 0) {
+        -- verdict.skip;
+      }
+      compress_up_out += length;
+      ++ compress_bypassed;
+      continue;
+    }
+    if (start == 0) {
+      start = now_us();
+    }
+    sampled += length;
+    u32 size = !deduped && incompressible(frame.data, length) ? 0 :
+      lz4_compress(frame.data, length, packed, length - length / COMPRESS_MIN_SAVING - 1, accelerations[level]);
+    if (size == 0) {
+      // Leave the flow alone for a while, longer each time
+      if (verdict.flow != flow) {
+        verdict = {flow, 0, COMPRESS_SKIP_MIN};
+      }
+      verdict.skip = verdict.backoff;
+      verdict.backoff = verdict.backoff * 2 < COMPRESS_SKIP_MAX ? verdict.backoff * 2 : COMPRESS_SKIP_MAX;
+      compress_up_out += length;
+      ++ compress_missed;
+      continue;
+    }
+    verdict = {flow, 0, COMPRESS_SKIP_MIN};
+    frame.data[0] = frame.type;
+    memcpy(frame.data + 1, packed, size);
+    frame.type = COMPRESSED;
+    frame.length = HEADER_LENGTH + 1 + size;
+    compress_up_out += 1 + size;
+    ++ compress_packed;
+  }
+  if (start) {
+    u64 elapsed = now_us() - start;
+    compress_up_cpu_us += elapsed;
+    sample_in[level] += sampled;
+    sample_us[level] += elapsed;
+    if (sample_us[level] >= COMPRESS_SAMPLE_TIME) {
+      compress_level_mbps[level] = (u32) (sample_in[level] * 8 / sample_us[level]);
+      sample_in[level] = sample_us[level] = 0;
+    }
+  }
+}
+
+bool compress_open(Message &frame) {
+  u64 start = now_us();
+  u8 plain[DATA_MAX_LENGTH];
+  u32 length = frame.length - HEADER_LENGTH;
+  int size = length > 1 ? lz4_decompress(frame.data + 1, length - 1, plain, DATA_MAX_LENGTH) : -1;
+  if (size < 0 || frame.data[0] == COMPRESSED) {
+    ++ compress_rejected;
+    return false;
+  }
+  frame.type = frame.data[0];
+  frame.length = HEADER_LENGTH + size;
+  memcpy(frame.data, plain, size);
+  compress_down_in += length;
+  compress_down_out += size;
+  compress_down_cpu_us += now_us() - start;
+  ++ compress_unpacked;
+  return true;
+}
@@ -0,0 +1,51 @@
+// Payload compression of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define COMPRESS_MIN_LENGTH          128   // bytes, smaller packets are sent as they are
+# define COMPRESS_MIN_SAVING          16    // a packed frame must be at least 1/16 smaller
+# define COMPRESS_HASH_BITS           12
+# define COMPRESS_PROBE_LENGTH        256   // bytes of payload sampled by the entropy probe
+# define COMPRESS_PROBE_DISTINCT      144   // distinct byte values in the sample that mean random (162 expected)
+# define COMPRESS_FLOWS               256   // flow verdicts kept, must be a power of 2
+# define COMPRESS_SKIP_MIN            16    // frames a flow is sent as it is after a miss, doubled per miss
+# define COMPRESS_SKIP_MAX            1024
+# define COMPRESS_LEVELS              3     // LZ4 acceleration 1, 4 and 16
+# define COMPRESS_HEADROOM            4     // a level must pack this many times faster than the link
+# define COMPRESS_SAMPLE_TIME         20000 // us of packing per update of a level's throughput
+
+// With compression on, data frames of at least COMPRESS_MIN_LENGTH bytes travel as COMPRESSED frames
+// (the inner type, then an LZ4 block of its data) when that saves enough, and received ones are
+// unpacked whatever the setting. Packing runs on the writer thread before sealing. A flow whose
+// payload looks random to the entropy probe (or is a TLS record), or does not pack well, is sent
+// as it is for the next COMPRESS_SKIP_MIN ~ COMPRESS_SKIP_MAX frames, so encrypted and media flows
+// cost a table lookup per frame. The LZ4 acceleration follows the delivery rate of the link: the
+// best ratio the packing throughput affords with COMPRESS_HEADROOM to spare, and nothing at all
+// on a link faster than the fastest level. The throughput of a level is that of a mid-range phone
+// core until the frames packed at that level have measured it here
+
+// Statistics
+extern u32 compress_packed, compress_bypassed, compress_missed, compress_unpacked, compress_rejected;
+extern u64 compress_up_in, compress_up_out, compress_down_in, compress_down_out; // bytes of data frames
+extern u64 compress_up_cpu_us, compress_down_cpu_us;
+extern volatile int compress_level; // -1 while the link is too fast
+extern u32 compress_link_mbps;
+extern u32 compress_level_mbps[COMPRESS_LEVELS]; // packing throughput per level on one core
+
+// Switch compression of sent frames, before open
+bool compress_configure(bool enabled);
+bool compress_enabled();
+
+// Delivery rate of the link in bytes per second, picks the level (timer thread)
+void compress_link(u64 rate);
+
+// Pack data frames in place where it pays (writer thread)
+void compress_frames(Message **frames, int count);
+
+// Unpack a COMPRESSED frame in place, false if it is malformed (receiving order)
+bool compress_open(Message &frame);
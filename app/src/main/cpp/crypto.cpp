@@ -0,0 +1,181 @@
+// Frame encryption of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "chacha.h"
+# include "crypto.h"
+# include "gcm.h"
+# include "hash.h"
+# include "packet.h"
+
+// Native C++
+# include <atomic>
+# include <cstdlib>
+# include <cstring>
+
+// Keys of both ciphers, from the same bytes
+struct Keys {
+  GcmKey gcm;
+  ChachaKey chacha;
+};
+
+static Keys keys;
+static u8 shared_key[CRYPTO_KEY_LENGTH];
+static u8 salt[CRYPTO_SALT_LENGTH];
+static int active_cipher;
+static std::atomic<bool> enabled;
+static u64 sealed_counter;   // last sent in this session
+static u64 opened_counter;   // last received in this session
+
+// Statistics
+u32 crypto_sealed, crypto_opened, crypto_rejected;
+
+static void nonce_for(u8 *nonce, u32 direction, u64 counter) {
+  store32(nonce, direction);
+  store64(nonce + 4, counter);
+}
+
+// Number frames in sending order and wrap them for the cipher given, counting from 'counter'
+static void wrap(int with_cipher, Message **frames, int count, u64 &counter) {
+  for (int i = 0; i < count; ++ i) {
+    Message &frame = *frames[i];
+    memmove(frame.data + CRYPTO_COUNTER_LENGTH + 1, frame.data, frame.length - HEADER_LENGTH);
+    frame.data[CRYPTO_COUNTER_LENGTH] = frame.type;
+    store64(frame.data, ++ counter);
+    frame.type = with_cipher == CRYPTO_CHACHA ? SEALED_CHACHA : SEALED;
+    frame.length += CRYPTO_OVERHEAD;
+  }
+}
+
+// Encrypt wrapped frames in place with the keys given, the nonce comes from the counter in the frame
+static void encrypt(const Keys &with, Message **frames, int count) {
+  u8 nonces[CHACHA_GROUP][GCM_NONCE_LENGTH];
+  ChachaJob jobs[CHACHA_GROUP];
+  for (int base = 0; base < count; base += CHACHA_GROUP) {
+    int group = count - base < CHACHA_GROUP ? count - base : CHACHA_GROUP;
+    for (int i = 0; i < group; ++ i) {
+      Message &frame = *frames[base + i];
+      u32 length = frame.length - HEADER_LENGTH - CRYPTO_COUNTER_LENGTH - CRYPTO_TAG_LENGTH; // with the inner type
+      u8 *inner = frame.data + CRYPTO_COUNTER_LENGTH;
+
+      // The header is authenticated as sent
+      nonce_for(nonces[i], CRYPTO_UP, load64(frame.data));
+      jobs[i] = {nonces[i], (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length};
+    }
+    if (frames[base] -> type == SEALED_CHACHA) {
+      chacha_seal(with.chacha, jobs, group);
+    } else {
+      GcmJob gcm_jobs[CHACHA_GROUP];
+      for (int i = 0; i < group; ++ i) {
+        gcm_jobs[i] = {jobs[i].nonce, jobs[i].aad, jobs[i].aad_length, jobs[i].data, jobs[i].length, jobs[i].tag};
+      }
+      gcm_seal_batch(with.gcm, gcm_jobs, group);
+    }
+  }
+}
+
+bool crypto_configure(const u8 *bytes, u32 length, int choice) {
+  if (bytes == nullptr || length == 0) {
+    enabled = false;
+    return true;
+  }
+  if (length != CRYPTO_KEY_LENGTH) {
+    error("Key must be %d bytes (got %d)", CRYPTO_KEY_LENGTH, length);
+    enabled = false;
+    return false;
+  }
+  if (choice == CRYPTO_AUTO) {
+    choice = gcm_accelerated() ? CRYPTO_AES_GCM : CRYPTO_CHACHA;
+  }
+  active_cipher = choice;
+  memcpy(shared_key, bytes, CRYPTO_KEY_LENGTH);
+  crypto_session();
+  crypto_sealed = crypto_opened = crypto_rejected = 0;
+  enabled = true;
+  return true;
+}
+
+bool crypto_enabled() {
+  return enabled;
+}
+
+const char* crypto_cipher() {
+  return active_cipher == CRYPTO_CHACHA ? "ChaCha20-Poly1305" : "AES-256-GCM";
+}
+
+const char* crypto_engine() {
+  return active_cipher == CRYPTO_CHACHA ? chacha_engine() : gcm_engine();
+}
+
+void crypto_session() {
+  u8 secret[HASH_MAX_LENGTH], key[CRYPTO_KEY_LENGTH];
+  arc4random_buf(salt, CRYPTO_SALT_LENGTH);
+  hkdf_extract(HASH_SHA256, salt, CRYPTO_SALT_LENGTH, shared_key, CRYPTO_KEY_LENGTH, secret);
+  hkdf_expand(HASH_SHA256, secret, (const u8 *) CRYPTO_KEY_INFO, sizeof(CRYPTO_KEY_INFO) - 1, key, CRYPTO_KEY_LENGTH);
+  gcm_init(keys.gcm, key);
+  chacha_init(keys.chacha, key);
+  sealed_counter = opened_counter = 0;
+}
+
+bool crypto_salt(Message &frame) {
+  if (!enabled) {
+    return false;
+  }
+  frame.type = SALT;
+  frame.length = HEADER_LENGTH + CRYPTO_SALT_LENGTH;
+  memcpy(frame.data, salt, CRYPTO_SALT_LENGTH);
+  return true;
+}
+
+void crypto_seal(Message **frames, int count) {
+  crypto_wrap(frames, count);
+  crypto_encrypt(frames, count);
+}
+
+void crypto_wrap(Message **frames, int count) {
+  wrap(active_cipher, frames, count, sealed_counter);
+  crypto_sealed += count;
+}
+
+void crypto_encrypt(Message **frames, int count) {
+  encrypt(keys, frames, count);
+}
+
+bool crypto_cleartext(const Message &frame) {
+  if (!enabled || frame.type == HEARTBEAT || frame.type == IP_REPLY) {
+    return true;
+  }
+  ++ crypto_rejected;
+  return false;
+}
+
+bool crypto_open(Message &frame) {
+  return crypto_accept(frame, crypto_decrypt(frame));
+}
+
+bool crypto_decrypt(Message &frame) {
+  if (!enabled || frame.type != (active_cipher == CRYPTO_CHACHA ? SEALED_CHACHA : SEALED) || frame.length < HEADER_LENGTH + CRYPTO_OVERHEAD) {
+    return false;
+  }
+  u32 length = frame.length - HEADER_LENGTH - CRYPTO_COUNTER_LENGTH - CRYPTO_TAG_LENGTH; // with the inner type
+  u8 *inner = frame.data + CRYPTO_COUNTER_LENGTH, nonce[GCM_NONCE_LENGTH];
+  nonce_for(nonce, CRYPTO_DOWN, load64(frame.data));
+  return active_cipher == CRYPTO_CHACHA ?
+    chacha_open(keys.chacha, nonce, (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length) :
+    gcm_open(keys.gcm, nonce, (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length);
+}
+
+bool crypto_accept(Message &frame, bool authentic) {
+  u64 counter = authentic ? load64(frame.data) : 0;
+  if (!authentic || counter <= opened_counter) {
+    ++ crypto_rejected;
+    return false;
+  }
+  opened_counter = counter;
+  u32 length = frame.length - HEADER_LENGTH - CRYPTO_OVERHEAD;
+  frame.type = frame.data[CRYPTO_COUNTER_LENGTH];
+  frame.length = length + HEADER_LENGTH;
+  memmove(frame.data, frame.data + CRYPTO_COUNTER_LENGTH + 1, length);
+  ++ crypto_opened;
+  return true;
+}
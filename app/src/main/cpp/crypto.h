@@ -0,0 +1,67 @@
+// Frame encryption of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define CRYPTO_KEY_LENGTH            32
+# define CRYPTO_SALT_LENGTH           16
+# define CRYPTO_KEY_INFO              "4over6 frames" // HKDF info of the session key
+# define CRYPTO_COUNTER_LENGTH        8
+# define CRYPTO_TAG_LENGTH            16
+# define CRYPTO_OVERHEAD              (CRYPTO_COUNTER_LENGTH + 1 + CRYPTO_TAG_LENGTH)
+# define CRYPTO_UP                    0     // nonce prefix, client to server
+# define CRYPTO_DOWN                  1     // nonce prefix, server to client
+
+// Ciphers
+# define CRYPTO_AUTO                  0     // AES-GCM with AES instructions, ChaCha20-Poly1305 without
+# define CRYPTO_AES_GCM               1
+# define CRYPTO_CHACHA                2
+
+// With a pre-shared key, data frames travel as SEALED (AES-256-GCM) or SEALED_CHACHA
+// (ChaCha20-Poly1305) frames, authenticated together with their header. Both ends use the same
+// cipher, frames of the other one are rejected. Every session draws a fresh salt, sent in a SALT
+// frame first on each of its connections, and both ends key the session with HKDF-SHA256 of the
+// pre-shared key under that salt. The nonce is the direction and a 64-bit frame counter, which is
+// sent in clear and only starts over with a new session key, so it never repeats for a key. Received
+// counters must increase over the whole session, failovers included, so frames of one connection
+// can not be replayed on a later one (the server keeps its counters per session the same way)
+
+// Statistics
+extern u32 crypto_sealed, crypto_opened, crypto_rejected;
+
+// Set the pre-shared key (nullptr to disable) and cipher, before open, returns false if the key is
+// refused
+bool crypto_configure(const u8 *key, u32 length, int cipher);
+bool crypto_enabled();
+const char* crypto_cipher();
+const char* crypto_engine();
+
+// A new session, draws its salt and derives its key, both counters start over (before it connects)
+void crypto_session();
+
+// The SALT frame each connection of the session starts with, false if frames are not sealed
+bool crypto_salt(Message &frame);
+
+// Seal frames in place, in order (writer thread)
+void crypto_seal(Message **frames, int count);
+
+// The same in two steps, wrap numbers the frames in sending order (writer thread) and encrypt can
+// run on any thread afterwards
+void crypto_wrap(Message **frames, int count);
+void crypto_encrypt(Message **frames, int count);
+
+// Whether a frame received unsealed may be delivered: any without a key, and with one only the
+// control frames that travel in clear (heartbeats and IP replies), others count as rejected
+bool crypto_cleartext(const Message &frame);
+
+// Open a sealed frame in place, false if it is forged, replayed or malformed (recv thread)
+bool crypto_open(Message &frame);
+
+// The same in two steps, decrypt checks the tag (any thread) and accept checks the counter and
+// unwraps the frame, in receiving order
+bool crypto_decrypt(Message &frame);
+bool crypto_accept(Message &frame, bool authentic);
@@ -0,0 +1,400 @@
+// Byte cache of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "dedup.h"
+# include "packet.h"
+
+// Native C++
+# include <atomic>
+# include <cstring>
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+
+// Tokens after the headers of a DEDUPED frame are varints: twice the length of a literal chunk, or
+// one more than twice the number of chunks after the first of a run, then the fingerprint of the
+// first (the rest follow it in the store)
+# define DEDUP_FINGERPRINT            8
+# define DEDUP_RECORD                 2     // length of a chunk before its bytes in the store
+# define HTTPS_PORT                   443
+
+// Index entry, the high half of the fingerprint and where the chunk is in the store (0 if empty)
+struct Entry {
+  u32 tag;
+  u32 position;
+};
+
+struct alignas(64) Bucket {
+  Entry entries[DEDUP_WAYS];
+};
+
+// Ring of chunks, positions grow forever and a chunk is intact while less than 'size' behind
+struct Store {
+  u8 *base;
+  u32 size;
+  u32 head;
+  Bucket *index;
+  u32 buckets;
+  u32 generation;
+};
+
+// A flow found to carry TLS, by flow hash
+struct Verdict {
+  u32 flow;
+  bool tls;
+};
+
+static bool enabled;
+static u8 *mapping;
+static u32 mapping_length;
+static Store up, down;
+static std::atomic<u32> generation;
+static Verdict verdicts[DEDUP_FLOWS];
+static u64 gear[256];
+
+// Statistics
+u32 dedup_chunks, dedup_hits, dedup_bypassed, dedup_restored, dedup_rejected;
+u64 dedup_up_in, dedup_up_out, dedup_down_in, dedup_down_out;
+u32 dedup_store_mb;
+
+// SplitMix64, fills the Gear table from the seed both ends share
+static u64 split_mix(u64 &state) {
+  u64 z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// End of the chunk starting at 'start' of the payload, where the high bits of the hash (which
+// depend on the last 64 bytes only) are zero, so a boundary does not depend on where the chunk starts
+static u32 chunk_end(const u8 *payload, u32 start, u32 length) {
+  const u64 mask = ((1ull << DEDUP_CHUNK_BITS) - 1) << (64 - DEDUP_CHUNK_BITS);
+  u32 limit = length - start < DEDUP_CHUNK_MAX ? length : start + DEDUP_CHUNK_MAX;
+  if (limit - start <= DEDUP_CHUNK_MIN) {
+    return limit;
+  }
+  u64 hash = 0;
+  for (u32 i = start + DEDUP_CHUNK_MIN > 64 ? start + DEDUP_CHUNK_MIN - 64 : 0; i < limit; ++ i) {
+    hash = (hash << 1) + gear[payload[i]];
+    if (i >= start + DEDUP_CHUNK_MIN && !(hash & mask)) {
+      return i + 1;
+    }
+  }
+  return limit;
+}
+
+// 64-bit fingerprint of a chunk, little-endian words
+static u64 fingerprint(const u8 *data, u32 length) {
+  u64 hash = length * 0x9e3779b97f4a7c15ull, word;
+  u32 i = 0;
+  for (; i + 8 <= length; i += 8) {
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 31;
+  }
+  word = 0;
+  memcpy(&word, data + i, length - i);
+  hash = (hash ^ word) * 0x94d049bb133111ebull;
+  return hash ^ (hash >> 29);
+}
+
+static u8* put_varint(u8 *ptr, u32 value) {
+  for (; value >= 128; value >>= 7) {
+    *ptr ++ = (u8) (value | 128);
+  }
+  *ptr ++ = (u8) value;
+  return ptr;
+}
+
+static void reset(Store &store, u32 current) {
+  store.head = 0;
+  memset(store.index, 0, store.buckets * sizeof(Bucket));
+  store.generation = current;
+}
+
+// Chunk at a position of the store (the length is set), nullptr unless it is intact and before the head
+static const u8* record_at(const Store &store, u32 position, u32 &length) {
+  u32 offset = position & (store.size - 1);
+  if (store.head - position > store.size || position == store.head || offset + DEDUP_RECORD > store.size) {
+    return nullptr;
+  }
+  const u8 *record = store.base + offset;
+  length = load16(record);
+  return length && length <= DEDUP_CHUNK_MAX && offset + DEDUP_RECORD + length <= store.size ? record + DEDUP_RECORD : nullptr;
+}
+
+// Position of the first intact chunk with the fingerprint's tag in its bucket, false if none
+static bool lookup(const Store &store, u64 print, u32 &position) {
+  const Bucket &bucket = store.index[print & (store.buckets - 1)];
+  u32 tag = (u32) (print >> 32) | 1;
+  for (const Entry &entry: bucket.entries) {
+    if (entry.tag == tag && store.head - entry.position <= store.size) {
+      position = entry.position;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Cache a chunk at the head, in the first empty or overwritten entry of its bucket, else the oldest
+static void insert(Store &store, const u8 *data, u32 length, u64 print) {
+  u32 offset = store.head & (store.size - 1);
+  if (offset + DEDUP_RECORD + length > store.size) {
+    store.head += store.size - offset; // chunks never wrap
+    offset = 0;
+  }
+  u8 *record = store.base + offset;
+  store16(record, (u16) length);
+  memcpy(record + DEDUP_RECORD, data, length);
+  Bucket &bucket = store.index[print & (store.buckets - 1)];
+  Entry *victim = &bucket.entries[0];
+  for (Entry &entry: bucket.entries) {
+    u32 age = store.head - entry.position;
+    if (entry.tag == 0 || age > store.size) {
+      victim = &entry;
+      break;
+    }
+    victim = age > store.head - victim -> position ? &entry : victim;
+  }
+  *victim = {(u32) (print >> 32) | 1, store.head};
+  store.head += DEDUP_RECORD + length;
+}
+
+// TLS payloads never repeat, a flow is left alone once one is seen
+static bool bypass(const u8 *packet, u32 length, const u8 *tcp, const u8 *payload) {
+  if (load16(tcp) == HTTPS_PORT || load16(tcp + TRANSPORT_DESTINATION) == HTTPS_PORT) {
+    return true;
+  }
+  u32 flow = flow_hash(packet, length, 0);
+  Verdict &verdict = verdicts[flow & (DEDUP_FLOWS - 1)];
+  if (payload[0] == 23 && payload[1] == 3 && payload[2] == 3) {
+    verdict = {flow, true};
+  }
+  return verdict.flow == flow && verdict.tls;
+}
+
+// Pack a data frame against the store, false if it is not worth it (nothing is cached then)
+static bool pack(Store &store, Message &frame, bool check, u8 *packed) {
+  u32 length = frame.length - HEADER_LENGTH;
+  const u8 *tcp = transport_header(frame.data, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  if (tcp == nullptr) {
+    return false;
+  }
+  u32 header = (u32) (tcp - frame.data) + (tcp[TCP_OFFSET] >> 4) * 4u;
+  if (header >= length || length - header < DEDUP_MIN_PAYLOAD ||
+      length + 2 + 2 * ((length - header) / DEDUP_CHUNK_MIN + 1) + DEDUP_FINGERPRINT > DATA_MAX_LENGTH) {
+    return false;
+  }
+  if (check && bypass(frame.data, length, tcp, frame.data + header)) {
+    ++ dedup_bypassed;
+    return false;
+  }
+
+  // Chunks found one after another in the store go as a run, by the fingerprint of the first
+  u8 *ptr = packed;
+  *ptr ++ = frame.type;
+  *ptr ++ = (u8) header;
+  memcpy(ptr, frame.data, header);
+  ptr += header;
+  u32 run = 0, next = 0;
+  u64 first = 0;
+  for (u32 offset = header, size; offset <= length; offset += size) {
+    const u8 *chunk = frame.data + offset, *cached;
+    size = offset < length ? header + chunk_end(frame.data + header, offset - header, length - header) - offset : 0;
+    u32 cached_size;
+    if (run && size && (cached = record_at(store, next, cached_size)) && cached_size == size && memcmp(cached, chunk, size) == 0) {
+      ++ run;
+      next += DEDUP_RECORD + size;
+      ++ dedup_chunks;
+      ++ dedup_hits;
+      continue;
+    }
+    if (run) {
+      ptr = put_varint(ptr, (run - 1) << 1 | 1);
+      memcpy(ptr, &first, DEDUP_FINGERPRINT);
+      ptr += DEDUP_FINGERPRINT;
+      run = 0;
+    }
+    if (size == 0) {
+      break;
+    }
+    u64 print = fingerprint(chunk, size);
+    ++ dedup_chunks;
+    if (lookup(store, print, next) && (cached = record_at(store, next, cached_size)) && cached_size == size &&
+        memcmp(cached, chunk, size) == 0) {
+      run = 1;
+      first = print;
+      next += DEDUP_RECORD + size;
+      ++ dedup_hits;
+      continue;
+    }
+    ptr = put_varint(ptr, size << 1);
+    memcpy(ptr, chunk, size);
+    ptr += size;
+    insert(store, chunk, size, print);
+  }
+  frame.type = DEDUPED;
+  frame.length = HEADER_LENGTH + (ptr - packed);
+  memcpy(frame.data, packed, ptr - packed);
+  return true;
+}
+
+// Restore a frame against the store, taking its literal chunks as the sender did
+static bool unpack(Store &store, Message &frame, u8 *plain) {
+  u32 length = frame.length - HEADER_LENGTH;
+  const u8 *ptr = frame.data + 2, *end = frame.data + length;
+  if (length < 2 || frame.data[1] > length - 2 || frame.data[0] == DEDUPED || frame.data[0] == COMPRESSED) {
+    return false;
+  }
+  u32 size = frame.data[1];
+  memcpy(plain, ptr, size);
+  ptr += size;
+  while (ptr < end) {
+    u32 value = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (ptr == end || shift > 14) {
+        return false;
+      }
+      value |= (u32) (*ptr & 127) << shift;
+      if (!(*ptr ++ & 128)) {
+        break;
+      }
+    }
+    if (value & 1) {
+      // A run, the first chunk must have the fingerprint
+      u64 print;
+      u32 position, cached_size;
+      if (end - ptr < DEDUP_FINGERPRINT) {
+        return false;
+      }
+      memcpy(&print, ptr, DEDUP_FINGERPRINT);
+      ptr += DEDUP_FINGERPRINT;
+      if (!lookup(store, print, position)) {
+        return false;
+      }
+      for (u32 i = 0; i <= value >> 1; ++ i) {
+        const u8 *cached = record_at(store, position, cached_size);
+        if (cached == nullptr || size + cached_size > DATA_MAX_LENGTH || (i == 0 && fingerprint(cached, cached_size) != print)) {
+          return false;
+        }
+        memcpy(plain + size, cached, cached_size);
+        size += cached_size;
+        position += DEDUP_RECORD + cached_size;
+        ++ dedup_restored;
+      }
+      continue;
+    }
+    u32 chunk = value >> 1;
+    if (chunk == 0 || chunk > DEDUP_CHUNK_MAX || (u32) (end - ptr) < chunk || size + chunk > DATA_MAX_LENGTH) {
+      return false;
+    }
+    memcpy(plain + size, ptr, chunk);
+    insert(store, ptr, chunk, fingerprint(ptr, chunk));
+    ptr += chunk;
+    size += chunk;
+  }
+  frame.type = frame.data[0];
+  frame.length = HEADER_LENGTH + size;
+  memcpy(frame.data, plain, size);
+  return true;
+}
+
+bool dedup_configure(const char *path, u32 megabytes) {
+  enabled = false;
+  if (mapping) {
+    munmap(mapping, mapping_length);
+    mapping = nullptr;
+  }
+  dedup_store_mb = 0;
+  if (path == nullptr || megabytes == 0) {
+    return true;
+  }
+  megabytes = megabytes < DEDUP_STORE_MAX ? megabytes : DEDUP_STORE_MAX;
+  while (megabytes & (megabytes - 1)) {
+    megabytes &= megabytes - 1;
+  }
+
+  // One file for both stores and their indexes, gone from the file system once mapped
+  u32 size = megabytes * 1048576, buckets = size / (1 << DEDUP_CHUNK_BITS) / DEDUP_WAYS;
+  u32 length = (size + buckets * (u32) sizeof(Bucket)) * 2;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd == -1 || ftruncate(fd, length) != 0) {
+    error("Failed to create the byte cache at %s", path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return false;
+  }
+  void *mapped = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  unlink(path);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    error("Failed to map the byte cache (%d bytes)", length);
+    return false;
+  }
+  mapping = (u8 *) mapped;
+  mapping_length = length;
+  Bucket *indexes = (Bucket *) (mapping + size * 2);
+  up = {mapping, size, 0, indexes, buckets, 0};
+  down = {mapping + size, size, 0, indexes + buckets, buckets, 0};
+
+  u64 state = DEDUP_GEAR_SEED;
+  for (u64 &value: gear) {
+    value = split_mix(state);
+  }
+  memset(verdicts, 0, sizeof(verdicts));
+  dedup_chunks = dedup_hits = dedup_bypassed = dedup_restored = dedup_rejected = 0;
+  dedup_up_in = dedup_up_out = dedup_down_in = dedup_down_out = 0;
+  dedup_store_mb = megabytes;
+  up.generation = down.generation = generation - 1;
+  enabled = true;
+  return true;
+}
+
+bool dedup_enabled() {
+  return enabled;
+}
+
+void dedup_connection() {
+  ++ generation;
+}
+
+void dedup_frames(Message **frames, int count) {
+  if (!enabled) {
+    return;
+  }
+  u32 current = generation;
+  if (up.generation != current) {
+    reset(up, current);
+  }
+  u8 packed[DATA_MAX_LENGTH];
+  for (int i = 0; i < count; ++ i) {
+    Message &frame = *frames[i];
+    if (frame.type != NET_REQUEST) {
+      continue;
+    }
+    dedup_up_in += frame.length - HEADER_LENGTH;
+    pack(up, frame, true, packed);
+    dedup_up_out += frame.length - HEADER_LENGTH;
+  }
+}
+
+bool dedup_open(Message &frame) {
+  u32 current = generation, length = frame.length - HEADER_LENGTH;
+  if (mapping == nullptr) {
+    ++ dedup_rejected;
+    return false;
+  }
+  if (down.generation != current) {
+    reset(down, current);
+  }
+  u8 plain[DATA_MAX_LENGTH];
+  if (!unpack(down, frame, plain)) {
+    ++ dedup_rejected;
+    return false;
+  }
+  dedup_down_in += length;
+  dedup_down_out += frame.length - HEADER_LENGTH;
+  return true;
+}
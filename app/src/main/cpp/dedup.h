@@ -0,0 +1,49 @@
+// Byte cache of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define DEDUP_MIN_PAYLOAD            256   // bytes of TCP payload, smaller packets are sent as they are
+# define DEDUP_CHUNK_BITS             5     // boundary bits of the rolling hash, chunks of 48 bytes on average
+# define DEDUP_CHUNK_MIN              16
+# define DEDUP_CHUNK_MAX              1024
+# define DEDUP_STORE_MAX              64    // MBytes per direction
+# define DEDUP_WAYS                   8     // index entries per bucket, a cache line, one per 2^bits * ways bytes of store
+# define DEDUP_GEAR_SEED              0x346f76657236ull // both ends must chunk alike
+# define DEDUP_FLOWS                  256   // flow verdicts kept, must be a power of 2
+
+// Redundancy elimination: TCP payloads are cut into chunks where a Gear rolling hash of the content
+// has DEDUP_CHUNK_BITS zero bits, so a chunk is found again wherever a repeated fetch puts it in
+// the segments. Data frames then travel as DEDUPED frames (the inner type, the length of the
+// headers, the headers, then tokens), where chunks the peer holds already, one after another in
+// its store, are replaced by a run of the 64-bit fingerprint of the first and their count, and any
+// other chunk is sent as it is and cached by both ends. Each direction has a store, a ring of
+// chunks, and an index of DEDUP_WAYS-entry buckets a cache line each, all in a memory-mapped file
+// (unlinked at once, so the kernel can write pages back under memory pressure and nothing outlives
+// the session). Both ends insert the same chunks in the same order,
+// and start over on a new primary connection. TLS flows (port 443 or a TLS record seen) are sent
+// as they are. Received frames are restored whenever the stores are mapped
+
+// Statistics
+extern u32 dedup_chunks, dedup_hits, dedup_bypassed, dedup_restored, dedup_rejected;
+extern u64 dedup_up_in, dedup_up_out, dedup_down_in, dedup_down_out; // bytes of data frames
+extern u32 dedup_store_mb;
+
+// Map the stores (megabytes per direction, rounded down to a power of 2, 0 to disable) in a file at
+// 'path', before open, returns false if the file can not be mapped
+bool dedup_configure(const char *path, u32 megabytes);
+bool dedup_enabled();
+
+// A new primary connection, both stores start over
+void dedup_connection();
+
+// Replace cached chunks of data frames in place (writer thread)
+void dedup_frames(Message **frames, int count);
+
+// Restore a DEDUPED frame in place, false if it is malformed or refers to a chunk not in the store
+// (receiving order)
+bool dedup_open(Message &frame);
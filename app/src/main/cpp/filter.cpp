@@ -0,0 +1,486 @@
+// Packet filter of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "filter.h"
+# include "packet.h"
+
+// Native C++
+# include <atomic>
+# include <cstdlib>
+# include <cstring>
+# include <pthread.h>
+# include <sched.h>
+
+// Operations of the compiled form, in the order of the labels of execute()
+# define OP_LD_W_ABS                  0
+# define OP_LD_H_ABS                  1
+# define OP_LD_B_ABS                  2
+# define OP_LD_W_IND                  3
+# define OP_LD_H_IND                  4
+# define OP_LD_B_IND                  5
+# define OP_LD_MEM                    6
+# define OP_LD_IMM                    7
+# define OP_LD_LEN                    8
+# define OP_LDX_MEM                   9
+# define OP_LDX_IMM                   10
+# define OP_LDX_LEN                   11
+# define OP_LDX_MSH                   12
+# define OP_ST                        13
+# define OP_STX                       14
+# define OP_ADD_K                     15
+# define OP_SUB_K                     16
+# define OP_MUL_K                     17
+# define OP_DIV_K                     18
+# define OP_MOD_K                     19
+# define OP_AND_K                     20
+# define OP_OR_K                      21
+# define OP_XOR_K                     22
+# define OP_LSH_K                     23
+# define OP_RSH_K                     24
+# define OP_ADD_X                     25
+# define OP_SUB_X                     26
+# define OP_MUL_X                     27
+# define OP_DIV_X                     28
+# define OP_MOD_X                     29
+# define OP_AND_X                     30
+# define OP_OR_X                      31
+# define OP_XOR_X                     32
+# define OP_LSH_X                     33
+# define OP_RSH_X                     34
+# define OP_NEG                       35
+# define OP_JA                        36
+# define OP_JEQ_K                     37
+# define OP_JGT_K                     38
+# define OP_JGE_K                     39
+# define OP_JSET_K                    40
+# define OP_JEQ_X                     41
+# define OP_JGT_X                     42
+# define OP_JGE_X                     43
+# define OP_JSET_X                    44
+# define OP_RET_K                     45
+# define OP_RET_A                     46
+# define OP_TAX                       47
+# define OP_TXA                       48
+# define OP_LD_W_ABS_JEQ              49    // a load at a constant offset, then a compare with a constant
+# define OP_LD_H_ABS_JEQ              50
+# define OP_LD_B_ABS_JEQ              51
+# define OP_LD_B_ABS_JSET             52
+# define OP_COUNT                     53
+
+// Compiled instruction, jumps lead straight to the next operation to run
+struct Op {
+  const void *handler;
+  u32 k;
+  u32 value;                  // constant a fused load is compared with
+  const Op *jt, *jf;
+};
+
+struct Program {
+  sock_filter code[FILTER_MAX_INSNS];
+  u32 count;
+  Op ops[FILTER_MAX_INSNS];
+  u32 op_count;
+};
+
+// Two slots, the send thread runs the installed one, and announces it in 'in_use' while it does
+static Program programs[2];
+static std::atomic<Program*> current, in_use;
+static pthread_mutex_t install_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 filter_verdicts[FILTER_VERDICTS];
+u32 filter_installs, filter_insns, filter_ops;
+
+// Fetch 'size' bytes at 'offset' if the packet has them, the kernel ends the program with 0 otherwise
+static inline bool fetch(const u8 *packet, u32 length, u64 offset, u32 size, u32 &value) {
+  if (offset + size > length) {
+    return false;
+  }
+  const u8 *ptr = packet + offset;
+  value = size == 4 ? load32(ptr) : size == 2 ? load16(ptr) : *ptr;
+  return true;
+}
+
+// Shifts by the register of 32 or more give 0, on every CPU
+static inline u32 shift_left(u32 a, u32 x) {
+  return x < 32 ? a << x : 0;
+}
+
+static inline u32 shift_right(u32 a, u32 x) {
+  return x < 32 ? a >> x : 0;
+}
+
+// Compiled form, direct-threaded: each operation jumps to the handler of the next one, and a null
+// 'op' returns the handlers through 'table' for the compiler
+static u32 execute(const Op *op, const u8 *packet, u32 length, const void *const **table) {
+  static const void *const handlers[OP_COUNT] = {
+    &&ld_w_abs, &&ld_h_abs, &&ld_b_abs, &&ld_w_ind, &&ld_h_ind, &&ld_b_ind,
+    &&ld_mem, &&ld_imm, &&ld_len, &&ldx_mem, &&ldx_imm, &&ldx_len, &&ldx_msh, &&st, &&stx,
+    &&add_k, &&sub_k, &&mul_k, &&div_k, &&mod_k, &&and_k, &&or_k, &&xor_k, &&lsh_k, &&rsh_k,
+    &&add_x, &&sub_x, &&mul_x, &&div_x, &&mod_x, &&and_x, &&or_x, &&xor_x, &&lsh_x, &&rsh_x,
+    &&neg, &&ja, &&jeq_k, &&jgt_k, &&jge_k, &&jset_k, &&jeq_x, &&jgt_x, &&jge_x, &&jset_x,
+    &&ret_k, &&ret_a, &&tax, &&txa,
+    &&ld_w_abs_jeq, &&ld_h_abs_jeq, &&ld_b_abs_jeq, &&ld_b_abs_jset
+  };
+  if (op == nullptr) {
+    *table = handlers;
+    return 0;
+  }
+  u32 a = 0, x = 0, memory[BPF_MEMWORDS] = {0};
+
+# define NEXT() do { ++ op; goto *op -> handler; } while (0)
+# define BRANCH(condition) do { op = (condition) ? op -> jt : op -> jf; goto *op -> handler; } while (0)
+# define LOAD(offset, size, to) do { if (!fetch(packet, length, offset, size, to)) return 0; } while (0)
+
+  goto *op -> handler;
+  ld_w_abs: LOAD(op -> k, 4, a); NEXT();
+  ld_h_abs: LOAD(op -> k, 2, a); NEXT();
+  ld_b_abs: LOAD(op -> k, 1, a); NEXT();
+  ld_w_ind: LOAD((u64) x + op -> k, 4, a); NEXT();
+  ld_h_ind: LOAD((u64) x + op -> k, 2, a); NEXT();
+  ld_b_ind: LOAD((u64) x + op -> k, 1, a); NEXT();
+  ld_mem: a = memory[op -> k]; NEXT();
+  ld_imm: a = op -> k; NEXT();
+  ld_len: a = length; NEXT();
+  ldx_mem: x = memory[op -> k]; NEXT();
+  ldx_imm: x = op -> k; NEXT();
+  ldx_len: x = length; NEXT();
+  ldx_msh: LOAD(op -> k, 1, x); x = (x & 0x0f) * 4; NEXT();
+  st: memory[op -> k] = a; NEXT();
+  stx: memory[op -> k] = x; NEXT();
+  add_k: a += op -> k; NEXT();
+  sub_k: a -= op -> k; NEXT();
+  mul_k: a *= op -> k; NEXT();
+  div_k: a /= op -> k; NEXT();
+  mod_k: a %= op -> k; NEXT();
+  and_k: a &= op -> k; NEXT();
+  or_k: a |= op -> k; NEXT();
+  xor_k: a ^= op -> k; NEXT();
+  lsh_k: a <<= op -> k; NEXT();
+  rsh_k: a >>= op -> k; NEXT();
+  add_x: a += x; NEXT();
+  sub_x: a -= x; NEXT();
+  mul_x: a *= x; NEXT();
+  div_x: if (x == 0) return 0; a /= x; NEXT();
+  mod_x: if (x == 0) return 0; a %= x; NEXT();
+  and_x: a &= x; NEXT();
+  or_x: a |= x; NEXT();
+  xor_x: a ^= x; NEXT();
+  lsh_x: a = shift_left(a, x); NEXT();
+  rsh_x: a = shift_right(a, x); NEXT();
+  neg: a = -a; NEXT();
+  ja: op = op -> jt; goto *op -> handler;
+  jeq_k: BRANCH(a == op -> k);
+  jgt_k: BRANCH(a > op -> k);
+  jge_k: BRANCH(a >= op -> k);
+  jset_k: BRANCH(a & op -> k);
+  jeq_x: BRANCH(a == x);
+  jgt_x: BRANCH(a > x);
+  jge_x: BRANCH(a >= x);
+  jset_x: BRANCH(a & x);
+  ret_k: return op -> k;
+  ret_a: return a;
+  tax: x = a; NEXT();
+  txa: a = x; NEXT();
+  ld_w_abs_jeq: LOAD(op -> k, 4, a); BRANCH(a == op -> value);
+  ld_h_abs_jeq: LOAD(op -> k, 2, a); BRANCH(a == op -> value);
+  ld_b_abs_jeq: LOAD(op -> k, 1, a); BRANCH(a == op -> value);
+  ld_b_abs_jset: LOAD(op -> k, 1, a); BRANCH(a & op -> value);
+
+# undef NEXT
+# undef BRANCH
+# undef LOAD
+}
+
+// The checks of the kernel (sk_chk_filter), returns false with the reason logged
+static bool check(const sock_filter *code, u32 count) {
+  if (count == 0 || count > FILTER_MAX_INSNS) {
+    error("Filter of %d instructions refused (1 ~ %d)", count, FILTER_MAX_INSNS);
+    return false;
+  }
+  for (u32 i = 0; i < count; ++ i) {
+    const sock_filter &insn = code[i];
+    u32 k = insn.k, left = count - i - 1;
+    bool valid = true;
+    switch (insn.code) {
+      case BPF_LD | BPF_W | BPF_ABS: case BPF_LD | BPF_H | BPF_ABS: case BPF_LD | BPF_B | BPF_ABS:
+      case BPF_LDX | BPF_B | BPF_MSH:
+        valid = k < 0x80000000u; // no ancillary data here
+        break;
+      case BPF_LD | BPF_W | BPF_IND: case BPF_LD | BPF_H | BPF_IND: case BPF_LD | BPF_B | BPF_IND:
+      case BPF_LD | BPF_IMM: case BPF_LD | BPF_W | BPF_LEN: case BPF_LDX | BPF_IMM: case BPF_LDX | BPF_W | BPF_LEN:
+      case BPF_ALU | BPF_ADD | BPF_K: case BPF_ALU | BPF_SUB | BPF_K: case BPF_ALU | BPF_MUL | BPF_K:
+      case BPF_ALU | BPF_AND | BPF_K: case BPF_ALU | BPF_OR | BPF_K: case BPF_ALU | BPF_XOR | BPF_K:
+      case BPF_ALU | BPF_ADD | BPF_X: case BPF_ALU | BPF_SUB | BPF_X: case BPF_ALU | BPF_MUL | BPF_X:
+      case BPF_ALU | BPF_DIV | BPF_X: case BPF_ALU | BPF_MOD | BPF_X: case BPF_ALU | BPF_AND | BPF_X:
+      case BPF_ALU | BPF_OR | BPF_X: case BPF_ALU | BPF_XOR | BPF_X: case BPF_ALU | BPF_LSH | BPF_X:
+      case BPF_ALU | BPF_RSH | BPF_X: case BPF_ALU | BPF_NEG:
+      case BPF_RET | BPF_K: case BPF_RET | BPF_A: case BPF_MISC | BPF_TAX: case BPF_MISC | BPF_TXA:
+        break;
+      case BPF_LD | BPF_MEM: case BPF_LDX | BPF_MEM: case BPF_ST: case BPF_STX:
+        valid = k < BPF_MEMWORDS;
+        break;
+      case BPF_ALU | BPF_DIV | BPF_K: case BPF_ALU | BPF_MOD | BPF_K:
+        valid = k != 0;
+        break;
+      case BPF_ALU | BPF_LSH | BPF_K: case BPF_ALU | BPF_RSH | BPF_K:
+        valid = k < 32;
+        break;
+      case BPF_JMP | BPF_JA:
+        valid = k < left;
+        break;
+      case BPF_JMP | BPF_JEQ | BPF_K: case BPF_JMP | BPF_JGT | BPF_K: case BPF_JMP | BPF_JGE | BPF_K:
+      case BPF_JMP | BPF_JSET | BPF_K: case BPF_JMP | BPF_JEQ | BPF_X: case BPF_JMP | BPF_JGT | BPF_X:
+      case BPF_JMP | BPF_JGE | BPF_X: case BPF_JMP | BPF_JSET | BPF_X:
+        valid = insn.jt < left && insn.jf < left;
+        break;
+      default:
+        valid = false;
+    }
+    if (!valid) {
+      error("Filter refused at instruction %d (code 0x%x, k %u)", i, insn.code, k);
+      return false;
+    }
+  }
+  if (BPF_CLASS(code[count - 1].code) != BPF_RET) {
+    error("Filter refused, it does not end with a return");
+    return false;
+  }
+  return true;
+}
+
+static int power_of_two(u32 k) {
+  return (k & (k - 1)) == 0 ? __builtin_ctz(k) : -1;
+}
+
+// Operation of a single instruction, specialized on its constant
+static int operation(const sock_filter &insn, u32 &k) {
+  switch (insn.code) {
+    case BPF_LD | BPF_W | BPF_ABS: return OP_LD_W_ABS;
+    case BPF_LD | BPF_H | BPF_ABS: return OP_LD_H_ABS;
+    case BPF_LD | BPF_B | BPF_ABS: return OP_LD_B_ABS;
+    case BPF_LD | BPF_W | BPF_IND: return OP_LD_W_IND;
+    case BPF_LD | BPF_H | BPF_IND: return OP_LD_H_IND;
+    case BPF_LD | BPF_B | BPF_IND: return OP_LD_B_IND;
+    case BPF_LD | BPF_MEM: return OP_LD_MEM;
+    case BPF_LD | BPF_IMM: return OP_LD_IMM;
+    case BPF_LD | BPF_W | BPF_LEN: return OP_LD_LEN;
+    case BPF_LDX | BPF_MEM: return OP_LDX_MEM;
+    case BPF_LDX | BPF_IMM: return OP_LDX_IMM;
+    case BPF_LDX | BPF_W | BPF_LEN: return OP_LDX_LEN;
+    case BPF_LDX | BPF_B | BPF_MSH: return OP_LDX_MSH;
+    case BPF_ST: return OP_ST;
+    case BPF_STX: return OP_STX;
+    case BPF_ALU | BPF_ADD | BPF_K: return OP_ADD_K;
+    case BPF_ALU | BPF_SUB | BPF_K: return OP_SUB_K;
+    case BPF_ALU | BPF_AND | BPF_K: return OP_AND_K;
+    case BPF_ALU | BPF_OR | BPF_K: return OP_OR_K;
+    case BPF_ALU | BPF_XOR | BPF_K: return OP_XOR_K;
+    case BPF_ALU | BPF_LSH | BPF_K: return OP_LSH_K;
+    case BPF_ALU | BPF_RSH | BPF_K: return OP_RSH_K;
+    case BPF_ALU | BPF_ADD | BPF_X: return OP_ADD_X;
+    case BPF_ALU | BPF_SUB | BPF_X: return OP_SUB_X;
+    case BPF_ALU | BPF_MUL | BPF_X: return OP_MUL_X;
+    case BPF_ALU | BPF_DIV | BPF_X: return OP_DIV_X;
+    case BPF_ALU | BPF_MOD | BPF_X: return OP_MOD_X;
+    case BPF_ALU | BPF_AND | BPF_X: return OP_AND_X;
+    case BPF_ALU | BPF_OR | BPF_X: return OP_OR_X;
+    case BPF_ALU | BPF_XOR | BPF_X: return OP_XOR_X;
+    case BPF_ALU | BPF_LSH | BPF_X: return OP_LSH_X;
+    case BPF_ALU | BPF_RSH | BPF_X: return OP_RSH_X;
+    case BPF_ALU | BPF_NEG: return OP_NEG;
+    case BPF_JMP | BPF_JA: return OP_JA;
+    case BPF_JMP | BPF_JEQ | BPF_K: return OP_JEQ_K;
+    case BPF_JMP | BPF_JGT | BPF_K: return OP_JGT_K;
+    case BPF_JMP | BPF_JGE | BPF_K: return OP_JGE_K;
+    case BPF_JMP | BPF_JSET | BPF_K: return OP_JSET_K;
+    case BPF_JMP | BPF_JEQ | BPF_X: return OP_JEQ_X;
+    case BPF_JMP | BPF_JGT | BPF_X: return OP_JGT_X;
+    case BPF_JMP | BPF_JGE | BPF_X: return OP_JGE_X;
+    case BPF_JMP | BPF_JSET | BPF_X: return OP_JSET_X;
+    case BPF_RET | BPF_K: return OP_RET_K;
+    case BPF_RET | BPF_A: return OP_RET_A;
+    case BPF_MISC | BPF_TAX: return OP_TAX;
+    case BPF_MISC | BPF_TXA: return OP_TXA;
+  }
+
+  // Multiplications and divisions by powers of 2 become shifts and masks
+  int shift = power_of_two(insn.k);
+  switch (insn.code) {
+    case BPF_ALU | BPF_MUL | BPF_K:
+      if (shift >= 0) {
+        k = (u32) shift;
+        return OP_LSH_K;
+      }
+      return OP_MUL_K;
+    case BPF_ALU | BPF_DIV | BPF_K:
+      if (shift >= 0) {
+        k = (u32) shift;
+        return OP_RSH_K;
+      }
+      return OP_DIV_K;
+    default: // BPF_ALU | BPF_MOD | BPF_K
+      if (shift >= 0) {
+        k = insn.k - 1;
+        return OP_AND_K;
+      }
+      return OP_MOD_K;
+  }
+}
+
+// Compile a checked program, a load followed by a compare becomes one operation unless something
+// jumps to the compare
+static void compile(Program &program) {
+  const void *const *handlers;
+  execute(nullptr, nullptr, 0, &handlers);
+  const sock_filter *code = program.code;
+  u32 count = program.count;
+  bool landing[FILTER_MAX_INSNS] = {false};
+  for (u32 i = 0; i < count; ++ i) {
+    if (BPF_CLASS(code[i].code) == BPF_JMP) {
+      if (BPF_OP(code[i].code) == BPF_JA) {
+        landing[i + 1 + code[i].k] = true;
+      } else {
+        landing[i + 1 + code[i].jt] = landing[i + 1 + code[i].jf] = true;
+      }
+    }
+  }
+
+  // Operations, with the instructions their jumps go to, then those resolved to operations
+  u32 first_op[FILTER_MAX_INSNS], jt[FILTER_MAX_INSNS], jf[FILTER_MAX_INSNS];
+  bool branch[FILTER_MAX_INSNS];
+  u32 count_ops = 0;
+  for (u32 i = 0; i < count; ++ i) {
+    const sock_filter &insn = code[i];
+    Op &op = program.ops[count_ops];
+    first_op[i] = count_ops;
+    op.k = insn.k;
+    op.value = 0;
+    op.jt = op.jf = nullptr;
+    int kind = operation(insn, op.k);
+    branch[count_ops] = BPF_CLASS(insn.code) == BPF_JMP;
+    jt[count_ops] = i + 1 + (kind == OP_JA ? insn.k : insn.jt);
+    jf[count_ops] = i + 1 + (kind == OP_JA ? insn.k : insn.jf);
+    const sock_filter *next = i + 1 < count && !landing[i + 1] ? &code[i + 1] : nullptr;
+    if (next && (next -> code == (BPF_JMP | BPF_JEQ | BPF_K) || next -> code == (BPF_JMP | BPF_JSET | BPF_K))) {
+      bool equal = next -> code == (BPF_JMP | BPF_JEQ | BPF_K);
+      int fused = kind == OP_LD_W_ABS && equal ? OP_LD_W_ABS_JEQ : kind == OP_LD_H_ABS && equal ? OP_LD_H_ABS_JEQ
+        : kind == OP_LD_B_ABS ? (equal ? OP_LD_B_ABS_JEQ : OP_LD_B_ABS_JSET) : -1;
+      if (fused >= 0) {
+        kind = fused;
+        op.value = next -> k;
+        branch[count_ops] = true;
+        jt[count_ops] = i + 2 + next -> jt;
+        jf[count_ops] = i + 2 + next -> jf;
+        first_op[++ i] = count_ops;
+      }
+    }
+    op.handler = handlers[kind];
+    ++ count_ops;
+  }
+  for (u32 i = 0; i < count_ops; ++ i) {
+    if (branch[i]) {
+      program.ops[i].jt = &program.ops[first_op[jt[i]]];
+      program.ops[i].jf = &program.ops[first_op[jf[i]]];
+    }
+  }
+  program.op_count = count_ops;
+}
+
+bool filter_install(const sock_filter *code, u32 count) {
+  pthread_mutex_lock(&install_lock);
+  Program *old = current.load();
+  Program *program = nullptr;
+  if (count) {
+    if (!check(code, count)) {
+      pthread_mutex_unlock(&install_lock);
+      return false;
+    }
+
+    // The slot the send thread has left, see below
+    program = old == &programs[0] ? &programs[1] : &programs[0];
+    memcpy(program -> code, code, count * sizeof(sock_filter));
+    program -> count = count;
+    compile(*program);
+  }
+
+  // Swap, then wait for the send thread to leave the old program before its slot may be reused
+  current.store(program);
+  while (old && in_use.load() == old) {
+    sched_yield();
+  }
+  memset(filter_verdicts, 0, sizeof(filter_verdicts));
+  filter_installs += count != 0;
+  filter_insns = count;
+  filter_ops = program ? program -> op_count : 0;
+  pthread_mutex_unlock(&install_lock);
+  return true;
+}
+
+bool filter_install_text(const char *bytecode) {
+  if (bytecode == nullptr || *bytecode == 0) {
+    return filter_install(nullptr, 0);
+  }
+  static sock_filter code[FILTER_MAX_INSNS];
+  char *end;
+  unsigned long count = strtoul(bytecode, &end, 10);
+  bool valid = end != bytecode && count > 0 && count <= FILTER_MAX_INSNS;
+  for (u32 i = 0; valid && i < count; ++ i) {
+    valid = *end == ',';
+    unsigned long fields[4];
+    for (int j = 0; valid && j < 4; ++ j) {
+      const char *start = end + (j == 0);
+      fields[j] = strtoul(start, &end, 10);
+      valid = end != start;
+    }
+    valid = valid && fields[0] <= 0xffff && fields[1] <= 0xff && fields[2] <= 0xff && fields[3] <= 0xffffffffu;
+    if (valid) {
+      code[i] = {(u16) fields[0], (u8) fields[1], (u8) fields[2], (u32) fields[3]};
+    }
+  }
+  while (valid && (*end == ' ' || *end == ',' || *end == '\n')) {
+    ++ end;
+  }
+  if (!valid || *end != 0) {
+    error("Filter bytecode malformed near \"%.16s\"", end);
+    return false;
+  }
+  return filter_install(code, (u32) count);
+}
+
+bool filter_enabled() {
+  return current.load() != nullptr;
+}
+
+u32 filter_run(const u8 *packet, u32 length) {
+  Program *program = current.load(std::memory_order_acquire);
+  if (program == nullptr) {
+    return FILTER_PASS;
+  }
+
+  // Announce the program, then make sure it was not swapped meanwhile, or the installer may miss it
+  in_use.store(program);
+  for (Program *now; (now = current.load()) != program; program = now) {
+    in_use.store(now);
+    if (now == nullptr) {
+      return FILTER_PASS;
+    }
+  }
+  u32 verdict = execute(program -> ops, packet, length, nullptr);
+  in_use.store(nullptr, std::memory_order_release);
+  verdict = verdict < FILTER_VERDICTS ? verdict : FILTER_PASS;
+  ++ filter_verdicts[verdict];
+  return verdict;
+}
+
+int filter_class(u32 verdict, const u8 *packet, u32 length) {
+  if (verdict == FILTER_BULK) {
+    return PACKET_BULK;
+  }
+  if (verdict == FILTER_PRIORITY) {
+    int type = packet_class(packet, length);
+    return type == PACKET_BULK ? PACKET_SMALL : type;
+  }
+  return PACKET_AUTO;
+}
@@ -0,0 +1,51 @@
+// Packet filter of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Networks
+# include <linux/filter.h>
+
+// Parameters
+# define FILTER_MAX_INSNS             512   // instructions of a program
+
+// Verdicts, the return value of a program (others pass as FILTER_PASS)
+# define FILTER_DROP                  0
+# define FILTER_PASS                  1     // classified as usual
+# define FILTER_PRIORITY              2     // interactive, ahead of all flows
+# define FILTER_BULK                  3     // fair queued with the bulk flows
+# define FILTER_PACKET                4     // goes as a packet, never terminated by split TCP
+# define FILTER_VERDICTS              5
+
+// Packet filter: a classic BPF program runs on every packet read from tun, from its IP header on
+// (as on a raw socket, so "tcpdump -y RAW -ddd" compiles one), and its return value decides what
+// becomes of the packet. Programs are checked as the kernel does (known opcodes, forward jumps in
+// range, no division by a zero constant, scratch memory in range, a return at the end) but scratch
+// memory starts zeroed, and ancillary loads (negative offsets) are refused. A checked program is
+// compiled into direct-threaded code: jump targets are resolved to pointers, loads followed by a
+// compare are fused, and divisions by powers of 2 become shifts. Programs swap at any time: the
+// send thread takes the new one with its next packet, and the old one is reused only once the send
+// thread has left it
+
+// Statistics
+extern u32 filter_verdicts[FILTER_VERDICTS];
+extern u32 filter_installs, filter_insns, filter_ops;
+
+// Check, compile and install 'count' instructions (0 to remove the program), any time, returns
+// false if the program is refused and keeps the one installed then
+bool filter_install(const sock_filter *code, u32 count);
+
+// The same from the iptables bytecode format ("count,code jt jf k,code jt jf k,...", nullptr or empty
+// to remove the program)
+bool filter_install_text(const char *bytecode);
+
+bool filter_enabled();
+
+// Verdict for a packet read from tun (send thread), FILTER_PASS without a program
+u32 filter_run(const u8 *packet, u32 length);
+
+// Packet class a verdict puts a packet in, or PACKET_AUTO to leave it to the queue
+int filter_class(u32 verdict, const u8 *packet, u32 length);
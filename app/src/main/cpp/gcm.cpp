@@ -0,0 +1,601 @@
+// AES-256-GCM of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "gcm.h"
+
+// Native C++
+# include <cstring>
+
+// Accelerated engines
+# if defined(__x86_64__) || defined(__i386__)
+#   define GCM_X86
+#   include <cpuid.h>
+#   include <immintrin.h>
+# elif defined(__aarch64__)
+#   define GCM_ARM
+#   include <arm_neon.h>
+#   include <asm/hwcap.h>
+#   include <sys/auxv.h>
+# endif
+
+// Engine: CTR keystream XORed into data (the 32-bit counter in the last 4 bytes of 'counter' is
+// advanced), AES of blocks of their own (counter blocks of several frames at once), and GHASH over
+// whole blocks
+struct GcmEngine {
+  const char *name;
+  bool accelerated;
+  void (*ctr)(const GcmKey &key, u8 *counter, u8 *data, u32 length);
+  void (*blocks)(const GcmKey &key, const u8 *in, u8 *out, u32 count);
+  void (*ghash)(const GcmKey &key, u8 *state, const u8 *data, u32 length);
+  void (*prepare)(GcmKey &key); // powers of H, if the engine uses them
+};
+
+static const GcmEngine *engine;
+static u8 sbox[256];
+
+static u32 load_be32(const u8 *ptr) {
+  return (u32) ptr[0] << 24 | (u32) ptr[1] << 16 | (u32) ptr[2] << 8 | ptr[3];
+}
+
+static u64 load_be64(const u8 *ptr) {
+  return (u64) load_be32(ptr) << 32 | load_be32(ptr + 4);
+}
+
+static void store_be32(u8 *ptr, u32 value) {
+  ptr[0] = value >> 24;
+  ptr[1] = value >> 16;
+  ptr[2] = value >> 8;
+  ptr[3] = value;
+}
+
+static void store_be64(u8 *ptr, u64 value) {
+  store_be32(ptr, value >> 32);
+  store_be32(ptr + 4, (u32) value);
+}
+
+// Portable engine, a byte-oriented AES and a bitwise GHASH (neither is constant time)
+static u8 xtime(u8 x) {
+  return (x << 1) ^ ((x >> 7) * 0x1b);
+}
+
+static void aes_soft(const GcmKey &key, const u8 *in, u8 *out) {
+  u8 state[16], shifted[16];
+  for (int i = 0; i < 16; ++ i) {
+    state[i] = in[i] ^ key.round_keys[0][i];
+  }
+  for (int round = 1; round <= GCM_ROUNDS; ++ round) {
+    // SubBytes and ShiftRows, the state is column-major
+    for (int column = 0; column < 4; ++ column) {
+      for (int row = 0; row < 4; ++ row) {
+        shifted[column * 4 + row] = sbox[state[((column + row) & 3) * 4 + row]];
+      }
+    }
+    // MixColumns, except in the last round
+    for (int column = 0; column < 16; column += 4) {
+      u8 *a = shifted + column;
+      if (round < GCM_ROUNDS) {
+        u8 all = a[0] ^ a[1] ^ a[2] ^ a[3], first = a[0];
+        a[0] ^= all ^ xtime(a[0] ^ a[1]);
+        a[1] ^= all ^ xtime(a[1] ^ a[2]);
+        a[2] ^= all ^ xtime(a[2] ^ a[3]);
+        a[3] ^= all ^ xtime(a[3] ^ first);
+      }
+      for (int row = 0; row < 4; ++ row) {
+        state[column + row] = a[row] ^ key.round_keys[round][column + row];
+      }
+    }
+  }
+  memcpy(out, state, 16);
+}
+
+static void ctr_soft(const GcmKey &key, u8 *counter, u8 *data, u32 length) {
+  u8 stream[16];
+  u32 count = load_be32(counter + 12);
+  while (length) {
+    store_be32(counter + 12, count ++);
+    aes_soft(key, counter, stream);
+    u32 n = length < 16 ? length : 16;
+    for (u32 i = 0; i < n; ++ i) {
+      data[i] ^= stream[i];
+    }
+    data += n;
+    length -= n;
+  }
+  store_be32(counter + 12, count);
+}
+
+static void blocks_soft(const GcmKey &key, const u8 *in, u8 *out, u32 count) {
+  for (u32 i = 0; i < count; ++ i) {
+    aes_soft(key, in + i * 16, out + i * 16);
+  }
+}
+
+static void ghash_soft(const GcmKey &key, u8 *state, const u8 *data, u32 length) {
+  u64 h_high = load_be64(key.h), h_low = load_be64(key.h + 8);
+  u64 x_high = load_be64(state), x_low = load_be64(state + 8);
+  for (; length >= 16; data += 16, length -= 16) {
+    x_high ^= load_be64(data);
+    x_low ^= load_be64(data + 8);
+    u64 z_high = 0, z_low = 0, v_high = h_high, v_low = h_low;
+    for (int i = 0; i < 128; ++ i) {
+      u64 bit = (i < 64 ? x_high >> (63 - i) : x_low >> (127 - i)) & 1;
+      z_high ^= v_high & (0 - bit);
+      z_low ^= v_low & (0 - bit);
+      u64 carry = v_low & 1;
+      v_low = (v_low >> 1) | (v_high << 63);
+      v_high = (v_high >> 1) ^ (0xe100000000000000ull & (0 - carry));
+    }
+    x_high = z_high;
+    x_low = z_low;
+  }
+  store_be64(state, x_high);
+  store_be64(state + 8, x_low);
+}
+
+static const GcmEngine soft_engine = {"portable", false, ctr_soft, blocks_soft, ghash_soft, nullptr};
+
+# ifdef GCM_X86
+// AES-NI, four blocks in flight
+__attribute__((target("aes,sse4.1")))
+static void ctr_ni(const GcmKey &key, u8 *counter, u8 *data, u32 length) {
+  __m128i keys[GCM_ROUNDS + 1];
+  for (int i = 0; i <= GCM_ROUNDS; ++ i) {
+    keys[i] = _mm_load_si128((const __m128i *) key.round_keys[i]);
+  }
+  __m128i base = _mm_loadu_si128((const __m128i *) counter);
+  u32 count = load_be32(counter + 12);
+  for (; length >= 64; data += 64, length -= 64, count += 4) {
+    __m128i blocks[4];
+    for (int j = 0; j < 4; ++ j) {
+      blocks[j] = _mm_xor_si128(_mm_insert_epi32(base, (int) __builtin_bswap32(count + j), 3), keys[0]);
+    }
+    for (int round = 1; round < GCM_ROUNDS; ++ round) {
+      for (int j = 0; j < 4; ++ j) {
+        blocks[j] = _mm_aesenc_si128(blocks[j], keys[round]);
+      }
+    }
+    for (int j = 0; j < 4; ++ j) {
+      __m128i *block = (__m128i *) (data + j * 16);
+      blocks[j] = _mm_aesenclast_si128(blocks[j], keys[GCM_ROUNDS]);
+      _mm_storeu_si128(block, _mm_xor_si128(_mm_loadu_si128(block), blocks[j]));
+    }
+  }
+  for (; length; ++ count) {
+    __m128i block = _mm_xor_si128(_mm_insert_epi32(base, (int) __builtin_bswap32(count), 3), keys[0]);
+    for (int round = 1; round < GCM_ROUNDS; ++ round) {
+      block = _mm_aesenc_si128(block, keys[round]);
+    }
+    alignas(16) u8 stream[16];
+    _mm_store_si128((__m128i *) stream, _mm_aesenclast_si128(block, keys[GCM_ROUNDS]));
+    u32 n = length < 16 ? length : 16;
+    for (u32 i = 0; i < n; ++ i) {
+      data[i] ^= stream[i];
+    }
+    data += n;
+    length -= n;
+  }
+  store_be32(counter + 12, count);
+}
+
+__attribute__((target("aes,sse2")))
+static void blocks_ni(const GcmKey &key, const u8 *in, u8 *out, u32 count) {
+  __m128i keys[GCM_ROUNDS + 1];
+  for (int i = 0; i <= GCM_ROUNDS; ++ i) {
+    keys[i] = _mm_load_si128((const __m128i *) key.round_keys[i]);
+  }
+  for (; count; in += 64, out += 64) {
+    u32 n = count < 4 ? count : 4;
+    __m128i blocks[4];
+    for (u32 j = 0; j < n; ++ j) {
+      blocks[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (in + j * 16)), keys[0]);
+    }
+    for (int round = 1; round < GCM_ROUNDS; ++ round) {
+      for (u32 j = 0; j < n; ++ j) {
+        blocks[j] = _mm_aesenc_si128(blocks[j], keys[round]);
+      }
+    }
+    for (u32 j = 0; j < n; ++ j) {
+      _mm_storeu_si128((__m128i *) (out + j * 16), _mm_aesenclast_si128(blocks[j], keys[GCM_ROUNDS]));
+    }
+    count -= n;
+  }
+}
+
+// Carry-less multiplication in GF(2^128) of byte-reflected operands (Intel's GCM white paper),
+// products are accumulated unreduced, so four blocks share one reduction
+__attribute__((target("pclmul,sse2")))
+static void clmul_accumulate(__m128i a, __m128i b, __m128i &low, __m128i &middle, __m128i &high) {
+  low = _mm_xor_si128(low, _mm_clmulepi64_si128(a, b, 0x00));
+  middle = _mm_xor_si128(middle, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01)));
+  high = _mm_xor_si128(high, _mm_clmulepi64_si128(a, b, 0x11));
+}
+
+__attribute__((target("pclmul,sse2")))
+static __m128i clmul_reduce(__m128i low, __m128i middle, __m128i high) {
+  low = _mm_xor_si128(low, _mm_slli_si128(middle, 8));
+  high = _mm_xor_si128(high, _mm_srli_si128(middle, 8));
+
+  // Shift the 256-bit product left by one bit
+  __m128i low_carry = _mm_srli_epi32(low, 31), high_carry = _mm_srli_epi32(high, 31);
+  low = _mm_or_si128(_mm_slli_epi32(low, 1), _mm_slli_si128(low_carry, 4));
+  high = _mm_or_si128(_mm_slli_epi32(high, 1), _mm_slli_si128(high_carry, 4));
+  high = _mm_or_si128(high, _mm_srli_si128(low_carry, 12));
+
+  // Reduce modulo x^128 + x^7 + x^2 + x + 1
+  __m128i fold = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)), _mm_slli_epi32(low, 25));
+  low = _mm_xor_si128(low, _mm_slli_si128(fold, 12));
+  __m128i rest = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)), _mm_srli_epi32(low, 7));
+  rest = _mm_xor_si128(rest, _mm_srli_si128(fold, 4));
+  return _mm_xor_si128(high, _mm_xor_si128(low, rest));
+}
+
+__attribute__((target("pclmul,sse2")))
+static __m128i gfmul_clmul(__m128i a, __m128i b) {
+  __m128i low = _mm_setzero_si128(), middle = low, high = low;
+  clmul_accumulate(a, b, low, middle, high);
+  return clmul_reduce(low, middle, high);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static void ghash_clmul(const GcmKey &key, u8 *state, const u8 *data, u32 length) {
+  const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i powers[4];
+  for (int i = 0; i < 4; ++ i) {
+    powers[i] = _mm_load_si128((const __m128i *) key.powers[i]);
+  }
+  __m128i x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) state), reverse);
+
+  // X = (X + B0) H^4 + B1 H^3 + B2 H^2 + B3 H
+  for (; length >= 64; data += 64, length -= 64) {
+    __m128i low = _mm_setzero_si128(), middle = low, high = low;
+    for (int j = 0; j < 4; ++ j) {
+      __m128i block = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + j * 16)), reverse);
+      clmul_accumulate(j == 0 ? _mm_xor_si128(x, block) : block, powers[3 - j], low, middle, high);
+    }
+    x = clmul_reduce(low, middle, high);
+  }
+  for (; length >= 16; data += 16, length -= 16) {
+    x = gfmul_clmul(_mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), reverse)), powers[0]);
+  }
+  _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi8(x, reverse));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static void prepare_clmul(GcmKey &key) {
+  const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i h = _mm_shuffle_epi8(_mm_load_si128((const __m128i *) key.h), reverse), power = h;
+  for (int i = 0; i < 4; ++ i) {
+    _mm_store_si128((__m128i *) key.powers[i], power);
+    power = gfmul_clmul(power, h);
+  }
+}
+
+static const GcmEngine hardware_engine = {"AES-NI", true, ctr_ni, blocks_ni, ghash_clmul, prepare_clmul};
+
+static bool hardware_supported() {
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_AES) && (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1) && (ecx & bit_SSSE3);
+}
+# endif
+
+# ifdef GCM_ARM
+// ARMv8 Crypto Extensions (this file is built with +crypto for arm64), four blocks in flight
+static void ctr_ce(const GcmKey &key, u8 *counter, u8 *data, u32 length) {
+  uint8x16_t keys[GCM_ROUNDS + 1];
+  for (int i = 0; i <= GCM_ROUNDS; ++ i) {
+    keys[i] = vld1q_u8(key.round_keys[i]);
+  }
+  uint32x4_t base = vreinterpretq_u32_u8(vld1q_u8(counter));
+  u32 count = load_be32(counter + 12);
+  for (; length >= 64; data += 64, length -= 64, count += 4) {
+    uint8x16_t blocks[4];
+    for (int j = 0; j < 4; ++ j) {
+      blocks[j] = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32(count + j), base, 3));
+    }
+    for (int round = 0; round < GCM_ROUNDS - 1; ++ round) {
+      for (int j = 0; j < 4; ++ j) {
+        blocks[j] = vaesmcq_u8(vaeseq_u8(blocks[j], keys[round]));
+      }
+    }
+    for (int j = 0; j < 4; ++ j) {
+      blocks[j] = veorq_u8(vaeseq_u8(blocks[j], keys[GCM_ROUNDS - 1]), keys[GCM_ROUNDS]);
+      vst1q_u8(data + j * 16, veorq_u8(vld1q_u8(data + j * 16), blocks[j]));
+    }
+  }
+  for (; length; ++ count) {
+    uint8x16_t block = vreinterpretq_u8_u32(vsetq_lane_u32(__builtin_bswap32(count), base, 3));
+    for (int round = 0; round < GCM_ROUNDS - 1; ++ round) {
+      block = vaesmcq_u8(vaeseq_u8(block, keys[round]));
+    }
+    u8 stream[16];
+    vst1q_u8(stream, veorq_u8(vaeseq_u8(block, keys[GCM_ROUNDS - 1]), keys[GCM_ROUNDS]));
+    u32 n = length < 16 ? length : 16;
+    for (u32 i = 0; i < n; ++ i) {
+      data[i] ^= stream[i];
+    }
+    data += n;
+    length -= n;
+  }
+  store_be32(counter + 12, count);
+}
+
+static void blocks_ce(const GcmKey &key, const u8 *in, u8 *out, u32 count) {
+  uint8x16_t keys[GCM_ROUNDS + 1];
+  for (int i = 0; i <= GCM_ROUNDS; ++ i) {
+    keys[i] = vld1q_u8(key.round_keys[i]);
+  }
+  for (; count; in += 64, out += 64) {
+    u32 n = count < 4 ? count : 4;
+    uint8x16_t blocks[4];
+    for (u32 j = 0; j < n; ++ j) {
+      blocks[j] = vld1q_u8(in + j * 16);
+    }
+    for (int round = 0; round < GCM_ROUNDS - 1; ++ round) {
+      for (u32 j = 0; j < n; ++ j) {
+        blocks[j] = vaesmcq_u8(vaeseq_u8(blocks[j], keys[round]));
+      }
+    }
+    for (u32 j = 0; j < n; ++ j) {
+      vst1q_u8(out + j * 16, veorq_u8(vaeseq_u8(blocks[j], keys[GCM_ROUNDS - 1]), keys[GCM_ROUNDS]));
+    }
+    count -= n;
+  }
+}
+
+static uint8x16_t clmul_pmull(uint8x16_t a, int a_high, uint8x16_t b, int b_high) {
+  uint64x2_t x = vreinterpretq_u64_u8(a), y = vreinterpretq_u64_u8(b);
+  poly64_t p = (poly64_t) (a_high ? vgetq_lane_u64(x, 1) : vgetq_lane_u64(x, 0));
+  poly64_t q = (poly64_t) (b_high ? vgetq_lane_u64(y, 1) : vgetq_lane_u64(y, 0));
+  return vreinterpretq_u8_p128(vmull_p64(p, q));
+}
+
+// Same algorithm as the PCLMULQDQ version, byte shifts are done with EXT against zero
+static void pmull_accumulate(uint8x16_t a, uint8x16_t b, uint8x16_t &low, uint8x16_t &middle, uint8x16_t &high) {
+  low = veorq_u8(low, clmul_pmull(a, 0, b, 0));
+  middle = veorq_u8(middle, veorq_u8(clmul_pmull(a, 0, b, 1), clmul_pmull(a, 1, b, 0)));
+  high = veorq_u8(high, clmul_pmull(a, 1, b, 1));
+}
+
+static uint8x16_t pmull_reduce(uint8x16_t low, uint8x16_t middle, uint8x16_t high) {
+  const uint8x16_t zero = vdupq_n_u8(0);
+  low = veorq_u8(low, vextq_u8(zero, middle, 8));
+  high = veorq_u8(high, vextq_u8(middle, zero, 8));
+
+  // Shift the 256-bit product left by one bit
+  uint32x4_t low_words = vreinterpretq_u32_u8(low), high_words = vreinterpretq_u32_u8(high);
+  uint8x16_t low_carry = vreinterpretq_u8_u32(vshrq_n_u32(low_words, 31));
+  uint8x16_t high_carry = vreinterpretq_u8_u32(vshrq_n_u32(high_words, 31));
+  low = vorrq_u8(vreinterpretq_u8_u32(vshlq_n_u32(low_words, 1)), vextq_u8(zero, low_carry, 12));
+  high = vorrq_u8(vreinterpretq_u8_u32(vshlq_n_u32(high_words, 1)), vextq_u8(zero, high_carry, 12));
+  high = vorrq_u8(high, vextq_u8(low_carry, zero, 12));
+
+  // Reduce modulo x^128 + x^7 + x^2 + x + 1
+  low_words = vreinterpretq_u32_u8(low);
+  uint32x4_t fold = veorq_u32(veorq_u32(vshlq_n_u32(low_words, 31), vshlq_n_u32(low_words, 30)), vshlq_n_u32(low_words, 25));
+  low = veorq_u8(low, vextq_u8(zero, vreinterpretq_u8_u32(fold), 4));
+  low_words = vreinterpretq_u32_u8(low);
+  uint32x4_t rest = veorq_u32(veorq_u32(vshrq_n_u32(low_words, 1), vshrq_n_u32(low_words, 2)), vshrq_n_u32(low_words, 7));
+  uint8x16_t folded = veorq_u8(vreinterpretq_u8_u32(rest), vextq_u8(vreinterpretq_u8_u32(fold), zero, 4));
+  return veorq_u8(high, veorq_u8(low, folded));
+}
+
+static uint8x16_t gfmul_pmull(uint8x16_t a, uint8x16_t b) {
+  uint8x16_t low = vdupq_n_u8(0), middle = low, high = low;
+  pmull_accumulate(a, b, low, middle, high);
+  return pmull_reduce(low, middle, high);
+}
+
+static uint8x16_t reverse_bytes(uint8x16_t x) {
+  x = vrev64q_u8(x);
+  return vextq_u8(x, x, 8);
+}
+
+static void ghash_pmull(const GcmKey &key, u8 *state, const u8 *data, u32 length) {
+  uint8x16_t powers[4];
+  for (int i = 0; i < 4; ++ i) {
+    powers[i] = vld1q_u8(key.powers[i]);
+  }
+  uint8x16_t x = reverse_bytes(vld1q_u8(state));
+
+  // X = (X + B0) H^4 + B1 H^3 + B2 H^2 + B3 H
+  for (; length >= 64; data += 64, length -= 64) {
+    uint8x16_t low = vdupq_n_u8(0), middle = low, high = low;
+    for (int j = 0; j < 4; ++ j) {
+      uint8x16_t block = reverse_bytes(vld1q_u8(data + j * 16));
+      pmull_accumulate(j == 0 ? veorq_u8(x, block) : block, powers[3 - j], low, middle, high);
+    }
+    x = pmull_reduce(low, middle, high);
+  }
+  for (; length >= 16; data += 16, length -= 16) {
+    x = gfmul_pmull(veorq_u8(x, reverse_bytes(vld1q_u8(data))), powers[0]);
+  }
+  vst1q_u8(state, reverse_bytes(x));
+}
+
+static void prepare_pmull(GcmKey &key) {
+  uint8x16_t h = reverse_bytes(vld1q_u8(key.h)), power = h;
+  for (int i = 0; i < 4; ++ i) {
+    vst1q_u8(key.powers[i], power);
+    power = gfmul_pmull(power, h);
+  }
+}
+
+static const GcmEngine hardware_engine = {"ARMv8 CE", true, ctr_ce, blocks_ce, ghash_pmull, prepare_pmull};
+
+static bool hardware_supported() {
+  unsigned long hwcap = getauxval(AT_HWCAP);
+  return (hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL);
+}
+# endif
+
+// S-box from the multiplicative inverse in GF(2^8) and the affine map, walking the field with
+// generator 3 and its inverse
+static void sbox_init() {
+  u8 p = 1, q = 1;
+  do {
+    p = p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0);
+    q ^= q << 1;
+    q ^= q << 2;
+    q ^= q << 4;
+    q ^= q & 0x80 ? 0x09 : 0;
+    u8 x = q ^ (u8) (q << 1 | q >> 7) ^ (u8) (q << 2 | q >> 6) ^ (u8) (q << 3 | q >> 5) ^ (u8) (q << 4 | q >> 4);
+    sbox[p] = x ^ 0x63;
+  } while (p != 1);
+  sbox[0] = 0x63;
+}
+
+static void select_engine() {
+  if (engine) {
+    return;
+  }
+  sbox_init();
+  engine = &soft_engine;
+# if defined(GCM_X86) || defined(GCM_ARM)
+  if (hardware_supported()) {
+    engine = &hardware_engine;
+  }
+# endif
+}
+
+const char* gcm_engine() {
+  select_engine();
+  return engine -> name;
+}
+
+bool gcm_accelerated() {
+  select_engine();
+  return engine -> accelerated;
+}
+
+void gcm_init(GcmKey &key, const u8 *bytes) {
+  select_engine();
+
+  // AES-256 key expansion (FIPS-197), the same byte layout serves every engine
+  u8 *words = &key.round_keys[0][0];
+  memcpy(words, bytes, GCM_KEY_LENGTH);
+  u8 rcon = 1;
+  for (int i = 8; i < (GCM_ROUNDS + 1) * 4; ++ i) {
+    u8 temp[4];
+    memcpy(temp, words + (i - 1) * 4, 4);
+    if (i % 8 == 0) {
+      u8 first = temp[0];
+      temp[0] = sbox[temp[1]] ^ rcon;
+      temp[1] = sbox[temp[2]];
+      temp[2] = sbox[temp[3]];
+      temp[3] = sbox[first];
+      rcon = xtime(rcon);
+    } else if (i % 8 == 4) {
+      for (u8 &byte: temp) {
+        byte = sbox[byte];
+      }
+    }
+    for (int j = 0; j < 4; ++ j) {
+      words[i * 4 + j] = words[(i - 8) * 4 + j] ^ temp[j];
+    }
+  }
+
+  // H = E(K, 0)
+  u8 counter[16] = {0};
+  memset(key.h, 0, 16);
+  aes_soft(key, counter, key.h);
+  if (engine -> prepare) {
+    engine -> prepare(key);
+  }
+}
+
+// GHASH over AAD and ciphertext (each zero padded) and their bit lengths
+static void gcm_hash(const GcmKey &key, const u8 *aad, u32 aad_length, const u8 *data, u32 length, u8 *state) {
+  u8 block[16];
+  memset(state, 0, 16);
+  const u8 *parts[2] = {aad, data};
+  u32 lengths[2] = {aad_length, length};
+  for (int i = 0; i < 2; ++ i) {
+    u32 whole = lengths[i] & ~15u;
+    engine -> ghash(key, state, parts[i], whole);
+    if (lengths[i] != whole) {
+      memset(block, 0, 16);
+      memcpy(block, parts[i] + whole, lengths[i] - whole);
+      engine -> ghash(key, state, block, 16);
+    }
+  }
+  store_be64(block, (u64) aad_length * 8);
+  store_be64(block + 8, (u64) length * 8);
+  engine -> ghash(key, state, block, 16);
+}
+
+// The hash XORed with E(K, J0)
+static void gcm_tag(const GcmKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, const u8 *data, u32 length, u8 *tag) {
+  u8 state[16], counter[16];
+  gcm_hash(key, aad, aad_length, data, length, state);
+  memcpy(counter, nonce, GCM_NONCE_LENGTH);
+  store_be32(counter + 12, 1);
+  engine -> ctr(key, counter, state, 16);
+  memcpy(tag, state, GCM_TAG_LENGTH);
+}
+
+void gcm_seal(const GcmKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, u8 *data, u32 length, u8 *tag) {
+  u8 counter[16];
+  memcpy(counter, nonce, GCM_NONCE_LENGTH);
+  store_be32(counter + 12, 2);
+  engine -> ctr(key, counter, data, length);
+  gcm_tag(key, nonce, aad, aad_length, data, length, tag);
+}
+
+// The keystream of whole 64-byte spans is made per frame, four blocks in flight; the blocks left
+// over and the tag masks E(K, J0), which would go one by one, are gathered from all frames and
+// encrypted together
+void gcm_seal_batch(const GcmKey &key, GcmJob *jobs, int count) {
+  alignas(16) u8 counters[GCM_BATCH * GCM_BATCH_BLOCKS][16], stream[GCM_BATCH * GCM_BATCH_BLOCKS][16];
+  for (int base = 0; base < count; base += GCM_BATCH) {
+    int group = count - base < GCM_BATCH ? count - base : GCM_BATCH;
+    u32 blocks = 0;
+    for (int i = 0; i < group; ++ i) {
+      const GcmJob &job = jobs[base + i];
+      u8 counter[16];
+      memcpy(counter, job.nonce, GCM_NONCE_LENGTH);
+      store_be32(counter + 12, 2);
+      engine -> ctr(key, counter, job.data, job.length & ~63u);
+      memcpy(counters[blocks], job.nonce, GCM_NONCE_LENGTH);
+      store_be32(counters[blocks ++] + 12, 1);
+      for (u32 offset = job.length & ~63u; offset < job.length; offset += 16) {
+        memcpy(counters[blocks], job.nonce, GCM_NONCE_LENGTH);
+        store_be32(counters[blocks ++] + 12, 2 + offset / 16);
+      }
+    }
+    engine -> blocks(key, counters[0], stream[0], blocks);
+
+    blocks = 0;
+    for (int i = 0; i < group; ++ i) {
+      const GcmJob &job = jobs[base + i];
+      const u8 *mask = stream[blocks ++];
+      for (u32 offset = job.length & ~63u; offset < job.length; offset += 16) {
+        const u8 *key_stream = stream[blocks ++];
+        for (u32 j = offset; j < offset + 16 && j < job.length; ++ j) {
+          job.data[j] ^= key_stream[j - offset];
+        }
+      }
+      u8 state[16];
+      gcm_hash(key, job.aad, job.aad_length, job.data, job.length, state);
+      for (int j = 0; j < GCM_TAG_LENGTH; ++ j) {
+        job.tag[j] = state[j] ^ mask[j];
+      }
+    }
+  }
+}
+
+bool gcm_open(const GcmKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, u8 *data, u32 length, const u8 *tag) {
+  u8 expected[GCM_TAG_LENGTH], difference = 0;
+  gcm_tag(key, nonce, aad, aad_length, data, length, expected);
+  for (int i = 0; i < GCM_TAG_LENGTH; ++ i) {
+    difference |= expected[i] ^ tag[i];
+  }
+  if (difference) {
+    return false;
+  }
+  u8 counter[16];
+  memcpy(counter, nonce, GCM_NONCE_LENGTH);
+  store_be32(counter + 12, 2);
+  engine -> ctr(key, counter, data, length);
+  return true;
+}
@@ -0,0 +1,50 @@
+// AES-256-GCM of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define GCM_KEY_LENGTH               32    // AES-256
+# define GCM_NONCE_LENGTH             12
+# define GCM_TAG_LENGTH               16
+# define GCM_ROUNDS                   14
+# define GCM_BATCH                    16    // frames of a batch whose leftover blocks are encrypted together
+# define GCM_BATCH_BLOCKS             5     // per frame, the tag mask and up to 4 after the last whole 64 bytes
+
+// Expanded key
+struct GcmKey {
+  alignas(16) u8 round_keys[GCM_ROUNDS + 1][16];
+  alignas(16) u8 h[16];             // hash subkey
+  alignas(16) u8 powers[4][16];     // H^1 ~ H^4 in the layout of an accelerated engine
+};
+
+// The engine (AES-NI with PCLMULQDQ, ARMv8 Crypto Extensions with PMULL, or portable C) is picked
+// once from the CPU features at run time
+
+// Name of the engine in use, and whether it is hardware accelerated
+const char* gcm_engine();
+bool gcm_accelerated();
+
+void gcm_init(GcmKey &key, const u8 *bytes);
+
+// Encrypt or decrypt 'data' in place, open returns false (and leaves 'data' undefined) if the tag
+// does not match
+void gcm_seal(const GcmKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, u8 *data, u32 length, u8 *tag);
+// One frame of a batch, sealed in place
+struct GcmJob {
+  const u8 *nonce;
+  const u8 *aad;
+  u32 aad_length;
+  u8 *data;
+  u32 length;
+  u8 *tag;
+};
+
+// Seal a batch of frames, as gcm_seal does one by one, but with the blocks of short frames and
+// the tag masks of all of them kept in flight together
+void gcm_seal_batch(const GcmKey &key, GcmJob *jobs, int count);
+
+bool gcm_open(const GcmKey &key, const u8 *nonce, const u8 *aad, u32 aad_length, u8 *data, u32 length, const u8 *tag);
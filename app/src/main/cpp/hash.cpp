@@ -0,0 +1,226 @@
+// Hashes and key derivation of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "hash.h"
+
+// Native C++
+# include <cstring>
+
+static const u32 sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const u32 sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const u64 sha512_k[80] = {
+  0x428a2f98d728ae22ull, 0x7137449123ef65cdull, 0xb5c0fbcfec4d3b2full, 0xe9b5dba58189dbbcull,
+  0x3956c25bf348b538ull, 0x59f111f1b605d019ull, 0x923f82a4af194f9bull, 0xab1c5ed5da6d8118ull,
+  0xd807aa98a3030242ull, 0x12835b0145706fbeull, 0x243185be4ee4b28cull, 0x550c7dc3d5ffb4e2ull,
+  0x72be5d74f27b896full, 0x80deb1fe3b1696b1ull, 0x9bdc06a725c71235ull, 0xc19bf174cf692694ull,
+  0xe49b69c19ef14ad2ull, 0xefbe4786384f25e3ull, 0x0fc19dc68b8cd5b5ull, 0x240ca1cc77ac9c65ull,
+  0x2de92c6f592b0275ull, 0x4a7484aa6ea6e483ull, 0x5cb0a9dcbd41fbd4ull, 0x76f988da831153b5ull,
+  0x983e5152ee66dfabull, 0xa831c66d2db43210ull, 0xb00327c898fb213full, 0xbf597fc7beef0ee4ull,
+  0xc6e00bf33da88fc2ull, 0xd5a79147930aa725ull, 0x06ca6351e003826full, 0x142929670a0e6e70ull,
+  0x27b70a8546d22ffcull, 0x2e1b21385c26c926ull, 0x4d2c6dfc5ac42aedull, 0x53380d139d95b3dfull,
+  0x650a73548baf63deull, 0x766a0abb3c77b2a8ull, 0x81c2c92e47edaee6ull, 0x92722c851482353bull,
+  0xa2bfe8a14cf10364ull, 0xa81a664bbc423001ull, 0xc24b8b70d0f89791ull, 0xc76c51a30654be30ull,
+  0xd192e819d6ef5218ull, 0xd69906245565a910ull, 0xf40e35855771202aull, 0x106aa07032bbd1b8ull,
+  0x19a4c116b8d2d0c8ull, 0x1e376c085141ab53ull, 0x2748774cdf8eeb99ull, 0x34b0bcb5e19b48a8ull,
+  0x391c0cb3c5c95a63ull, 0x4ed8aa4ae3418acbull, 0x5b9cca4f7763e373ull, 0x682e6ff3d6b2b8a3ull,
+  0x748f82ee5defb2fcull, 0x78a5636f43172f60ull, 0x84c87814a1f0ab72ull, 0x8cc702081a6439ecull,
+  0x90befffa23631e28ull, 0xa4506cebde82bde9ull, 0xbef9a3f7b2c67915ull, 0xc67178f2e372532bull,
+  0xca273eceea26619cull, 0xd186b8c721c0c207ull, 0xeada7dd6cde0eb1eull, 0xf57d4f7fee6ed178ull,
+  0x06f067aa72176fbaull, 0x0a637dc5a2c898a6ull, 0x113f9804bef90daeull, 0x1b710b35131c471bull,
+  0x28db77f523047d84ull, 0x32caab7b40c72493ull, 0x3c9ebe0a15c9bebcull, 0x431d67c49c100d4cull,
+  0x4cc5d4becb3e42b6ull, 0x597f299cfc657e2aull, 0x5fcb6fab3ad6faecull, 0x6c44198c4a475817ull
+};
+
+static const u64 sha384_iv[8] = {
+  0xcbbb9d5dc1059ed8ull, 0x629a292a367cd507ull, 0x9159015a3070dd17ull, 0x152fecd8f70e5939ull,
+  0x67332667ffc00b31ull, 0x8eb44a8768581511ull, 0xdb0c2e0d64f98fa7ull, 0x47b5481dbefa4fa4ull
+};
+
+static inline u32 rotr32(u32 x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static inline u64 rotr64(u64 x, int n) {
+  return (x >> n) | (x << (64 - n));
+}
+
+static void sha256_block(u32 *state, const u8 *block) {
+  u32 w[64];
+  for (int i = 0; i < 16; ++ i) {
+    w[i] = (u32) block[i * 4] << 24 | (u32) block[i * 4 + 1] << 16 | (u32) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  }
+  for (int i = 16; i < 64; ++ i) {
+    u32 s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    u32 s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  u32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; ++ i) {
+    u32 t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    u32 t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+  }
+  state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+  state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+static void sha512_block(u64 *state, const u8 *block) {
+  u64 w[80];
+  for (int i = 0; i < 16; ++ i) {
+    w[i] = 0;
+    for (int j = 0; j < 8; ++ j) {
+      w[i] = w[i] << 8 | block[i * 8 + j];
+    }
+  }
+  for (int i = 16; i < 80; ++ i) {
+    u64 s0 = rotr64(w[i - 15], 1) ^ rotr64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+    u64 s1 = rotr64(w[i - 2], 19) ^ rotr64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  u64 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 80; ++ i) {
+    u64 t1 = h + (rotr64(e, 14) ^ rotr64(e, 18) ^ rotr64(e, 41)) + ((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+    u64 t2 = (rotr64(a, 28) ^ rotr64(a, 34) ^ rotr64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+  }
+  state[0] += a, state[1] += b, state[2] += c, state[3] += d;
+  state[4] += e, state[5] += f, state[6] += g, state[7] += h;
+}
+
+static inline u32 block_length(int algorithm) {
+  return algorithm == HASH_SHA256 ? 64 : 128;
+}
+
+static inline void compress(Hash &hash, const u8 *block) {
+  if (hash.algorithm == HASH_SHA256) {
+    sha256_block(hash.state32, block);
+  } else {
+    sha512_block(hash.state64, block);
+  }
+}
+
+u32 hash_length(int algorithm) {
+  return algorithm == HASH_SHA256 ? 32 : 48;
+}
+
+void hash_init(Hash &hash, int algorithm) {
+  hash.algorithm = algorithm;
+  memcpy(hash.state32, sha256_iv, sizeof(sha256_iv));
+  memcpy(hash.state64, sha384_iv, sizeof(sha384_iv));
+  hash.buffered = 0;
+  hash.length = 0;
+}
+
+void hash_update(Hash &hash, const u8 *data, u32 length) {
+  u32 block = block_length(hash.algorithm);
+  if (length == 0) {
+    return;
+  }
+  hash.length += length;
+  if (hash.buffered) {
+    u32 taken = block - hash.buffered < length ? block - hash.buffered : length;
+    memcpy(hash.buffer + hash.buffered, data, taken);
+    hash.buffered += taken, data += taken, length -= taken;
+    if (hash.buffered < block) {
+      return;
+    }
+    compress(hash, hash.buffer);
+    hash.buffered = 0;
+  }
+  for (; length >= block; data += block, length -= block) {
+    compress(hash, data);
+  }
+  memcpy(hash.buffer, data, length);
+  hash.buffered = length;
+}
+
+void hash_final(const Hash &hash, u8 *digest) {
+  Hash last = hash;
+  u32 block = block_length(hash.algorithm), size = block / 8; // bytes of the length field
+  u64 bits = hash.length * 8;
+  u8 padding[2 * HASH_MAX_BLOCK] = {0x80};
+  u32 padded = (last.buffered + 1 + size <= block ? block : 2 * block) - last.buffered;
+  for (int i = 0; i < 8; ++ i) {
+    padding[padded - 1 - i] = (u8) (bits >> (i * 8));
+  }
+  hash_update(last, padding, padded);
+  if (hash.algorithm == HASH_SHA256) {
+    for (int i = 0; i < 32; ++ i) {
+      digest[i] = (u8) (last.state32[i / 4] >> (24 - i % 4 * 8));
+    }
+  } else {
+    for (int i = 0; i < 48; ++ i) {
+      digest[i] = (u8) (last.state64[i / 8] >> (56 - i % 8 * 8));
+    }
+  }
+}
+
+void hash_digest(int algorithm, const u8 *data, u32 length, u8 *digest) {
+  Hash hash;
+  hash_init(hash, algorithm);
+  hash_update(hash, data, length);
+  hash_final(hash, digest);
+}
+
+void hmac(int algorithm, const u8 *key, u32 key_length, const u8 *data, u32 length, u8 *mac) {
+  u32 block = block_length(algorithm);
+  u8 pad[HASH_MAX_BLOCK] = {0}, inner[HASH_MAX_LENGTH];
+  if (key_length > block) {
+    hash_digest(algorithm, key, key_length, pad);
+  } else {
+    memcpy(pad, key, key_length);
+  }
+  Hash hash;
+  for (u32 i = 0; i < block; ++ i) {
+    pad[i] ^= 0x36;
+  }
+  hash_init(hash, algorithm);
+  hash_update(hash, pad, block);
+  hash_update(hash, data, length);
+  hash_final(hash, inner);
+  for (u32 i = 0; i < block; ++ i) {
+    pad[i] ^= 0x36 ^ 0x5c;
+  }
+  hash_init(hash, algorithm);
+  hash_update(hash, pad, block);
+  hash_update(hash, inner, hash_length(algorithm));
+  hash_final(hash, mac);
+}
+
+void hkdf_extract(int algorithm, const u8 *salt, u32 salt_length, const u8 *ikm, u32 ikm_length, u8 *prk) {
+  u8 zeros[HASH_MAX_LENGTH] = {0};
+  if (salt_length == 0) {
+    salt = zeros, salt_length = hash_length(algorithm);
+  }
+  hmac(algorithm, salt, salt_length, ikm, ikm_length, prk);
+}
+
+// T(i) = HMAC(PRK, T(i - 1) | info | i), 'info' is at most a few labels long here
+void hkdf_expand(int algorithm, const u8 *prk, const u8 *info, u32 info_length, u8 *okm, u32 length) {
+  u32 size = hash_length(algorithm), previous = 0;
+  u8 input[HASH_MAX_LENGTH + 256 + 1], block[HASH_MAX_LENGTH];
+  for (u8 i = 1; length; ++ i) {
+    memcpy(input + previous, info, info_length);
+    input[previous + info_length] = i;
+    hmac(algorithm, prk, size, input, previous + info_length + 1, block);
+    u32 taken = length < size ? length : size;
+    memcpy(okm, block, taken);
+    okm += taken, length -= taken;
+    memcpy(input, block, size);
+    previous = size;
+  }
+}
@@ -0,0 +1,38 @@
+// Hashes and key derivation of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define HASH_SHA256                  0
+# define HASH_SHA384                  1
+# define HASH_MAX_LENGTH              48
+# define HASH_MAX_BLOCK               128
+
+// SHA-256 and SHA-384 (FIPS 180-4) with HMAC and HKDF (RFC 5869), for the TLS key schedule, so
+// speed does not matter here
+
+struct Hash {
+  int algorithm;
+  u32 state32[8];   // SHA-256
+  u64 state64[8];   // SHA-384
+  u8 buffer[HASH_MAX_BLOCK];
+  u32 buffered;
+  u64 length;
+};
+
+u32 hash_length(int algorithm);
+
+void hash_init(Hash &hash, int algorithm);
+void hash_update(Hash &hash, const u8 *data, u32 length);
+
+// Digest of everything so far, the hash can go on (transcripts)
+void hash_final(const Hash &hash, u8 *digest);
+
+void hash_digest(int algorithm, const u8 *data, u32 length, u8 *digest);
+void hmac(int algorithm, const u8 *key, u32 key_length, const u8 *data, u32 length, u8 *mac);
+void hkdf_extract(int algorithm, const u8 *salt, u32 salt_length, const u8 *ikm, u32 ikm_length, u8 *prk);
+void hkdf_expand(int algorithm, const u8 *prk, const u8 *info, u32 info_length, u8 *okm, u32 length);
@@ -0,0 +1,45 @@
+// Protocol messages of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define DATA_MAX_LENGTH              4096
+# define HEADER_LENGTH                (sizeof(u32) + sizeof(u8))
+# define DATA_RESERVE                 64    // bytes of 'data' left free by tun reads, for frame transforms
+
+# define IP_REQUEST    100
+# define IP_REPLY      101
+# define NET_REQUEST   102
+# define NET_REPLY     103
+# define HEARTBEAT     104
+# define SEALED        105   // counter, then the encrypted type and data of the inner frame, then the tag
+# define SEALED_CHACHA 106   // the same with ChaCha20-Poly1305
+# define COMPRESSED    107   // the inner type, then an LZ4 block of the inner data
+# define HEADER_FULL   108   // context id, then a data packet with full headers, which the context takes
+# define HEADER_DELTA  109   // context id, the header fields the context does not predict, then the payload
+# define HEADER_RESYNC 110   // context id the receiver has lost
+# define DEDUPED       111   // the inner type, the length of the headers, the headers, then literal chunks and runs of cached ones
+# define STREAM_OPEN   112   // stream id, then the destination address and port, then a host name if the address is 0
+# define STREAM_DATA   113   // stream id, then bytes of the stream
+# define STREAM_CLOSE  114   // stream id, then STREAM_FIN (no more bytes) or STREAM_RESET
+# define STREAM_WINDOW 115   // stream id, then bytes more the sender may send
+# define SALT          116   // the salt the session key of sealed frames is derived with
+# define STREAM_FIN    0
+# define STREAM_RESET  1
+# define STREAM_ID_LENGTH             4
+# define STREAM_PROXIED               0x80000000u // bit of the ids of streams opened by the local proxy
+
+// Message
+struct Message {
+  u32 length; // includes 'length', 'type' and 'data'
+  u8 type;
+  u8 data[DATA_MAX_LENGTH];
+};
+
+// Constant message
+const Message ip_request = {HEADER_LENGTH, IP_REQUEST};
+const Message heartbeat = {HEADER_LENGTH, HEARTBEAT};
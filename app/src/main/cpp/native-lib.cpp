@@ -3,7 +3,6 @@
 // Chenggang Zhao & Yuxian Gu
 
 // Android Includes
-# include <android/log.h>
 # include <jni.h>
 
 // Native C++
@@ -23,49 +22,109 @@
 # include <netinet/in.h>
 # include <netinet/ip.h>
 # include <netinet/tcp.h>
+# include <poll.h>
+# include <sys/eventfd.h>
 # include <sys/socket.h>
 
-// Defines & Macros
-# define debug(...) __android_log_print(ANDROID_LOG_DEBUG, __func__, __VA_ARGS__)
-# define error(...) __android_log_print(ANDROID_LOG_ERROR, __func__, __VA_ARGS__)
-
-typedef unsigned char u8;
-typedef unsigned int u32;
+// Backend
+# include "common.h"
+# include "compress.h"
+# include "crypto.h"
+# include "dedup.h"
+# include "filter.h"
+# include "message.h"
+# include "pmtu.h"
+# include "pool.h"
+# include "proxy.h"
+# include "queue.h"
+# include "rohc.h"
+# include "route.h"
+# include "shaper.h"
+# include "stream.h"
+# include "timer.h"
+# include "tls.h"
+# include "writer.h"
 
 // Parameters
-# define DATA_MAX_LENGTH              4096
 # define PRINT_BUFFER_LENGTH          128
+# define STATUS_BUFFER_LENGTH         4096
 # define REQUEST_LIMIT                3
 # define RECV_CHECK_INTEVAL           100
 # define RECONNECT_LIMIT              3
 # define SOCKET_TIMEOUT               4     // also IP request timeout
+# define HEARTBEAT_INTERVAL           20    // s
+# define HEARTBEAT_TIMEOUT            60    // s
+# define STATS_INTERVAL               1000  // ms
+# define STANDBY_POLL_INTERVAL        100   // ms
+# define STANDBY_RETRY_INTERVAL       1000  // ms, doubled on each failure
+# define STANDBY_RETRY_MAX            32000 // ms
+# define LIVENESS_PROBE_INTERVAL      200   // ms, probes are suppressed while data flows
+# define LIVENESS_DETECT_TARGET       2000  // ms, also TCP_USER_TIMEOUT
+# define KEEPALIVE_IDLE               1     // s
+# define KEEPALIVE_INTERVAL           1     // s
+# define ENERGY_TIMER_ALIGN           1000  // ms, timers of energy mode fire on these boundaries
+# define ENERGY_HEARTBEAT_SLACK       5000  // ms a heartbeat may wait for a burst in energy mode
+# define MSS_CLAMP_MIN                536   // bytes, inner MSS options are never clamped below
+# define RECV_FRAMES                  ((POOL_WINDOW + 1) * POOL_BATCH) // a full window and a batch being filled
 
-# define IP_REQUEST   100
-# define IP_REPLY     101
-# define NET_REQUEST  102
-# define NET_REPLY    103
-# define HEARTBEAT    104
+// File descriptor & socket info
+int sockfd = -1, tunfd = -1, retired_fd = -1;
+sockaddr* sock_addr; socklen_t sock_len;
+addrinfo *list, *sock_info;
 
-// Message
-struct Message {
-  u32 length; // includes 'length', 'type' and 'data'
-  u8 type;
-  u8 data[DATA_MAX_LENGTH];
-};
+// Warm standby (connected, IP-requested and heartbeated, but carrying no traffic)
+int standby_fd = -1;
+addrinfo *standby_info;
+pthread_mutex_t standby_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t standby_wakeup = PTHREAD_COND_INITIALIZER;
+std::string ip_info;
 
-// Constant message
-const Message ip_request = {sizeof(u32) + sizeof(u8), IP_REQUEST};
-const Message heartbeat = {sizeof(u32) + sizeof(u8), HEARTBEAT};
+// Receive buffers, sealed frames are opened by the workers and delivered in order
+Message recv_frames[RECV_FRAMES];
+Message *recv_free[RECV_FRAMES];
+int recv_free_count;
+pthread_mutex_t recv_lock = PTHREAD_MUTEX_INITIALIZER;
+PoolStage opening;
+int pool_requested = -1;
+volatile bool tunnel_down;
 
-// File descriptor & socket info
-int sockfd = -1, tunfd = -1;
-sockaddr* sock_addr; socklen_t sock_len;
-addrinfo *list;
+// Java side, for protecting sockets created by native threads
+JavaVM *jvm;
+jobject service;
 
 // Counters
-u32 time_connected, time_last_heartbeat, time_send_heartbeat;
-u32 bytes_sent, bytes_recv, bytes_sent_sec, bytes_recv_sec;
-volatile bool running = false, ip_requesting = false;
+u64 time_start_us;
+u32 bytes_sent, bytes_recv, bytes_sent_sec, bytes_recv_sec, bytes_sent_rate, bytes_recv_rate;
+u32 sojourn_max_rate;
+u32 acks_filtered_last, acks_filtered_rate;
+u32 failovers, failover_last_us;
+
+// Liveness
+u32 liveness_probe_ms = LIVENESS_PROBE_INTERVAL, liveness_target_ms = LIVENESS_DETECT_TARGET;
+u32 probes_sent, detection_last_ms;
+volatile u64 time_last_alive_us;
+int dead_fd = -1;
+
+// MSS clamping, so a full-size inner segment fills an outer segment with its frame
+u32 mss_outer, mss_clamp = 65535; // no clamping until the outer MSS is known
+u32 mss_clamped_up, mss_clamped_down;
+
+// Timers (fired on the timer thread)
+void heartbeat_fire(Timer *timer);
+void heartbeat_timeout_fire(Timer *timer);
+void standby_timeout_fire(Timer *timer);
+void standby_retry_fire(Timer *timer);
+void liveness_fire(Timer *timer);
+void stats_fire(Timer *timer);
+Timer heartbeat_timer = {heartbeat_fire};
+Timer heartbeat_timeout = {heartbeat_timeout_fire};
+Timer standby_timeout = {standby_timeout_fire};
+Timer standby_retry = {standby_retry_fire};
+Timer liveness_timer = {liveness_fire};
+Timer stats_timer = {stats_fire};
+volatile bool running = false, ip_requesting = false, energy_mode = false;
+int shutdown_fd = -1; // readable once stopped, watched by every blocking wait
+u64 time_stop_us;
 bool error_occured;
 
 // Utilities - print pretty time and size
@@ -90,14 +149,65 @@ std::string prettyTime(u32 time) {
   return pretty(time, 60, units, 2);
 }
 
+// Stop all threads, wakes up every blocking wait
+void stop() {
+  if (running) {
+    time_stop_us = now_us();
+  }
+  running = false;
+  eventfd_write(shutdown_fd, 1);
+  pthread_mutex_lock(&standby_lock);
+  pthread_cond_signal(&standby_wakeup);
+  pthread_mutex_unlock(&standby_lock);
+}
+
+// Wait for 'events' on 'fd' (timeout in ms, -1 for none), returns 1 if ready, 0 if timeout and -1 if stopped
+int wait_fd(int fd, short events, int timeout) {
+  // Data opened in user space is not seen by poll
+  if ((events & POLLIN) && tls_pending(fd)) {
+    return 1;
+  }
+  pollfd fds[2] = {{fd, events, 0}, {shutdown_fd, POLLIN, 0}};
+  int ready = poll(fds, 2, timeout);
+  if (ready < 0 && errno == EINTR) {
+    return 0;
+  }
+  if (ready < 0 || fds[1].revents) {
+    return -1;
+  }
+  return fds[0].revents ? 1 : 0;
+}
+
+// Connect without blocking past a stop, returns 0 if succeeded
+int connect_wait(int fd, const sockaddr *addr, socklen_t len) {
+  int flags = fcntl(fd, F_GETFL);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int result = connect(fd, addr, len);
+  if (result != 0 && errno == EINPROGRESS) {
+    int ready = wait_fd(fd, POLLOUT, SOCKET_TIMEOUT * 1000), err = ready == 0 ? ETIMEDOUT : ECANCELED;
+    socklen_t size = sizeof(err);
+    if (ready > 0) {
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size);
+    }
+    errno = err;
+    result = err ? -1 : 0;
+  }
+  fcntl(fd, F_SETFL, flags);
+  return result;
+}
+
 // Send raw
-int send_raw(u8* ptr, u32 length) {
+int send_raw(int fd, u8* ptr, u32 length) {
   // Already terminate
   if (!running && !ip_requesting) {
     return -1;
   }
+  if (wait_fd(fd, POLLOUT, SOCKET_TIMEOUT * 1000) <= 0) {
+    error("Socket not writable or stopped");
+    return -1;
+  }
 
-  int sent = send(sockfd, ptr, length, 0);
+  int sent = tls_send(fd, ptr, length, MSG_NOSIGNAL);
   if (sent < length) {
     error("Failed to write raw sockets (%d/%d)", sent, length);
     return -1;
@@ -105,16 +215,35 @@ int send_raw(u8* ptr, u32 length) {
   return sent;
 }
 
+// Send the salt of sealed frames if any, so the server can key the session
+int send_salt(int fd) {
+  Message salt;
+  return crypto_salt(salt) ? send_raw(fd, (u8 *) &salt, salt.length) : 0;
+}
+
 // Receive raw
-int recv_raw(u8 *buffer, u32 length) {
+int recv_raw(int fd, u8 *buffer, u32 length) {
   int received = 0, times_reconnect = 0;
   // Note: there will be no auto shutdown because the protocol does not include an end signal, so the only way to stop is via heartbeat or reconnect times
   while ((running || ip_requesting) && (received < length)) {
-    int single = recv(sockfd, buffer + received, length - received, 0);
-    if (single < 0 && errno != EAGAIN) {
+    int ready = wait_fd(fd, POLLIN, SOCKET_TIMEOUT * 1000), single = -1;
+    if (ready < 0) {
+      break;
+    } else if (ready == 0) {
+      errno = EAGAIN;
+    } else {
+      single = tls_recv(fd, buffer + received, length - received);
+    }
+    if (single == 0 || (single < 0 && errno != EAGAIN)) {
+      // Standby sockets are rebuilt instead, a primary with a standby fails over at once, and a TLS
+      // session can not go on over a new connection
+      if (fd != sockfd || standby_fd != -1 || tls_enabled()) {
+        debug("Connection lost (%s)", single == 0 ? "closed by peer" : strerror(errno));
+        break;
+      }
       usleep(RECV_CHECK_INTEVAL);
       debug("Reconnecting (%s)", strerror(errno));
-      if (connect(sockfd, sock_addr, sock_len) != 0) {
+      if (connect_wait(fd, sock_addr, sock_len) != 0) {
         times_reconnect += 1;
         debug("Reconnect error: %s", strerror(errno));
         if (times_reconnect == RECONNECT_LIMIT) {
@@ -124,10 +253,11 @@ int recv_raw(u8 *buffer, u32 length) {
       } else {
         times_reconnect = 0;
         debug("Reconnect OK");
+        send_salt(fd);
       }
     } else if (single <= 0) {
       times_reconnect = 0;
-      if (ip_requesting) {
+      if (ip_requesting || fd != sockfd) {
         debug("IP Request timeout");
         break;
       }
@@ -142,82 +272,554 @@ int recv_raw(u8 *buffer, u32 length) {
   return received;
 }
 
-// Send heartbeat
-int send_heartbeat() {
-  return send_raw((u8 *) &heartbeat, heartbeat.length);
-}
-
 // Send IP request
-int send_ip_request() {
-  return send_raw((u8 *) &ip_request, ip_request.length);
+int send_ip_request(int fd) {
+  return send_raw(fd, (u8 *) &ip_request, ip_request.length);
 }
 
 // Waiting for a message
-bool recv_message(Message &message) {
+bool recv_message(int fd, Message &message) {
   int size;
-  size = recv_raw((u8 *) &message, sizeof(u32));
+  size = recv_raw(fd, (u8 *) &message, sizeof(u32));
   if ((size < sizeof(u32)) || (!running && !ip_requesting)) {
     return false;
   }
+  if (message.length < HEADER_LENGTH || message.length > sizeof(Message)) {
+    error("Bad message length (%d)", message.length);
+    return false;
+  }
 
-  size = recv_raw(((u8 *) &message) + sizeof(u32), message.length - sizeof(u32));
+  size = recv_raw(fd, ((u8 *) &message) + sizeof(u32), message.length - sizeof(u32));
   return (size + sizeof(u32)) == message.length;
 }
 
-// Sender thread
+// Send an IP request and wait for the reply (with the address info NUL-terminated in 'data')
+bool request_ip(int fd, Message &message) {
+  send_salt(fd);
+  send_ip_request(fd);
+
+  u32 times_try = 0;
+  while (times_try < REQUEST_LIMIT) {
+    debug("Waiting for IP reply");
+    if (!recv_message(fd, message)) {
+      return false;
+    }
+
+    if (message.type == IP_REPLY) {
+      message.data[message.length - 5] = '\0';
+      debug("Received IP reply: %s", message.data);
+      return true;
+    }
+
+    debug("Not an IP reply");
+    ++ times_try;
+  }
+  return false;
+}
+
+// Exclude a socket from the VPN (must be called on sockets not created by Java request path)
+void protect_socket(int fd) {
+  JNIEnv *env;
+  if (jvm == nullptr || jvm -> GetEnv((void **) &env, JNI_VERSION_1_6) != JNI_OK) {
+    error("Can not protect socket %d without an attached thread", fd);
+    return;
+  }
+  jclass cls = env -> GetObjectClass(service);
+  jmethodID protect = env -> GetMethodID(cls, "protect", "(I)Z");
+  if (!env -> CallBooleanMethod(service, protect, fd)) {
+    error("Failed to protect socket %d", fd);
+  }
+  env -> DeleteLocalRef(cls);
+}
+
+// Create a socket and connect, returns -1 if failed. Sockets of native threads are protected from the
+// VPN before connecting, or their SYN would be routed into it
+int connect_socket(addrinfo *ptr, bool protect) {
+  debug("Creating socket at family@%d, type@%d, protocol@%d", ptr -> ai_family, ptr -> ai_socktype, ptr -> ai_protocol);
+  int fd = socket(ptr -> ai_family, ptr -> ai_socktype, ptr -> ai_protocol);
+  if (fd < 0) {
+    debug("socket() failed, %s", strerror(errno));
+    return -1;
+  }
+  if (protect) {
+    protect_socket(fd);
+  }
+
+  u32 enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(u32));
+
+  // Set timeout
+  timeval timeout = {SOCKET_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // Let the kernel abort a blackholed connection within the detection target
+  u32 user_timeout = liveness_target_ms;
+  u32 keepalive_idle = KEEPALIVE_IDLE, keepalive_interval = KEEPALIVE_INTERVAL;
+  u32 keepalive_count = liveness_target_ms / 1000 / KEEPALIVE_INTERVAL + 1;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(u32));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_idle, sizeof(u32));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_interval, sizeof(u32));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_count, sizeof(u32));
+  setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(u32));
+
+  if (connect_wait(fd, ptr -> ai_addr, ptr -> ai_addrlen) != 0) {
+    debug("connect() failed, %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  if (tls_enabled() && !tls_handshake(fd, shutdown_fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Drop the standby (standby thread only, which owns its socket until a failover takes it), a new one
+// is built right after
+void drop_standby() {
+  pthread_mutex_lock(&standby_lock);
+  if (standby_fd != -1) {
+    shutdown(standby_fd, SHUT_RDWR);
+    close(standby_fd);
+    standby_fd = -1;
+  }
+  timer_cancel(&standby_timeout);
+  pthread_mutex_unlock(&standby_lock);
+}
+
+// Derive the MSS inner SYNs are clamped to from the outer one of 'fd'
+void mss_update(int fd) {
+  int outer = 0;
+  socklen_t size = sizeof(int);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_MAXSEG, &outer, &size) != 0 || outer <= 0) {
+    return;
+  }
+
+  // A sealed frame adds its counter, type and tag, while TLS records hold many frames each
+  u32 overhead = HEADER_LENGTH + (crypto_enabled() ? CRYPTO_OVERHEAD : 0) + IPV4_MIN_HEADER + TCP_MIN_HEADER;
+  mss_outer = (u32) outer;
+  mss_clamp = mss_outer > overhead + MSS_CLAMP_MIN ? mss_outer - overhead : MSS_CLAMP_MIN;
+}
+
+// Promote the standby to primary, returns false if there is no standby
+bool failover() {
+  u64 start = now_us();
+  pthread_mutex_lock(&standby_lock);
+  int fd = standby_fd;
+  standby_fd = -1;
+  pthread_mutex_unlock(&standby_lock);
+  if (fd == -1) {
+    return false;
+  }
+
+  // The writer may still hold the old socket for a moment, so it is closed one failover later
+  int old = sockfd;
+  sockfd = fd;
+  sock_info = standby_info;
+  sock_addr = sock_info -> ai_addr;
+  sock_len = sock_info -> ai_addrlen;
+  writer_attach(fd);
+  mss_update(fd);
+  rohc_connection();
+  dedup_connection();
+  stream_connection();
+  proxy_connection();
+  pmtu_connection();
+  shutdown(old, SHUT_RDWR);
+  if (retired_fd != -1) {
+    close(retired_fd);
+  }
+  retired_fd = old;
+
+  timer_cancel(&standby_timeout);
+  timer_schedule(&heartbeat_timeout, HEARTBEAT_TIMEOUT * 1000);
+  detection_last_ms = (start - time_last_alive_us) / 1000;
+  time_last_alive_us = now_us();
+  failover_last_us = time_last_alive_us - start;
+  ++ failovers;
+  debug("Failover to standby sockfd = %d in %d us (peer silent for %d ms)", fd, failover_last_us, detection_last_ms);
+  return true;
+}
+
+// Sender thread, frames tun packets in place in the writer queue, serves the sockets of the proxy and
+// the bypass path, and sends path MTU probes
 void* send_thread(void *_) {
-  Message message;
+  pollfd fds[PROXY_FDS + ROUTE_BYPASS_SOCKETS + 2];
   while (running) { // 'running' is volatile
-    int length = read(tunfd, message.data, DATA_MAX_LENGTH);
+    fds[0] = {tunfd, POLLIN, 0};
+    fds[1] = {shutdown_fd, POLLIN, 0};
+    int timeout = -1, count = proxy_poll(fds + 2, timeout);
+    int bypass = route_poll(fds + 2 + count);
+    pmtu_poll(timeout);
+    if (poll(fds, count + bypass + 2, timeout) < 0 || fds[1].revents) {
+      continue;
+    }
+    proxy_serve(fds + 2, count);
+    route_serve(fds + 2 + count, bypass);
+    pmtu_serve();
+    if (!(fds[0].revents & POLLIN)) {
+      continue;
+    }
+    Message *message = writer_reserve();
+    int length = read(tunfd, message -> data, DATA_MAX_LENGTH - DATA_RESERVE);
     if (length > 0) {
-      message.length = length + sizeof(u32) + sizeof(u8);
-      message.type = NET_REQUEST;
+      message -> length = length + HEADER_LENGTH;
+      message -> type = NET_REQUEST;
 
       // debug("Sending from send_thread with length = %d", length);
-      send_raw((u8*) &message, message.length);
-
-      bytes_sent += message.length;
-      bytes_sent_sec += message.length;
+      u32 verdict = filter_run(message -> data, (u32) length);
+      if (verdict == FILTER_DROP || route_input(message -> data, (u32) length)
+        || pmtu_too_big(message -> data, (u32) length)) {
+        writer_discard(message);
+      } else if (verdict == FILTER_PACKET || !stream_input(message)) {
+        // Only packets that go into the tunnel count, the writer owns the message once committed
+        mss_clamped_up += tcp_clamp_mss(message -> data, (u32) length, (u16) mss_clamp);
+        bytes_sent += message -> length;
+        bytes_sent_sec += message -> length;
+        writer_commit_class(message, filter_class(verdict, message -> data, (u32) length));
+      }
+    } else {
+      writer_discard(message);
     }
   }
   debug("Sender thread ends");
   return nullptr;
 }
 
-// Receiver thread
+// Receive buffers, never run out as the window bounds the frames with the workers
+Message* recv_buffer() {
+  pthread_mutex_lock(&recv_lock);
+  Message *message = recv_free[-- recv_free_count];
+  pthread_mutex_unlock(&recv_lock);
+  return message;
+}
+
+void recv_release(Message *message) {
+  pthread_mutex_lock(&recv_lock);
+  recv_free[recv_free_count ++] = message;
+  pthread_mutex_unlock(&recv_lock);
+}
+
+// Handle a frame in receiving order, returns false if the tunnel is down
+bool deliver(Message &message) {
+  // Packed frames are taken whatever the setting
+  if (message.type == COMPRESSED && !compress_open(message)) {
+    error("Dropped a malformed compressed frame");
+    return true;
+  }
+  if (message.type == DEDUPED && !dedup_open(message)) {
+    error("Dropped a frame referring to a chunk not in the byte cache");
+    return true;
+  }
+  bool resync;
+  if ((message.type == HEADER_FULL || message.type == HEADER_DELTA) && !rohc_open(message, resync)) {
+    if (resync) {
+      Message request = {HEADER_LENGTH + 1, HEADER_RESYNC, {message.data[0]}};
+      writer_control(request);
+      debug("Header context %d lost, asked for it again", message.data[0]);
+    }
+    return true;
+  }
+  if (message.type == NET_REPLY) {
+    int length = message.length - sizeof(u32) - sizeof(u8);
+    if (pmtu_input(message.data, (u32) length)) {
+      return true;
+    }
+    // debug("Received net reply with length = %d", message.length);
+    int tier = shaper_tier(message.data, length);
+    for (u64 delay; (delay = shaper_delay(SHAPER_DOWN, tier)) > 0; ) {
+      if (!shaper_sleep(SHAPER_DOWN, delay, -1, shutdown_fd)) {
+        break;
+      }
+    }
+    shaper_consume(SHAPER_DOWN, tier, length);
+    mss_clamped_down += tcp_clamp_mss(message.data, (u32) length, (u16) mss_clamp);
+    if (length != write(tunfd, message.data, length)) {
+      debug("System tunnel down");
+      return false;
+    }
+  } else if (message.type == HEADER_RESYNC && message.length > HEADER_LENGTH) {
+    rohc_resync(message.data[0]);
+  } else if (message.type == STREAM_DATA || message.type == STREAM_CLOSE || message.type == STREAM_WINDOW) {
+    if (message.length >= HEADER_LENGTH + STREAM_ID_LENGTH && (load32(message.data) & STREAM_PROXIED)) {
+      proxy_deliver(message);
+    } else {
+      stream_deliver(message);
+    }
+  } else if (message.type == HEARTBEAT) {
+    timer_schedule(&heartbeat_timeout, HEARTBEAT_TIMEOUT * 1000);
+    debug("Heartbeat received (time: %d)", (u32) ((now_us() - time_start_us) / 1000000));
+  } else {
+    debug("Unknown type (%d) or IP reply packet received", message.type);
+  }
+  return true;
+}
+
+// Opening stage, authenticated in parallel, then accepted and delivered in order
+void open_task(Message **frames, bool *passed, int count) {
+  for (int i = 0; i < count; ++ i) {
+    passed[i] = crypto_decrypt(*frames[i]);
+  }
+}
+
+void open_deliver(Message **frames, const bool *passed, int count) {
+  for (int i = 0; i < count; ++ i) {
+    if (!crypto_accept(*frames[i], passed[i])) {
+      error("Dropped a frame that failed authentication");
+    } else if (!tunnel_down && !deliver(*frames[i])) {
+      tunnel_down = true;
+    }
+    recv_release(frames[i]);
+  }
+}
+
+// Receiver thread, sealed frames are batched for the workers until the socket has nothing more
+// buffered, so a lone frame never waits
 void* recv_thread(void *_) {
-  Message message;
-  while (running) {
+  Message *batch[POOL_BATCH];
+  int batched = 0;
+  while (running && !tunnel_down) {
     // debug("recv_thread waiting for new message");
-    if (!recv_message(message)) {
-      running = false;
+    int fd = sockfd;
+    Message *message = recv_buffer();
+    if (!recv_message(fd, *message)) {
+      recv_release(message);
+      // The socket may have been replaced already by a heartbeat timeout
+      if (running && (fd != sockfd || failover())) {
+        continue;
+      }
+      stop();
       break;
     }
 
-    bytes_recv += message.length;
-    bytes_recv_sec += message.length;
-    if (message.type == NET_REPLY) {
-      int length = message.length - sizeof(u32) - sizeof(u8);
-      // debug("Received net reply with length = %d", message.length);
-      if (length != write(tunfd, message.data, length)) {
-        debug("System tunnel down");
-        break;
+    bytes_recv += message -> length;
+    bytes_recv_sec += message -> length;
+    if (message -> type == SEALED || message -> type == SEALED_CHACHA) {
+      batch[batched ++] = message;
+      if (batched == POOL_BATCH || wait_fd(fd, POLLIN, 0) <= 0) {
+        pool_submit(opening, batch, batched);
+        batched = 0;
       }
-    } else if (message.type == HEARTBEAT) {
-      time_last_heartbeat = time_connected;
-      debug("Heartbeat received (time: %d)", time_last_heartbeat);
-    } else {
-      debug("Unknown type (%d) or IP reply packet received", message.type);
+      continue;
+    }
+    if (!crypto_cleartext(*message)) {
+      error("Dropped a frame in clear (type %d) on a keyed session", message -> type);
+      recv_release(message);
+      continue;
+    }
+    bool up = deliver(*message);
+    recv_release(message);
+    if (!up) {
+      break;
     }
   }
+  if (batched) {
+    pool_submit(opening, batch, batched);
+  }
   debug("Recv thread ends");
   return nullptr;
 }
 
+// Heartbeat on the primary, the standby thread heartbeats the standby by itself
+void heartbeat_fire(Timer *timer) {
+  debug("Time up for %ds, sending heartbeat", HEARTBEAT_INTERVAL);
+  writer_piggyback(heartbeat, ENERGY_HEARTBEAT_SLACK);
+  timer_schedule(timer, HEARTBEAT_INTERVAL * 1000);
+}
+
+// No heartbeat from the primary
+void heartbeat_timeout_fire(Timer *timer) {
+  if (!running) {
+    return;
+  }
+  if (failover()) {
+    debug("Not receiving heartbeat for %d seconds, failover", HEARTBEAT_TIMEOUT);
+  } else {
+    debug("Not receiving heartbeat for %d seconds, terminate", HEARTBEAT_TIMEOUT);
+    error_occured = true;
+    stop();
+  }
+}
+
+// No heartbeat from the standby, the standby thread sees it shut down and rebuilds
+void standby_timeout_fire(Timer *timer) {
+  debug("Standby not receiving heartbeat, rebuild");
+  pthread_mutex_lock(&standby_lock);
+  if (standby_fd != -1) {
+    shutdown(standby_fd, SHUT_RDWR);
+  }
+  pthread_mutex_unlock(&standby_lock);
+}
+
+// Standby rebuild backoff ends
+void standby_retry_fire(Timer *timer) {
+  pthread_mutex_lock(&standby_lock);
+  pthread_cond_signal(&standby_wakeup);
+  pthread_mutex_unlock(&standby_lock);
+}
+
+// Liveness, probes an idle primary and declares it dead once ACKs stop for the detection target
+void liveness_fire(Timer *timer) {
+  // Energy mode checks on the coalesced boundaries only, and leaves probing to heartbeats
+  timer_schedule(timer, energy_mode && liveness_probe_ms < ENERGY_TIMER_ALIGN ? ENERGY_TIMER_ALIGN : liveness_probe_ms);
+  int fd = sockfd;
+  u64 now = now_us();
+
+  // Already declared, waiting for recv_thread to fail over
+  tcp_info info;
+  socklen_t length = sizeof(info);
+  if (fd == dead_fd || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) != 0) {
+    return;
+  }
+
+  // Nothing in flight means everything sent so far has been acknowledged
+  if (info.tcpi_unacked == 0) {
+    time_last_alive_us = now;
+  } else if (now - time_last_alive_us > (u64) info.tcpi_last_ack_recv * 1000) {
+    time_last_alive_us = now - (u64) info.tcpi_last_ack_recv * 1000;
+  }
+
+  if (now - time_last_alive_us > (u64) liveness_target_ms * 1000) {
+    // Wakes recv_thread, which fails over or terminates
+    debug("Peer silent for %d ms, declare dead", (u32) ((now - time_last_alive_us) / 1000));
+    detection_last_ms = (now - time_last_alive_us) / 1000;
+    dead_fd = fd;
+    shutdown(fd, SHUT_RDWR);
+    return;
+  }
+
+  // Data in flight is a probe already
+  if (!energy_mode && now - writer_last_us >= (u64) liveness_probe_ms * 1000) {
+    writer_control(heartbeat);
+    ++ probes_sent;
+  }
+}
+
+// Per-second statistics, independent of how often the UI asks
+void stats_fire(Timer *timer) {
+  bytes_sent_rate = bytes_sent_sec;
+  bytes_recv_rate = bytes_recv_sec;
+  bytes_sent_sec = bytes_recv_sec = 0;
+  acks_filtered_rate = queue_acks_filtered - acks_filtered_last;
+  acks_filtered_last = queue_acks_filtered;
+  sojourn_max_rate = queue_sojourn_max_us;
+  queue_sojourn_max_us = 0;
+
+  // Compression effort follows the delivery rate of the primary, or the upstream shaper if slower
+  tcp_info info;
+  socklen_t length = sizeof(info);
+  if (compress_enabled() && getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+    u64 rate = info.tcpi_delivery_rate, shaped = shaper_rate(SHAPER_UP, SHAPER_TOTAL);
+    compress_link(shaped && (rate == 0 || shaped < rate) ? shaped : rate);
+  }
+  timer_schedule(timer, STATS_INTERVAL);
+}
+
+// Read what has arrived of a standby frame into 'message' ('received' bytes so far) without waiting,
+// returns false if the standby is lost
+bool standby_recv(int fd, Message &message, u32 &received) {
+  u32 wanted = received < sizeof(u32) ? sizeof(u32) : message.length;
+  int single = tls_recv(fd, (u8 *) &message + received, wanted - received);
+  if (single == 0 || (single < 0 && errno != EAGAIN)) {
+    return false;
+  }
+  received += single > 0 ? single : 0;
+  if (received == sizeof(u32) && (message.length < HEADER_LENGTH || message.length > sizeof(Message))) {
+    error("Bad message length (%d) on standby", message.length);
+    return false;
+  }
+  if (received >= HEADER_LENGTH && received == message.length) {
+    if (message.type == HEARTBEAT) {
+      timer_schedule(&standby_timeout, HEARTBEAT_TIMEOUT * 1000);
+    }
+    received = 0;
+  }
+  return true;
+}
+
+// Standby thread, keeps one pre-requested connection ready for failover
+void* standby_thread(void *_) {
+  JNIEnv *env;
+  jvm -> AttachCurrentThread(&env, nullptr);
+
+  addrinfo *next = sock_info;
+  Message message;
+  u32 backoff = STANDBY_RETRY_INTERVAL, received = 0;
+  u64 heartbeat_due_us = 0;
+  while (running) {
+    if (standby_fd == -1) {
+      // Prefer another server of the same name, fall back to the same one
+      next = next -> ai_next ? next -> ai_next : list;
+      int fd = connect_socket(next, true);
+      if (fd != -1) {
+        if (request_ip(fd, message)) {
+          if (ip_info != (const char *) message.data) {
+            error("Standby is assigned with a different address: %s", message.data);
+          }
+          pthread_mutex_lock(&standby_lock);
+          standby_fd = fd;
+          standby_info = next;
+          received = 0;
+          heartbeat_due_us = now_us() + HEARTBEAT_INTERVAL * 1000000ull;
+          timer_schedule(&standby_timeout, HEARTBEAT_TIMEOUT * 1000);
+          pthread_mutex_unlock(&standby_lock);
+          debug("Standby ready, sockfd = %d", fd);
+          backoff = STANDBY_RETRY_INTERVAL;
+          continue;
+        }
+        close(fd);
+      }
+
+      // Back off before the next attempt
+      pthread_mutex_lock(&standby_lock);
+      timer_schedule(&standby_retry, backoff);
+      while (running && timer_pending(&standby_retry)) {
+        pthread_cond_wait(&standby_wakeup, &standby_lock);
+      }
+      pthread_mutex_unlock(&standby_lock);
+      backoff = backoff * 2 < STANDBY_RETRY_MAX ? backoff * 2 : STANDBY_RETRY_MAX;
+      continue;
+    }
+
+    // Idle standby only carries heartbeats, sent and read here without blocking while the lock is
+    // held, so a failover taking the standby never waits behind a read
+    int fd = standby_fd, ready = wait_fd(fd, POLLIN, STANDBY_POLL_INTERVAL);
+    if (ready < 0) {
+      continue;
+    }
+    pthread_mutex_lock(&standby_lock);
+    bool alive = true;
+    if (fd != -1 && standby_fd == fd) {
+      if (now_us() >= heartbeat_due_us) {
+        heartbeat_due_us = now_us() + HEARTBEAT_INTERVAL * 1000000ull;
+        alive = tls_send(fd, (u8 *) &heartbeat, heartbeat.length, MSG_NOSIGNAL | MSG_DONTWAIT) == (int) heartbeat.length;
+      }
+      if (alive && ready > 0) {
+        alive = standby_recv(fd, message, received);
+      }
+    }
+    pthread_mutex_unlock(&standby_lock);
+    if (!alive) {
+      debug("Standby lost, rebuild");
+      drop_standby();
+    }
+  }
+  drop_standby();
+
+  jvm -> DetachCurrentThread();
+  debug("Standby thread ends");
+  return nullptr;
+}
+
 void cleanup() {
   shutdown(sockfd, SHUT_RDWR);
+  close(sockfd);
+  if (retired_fd != -1) {
+    close(retired_fd);
+  }
   freeaddrinfo(list);
-  sockfd = -1;
+  sockfd = retired_fd = -1;
 }
 
 // APIs
@@ -227,48 +829,152 @@ extern "C" JNIEXPORT jstring JNICALL Java_com_lyricz_a4over6vpn_VPNService_tik(J
     return env -> NewStringUTF("");
   }
 
-  ++ time_connected;
-  if (time_connected - time_last_heartbeat > 60) {
-    debug("Not receiving heartbeat for 60 seconds, terminate");
-    error_occured = true;
-    running = false;
-    return env -> NewStringUTF("");
-  }
-
-  ++ time_send_heartbeat;
-  if (time_send_heartbeat == 20) {
-    time_send_heartbeat = 0;
-    debug("Time up for 20s, sending heartbeat");
-    send_heartbeat();
-  }
-
-  char str[PRINT_BUFFER_LENGTH];
-  sprintf(str, "Sent: %s (%s/s)\nReceived: %s (%s/s)\nTime connected: %s\n",
-    prettySize(bytes_sent).c_str(), prettySize(bytes_sent_sec).c_str(),
-    prettySize(bytes_recv).c_str(), prettySize(bytes_recv_sec).c_str(),
-    prettyTime(time_connected).c_str());
+  // Heartbeats and timeouts run on the timer wheel, only statistics are reported here
+  u32 time_connected = (now_us() - time_start_us) / 1000000;
+  tcp_info info;
+  socklen_t length = sizeof(info);
+  u32 segments = getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 ? info.tcpi_data_segs_out : 0;
+  u32 minutes_base = time_connected ? time_connected : 1; // per minute rates over the connected time
+  char str[STATUS_BUFFER_LENGTH];
+  snprintf(str, STATUS_BUFFER_LENGTH, "Sent: %s (%s/s)\nReceived: %s (%s/s)\nTime connected: %s\n"
+    "Standby: %s, failovers: %d (last %d ms)\nProbes: %d, last detection: %d ms (target %d ms)\n"
+    "Timers: %d fired, jitter %d us (max %d us)\nWriter: %d frames (%d control), %d partial writes\n"
+    "Coalescing: %d frames in %d segments, %d held back\nSojourn: %d us (max %d us/s), kernel unsent: %s\n"
+    "FQ-CoDel: %d active flows, %d dropped, %d marked, %d overflows\n"
+    "Classes: %d TCP control, %d DNS, %d small, %d bulk\nACK filter: %d dropped (%d/s)\n"
+    "Shaper: %d waits (%d ms) up, %d waits (%d ms) down\n"
+    "Energy: %s, %d bursts, %d wakeups/min, %s per wakeup, timers %d/min\n"
+    "Crypto: %s (%s), %d sealed, %d opened, %d rejected\n"
+    "Pool: %d workers, %d tasks, %d stolen, %d out of order, %d stalls\n"
+    "TLS: %s, records in %s, %d handshakes (%d resumed, last %d ms), %d tickets\n"
+    "Compression: %s, level %d (%d Mbit/s link), %d packed, %d bypassed, %d missed, %d unpacked, %d rejected\n"
+    "Compressed: %d%% up (all data), %d%% down (packed frames), %d/%d us CPU per MByte (up/down), %d/%d/%d Mbit/s by level\n"
+    "Headers: %s, %d/%d contexts, %d/%d deltas, %d/%d resyncs (sent/received), %d%%/%d%% of frame bytes (up/down)\n"
+    "Byte cache: %s (%d MBytes per direction), %d/%d chunks hit, %d bypassed, %d restored, %d rejected, %d%%/%d%% of data (up/down)\n"
+    "Split TCP: %s, %d streams (%d opened, %d passed as packets, %d reset), %s up, %s down, %d retransmitted to apps, %d deferred\n"
+    "Proxy: %s (port %d), %d streams (%d accepted, %d refused, %d reset), %s up, %s down\n"
+    "MSS clamp: %d bytes (outer %d), %d/%d SYNs clamped (up/down)\n"
+    "Path MTU: %d bytes (%s), %d searches, %d/%d probes echoed, %d too big received, %d synthesized\n"
+    "Filter: %s (%d instructions, %d operations, %d installs), %d dropped, %d passed, %d priority, %d bulk, %d as packets\n"
+    "Routes: %s (%d prefixes, %d split /24s, %d loads), %d to the tunnel, %d bypassed, %d dropped, bypass %d/%d datagrams (up/down, %d not relayed, %d too big)\n",
+    prettySize(bytes_sent).c_str(), prettySize(bytes_sent_rate).c_str(),
+    prettySize(bytes_recv).c_str(), prettySize(bytes_recv_rate).c_str(),
+    prettyTime(time_connected).c_str(),
+    standby_fd != -1 ? "ready" : "none", failovers, failover_last_us / 1000,
+    probes_sent, detection_last_ms, liveness_target_ms,
+    timer_fired, timer_fired ? (u32) (timer_jitter_sum_us / timer_fired) : 0, timer_jitter_max_us,
+    writer_frames, writer_controls, writer_partial,
+    writer_socket_frames, segments, writer_corked,
+    queue_sojourn_us, sojourn_max_rate, prettySize(writer_notsent).c_str(),
+    queue_flows, queue_drops, queue_marks, queue_overflows,
+    queue_classes[PACKET_TCP_CONTROL], queue_classes[PACKET_DNS], queue_classes[PACKET_SMALL], queue_classes[PACKET_BULK],
+    queue_acks_filtered, acks_filtered_rate,
+    shaper_delayed[SHAPER_UP], (u32) (shaper_delay_us[SHAPER_UP] / 1000),
+    shaper_delayed[SHAPER_DOWN], (u32) (shaper_delay_us[SHAPER_DOWN] / 1000),
+    energy_mode ? "on" : "off", writer_bursts, writer_wakeups * 60 / minutes_base,
+    prettySize(writer_wakeups ? (u32) (writer_bytes / writer_wakeups) : 0).c_str(), timer_fired * 60 / minutes_base,
+    crypto_enabled() ? crypto_cipher() : "off", crypto_engine(), crypto_sealed, crypto_opened, crypto_rejected,
+    pool_workers(), pool_tasks, pool_steals, pool_reordered, pool_stalls,
+    tls_suite(), tls_mode(sockfd), tls_handshakes, tls_resumed, tls_handshake_us / 1000, tls_tickets,
+    compress_enabled() ? "LZ4" : "off", compress_level, compress_link_mbps,
+    compress_packed, compress_bypassed, compress_missed, compress_unpacked, compress_rejected,
+    compress_up_in ? (u32) (compress_up_out * 100 / compress_up_in) : 100,
+    compress_down_out ? (u32) (compress_down_in * 100 / compress_down_out) : 100,
+    compress_up_in ? (u32) (compress_up_cpu_us * 1048576 / compress_up_in) : 0,
+    compress_down_out ? (u32) (compress_down_cpu_us * 1048576 / compress_down_out) : 0,
+    compress_level_mbps[0], compress_level_mbps[1], compress_level_mbps[2],
+    rohc_enabled() ? "on" : "off", rohc_contexts_sent, rohc_contexts_received, rohc_deltas_sent, rohc_deltas_received,
+    rohc_resyncs_sent, rohc_resyncs_received,
+    rohc_up_in ? (u32) (rohc_up_out * 100 / rohc_up_in) : 100,
+    rohc_down_out ? (u32) (rohc_down_in * 100 / rohc_down_out) : 100,
+    dedup_enabled() ? "on" : "off", dedup_store_mb, dedup_hits, dedup_chunks, dedup_bypassed, dedup_restored, dedup_rejected,
+    dedup_up_in ? (u32) (dedup_up_out * 100 / dedup_up_in) : 100,
+    dedup_down_out ? (u32) (dedup_down_in * 100 / dedup_down_out) : 100,
+    stream_enabled() ? "on" : "off", stream_active, stream_opened, stream_passed, stream_reset,
+    prettySize((u32) stream_up_bytes).c_str(), prettySize((u32) stream_down_bytes).c_str(), stream_retransmitted, stream_deferred,
+    proxy_enabled() ? "on" : "off", proxy_port(), proxy_active, proxy_accepted, proxy_refused, proxy_reset,
+    prettySize((u32) proxy_up_bytes).c_str(), prettySize((u32) proxy_down_bytes).c_str(),
+    mss_clamp, mss_outer, mss_clamped_up, mss_clamped_down,
+    pmtu_value(), pmtu_verified() ? "verified" : "unverified", pmtu_searches, pmtu_probes_acked, pmtu_probes_sent,
+    pmtu_too_big_received, pmtu_too_big_sent,
+    filter_enabled() ? "on" : "off", filter_insns, filter_ops, filter_installs,
+    filter_verdicts[FILTER_DROP], filter_verdicts[FILTER_PASS], filter_verdicts[FILTER_PRIORITY],
+    filter_verdicts[FILTER_BULK], filter_verdicts[FILTER_PACKET],
+    route_enabled() ? "on" : "off", route_prefixes, route_groups, route_loads,
+    route_hits[ROUTE_TUNNEL], route_hits[ROUTE_BYPASS], route_hits[ROUTE_DROP],
+    route_bypass_up, route_bypass_down, route_bypass_tunneled, route_bypass_oversized);
 
   debug("Sent: %s (%s/s) Received: %s (%s/s) Time connected: %s",
-    prettySize(bytes_sent).c_str(), prettySize(bytes_sent_sec).c_str(),
-    prettySize(bytes_recv).c_str(), prettySize(bytes_recv_sec).c_str(),
+    prettySize(bytes_sent).c_str(), prettySize(bytes_sent_rate).c_str(),
+    prettySize(bytes_recv).c_str(), prettySize(bytes_recv_rate).c_str(),
     prettyTime(time_connected).c_str());
 
-  bytes_sent_sec = bytes_recv_sec = 0;
   return env -> NewStringUTF(str);
 }
 
 // Handler system network in/out flow
-extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_backend(JNIEnv* env, jobject /* this */, jint fd) {
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_backend(JNIEnv* env, jobject thiz, jint fd) {
   tunfd = fd;
+  env -> GetJavaVM(&jvm);
+  service = env -> NewGlobalRef(thiz);
+
+  // Timers
+  timer_init();
+  time_start_us = time_last_alive_us = now_us();
+  acks_filtered_last = 0;
+  dead_fd = -1;
+  timer_schedule(&heartbeat_timer, HEARTBEAT_INTERVAL * 1000);
+  timer_schedule(&heartbeat_timeout, HEARTBEAT_TIMEOUT * 1000);
+  timer_schedule(&liveness_timer, liveness_probe_ms);
+  timer_schedule(&stats_timer, STATS_INTERVAL);
 
-  // Send & receive thread
-  pthread_t receiver, sender;
+  // Workers for frame transforms, and the receive buffers they work on
+  pool_start(pool_requested);
+  pool_stage_init(opening, open_task, open_deliver);
+  for (int i = 0; i < RECV_FRAMES; ++ i) {
+    recv_free[i] = recv_frames + i;
+  }
+  recv_free_count = RECV_FRAMES;
+  tunnel_down = false;
+
+  // Writer owns the primary socket from now on
+  shaper_init();
+  writer_init(shutdown_fd, tunfd);
+  writer_attach(sockfd);
+  mss_update(sockfd);
+  rohc_connection();
+  dedup_connection();
+  stream_start(tunfd);
+  proxy_start();
+  route_start(tunfd, pmtu_value(), protect_socket);
+
+  // Path MTU probes go from the tunnel address to the first DNS server ("ip route dns0 dns1 dns2")
+  char local[INET_ADDRSTRLEN] = {}, target[INET_ADDRSTRLEN] = {};
+  in_addr local_addr = {}, target_addr = {};
+  sscanf(ip_info.c_str(), "%15s %*s %15s", local, target);
+  inet_pton(AF_INET, local, &local_addr);
+  inet_pton(AF_INET, target, &target_addr);
+  pmtu_start(tunfd, ntohl(local_addr.s_addr), ntohl(target_addr.s_addr));
+
+  // Send, receive, write, standby & timer thread
+  pthread_t receiver, sender, writer, standby, timer;
   pthread_create(&receiver, nullptr, recv_thread, nullptr);
   pthread_create(&sender, nullptr, send_thread, nullptr);
+  pthread_create(&writer, nullptr, writer_thread, nullptr);
+  pthread_create(&standby, nullptr, standby_thread, nullptr);
+  pthread_create(&timer, nullptr, timer_thread, &shutdown_fd);
 
   // Waiting for terminate
   pthread_join(receiver, nullptr);
   pthread_join(sender, nullptr);
+  pthread_join(writer, nullptr);
+  pthread_join(standby, nullptr);
+  pthread_join(timer, nullptr);
+  pool_stop();
+  proxy_stop();
+  route_stop();
+  env -> DeleteGlobalRef(service);
+  debug("Threads joined in %d us after stop", (u32) (now_us() - time_stop_us));
 
   // Terminate
   debug("Socket shutdown (normal case)");
@@ -285,9 +991,137 @@ extern "C" JNIEXPORT void JNICALL Java_com_lyricz_a4over6vpn_VPNService_initiali
 
   // Cleanup
   bytes_recv = bytes_sent = 0;
-  time_connected = 0;
-  time_last_heartbeat = time_send_heartbeat = 0;
   bytes_sent_sec = bytes_recv_sec = 0;
+  bytes_sent_rate = bytes_recv_rate = 0;
+  failovers = failover_last_us = 0;
+  probes_sent = detection_last_ms = 0;
+}
+
+// Configure liveness probing, takes effect for sockets opened afterwards, non-positive values are
+// refused (a zero interval would fire every tick)
+extern "C" JNIEXPORT void JNICALL Java_com_lyricz_a4over6vpn_VPNService_liveness(JNIEnv* env, jobject /* this */, jint probe, jint target) {
+  if (probe <= 0 || target <= 0) {
+    error("Liveness probe interval and detection target must be positive (%d ms, %d ms), kept", probe, target);
+    return;
+  }
+  liveness_probe_ms = (u32) probe;
+  liveness_target_ms = (u32) target;
+  debug("Liveness probe interval = %d ms, detection target = %d ms", probe, target);
+}
+
+// Set the pre-shared key and cipher for frame encryption (null or empty key for none), before open
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_crypto(JNIEnv* env, jobject /* this */, jbyteArray j_key, jint cipher) {
+  if (j_key == nullptr) {
+    return crypto_configure(nullptr, 0, cipher);
+  }
+  jsize length = env -> GetArrayLength(j_key);
+  jbyte *bytes = env -> GetByteArrayElements(j_key, nullptr);
+  bool configured = crypto_configure((const u8 *) bytes, length, cipher);
+  env -> ReleaseByteArrayElements(j_key, bytes, JNI_ABORT);
+  debug("Frame encryption %s (%s)", crypto_enabled() ? crypto_cipher() : "off", crypto_engine());
+  return configured;
+}
+
+// Run the tunnel over TLS 1.3 with the pre-shared key (null or empty key for none) and the cipher of
+// the records, before open, instead of sealing frames
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_tls(JNIEnv* env, jobject /* this */, jbyteArray j_key, jint cipher) {
+  if (j_key == nullptr) {
+    return tls_configure(nullptr, 0, cipher);
+  }
+  jsize length = env -> GetArrayLength(j_key);
+  jbyte *bytes = env -> GetByteArrayElements(j_key, nullptr);
+  bool configured = tls_configure((const u8 *) bytes, length, cipher);
+  env -> ReleaseByteArrayElements(j_key, bytes, JNI_ABORT);
+  debug("TLS %s", tls_suite());
+  return configured;
+}
+
+// Switch LZ4 compression of sent frames (the server must take COMPRESSED frames), before open
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_compress(JNIEnv* env, jobject /* this */, jboolean enabled) {
+  bool configured = compress_configure(enabled);
+  debug("Compression %s", compress_enabled() ? "on" : "off");
+  return configured;
+}
+
+// Switch header compression of sent frames (the server must take HEADER_FULL and HEADER_DELTA
+// frames), before open
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_headers(JNIEnv* env, jobject /* this */, jboolean enabled) {
+  bool configured = rohc_configure(enabled);
+  debug("Header compression %s", rohc_enabled() ? "on" : "off");
+  return configured;
+}
+
+// Map the byte cache in a file at 'path' (megabytes per direction, 0 to disable, the server must take
+// DEDUPED frames), before open
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_cache(JNIEnv* env, jobject /* this */, jstring j_path, jint megabytes) {
+  const char* path = j_path ? env -> GetStringUTFChars(j_path, 0) : nullptr;
+  bool configured = dedup_configure(path, megabytes > 0 ? (u32) megabytes : 0);
+  if (path) {
+    env -> ReleaseStringUTFChars(j_path, path);
+  }
+  debug("Byte cache %s (%d MBytes per direction)", dedup_enabled() ? "on" : "off", dedup_store_mb);
+  return configured;
+}
+
+// Switch split TCP, TCP connections of apps are terminated here and only their bytes travel (the server
+// must take STREAM_* frames), before backend
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_split(JNIEnv* env, jobject /* this */, jboolean enabled) {
+  bool configured = stream_configure(enabled);
+  debug("Split TCP %s", stream_enabled() ? "on" : "off");
+  return configured;
+}
+
+// Listen for SOCKS5 and HTTP CONNECT on 127.0.0.1:'port' (0 to disable), the connections become streams
+// of the tunnel (the server must take STREAM_* frames), before backend
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_proxy(JNIEnv* env, jobject /* this */, jint port) {
+  bool configured = port >= 0 && port <= 65535 && proxy_configure((u16) port);
+  debug("Proxy %s (port %d)", proxy_enabled() ? "on" : "off", proxy_port());
+  return configured;
+}
+
+// Install a classic BPF program on packets from tun, in the iptables bytecode format ("count,code jt jf
+// k,...", null or empty to remove it), applies at once
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_filter(JNIEnv* env, jobject /* this */, jstring j_bytecode) {
+  const char* bytecode = j_bytecode ? env -> GetStringUTFChars(j_bytecode, 0) : nullptr;
+  bool installed = filter_install_text(bytecode);
+  if (bytecode) {
+    env -> ReleaseStringUTFChars(j_bytecode, bytecode);
+  }
+  debug("Filter %s (%d instructions, %d operations)", filter_enabled() ? "on" : "off", filter_insns, filter_ops);
+  return installed;
+}
+
+// Load a route table file mapping destination prefixes to the tunnel, the bypass path or a drop (null
+// or empty to remove it), applies at once
+extern "C" JNIEXPORT jboolean JNICALL Java_com_lyricz_a4over6vpn_VPNService_routes(JNIEnv* env, jobject /* this */, jstring j_path) {
+  const char* path = j_path ? env -> GetStringUTFChars(j_path, 0) : nullptr;
+  bool loaded = route_load(path);
+  if (path) {
+    env -> ReleaseStringUTFChars(j_path, path);
+  }
+  debug("Routes %s (%d prefixes, %d split /24s)", route_enabled() ? "on" : "off", route_prefixes, route_groups);
+  return loaded;
+}
+
+// Set the number of workers for frame transforms (negative for one per core besides the first, 0 for
+// none), before backend
+extern "C" JNIEXPORT void JNICALL Java_com_lyricz_a4over6vpn_VPNService_workers(JNIEnv* env, jobject /* this */, jint count) {
+  pool_requested = count;
+  debug("Workers = %d", count);
+}
+
+// Switch energy mode (bursty upstream, piggybacked heartbeats, coalesced timers), applies at once
+extern "C" JNIEXPORT void JNICALL Java_com_lyricz_a4over6vpn_VPNService_energy(JNIEnv* env, jobject /* this */, jboolean enabled) {
+  energy_mode = enabled;
+  writer_energy(enabled);
+  timer_align(enabled ? ENERGY_TIMER_ALIGN : 0);
+  debug("Energy mode %s", enabled ? "on" : "off");
+}
+
+// Configure a token bucket of the shaper (bytes per second, 0 for unlimited), applies at once
+extern "C" JNIEXPORT void JNICALL Java_com_lyricz_a4over6vpn_VPNService_shaper(JNIEnv* env, jobject /* this */, jint direction, jint tier, jint rate, jint burst) {
+  shaper_configure(direction, tier, (u32) rate, (u32) burst);
+  debug("Shaper direction %d tier %d: %d bytes/s, burst %d bytes", direction, tier, rate, burst);
 }
 
 // Apply for a global socket (addr can be a hostname)
@@ -302,37 +1136,27 @@ extern "C" JNIEXPORT jint JNICALL Java_com_lyricz_a4over6vpn_VPNService_open(JNI
   hint.ai_family = AF_UNSPEC;
   hint.ai_socktype = SOCK_STREAM;
 
+  // A new session, with a key of its own for sealed frames, clear the stop signal of the last one
+  crypto_session();
+  if (shutdown_fd == -1) {
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+  eventfd_t value;
+  eventfd_read(shutdown_fd, &value);
+
   debug("Trying to connect %s (port: %s)", addr, port);
   if (getaddrinfo(addr, port, &hint, &list)) {
     return (jint) (-1);
   }
 
   for (addrinfo *ptr = list; ptr != nullptr; ptr = ptr -> ai_next) {
-    debug("Creating socket at family@%d, type@%d, protocol@%d", ptr -> ai_family, ptr -> ai_socktype, ptr -> ai_protocol);
-    sockfd = socket(ptr -> ai_family, ptr -> ai_socktype, ptr -> ai_protocol);
-    if (sockfd < 0) {
-      debug("socket() failed, %s", strerror(errno));
-      continue;
-    }
-
-    u32 enable = 1;
-    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(u32));
-
-    // Set timeout
-    timeval timeout = {SOCKET_TIMEOUT, 0};
-    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    if (connect(sockfd, ptr -> ai_addr, ptr -> ai_addrlen) == 0) {
+    sockfd = connect_socket(ptr, false);
+    if (sockfd != -1) {
       debug("Success");
+      sock_info = ptr;
       sock_addr = ptr -> ai_addr;
       sock_len = ptr -> ai_addrlen;
       break;
-    } else {
-      debug("%s", strerror(errno));
-      shutdown(sockfd, SHUT_RDWR);
-      sockfd = -1;
-      debug("connect() failed");
     }
   }
 
@@ -350,38 +1174,28 @@ extern "C" JNIEXPORT jstring JNICALL Java_com_lyricz_a4over6vpn_VPNService_reque
   }
   debug("Sending IP request");
   ip_requesting = true;
-  send_ip_request();
-
-  // Waiting for reply
-
-  u32 times_try = 0;
   Message message;
-  while (times_try < REQUEST_LIMIT) {
-    debug("Waiting for IP reply");
-    if (!recv_message(message)) {
-      break;
-    }
-
-    if (message.type == IP_REPLY) {
-      ip_requesting = false;
-      message.data[message.length - 5] = '\0';
-      debug("Received IP reply: %s", message.data);
-
-      return env -> NewStringUTF((const char *) message.data);
-    }
+  bool replied = request_ip(sockfd, message);
+  ip_requesting = false;
 
-    debug("Not an IP reply");
-    ++ times_try;
+  if (replied) {
+    ip_info = (const char *) message.data;
+    return env -> NewStringUTF(ip_info.c_str());
   }
-  ip_requesting = false;
 
   debug("Socket shutdown (IP Request timeout)");
   cleanup();
   return env -> NewStringUTF("");
 }
 
+// MTU for the tun, the path MTU learned by earlier sessions (PMTU_INITIAL before any), after request
+extern "C" JNIEXPORT jint JNICALL Java_com_lyricz_a4over6vpn_VPNService_mtu(JNIEnv* env, jobject /* this */) {
+  debug("MTU = %d (%s)", pmtu_value(), pmtu_verified() ? "verified" : "unverified");
+  return (jint) pmtu_value();
+}
+
 // Terminate all
 extern "C" JNIEXPORT void JNICALL Java_com_lyricz_a4over6vpn_VPNService_terminate(JNIEnv* env, jobject /* this */) {
   debug("Terminate by API");
-  running = false;
+  stop();
 }
@@ -0,0 +1,266 @@
+// Inner packet helpers of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Networks
+# include <netinet/in.h>
+
+// IPv4 header fields (packets read from tun start with the IP header)
+# define IPV4_MIN_HEADER              20
+# define IPV4_TOS                     1
+# define IPV4_TOTAL_LENGTH            2
+# define IPV4_ID                      4
+# define IPV4_FRAGMENT                6
+# define IPV4_TTL                     8
+# define IPV4_PROTOCOL                9
+# define IPV4_CHECKSUM                10
+# define IPV4_SOURCE                  12
+# define IPV4_DESTINATION             16
+# define IPV4_ECN_MASK                0x03
+# define IPV4_ECN_CE                  0x03
+# define IPV4_DONT_FRAGMENT           0x4000
+# define IPV4_MORE_FRAGMENTS          0x2000
+# define IPV4_DEFAULT_TTL             64
+
+// TCP/UDP header fields, relative to the transport header
+# define TRANSPORT_DESTINATION        2
+# define TCP_SEQUENCE                 4
+# define TCP_ACK_NUMBER               8
+# define TCP_OFFSET                   12
+# define TCP_FLAGS                    13
+# define TCP_WINDOW                   14
+# define TCP_CHECKSUM                 16
+# define TCP_URGENT                   18
+# define TCP_FIN                      0x01
+# define TCP_SYN                      0x02
+# define TCP_RST                      0x04
+# define TCP_PSH                      0x08
+# define TCP_ACK                      0x10
+# define TCP_MIN_HEADER               20
+# define TCP_OPTION_END               0
+# define TCP_OPTION_NOP               1
+# define TCP_OPTION_MSS               2
+# define TCP_OPTION_MSS_LENGTH        4
+# define TCP_OPTION_SACK              5
+# define TCP_OPTION_TIMESTAMP         8
+# define UDP_LENGTH                   4
+# define UDP_CHECKSUM                 6
+# define UDP_HEADER                   8
+
+// ICMP header fields, relative to the ICMP header
+# define ICMP_ECHO_REPLY              0
+# define ICMP_UNREACHABLE             3
+# define ICMP_FRAGMENTATION_NEEDED    4     // code of ICMP_UNREACHABLE
+# define ICMP_ECHO_REQUEST            8
+# define ICMP_CODE                    1
+# define ICMP_CHECKSUM                2
+# define ICMP_ID                      4
+# define ICMP_SEQUENCE                6
+# define ICMP_NEXT_HOP_MTU            6
+# define ICMP_HEADER                  8
+
+// Packet classes, all but PACKET_BULK go to the priority queue
+# define PACKET_TCP_CONTROL           0     // SYN or pure ACK
+# define PACKET_DNS                   1
+# define PACKET_SMALL                 2
+# define PACKET_BULK                  3
+# define PACKET_CLASSES               4
+# define PACKET_AUTO                  -1    // class left to packet_class
+# define PACKET_SMALL_LENGTH          128   // bytes, IP packets up to this size are interactive
+# define DNS_PORT                     53
+
+inline u16 load16(const u8 *ptr) {
+  return (u16) (ptr[0] << 8 | ptr[1]);
+}
+
+inline u32 load32(const u8 *ptr) {
+  return (u32) ptr[0] << 24 | (u32) ptr[1] << 16 | (u32) ptr[2] << 8 | ptr[3];
+}
+
+inline u64 load64(const u8 *ptr) {
+  return (u64) load32(ptr) << 32 | load32(ptr + 4);
+}
+
+inline void store16(u8 *ptr, u16 value) {
+  ptr[0] = value >> 8;
+  ptr[1] = value & 0xff;
+}
+
+inline void store32(u8 *ptr, u32 value) {
+  store16(ptr, value >> 16);
+  store16(ptr + 2, value & 0xffff);
+}
+
+inline void store64(u8 *ptr, u64 value) {
+  store32(ptr, value >> 32);
+  store32(ptr + 4, (u32) value);
+}
+
+// Whether the packet is a well-formed IPv4 header
+inline bool is_ipv4(const u8 *packet, u32 length) {
+  return length >= IPV4_MIN_HEADER && (packet[0] >> 4) == 4 && (u32) (packet[0] & 0x0f) * 4 <= length;
+}
+
+inline u32 ipv4_header_length(const u8 *packet) {
+  return (u32) (packet[0] & 0x0f) * 4;
+}
+
+// Not the first fragment, transport header absent
+inline bool ipv4_later_fragment(const u8 *packet) {
+  return (load16(packet + IPV4_FRAGMENT) & 0x1fff) != 0;
+}
+
+// Internet checksum (RFC 1071), 0 over a header that carries a valid one
+inline u16 checksum(const u8 *data, u32 length) {
+  u32 sum = 0;
+  for (u32 i = 0; i + 1 < length; i += 2) {
+    sum += load16(data + i);
+  }
+  if (length & 1) {
+    sum += (u32) data[length - 1] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return (u16) ~sum;
+}
+
+// Incremental checksum update for a 16-bit word changing from 'from' to 'to' (RFC 1624, eqn. 3)
+inline void checksum_adjust(u8 *checksum, u16 from, u16 to) {
+  u32 sum = (u16) ~load16(checksum) + (u16) ~from + to;
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  store16(checksum, (u16) ~sum);
+}
+
+// Internet checksum of the transport header and payload of an IPv4 packet with its pseudo header,
+// 0 over a segment that carries a valid one
+inline u16 transport_checksum(const u8 *packet) {
+  u32 header = ipv4_header_length(packet), length = load16(packet + IPV4_TOTAL_LENGTH) - header;
+  u32 sum = packet[IPV4_PROTOCOL] + length;
+  for (u32 i = 0; i < 8; i += 2) {
+    sum += load16(packet + IPV4_SOURCE + i);
+  }
+  sum += (u16) ~checksum(packet + header, length);
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return (u16) ~sum;
+}
+
+// Transport header of a TCP/UDP packet carrying one, nullptr otherwise
+inline const u8* transport_header(const u8 *packet, u32 length, u8 protocol, u32 size) {
+  if (!is_ipv4(packet, length) || packet[IPV4_PROTOCOL] != protocol || ipv4_later_fragment(packet)) {
+    return nullptr;
+  }
+  u32 header = ipv4_header_length(packet);
+  return length >= header + size ? packet + header : nullptr;
+}
+
+inline u32 tcp_payload_length(const u8 *packet, const u8 *tcp) {
+  u32 headers = ipv4_header_length(packet) + (tcp[TCP_OFFSET] >> 4) * 4u;
+  u32 total = load16(packet + IPV4_TOTAL_LENGTH);
+  return total > headers ? total - headers : 0;
+}
+
+// TCP segment without payload, only ACK (and maybe PSH/URG/ECE/CWR) set
+inline bool tcp_pure_ack(const u8 *packet, u32 length) {
+  const u8 *tcp = transport_header(packet, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  return tcp && (tcp[TCP_FLAGS] & (TCP_ACK | TCP_SYN | TCP_FIN | TCP_RST)) == TCP_ACK && tcp_payload_length(packet, tcp) == 0;
+}
+
+// Whether the segment carries SACK blocks
+inline bool tcp_has_sack(const u8 *tcp) {
+  const u8 *option = tcp + TCP_MIN_HEADER, *end = tcp + (tcp[TCP_OFFSET] >> 4) * 4;
+  while (option < end && *option != TCP_OPTION_END) {
+    if (*option == TCP_OPTION_NOP) {
+      ++ option;
+      continue;
+    }
+    if (*option == TCP_OPTION_SACK) {
+      return true;
+    }
+    if (option + 1 >= end || option[1] < 2) {
+      break;
+    }
+    option += option[1];
+  }
+  return false;
+}
+
+// Lower the MSS option of a SYN (or SYN-ACK) to 'mss', returns whether it did
+inline bool tcp_clamp_mss(u8 *packet, u32 length, u16 mss) {
+  u8 *tcp = (u8 *) transport_header(packet, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  if (tcp == nullptr || !(tcp[TCP_FLAGS] & TCP_SYN) || tcp + (tcp[TCP_OFFSET] >> 4) * 4 > packet + length) {
+    return false;
+  }
+  u8 *option = tcp + TCP_MIN_HEADER, *end = tcp + (tcp[TCP_OFFSET] >> 4) * 4;
+  while (option < end && *option != TCP_OPTION_END) {
+    if (*option == TCP_OPTION_NOP) {
+      ++ option;
+      continue;
+    }
+    if (option + 1 >= end || option[1] < 2) {
+      break;
+    }
+    if (*option == TCP_OPTION_MSS && option[1] == TCP_OPTION_MSS_LENGTH && option + TCP_OPTION_MSS_LENGTH <= end) {
+      u16 value = load16(option + 2);
+      if (value <= mss) {
+        return false;
+      }
+      store16(option + 2, mss);
+
+      // The checksum sums 16-bit words from the header on, a value at an odd offset sums byte-swapped
+      bool odd = (option + 2 - tcp) & 1;
+      checksum_adjust(tcp + TCP_CHECKSUM, odd ? (u16) (value << 8 | value >> 8) : value, odd ? (u16) (mss << 8 | mss >> 8) : mss);
+      return true;
+    }
+    option += option[1];
+  }
+  return false;
+}
+
+// TCP segments with payload or FIN/RST stay bulk whatever their size, so they are never reordered
+// within a flow, a FIN must not overtake the data it ends
+inline int packet_class(const u8 *packet, u32 length) {
+  const u8 *tcp = transport_header(packet, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  if (tcp && ((tcp[TCP_FLAGS] & (TCP_SYN | TCP_FIN | TCP_RST)) == TCP_SYN || tcp_pure_ack(packet, length))) {
+    return PACKET_TCP_CONTROL;
+  }
+  const u8 *udp = transport_header(packet, length, IPPROTO_UDP, UDP_HEADER);
+  const u8 *ports = udp ? udp : tcp;
+  if (ports && load16(ports + TRANSPORT_DESTINATION) == DNS_PORT) {
+    return PACKET_DNS;
+  }
+  return tcp == nullptr && length <= PACKET_SMALL_LENGTH ? PACKET_SMALL : PACKET_BULK;
+}
+
+// Flow hash over the 5-tuple (addresses and protocol only for non-TCP/UDP and fragments)
+inline u32 flow_hash(const u8 *packet, u32 length, u32 seed) {
+  if (!is_ipv4(packet, length)) {
+    return seed;
+  }
+  u32 hash = seed ^ packet[IPV4_PROTOCOL];
+  u32 words[3] = {load32(packet + IPV4_SOURCE), load32(packet + IPV4_DESTINATION), 0};
+  u32 header = ipv4_header_length(packet);
+  u8 protocol = packet[IPV4_PROTOCOL];
+  if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) && !ipv4_later_fragment(packet) && length >= header + 4) {
+    words[2] = load32(packet + header);
+  }
+  for (u32 word: words) {
+    // Murmur3 mixing
+    word *= 0xcc9e2d51;
+    word = (word << 15) | (word >> 17);
+    word *= 0x1b873593;
+    hash ^= word;
+    hash = ((hash << 13) | (hash >> 19)) * 5 + 0xe6546b64;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  return hash;
+}
@@ -0,0 +1,291 @@
+// Path MTU discovery of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "packet.h"
+# include "pmtu.h"
+# include "writer.h"
+
+// Native C++
+# include <cstdlib>
+# include <cstring>
+# include <pthread.h>
+# include <unistd.h>
+
+# define PMTU_PLATEAUS                11
+# define PMTU_SIZES                   (PMTU_PLATEAUS + 1) // the plateaus, then a next-hop MTU reported for a probe
+# define PMTU_COOKIE                  4     // bytes of the payload that tell our echoes from those of apps
+# define PMTU_QUOTE                   8     // bytes after the IP header an ICMP error quotes (RFC 792)
+
+// Common MTUs of links and tunnels (IPv6 minimum, VPNs, PPPoE, Ethernet, FDDI), then what a frame carries
+static const u32 plateaus[PMTU_PLATEAUS] = {1280, 1360, 1400, 1420, 1440, 1460, 1480, 1492, 1500, 2002, PMTU_MAX};
+
+static int tun_fd = -1;
+static u32 local_address, target_address;
+static volatile u32 mtu = PMTU_INITIAL; // kept across sessions
+static volatile bool verified;
+static u16 ip_id;
+
+// Search, rounds are sent by the send thread and echoes taken by the receive thread
+static u32 sizes[PMTU_SIZES];
+static u32 misses[PMTU_SIZES];
+static u32 acked, sent;                 // bits of the sizes echoed, and probed in the current round
+static u32 confirmed, ceiling;          // largest size echoed, largest one not given up
+static u64 due_us;
+static bool searching;
+static u16 probe_id;                    // identifier of the echo requests of the search
+static u8 cookie[PMTU_COOKIE];          // their payload starts with it
+static pthread_mutex_t pmtu_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 pmtu_searches, pmtu_probes_sent, pmtu_probes_acked;
+u32 pmtu_too_big_received, pmtu_too_big_sent;
+
+// Start a search, with pmtu_lock held
+static void restart(u64 now) {
+  memcpy(sizes, plateaus, sizeof(plateaus));
+  sizes[PMTU_PLATEAUS] = 0;
+  memset(misses, 0, sizeof(misses));
+  acked = sent = 0;
+  confirmed = 0;
+  ceiling = PMTU_MAX;
+  due_us = now;
+  searching = true;
+  probe_id = (u16) arc4random();
+  arc4random_buf(cookie, PMTU_COOKIE);
+  ++ pmtu_searches;
+}
+
+// Index of a size of the search, -1 if it is none
+static int find(u32 size) {
+  for (int i = 0; i < PMTU_SIZES; ++ i) {
+    if (sizes[i] && sizes[i] == size) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// IPv4 header without options, the checksum filled in
+static void ipv4_header(u8 *packet, u32 length, u16 fragment, u32 source, u32 destination) {
+  memset(packet, 0, IPV4_MIN_HEADER);
+  packet[0] = 0x45;
+  store16(packet + IPV4_TOTAL_LENGTH, (u16) length);
+  store16(packet + IPV4_ID, ip_id ++);
+  store16(packet + IPV4_FRAGMENT, fragment);
+  packet[IPV4_TTL] = IPV4_DEFAULT_TTL;
+  packet[IPV4_PROTOCOL] = IPPROTO_ICMP;
+  store32(packet + IPV4_SOURCE, source);
+  store32(packet + IPV4_DESTINATION, destination);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+}
+
+// An echo request of 'size' bytes with DF set, the size is its sequence number (send thread)
+static void probe(u32 local, u32 target, u32 size, u16 id, const u8 *with_cookie) {
+  Message *message = writer_reserve();
+  u8 *packet = message -> data, *icmp = packet + IPV4_MIN_HEADER;
+  ipv4_header(packet, size, IPV4_DONT_FRAGMENT, local, target);
+  memset(icmp, 0, size - IPV4_MIN_HEADER);
+  icmp[0] = ICMP_ECHO_REQUEST;
+  store16(icmp + ICMP_ID, id);
+  store16(icmp + ICMP_SEQUENCE, (u16) size);
+  memcpy(icmp + ICMP_HEADER, with_cookie, PMTU_COOKIE);
+  store16(icmp + ICMP_CHECKSUM, checksum(icmp, size - IPV4_MIN_HEADER));
+  message -> length = size + HEADER_LENGTH;
+  message -> type = NET_REQUEST;
+  writer_commit(message);
+  ++ pmtu_probes_sent;
+}
+
+u32 pmtu_value() {
+  return mtu;
+}
+
+bool pmtu_verified() {
+  return verified;
+}
+
+void pmtu_start(int tun, u32 local, u32 target) {
+  pthread_mutex_lock(&pmtu_lock);
+  tun_fd = tun;
+  local_address = local;
+  target_address = target;
+  pmtu_searches = pmtu_probes_sent = pmtu_probes_acked = 0;
+  pmtu_too_big_received = pmtu_too_big_sent = 0;
+  restart(now_us());
+  pthread_mutex_unlock(&pmtu_lock);
+}
+
+void pmtu_connection() {
+  pthread_mutex_lock(&pmtu_lock);
+  if (tun_fd != -1) {
+    restart(now_us());
+  }
+  pthread_mutex_unlock(&pmtu_lock);
+}
+
+void pmtu_poll(int &timeout) {
+  pthread_mutex_lock(&pmtu_lock);
+  u64 now = now_us(), due = due_us;
+  pthread_mutex_unlock(&pmtu_lock);
+  if (tun_fd == -1) {
+    return;
+  }
+  int wait = due > now ? (int) ((due - now + 999) / 1000) : 0;
+  if (timeout < 0 || wait < timeout) {
+    timeout = wait;
+  }
+}
+
+void pmtu_serve() {
+  u32 probes[PMTU_SIZES];
+  int count = 0;
+  pthread_mutex_lock(&pmtu_lock);
+  u64 now = now_us();
+  if (tun_fd == -1 || now < due_us) {
+    pthread_mutex_unlock(&pmtu_lock);
+    return;
+  }
+  if (!searching) {
+    restart(now);
+  }
+
+  // Close the round: echoed sizes are confirmed, and sizes unanswered too often bound the search
+  for (int i = 0; i < PMTU_SIZES; ++ i) {
+    if (sizes[i] == 0) {
+      continue;
+    }
+    if (acked & (1u << i)) {
+      confirmed = sizes[i] > confirmed ? sizes[i] : confirmed;
+    } else if ((sent & (1u << i)) && ++ misses[i] >= PMTU_PROBES && sizes[i] <= ceiling) {
+      ceiling = sizes[i] - 1;
+    }
+  }
+
+  // Probe all sizes left in between at once, a round costs one round trip however many there are
+  sent = 0;
+  for (int i = 0; i < PMTU_SIZES; ++ i) {
+    if (sizes[i] > confirmed && sizes[i] <= ceiling) {
+      sent |= 1u << i;
+      probes[count ++] = sizes[i];
+    }
+  }
+  if (count) {
+    due_us = now + PMTU_PROBE_TIMEOUT * 1000ull;
+  } else {
+    // Nothing echoed means the path does not answer, which proves nothing either way
+    if (confirmed) {
+      mtu = confirmed;
+      verified = true;
+    }
+    debug("Path MTU search done, %d bytes (%s)", mtu, confirmed ? "confirmed" : "no echo, kept");
+    searching = false;
+    due_us = now + PMTU_RAISE_INTERVAL * 1000000ull;
+  }
+  u32 local = local_address, target = target_address;
+  u16 id = probe_id;
+  u8 with_cookie[PMTU_COOKIE];
+  memcpy(with_cookie, cookie, PMTU_COOKIE);
+  pthread_mutex_unlock(&pmtu_lock);
+
+  for (int i = 0; i < count; ++ i) {
+    probe(local, target, probes[i], id, with_cookie);
+  }
+}
+
+bool pmtu_input(const u8 *packet, u32 length) {
+  if (!is_ipv4(packet, length) || packet[IPV4_PROTOCOL] != IPPROTO_ICMP || ipv4_later_fragment(packet)
+    || load32(packet + IPV4_DESTINATION) != local_address) {
+    return false;
+  }
+  u32 header = ipv4_header_length(packet);
+  if (length < header + ICMP_HEADER) {
+    return false;
+  }
+  const u8 *icmp = packet + header;
+
+  // Echoes may be cut short by the target, the sequence number tells the size probed, and echoes of
+  // apps without the identifier, the size and the cookie of the search go on to the tun
+  if (icmp[0] == ICMP_ECHO_REPLY) {
+    if (length < header + ICMP_HEADER + PMTU_COOKIE || load32(packet + IPV4_SOURCE) != target_address) {
+      return false;
+    }
+    pthread_mutex_lock(&pmtu_lock);
+    int index = find(load16(icmp + ICMP_SEQUENCE));
+    bool ours = searching && index >= 0 && load16(icmp + ICMP_ID) == probe_id
+      && memcmp(icmp + ICMP_HEADER, cookie, PMTU_COOKIE) == 0;
+    if (ours && !(acked & (1u << index))) {
+      acked |= 1u << index;
+      ++ pmtu_probes_acked;
+    }
+    pthread_mutex_unlock(&pmtu_lock);
+    return ours;
+  }
+  if (icmp[0] != ICMP_UNREACHABLE || icmp[ICMP_CODE] != ICMP_FRAGMENTATION_NEEDED) {
+    return false;
+  }
+
+  // "Fragmentation needed" from a router on the path, only taken if it quotes one of our probes: the
+  // quote ends before the cookie, so the identifier, the size and the addresses have to do
+  const u8 *quoted = icmp + ICMP_HEADER;
+  u32 rest = length - header - ICMP_HEADER;
+  if (!is_ipv4(quoted, rest) || quoted[IPV4_PROTOCOL] != IPPROTO_ICMP || rest < ipv4_header_length(quoted) + ICMP_HEADER) {
+    return false;
+  }
+  const u8 *echo = quoted + ipv4_header_length(quoted);
+  u32 size = load16(echo + ICMP_SEQUENCE), next = load16(icmp + ICMP_NEXT_HOP_MTU);
+  if (echo[0] != ICMP_ECHO_REQUEST || load16(quoted + IPV4_TOTAL_LENGTH) != size
+    || load32(quoted + IPV4_SOURCE) != local_address || load32(quoted + IPV4_DESTINATION) != target_address) {
+    return false;
+  }
+  pthread_mutex_lock(&pmtu_lock);
+  if (!searching || find(size) < 0 || load16(echo + ICMP_ID) != probe_id) {
+    pthread_mutex_unlock(&pmtu_lock);
+    return false;
+  }
+  ++ pmtu_too_big_received;
+  ceiling = size - 1 < ceiling ? size - 1 : ceiling;
+
+  // Old routers leave the next-hop MTU out (0), then the probe size alone is given up
+  if (next >= PMTU_MIN && next < size) {
+    ceiling = next < ceiling ? next : ceiling;
+    if (find(next) < 0) {
+      sizes[PMTU_PLATEAUS] = next;
+      misses[PMTU_PLATEAUS] = 0;
+      acked &= ~(1u << PMTU_PLATEAUS);
+      sent &= ~(1u << PMTU_PLATEAUS);
+    }
+    if (next < mtu) {
+      mtu = next;
+      verified = true;
+      debug("Path MTU lowered to %d bytes by a router", next);
+    }
+  }
+  pthread_mutex_unlock(&pmtu_lock);
+  return true;
+}
+
+bool pmtu_too_big(const u8 *packet, u32 length) {
+  u32 limit = mtu;
+  if (length <= limit || !is_ipv4(packet, length) || !(load16(packet + IPV4_FRAGMENT) & IPV4_DONT_FRAGMENT)) {
+    return false;
+  }
+
+  // From the destination, as a router on the way would answer, quoting the header and 8 bytes
+  u32 quote = ipv4_header_length(packet) + PMTU_QUOTE;
+  u8 reply[IPV4_MIN_HEADER + ICMP_HEADER + 60 + PMTU_QUOTE];
+  u32 total = IPV4_MIN_HEADER + ICMP_HEADER + quote;
+  ipv4_header(reply, total, 0, load32(packet + IPV4_DESTINATION), load32(packet + IPV4_SOURCE));
+  u8 *icmp = reply + IPV4_MIN_HEADER;
+  memset(icmp, 0, ICMP_HEADER);
+  icmp[0] = ICMP_UNREACHABLE;
+  icmp[ICMP_CODE] = ICMP_FRAGMENTATION_NEEDED;
+  store16(icmp + ICMP_NEXT_HOP_MTU, (u16) limit);
+  memcpy(icmp + ICMP_HEADER, packet, quote);
+  store16(icmp + ICMP_CHECKSUM, checksum(icmp, ICMP_HEADER + quote));
+  if (write(tun_fd, reply, total) != (ssize_t) total) {
+    debug("Failed to write fragmentation needed to tun");
+  }
+  ++ pmtu_too_big_sent;
+  return true;
+}
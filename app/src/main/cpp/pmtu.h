@@ -0,0 +1,57 @@
+// Path MTU discovery of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define PMTU_INITIAL                 1500  // bytes, the tun MTU until a search has completed once
+# define PMTU_MIN                     576   // bytes, reports of a smaller next-hop MTU are not taken
+# define PMTU_MAX                     (DATA_MAX_LENGTH - DATA_RESERVE) // bytes, the largest packet a frame carries
+# define PMTU_PROBES                  3     // rounds a size goes unanswered before it is given up
+# define PMTU_PROBE_TIMEOUT           1000  // ms a round of probes waits for echoes
+# define PMTU_RAISE_INTERVAL          600   // s, searches again after this long
+
+// Path MTU discovery, packetization layer style (RFC 8899): a search sends ICMP echo requests with DF
+// set from the tunnel address to the first DNS server, which the server hands out and so sits at
+// its end of the tunnel, one per plateau size in rounds, as data frames through the tunnel. The
+// largest size echoed is the MTU of the tunnel, what every destination is reached through; paths
+// beyond are left to the end hosts, as "fragmentation needed" of other routers reach them. Each
+// search draws an identifier and a payload cookie for its probes, so echoes of apps are never taken.
+// A "fragmentation needed" quoting a probe adds its next-hop MTU as a size to probe and lowers the
+// MTU at once. Sizes that go unanswered for PMTU_PROBES rounds are given up, and if none is echoed
+// the path does not answer and the MTU is left as it was. Oversized packets with DF set from tun
+// are then answered with a "fragmentation needed" of our own, so local stacks adapt at once. The
+// learned MTU is what the next session hands to the tun. IPv4 only, the tun carries no IPv6
+
+// Statistics
+extern u32 pmtu_searches, pmtu_probes_sent, pmtu_probes_acked;
+extern u32 pmtu_too_big_received, pmtu_too_big_sent;
+
+// MTU of the path, learned or PMTU_INITIAL, the tun should get
+u32 pmtu_value();
+
+// Whether a search has confirmed the value
+bool pmtu_verified();
+
+// Start searching for a session on 'tun', probing 'target' from 'local' (addresses in host order),
+// before the threads start
+void pmtu_start(int tun, u32 local, u32 target);
+
+// A new primary connection, which may take another path, the search starts over
+void pmtu_connection();
+
+// Lower 'timeout' (ms) to when the send thread should send probes
+void pmtu_poll(int &timeout);
+
+// Send probes or complete the search when due (send thread)
+void pmtu_serve();
+
+// Take an echo or "fragmentation needed" for a probe (receiving order), returns false for other packets
+bool pmtu_input(const u8 *packet, u32 length);
+
+// Answer a packet from tun that has DF set and exceeds the MTU with "fragmentation needed" on tun
+// (send thread), returns whether it did, the packet is dropped then
+bool pmtu_too_big(const u8 *packet, u32 length);
@@ -0,0 +1,200 @@
+// Worker pool of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "pool.h"
+
+// Native C++
+# include <atomic>
+# include <cstring>
+# include <unistd.h>
+
+// Worker with its deque of tasks, the owner takes from the head and thieves from the tail
+struct Worker {
+  pthread_t thread;
+  PoolTask *deque[POOL_DEQUE];
+  u32 head, tail;
+  pthread_mutex_t lock;
+};
+
+static Worker workers[POOL_MAX_WORKERS];
+static int worker_count;
+static std::atomic<u32> next_worker;
+
+// Idle workers sleep until a task is queued anywhere
+static std::atomic<int> queued;
+static bool stopping;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+// Statistics
+u32 pool_tasks, pool_steals, pool_reordered, pool_stalls;
+
+void pool_stage_init(PoolStage &stage, PoolTransform transform, PoolDeliver deliver) {
+  stage.transform = transform;
+  stage.deliver = deliver;
+  stage.submitted = stage.delivered = 0;
+  stage.delivering = false;
+  pthread_mutex_init(&stage.lock, nullptr);
+  pthread_cond_init(&stage.space, nullptr);
+}
+
+// Deliver every task ready at the head of the reorder buffer, called with the stage locked
+static void deliver_ready(PoolStage &stage) {
+  if (stage.delivering) {
+    return;
+  }
+  stage.delivering = true;
+  while (stage.delivered != stage.submitted) {
+    PoolTask &task = stage.slots[stage.delivered & (POOL_WINDOW - 1)];
+    if (!task.done) {
+      break;
+    }
+    pthread_mutex_unlock(&stage.lock);
+    stage.deliver(task.frames, task.passed, task.count);
+    pthread_mutex_lock(&stage.lock);
+    task.done = false;
+    ++ stage.delivered;
+    pthread_cond_broadcast(&stage.space);
+  }
+  stage.delivering = false;
+}
+
+static void run(PoolTask *task) {
+  PoolStage &stage = *task -> stage;
+  stage.transform(task -> frames, task -> passed, task -> count);
+  pthread_mutex_lock(&stage.lock);
+  task -> done = true;
+  if (task != &stage.slots[stage.delivered & (POOL_WINDOW - 1)]) {
+    ++ pool_reordered;
+  }
+  ++ pool_tasks;
+  deliver_ready(stage);
+  pthread_mutex_unlock(&stage.lock);
+}
+
+// Own deque first, then the others, starting from the next worker
+static PoolTask* take(int index) {
+  for (int i = 0; i < worker_count; ++ i) {
+    Worker &worker = workers[(index + i) % worker_count];
+    PoolTask *task = nullptr;
+    pthread_mutex_lock(&worker.lock);
+    if (worker.head != worker.tail) {
+      task = i == 0 ? worker.deque[(worker.head ++) & (POOL_DEQUE - 1)] : worker.deque[(-- worker.tail) & (POOL_DEQUE - 1)];
+    }
+    pthread_mutex_unlock(&worker.lock);
+    if (task) {
+      -- queued;
+      if (i != 0) {
+        ++ pool_steals;
+      }
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+static void* worker_thread(void *argument) {
+  int index = (int) (long) argument;
+  while (true) {
+    PoolTask *task = take(index);
+    if (task) {
+      run(task);
+      continue;
+    }
+    pthread_mutex_lock(&idle_lock);
+    while (queued == 0 && !stopping) {
+      pthread_cond_wait(&idle_cond, &idle_lock);
+    }
+    bool done = queued == 0 && stopping;
+    pthread_mutex_unlock(&idle_lock);
+    if (done) {
+      break;
+    }
+  }
+  return nullptr;
+}
+
+static int worker_target(int requested) {
+  if (requested >= 0) {
+    return requested < POOL_MAX_WORKERS ? requested : POOL_MAX_WORKERS;
+  }
+  int cores = (int) sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  return cores < 0 ? 0 : (cores < POOL_MAX_WORKERS ? cores : POOL_MAX_WORKERS);
+}
+
+void pool_start(int requested) {
+  stopping = false;
+  queued = 0;
+  next_worker = 0;
+  pool_tasks = pool_steals = pool_reordered = pool_stalls = 0;
+  worker_count = worker_target(requested);
+  for (int i = 0; i < worker_count; ++ i) {
+    workers[i].head = workers[i].tail = 0;
+    pthread_mutex_init(&workers[i].lock, nullptr);
+  }
+  for (int i = 0; i < worker_count; ++ i) {
+    pthread_create(&workers[i].thread, nullptr, worker_thread, (void *) (long) i);
+  }
+}
+
+void pool_stop() {
+  pthread_mutex_lock(&idle_lock);
+  stopping = true;
+  pthread_cond_broadcast(&idle_cond);
+  pthread_mutex_unlock(&idle_lock);
+  for (int i = 0; i < worker_count; ++ i) {
+    pthread_join(workers[i].thread, nullptr);
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+  worker_count = 0;
+}
+
+int pool_workers() {
+  return worker_count;
+}
+
+void pool_submit(PoolStage &stage, Message **frames, int count) {
+  pthread_mutex_lock(&stage.lock);
+  if (stage.submitted - stage.delivered == POOL_WINDOW) {
+    ++ pool_stalls;
+    do {
+      pthread_cond_wait(&stage.space, &stage.lock);
+    } while (stage.submitted - stage.delivered == POOL_WINDOW);
+  }
+  PoolTask &task = stage.slots[(stage.submitted ++) & (POOL_WINDOW - 1)];
+  task.stage = &stage;
+  memcpy(task.frames, frames, count * sizeof(Message *));
+  task.count = count;
+  task.done = false;
+  pthread_mutex_unlock(&stage.lock);
+  if (worker_count == 0) {
+    run(&task);
+    return;
+  }
+
+  // Spread over the deques, a full one passes the task on
+  for (u32 i = next_worker ++; ; ++ i) {
+    Worker &worker = workers[i % worker_count];
+    pthread_mutex_lock(&worker.lock);
+    bool pushed = worker.tail - worker.head < POOL_DEQUE;
+    if (pushed) {
+      worker.deque[(worker.tail ++) & (POOL_DEQUE - 1)] = &task;
+    }
+    pthread_mutex_unlock(&worker.lock);
+    if (pushed) {
+      break;
+    }
+  }
+  ++ queued;
+  pthread_mutex_lock(&idle_lock);
+  pthread_cond_signal(&idle_cond);
+  pthread_mutex_unlock(&idle_lock);
+}
+
+bool pool_idle(PoolStage &stage) {
+  pthread_mutex_lock(&stage.lock);
+  bool idle = stage.submitted == stage.delivered;
+  pthread_mutex_unlock(&stage.lock);
+  return idle;
+}
@@ -0,0 +1,62 @@
+// Worker pool of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Native C++
+# include <pthread.h>
+
+// Parameters
+# define POOL_MAX_WORKERS             8
+# define POOL_BATCH                   8     // frames per task
+# define POOL_WINDOW                  8     // tasks in flight per stage, must be a power of 2
+# define POOL_DEQUE                   32    // tasks per worker, must be a power of 2
+
+// A stage fans batches of frames out to the workers and hands them back in submission order. Each
+// worker runs tasks from its own deque first, oldest first, and steals the newest task of another
+// worker when it runs dry. A finished task waits in the reorder buffer (a window of slots indexed
+// by sequence number) until the tasks before it are done, and whichever thread completes the head
+// delivers every task that is ready, one at a time. Without workers, tasks run at submission.
+
+// Transform runs on any worker and may fail frames one by one, deliver runs in submission order
+typedef void (*PoolTransform)(Message **frames, bool *passed, int count);
+typedef void (*PoolDeliver)(Message **frames, const bool *passed, int count);
+
+struct PoolStage;
+
+struct PoolTask {
+  PoolStage *stage;
+  Message *frames[POOL_BATCH];
+  bool passed[POOL_BATCH];
+  int count;
+  bool done;
+};
+
+struct PoolStage {
+  PoolTransform transform;
+  PoolDeliver deliver;
+  PoolTask slots[POOL_WINDOW]; // reorder buffer
+  u64 submitted, delivered;    // sequence numbers
+  bool delivering;
+  pthread_mutex_t lock;
+  pthread_cond_t space;
+};
+
+// Statistics
+extern u32 pool_tasks, pool_steals, pool_reordered, pool_stalls;
+
+void pool_stage_init(PoolStage &stage, PoolTransform transform, PoolDeliver deliver);
+
+// Start workers (negative for one per core besides the first, capped), stop runs every task left
+void pool_start(int workers);
+void pool_stop();
+int pool_workers();
+
+// Submit up to POOL_BATCH frames, waits while the window of the stage is full
+void pool_submit(PoolStage &stage, Message **frames, int count);
+
+// Whether every task submitted to the stage has been delivered
+bool pool_idle(PoolStage &stage);
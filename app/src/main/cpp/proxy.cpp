@@ -0,0 +1,532 @@
+// Local proxy of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "packet.h"
+# include "proxy.h"
+# include "queue.h"
+# include "stream.h"
+# include "writer.h"
+
+// Native C++
+# include <arpa/inet.h>
+# include <cerrno>
+# include <cstdlib>
+# include <cstring>
+# include <netinet/tcp.h>
+# include <pthread.h>
+# include <sys/eventfd.h>
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <unistd.h>
+
+# define PROXY_FRAME_MAX              (DATA_MAX_LENGTH - DATA_RESERVE - STREAM_ID_LENGTH) // bytes read into a STREAM_DATA
+
+# define STATE_FREE                   0
+# define STATE_GREETING               1     // the SOCKS5 greeting or the HTTP request so far
+# define STATE_REQUEST                2     // SOCKS5 method agreed, waiting for the request
+# define STATE_OPEN                   3
+
+# define SOCKS_VERSION                5
+# define SOCKS_NO_AUTH                0
+# define SOCKS_NO_METHOD              0xff
+# define SOCKS_CONNECT                1
+# define SOCKS_IPV4                   1
+# define SOCKS_NAME                   3
+# define SOCKS_IPV6                   4
+# define SOCKS_SUCCEEDED              0
+# define SOCKS_NOT_SUPPORTED          7
+# define SOCKS_ADDRESS_NOT_SUPPORTED  8
+# define SOCKS_REPLY_LENGTH           10    // with an IPv4 bound address
+
+# define HTTP_CONNECTED               "HTTP/1.1 200 Connection established\r\n\r\n"
+# define HTTP_BAD_REQUEST             "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+# define HTTP_NOT_ALLOWED             "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"
+
+// A proxied connection of an app
+struct Proxy {
+  u32 id;
+  u8 state;
+  int fd;
+  u8 handshake[PROXY_HANDSHAKE];
+  u32 taken;                  // bytes in 'handshake'
+
+  // Upstream, bytes of the app are read as long as the server has credit for them
+  u32 up_credit;
+  bool up_closed;
+
+  // Downstream, bytes of the server the socket has not taken yet, 'buffered' of them from 'head' on
+  u32 head, buffered;
+  u32 down_credit;            // bytes the socket took that have not been credited to the server yet
+  bool down_closed, filled;
+};
+
+static u16 listen_port;
+static int listener = -1, wake_fd = -1;
+static Proxy proxies[PROXY_MAX];
+alignas(4096) static u8 buffers[PROXY_MAX][STREAM_BUFFER]; // pages given back once a stream closes
+static u32 serial;
+static pthread_mutex_t proxy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 proxy_accepted, proxy_refused, proxy_reset;
+u32 proxy_active;
+u64 proxy_up_bytes, proxy_down_bytes;
+
+// Close the socket of a proxied connection, with a reset for the app if 'abort'
+static void release(Proxy &proxy, bool abort) {
+  if (abort) {
+    linger option = {1, 0};
+    setsockopt(proxy.fd, SOL_SOCKET, SO_LINGER, &option, sizeof(linger));
+  }
+  close(proxy.fd);
+  if (proxy.filled) {
+    madvise(buffers[&proxy - proxies], STREAM_BUFFER, MADV_DONTNEED);
+  }
+  proxy.state = STATE_FREE;
+  -- proxy_active;
+}
+
+// The send thread polls again, for sockets with bytes to write or streams with credit again
+static void wake() {
+  eventfd_write(wake_fd, 1);
+}
+
+static void reply(const Proxy &proxy, const void *data, u32 length) {
+  // A fresh socket has room for the few bytes
+  send(proxy.fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+// Credit the server with the bytes the socket took, false if the control queue is full
+static bool credit(Proxy &proxy) {
+  Message frame = {HEADER_LENGTH + STREAM_ID_LENGTH + sizeof(u32), STREAM_WINDOW};
+  store32(frame.data, proxy.id);
+  store32(frame.data + STREAM_ID_LENGTH, proxy.down_credit);
+  if (!writer_control(frame)) {
+    return false;
+  }
+  proxy.down_credit = 0;
+  return true;
+}
+
+// Give a stream up on both ends (any thread)
+static void reset(Proxy &proxy) {
+  Message frame = {HEADER_LENGTH + STREAM_ID_LENGTH + 1, STREAM_CLOSE};
+  store32(frame.data, proxy.id);
+  frame.data[STREAM_ID_LENGTH] = STREAM_RESET;
+  writer_control(frame);
+  ++ proxy_reset;
+  release(proxy, true);
+}
+
+// Write what the socket takes of the buffered bytes, false if the stream is gone
+static bool flush(Proxy &proxy) {
+  u8 *ring = buffers[&proxy - proxies];
+  while (proxy.buffered) {
+    u32 first = proxy.buffered < STREAM_BUFFER - proxy.head ? proxy.buffered : STREAM_BUFFER - proxy.head;
+    ssize_t written = send(proxy.fd, ring + proxy.head, first, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      break;
+    }
+    if (written < 0) {
+      reset(proxy);
+      return false;
+    }
+    proxy.head = (proxy.head + (u32) written) & (STREAM_BUFFER - 1);
+    proxy.buffered -= (u32) written;
+    proxy.down_credit += (u32) written;
+    proxy_down_bytes += (u32) written;
+    if ((u32) written < first) {
+      break;
+    }
+  }
+  if (proxy.down_credit >= STREAM_CREDIT_STEP) {
+    credit(proxy);
+  }
+  if (proxy.down_closed && !proxy.buffered) {
+    shutdown(proxy.fd, SHUT_WR);
+    if (proxy.up_closed) {
+      release(proxy, false);
+      return false;
+    }
+  }
+  return true;
+}
+
+// STREAM_OPEN for the destination of a request taking the first 'consumed' bytes of the handshake,
+// the bytes after it go up at once (send thread)
+static void open_stream(Proxy &proxy, u32 address, u16 port, const u8 *name, u32 name_length, u32 consumed) {
+  Message *frame = writer_reserve();
+  store32(frame -> data, proxy.id);
+  store32(frame -> data + STREAM_ID_LENGTH, address);
+  store16(frame -> data + STREAM_ID_LENGTH + sizeof(u32), port);
+  u32 length = STREAM_ID_LENGTH + sizeof(u32) + sizeof(u16);
+  if (name_length) {
+    memcpy(frame -> data + length, name, name_length);
+  }
+  frame -> length = HEADER_LENGTH + length + name_length;
+  frame -> type = STREAM_OPEN;
+  writer_commit(frame);
+  proxy.state = STATE_OPEN;
+  proxy.up_credit = STREAM_WINDOW_INITIAL;
+
+  u32 early = proxy.taken - consumed;
+  if (early) {
+    frame = writer_reserve();
+    store32(frame -> data, proxy.id);
+    memcpy(frame -> data + STREAM_ID_LENGTH, proxy.handshake + consumed, early);
+    frame -> length = HEADER_LENGTH + STREAM_ID_LENGTH + early;
+    frame -> type = STREAM_DATA;
+    writer_commit(frame);
+    proxy.up_credit -= early;
+    proxy_up_bytes += early;
+  }
+}
+
+// Drop the first 'length' bytes of the handshake
+static void consume(Proxy &proxy, u32 length) {
+  memmove(proxy.handshake, proxy.handshake + length, proxy.taken - length);
+  proxy.taken -= length;
+}
+
+// Go on with the handshake as far as the bytes so far allow, false if the app is refused
+static bool handshake(Proxy &proxy) {
+  u8 *data = proxy.handshake;
+  if (proxy.state == STATE_GREETING && data[0] == SOCKS_VERSION) {
+    // SOCKS5 greeting: version, number of methods, methods
+    if (proxy.taken < 2 || proxy.taken < 2u + data[1]) {
+      return true;
+    }
+    bool agreed = memchr(data + 2, SOCKS_NO_AUTH, data[1]) != nullptr;
+    u8 answer[2] = {SOCKS_VERSION, (u8) (agreed ? SOCKS_NO_AUTH : SOCKS_NO_METHOD)};
+    reply(proxy, answer, sizeof(answer));
+    if (!agreed) {
+      return false;
+    }
+    consume(proxy, 2u + data[1]);
+    proxy.state = STATE_REQUEST;
+  }
+  if (proxy.state == STATE_REQUEST) {
+    // SOCKS5 request: version, command, reserved, address type, address, port
+    if (proxy.taken < 5) {
+      return true;
+    }
+    u8 type = data[3];
+    u32 length = type == SOCKS_IPV4 ? 10 : type == SOCKS_NAME ? 7u + data[4] : type == SOCKS_IPV6 ? 22 : 0;
+    if (length == 0 || (type == SOCKS_NAME && data[4] == 0) || data[0] != SOCKS_VERSION) {
+      return false;
+    }
+    if (proxy.taken < length) {
+      return true;
+    }
+    u8 status = data[1] != SOCKS_CONNECT ? SOCKS_NOT_SUPPORTED : type == SOCKS_IPV6 ? SOCKS_ADDRESS_NOT_SUPPORTED : SOCKS_SUCCEEDED;
+    u8 answer[SOCKS_REPLY_LENGTH] = {SOCKS_VERSION, status, 0, SOCKS_IPV4}; // bound address and port left 0
+    reply(proxy, answer, sizeof(answer));
+    if (status != SOCKS_SUCCEEDED) {
+      return false;
+    }
+    u16 port = load16(data + length - sizeof(u16));
+    if (type == SOCKS_IPV4) {
+      open_stream(proxy, load32(data + 4), port, nullptr, 0, length);
+    } else {
+      open_stream(proxy, 0, port, data + 5, data[4], length);
+    }
+    return true;
+  }
+
+  // HTTP CONNECT host:port, taken once the header ends
+  const u8 *end = (const u8 *) memmem(data, proxy.taken, "\r\n\r\n", 4);
+  if (end == nullptr) {
+    return proxy.taken < PROXY_HANDSHAKE;
+  }
+  if (proxy.taken < 8 || memcmp(data, "CONNECT ", 8) != 0) {
+    reply(proxy, HTTP_NOT_ALLOWED, sizeof(HTTP_NOT_ALLOWED) - 1);
+    return false;
+  }
+  const u8 *host = data + 8, *space = (const u8 *) memchr(host, ' ', end - host), *colon = nullptr;
+  for (const u8 *p = host; space && p < space; ++ p) {
+    colon = *p == ':' ? p : colon;
+  }
+  // IPv6 literals are not reachable through the tunnel either
+  char digits[8] = {};
+  if (colon && colon != host && *host != '[' && space - colon - 1 < (int) sizeof(digits)) {
+    memcpy(digits, colon + 1, space - colon - 1);
+  }
+  int port = atoi(digits);
+  if (port <= 0 || port > 65535) {
+    reply(proxy, HTTP_BAD_REQUEST, sizeof(HTTP_BAD_REQUEST) - 1);
+    return false;
+  }
+  char literal[INET_ADDRSTRLEN] = {};
+  in_addr address = {};
+  u32 host_length = (u32) (colon - host);
+  memcpy(literal, host, host_length < sizeof(literal) ? host_length : 0);
+  bool numeric = inet_pton(AF_INET, literal, &address) == 1;
+  reply(proxy, HTTP_CONNECTED, sizeof(HTTP_CONNECTED) - 1);
+  open_stream(proxy, numeric ? ntohl(address.s_addr) : 0, (u16) port, numeric ? nullptr : host, numeric ? 0 : host_length,
+    (u32) (end + 4 - data));
+  return true;
+}
+
+// Read from the socket of an app, handshake or stream bytes (send thread)
+static void pull(Proxy &proxy) {
+  if (proxy.state != STATE_OPEN) {
+    ssize_t length = recv(proxy.fd, proxy.handshake + proxy.taken, PROXY_HANDSHAKE - proxy.taken, 0);
+    if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return;
+    }
+    proxy.taken += length > 0 ? (u32) length : 0;
+    if (length <= 0 || !handshake(proxy)) {
+      ++ proxy_refused;
+      release(proxy, false);
+    }
+    return;
+  }
+
+  // The bytes are read in place into the frame
+  Message *frame = writer_reserve();
+  u32 size = proxy.up_credit < PROXY_FRAME_MAX ? proxy.up_credit : PROXY_FRAME_MAX;
+  ssize_t length = recv(proxy.fd, frame -> data + STREAM_ID_LENGTH, size, 0);
+  if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    writer_discard(frame);
+    return;
+  }
+  store32(frame -> data, proxy.id);
+  if (length > 0) {
+    frame -> length = HEADER_LENGTH + STREAM_ID_LENGTH + (u32) length;
+    frame -> type = STREAM_DATA;
+    writer_commit(frame);
+    proxy.up_credit -= (u32) length;
+    proxy_up_bytes += (u32) length;
+    return;
+  }
+
+  // The app is done sending, or gone
+  frame -> length = HEADER_LENGTH + STREAM_ID_LENGTH + 1;
+  frame -> type = STREAM_CLOSE;
+  frame -> data[STREAM_ID_LENGTH] = length == 0 ? STREAM_FIN : STREAM_RESET;
+  writer_commit(frame);
+  proxy.up_closed = true;
+  if (length < 0) {
+    ++ proxy_reset;
+    release(proxy, true);
+  } else if (proxy.down_closed && !proxy.buffered) {
+    release(proxy, false);
+  }
+}
+
+// Take the connections waiting while there are free slots
+static void take() {
+  while (proxy_active < PROXY_MAX) {
+    int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+    int slot = 0;
+    while (proxies[slot].state != STATE_FREE) {
+      ++ slot;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int));
+    Proxy &proxy = proxies[slot];
+    proxy = Proxy();
+    proxy.id = (++ serial * PROXY_MAX + slot) | STREAM_PROXIED;
+    proxy.state = STATE_GREETING;
+    proxy.fd = fd;
+    ++ proxy_accepted;
+    ++ proxy_active;
+  }
+}
+
+bool proxy_configure(u16 port) {
+  listen_port = port;
+  proxy_accepted = proxy_refused = proxy_reset = 0;
+  proxy_up_bytes = proxy_down_bytes = 0;
+  return true;
+}
+
+bool proxy_enabled() {
+  return listen_port != 0;
+}
+
+u16 proxy_port() {
+  return listen_port;
+}
+
+bool proxy_start() {
+  if (listen_port == 0) {
+    return true;
+  }
+  if (wake_fd == -1) {
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+  listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int on = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(int));
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(listen_port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listener, (sockaddr *) &address, sizeof(sockaddr_in)) != 0 || listen(listener, PROXY_BACKLOG) != 0) {
+    error("Failed to listen on 127.0.0.1:%d for the proxy: %s", listen_port, strerror(errno));
+    close(listener);
+    listener = -1;
+    return false;
+  }
+  debug("Proxy listening on 127.0.0.1:%d", listen_port);
+  return true;
+}
+
+void proxy_stop() {
+  pthread_mutex_lock(&proxy_lock);
+  for (Proxy &proxy: proxies) {
+    if (proxy.state != STATE_FREE) {
+      release(proxy, true);
+    }
+  }
+  if (listener != -1) {
+    close(listener);
+    listener = -1;
+  }
+  pthread_mutex_unlock(&proxy_lock);
+}
+
+void proxy_connection() {
+  pthread_mutex_lock(&proxy_lock);
+  for (Proxy &proxy: proxies) {
+    // Handshakes under way open their streams on the new connection
+    if (proxy.state == STATE_OPEN) {
+      ++ proxy_reset;
+      release(proxy, true);
+    }
+  }
+  pthread_mutex_unlock(&proxy_lock);
+}
+
+int proxy_poll(pollfd *fds, int &timeout) {
+  if (listener == -1) {
+    return 0;
+  }
+  pthread_mutex_lock(&proxy_lock);
+  fds[0] = {wake_fd, POLLIN, 0};
+  fds[1] = {proxy_active < PROXY_MAX ? listener : -1, POLLIN, 0};
+  bool room = queue_stream_frames < QUEUE_STREAM_FRAMES;
+  bool due = false, full = false;
+  for (int slot = 0; slot < PROXY_MAX; ++ slot) {
+    Proxy &proxy = proxies[slot];
+    short events = 0;
+    if (proxy.state != STATE_FREE) {
+      bool reading = proxy.state != STATE_OPEN || (!proxy.up_closed && proxy.up_credit > 0);
+      if (reading && proxy.state == STATE_OPEN && !room) {
+        // Held back for room in the writer queue, the queue wakes the send thread once it drains
+        reading = false;
+        full = true;
+      }
+      events = (short) ((reading ? POLLIN : 0) | (proxy.buffered ? POLLOUT : 0));
+      due |= proxy.down_credit >= STREAM_CREDIT_STEP; // credit the control queue had no room for
+    }
+    fds[2 + slot] = {events ? proxy.fd : -1, events, 0};
+  }
+  if (full) {
+    queue_watch_room(wake_fd);
+  }
+  pthread_mutex_unlock(&proxy_lock);
+  if (due && (timeout < 0 || timeout > PROXY_TICK)) {
+    timeout = PROXY_TICK;
+  }
+  return PROXY_FDS;
+}
+
+void proxy_serve(const pollfd *fds, int count) {
+  if (count == 0) {
+    return;
+  }
+  if (fds[0].revents) {
+    eventfd_t value;
+    eventfd_read(wake_fd, &value);
+  }
+  pthread_mutex_lock(&proxy_lock);
+  for (int slot = 0; slot < PROXY_MAX; ++ slot) {
+    // Entries of sockets released since the poll are stale
+    Proxy &proxy = proxies[slot];
+    const pollfd &entry = fds[2 + slot];
+    if (proxy.state == STATE_FREE || entry.fd != proxy.fd) {
+      continue;
+    }
+    if (proxy.down_credit >= STREAM_CREDIT_STEP) {
+      credit(proxy);
+    }
+    if ((entry.revents & (POLLOUT | POLLERR | POLLHUP)) && proxy.buffered && !flush(proxy)) {
+      continue;
+    }
+    if ((entry.revents & (POLLIN | POLLERR | POLLHUP)) && (entry.events & POLLIN)) {
+      pull(proxy);
+    }
+  }
+  if (fds[1].revents & POLLIN) {
+    take();
+  }
+  pthread_mutex_unlock(&proxy_lock);
+}
+
+void proxy_deliver(const Message &frame) {
+  u32 length = frame.length - HEADER_LENGTH;
+  if (length < STREAM_ID_LENGTH) {
+    return;
+  }
+  u32 id = load32(frame.data);
+  const u8 *data = frame.data + STREAM_ID_LENGTH;
+  length -= STREAM_ID_LENGTH;
+
+  // Frames of a stream closed here already are dropped
+  pthread_mutex_lock(&proxy_lock);
+  Proxy &proxy = proxies[id & (PROXY_MAX - 1)];
+  if (proxy.state != STATE_OPEN || proxy.id != id) {
+    pthread_mutex_unlock(&proxy_lock);
+    return;
+  }
+  if (frame.type == STREAM_DATA) {
+    if (proxy.down_closed || proxy.buffered + length > STREAM_BUFFER) {
+      error("Proxied stream %d from the server overran its credit", id);
+      reset(proxy);
+      pthread_mutex_unlock(&proxy_lock);
+      return;
+    }
+
+    // Straight to the socket if nothing is waiting before, the rest is buffered
+    u32 written = 0;
+    if (!proxy.buffered) {
+      ssize_t sent = send(proxy.fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+      written = sent > 0 ? (u32) sent : 0;
+      proxy.down_credit += written;
+      proxy_down_bytes += written;
+    }
+    if (written < length) {
+      u8 *ring = buffers[id & (PROXY_MAX - 1)];
+      u32 offset = (proxy.head + proxy.buffered) & (STREAM_BUFFER - 1), rest = length - written;
+      u32 first = rest < STREAM_BUFFER - offset ? rest : STREAM_BUFFER - offset;
+      memcpy(ring + offset, data + written, first);
+      memcpy(ring, data + written + first, rest - first);
+      proxy.buffered += rest;
+      proxy.filled = true;
+      wake();
+    }
+    if (proxy.down_credit >= STREAM_CREDIT_STEP) {
+      credit(proxy);
+    }
+  } else if (frame.type == STREAM_CLOSE && length >= 1) {
+    if (data[0] == STREAM_FIN) {
+      proxy.down_closed = true;
+      flush(proxy);
+    } else {
+      ++ proxy_reset;
+      release(proxy, true);
+    }
+  } else if (frame.type == STREAM_WINDOW && length >= sizeof(u32)) {
+    if (proxy.up_credit == 0) {
+      wake();
+    }
+    proxy.up_credit += load32(data);
+  }
+  pthread_mutex_unlock(&proxy_lock);
+}
@@ -0,0 +1,53 @@
+// Local proxy of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Native C++
+# include <poll.h>
+
+// Parameters
+# define PROXY_MAX                    32    // proxied connections, must be a power of 2, more wait in the backlog
+# define PROXY_HANDSHAKE              512   // bytes of a SOCKS5 or HTTP CONNECT request, longer ones are refused
+# define PROXY_BACKLOG                16    // connections waiting for a slot
+# define PROXY_TICK                   20    // ms, polls again while credit waits for room in the control queue
+# define PROXY_FDS                    (PROXY_MAX + 2) // entries proxy_poll may fill
+
+// Local proxy: a SOCKS5 (no authentication, CONNECT) and HTTP CONNECT listener on 127.0.0.1 for apps
+// set up with a proxy. Each connection it takes becomes a stream of the tunnel right away, so its
+// bytes go up as STREAM_DATA read straight from the socket and come down written straight to it,
+// with no tun packets or inner TCP in between. Host names are not resolved here but sent to the
+// server in the STREAM_OPEN. The success reply goes out with the STREAM_OPEN, before the server has
+// connected (a refusal then resets the connection), and credit works as with split TCP. The sockets
+// are served by the send thread, the single producer of the writer queue, and written by the
+// receive thread as frames arrive, so a stream costs no thread of its own
+
+// Statistics
+extern u32 proxy_accepted, proxy_refused, proxy_reset;
+extern u32 proxy_active;
+extern u64 proxy_up_bytes, proxy_down_bytes;
+
+// Listen on 127.0.0.1:'port' (0 to disable, the server must take STREAM_* frames), before backend
+bool proxy_configure(u16 port);
+bool proxy_enabled();
+u16 proxy_port();
+
+// Open the listener for a session (before the threads start), and close it and all streams after
+bool proxy_start();
+void proxy_stop();
+
+// A new primary connection, the streams of the old one are reset
+void proxy_connection();
+
+// Fill 'fds' with what the send thread polls for the proxy, lowering 'timeout' (ms) if it should look
+// again without an event, returns the number of entries (at most PROXY_FDS)
+int proxy_poll(pollfd *fds, int &timeout);
+
+// Serve the entries proxy_poll filled once poll returns (send thread)
+void proxy_serve(const pollfd *fds, int count);
+
+// Handle a STREAM_* frame of a proxied stream from the server (receiving order)
+void proxy_deliver(const Message &frame);
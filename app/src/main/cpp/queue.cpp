@@ -0,0 +1,402 @@
+// Upstream queue (FQ-CoDel) of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "queue.h"
+
+// Native C++
+# include <cmath>
+# include <cstring>
+# include <pthread.h>
+# include <sys/eventfd.h>
+
+// Packet, 'next' links either a flow queue or the free list
+struct Packet {
+  Message message;
+  u64 enqueued;
+  int next;
+  int flow;     // -1 for the priority queue
+  bool stream;  // a frame of a split TCP stream, never dropped
+};
+
+// Flow queue with its DRR and CoDel state
+struct Flow {
+  int head, tail;
+  u32 backlog;
+  int deficit;
+  int next;     // in the new or old flow list
+  u8 list;      // FLOW_IDLE, FLOW_NEW or FLOW_OLD
+
+  // CoDel
+  u64 first_above, drop_next;
+  u32 count, last_count;
+  bool dropping;
+};
+
+# define FLOW_IDLE  0
+# define FLOW_NEW   1
+# define FLOW_OLD   2
+
+struct FlowList {
+  int head, tail;
+};
+
+static Packet pool[QUEUE_PACKETS];
+static Flow flows[QUEUE_FLOWS];
+static FlowList new_flows, old_flows;
+static Flow priority;
+static int free_list, queued;
+static u32 queued_bytes;
+static u32 seed;
+static int room_fd = -1;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 queue_drops, queue_marks, queue_overflows, queue_flows;
+u32 queue_classes[PACKET_CLASSES], queue_acks_filtered;
+u32 queue_sojourn_us, queue_sojourn_max_us;
+volatile u32 queue_stream_frames;
+
+static void list_push(FlowList &list, int index) {
+  flows[index].next = -1;
+  if (list.tail == -1) {
+    list.head = index;
+  } else {
+    flows[list.tail].next = index;
+  }
+  list.tail = index;
+}
+
+static int list_pop(FlowList &list) {
+  int index = list.head;
+  list.head = flows[index].next;
+  if (list.head == -1) {
+    list.tail = -1;
+  }
+  return index;
+}
+
+static void free_packet(int index) {
+  if (pool[index].stream) {
+    pool[index].stream = false;
+    if (-- queue_stream_frames <= QUEUE_STREAM_FRAMES / 2 && room_fd != -1) {
+      eventfd_write(room_fd, 1);
+      room_fd = -1;
+    }
+  }
+  pool[index].next = free_list;
+  free_list = index;
+}
+
+// Pop the head packet of a flow, -1 if empty
+static int flow_pop(Flow &flow) {
+  int index = flow.head;
+  if (index == -1) {
+    return -1;
+  }
+  flow.head = pool[index].next;
+  if (flow.head == -1) {
+    flow.tail = -1;
+  }
+  flow.backlog -= pool[index].message.length;
+  queued_bytes -= pool[index].message.length;
+  -- queued;
+  return index;
+}
+
+// Set CE on an ECN-capable IPv4 packet, returns false if it has to be dropped instead (stream frames
+// are let through as they are)
+static bool mark(Packet &packet) {
+  if (packet.stream) {
+    return true;
+  }
+  u8 *ip = packet.message.data;
+  u32 length = packet.message.length - HEADER_LENGTH;
+  if (!is_ipv4(ip, length) || (ip[IPV4_TOS] & IPV4_ECN_MASK) == 0) {
+    return false;
+  }
+  u16 from = load16(ip);
+  ip[IPV4_TOS] |= IPV4_ECN_CE;
+  checksum_adjust(ip + IPV4_CHECKSUM, from, load16(ip));
+  ++ queue_marks;
+  return true;
+}
+
+static u64 control_law(u64 t, u32 count) {
+  return t + (u64) (CODEL_INTERVAL / sqrt((double) count));
+}
+
+// CoDel dequeue helper, also decides whether the sojourn time has been above target for an interval
+static int codel_pop(Flow &flow, u64 now, bool &ok_to_drop) {
+  ok_to_drop = false;
+  int index = flow_pop(flow);
+  if (index == -1) {
+    flow.first_above = 0;
+    return -1;
+  }
+  u64 sojourn = now - pool[index].enqueued;
+  if (sojourn < CODEL_TARGET || flow.backlog <= QUEUE_QUANTUM) {
+    flow.first_above = 0;
+  } else if (flow.first_above == 0) {
+    flow.first_above = now + CODEL_INTERVAL;
+  } else if (now >= flow.first_above) {
+    ok_to_drop = true;
+  }
+  return index;
+}
+
+// CoDel (RFC 8289) on one flow
+static int codel_dequeue(Flow &flow, u64 now) {
+  bool ok_to_drop;
+  int index = codel_pop(flow, now, ok_to_drop);
+  if (index == -1) {
+    flow.dropping = false;
+    return -1;
+  }
+
+  if (flow.dropping) {
+    if (!ok_to_drop) {
+      flow.dropping = false;
+    }
+    while (flow.dropping && now >= flow.drop_next) {
+      ++ flow.count;
+      if (mark(pool[index])) {
+        flow.drop_next = control_law(flow.drop_next, flow.count);
+        break;
+      }
+      free_packet(index);
+      ++ queue_drops;
+      index = codel_pop(flow, now, ok_to_drop);
+      if (index == -1 || !ok_to_drop) {
+        flow.dropping = false;
+      } else {
+        flow.drop_next = control_law(flow.drop_next, flow.count);
+      }
+    }
+  } else if (ok_to_drop) {
+    if (!mark(pool[index])) {
+      free_packet(index);
+      ++ queue_drops;
+      index = codel_pop(flow, now, ok_to_drop);
+    }
+    flow.dropping = true;
+    u32 delta = flow.count - flow.last_count;
+    flow.count = (delta > 1 && now - flow.drop_next < 16 * CODEL_INTERVAL) ? delta : 1;
+    flow.drop_next = control_law(now, flow.count);
+    flow.last_count = flow.count;
+  }
+  return index;
+}
+
+// Whether a queued pure ACK carries nothing the newer one of the same connection does not: the newer
+// acknowledges strictly more (duplicate ACKs drive fast retransmit), the flags (ECE/CWR) are the same
+// and the older has no SACK blocks
+static bool ack_redundant(const u8 *older, const u8 *newer, u32 length) {
+  const u8 *tcp = transport_header(older, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  const u8 *newer_tcp = newer + ipv4_header_length(newer);
+  return tcp_pure_ack(older, length)
+    && memcmp(older + IPV4_SOURCE, newer + IPV4_SOURCE, 8) == 0 && memcmp(tcp, newer_tcp, 4) == 0
+    && (int) (load32(newer_tcp + TCP_ACK_NUMBER) - load32(tcp + TCP_ACK_NUMBER)) > 0
+    && tcp[TCP_FLAGS] == newer_tcp[TCP_FLAGS] && (older[IPV4_TOS] & IPV4_ECN_MASK) == (newer[IPV4_TOS] & IPV4_ECN_MASK)
+    && !tcp_has_sack(tcp);
+}
+
+// CAKE-style ACK filter over the priority queue
+static void ack_filter(const Message &newer) {
+  u32 length = newer.length - HEADER_LENGTH;
+  if (!tcp_pure_ack(newer.data, length)) {
+    return;
+  }
+  for (int index = priority.head, previous = -1; index != -1; ) {
+    Packet &packet = pool[index];
+    int next = packet.next;
+    if (ack_redundant(packet.message.data, newer.data, packet.message.length - HEADER_LENGTH)) {
+      if (previous == -1) {
+        priority.head = next;
+      } else {
+        pool[previous].next = next;
+      }
+      if (priority.tail == index) {
+        priority.tail = previous;
+      }
+      priority.backlog -= packet.message.length;
+      queued_bytes -= packet.message.length;
+      -- queued;
+      free_packet(index);
+      ++ queue_acks_filtered;
+    } else {
+      previous = index;
+    }
+    index = next;
+  }
+}
+
+void queue_init() {
+  pthread_mutex_lock(&queue_lock);
+  free_list = -1;
+  for (int i = QUEUE_PACKETS - 1; i >= 0; -- i) {
+    free_packet(i);
+  }
+  for (Flow &flow: flows) {
+    flow = Flow();
+    flow.head = flow.tail = flow.next = -1;
+  }
+  priority = Flow();
+  priority.head = priority.tail = priority.next = -1;
+  new_flows = old_flows = {-1, -1};
+  queued = 0;
+  queued_bytes = 0;
+  seed = (u32) now_us() * 2654435761u;
+  queue_drops = queue_marks = queue_overflows = queue_flows = 0;
+  queue_acks_filtered = 0;
+  for (u32 &count: queue_classes) {
+    count = 0;
+  }
+  queue_sojourn_us = queue_sojourn_max_us = 0;
+  queue_stream_frames = 0;
+  room_fd = -1;
+  pthread_mutex_unlock(&queue_lock);
+}
+
+Message* queue_reserve() {
+  pthread_mutex_lock(&queue_lock);
+  if (free_list == -1) {
+    // Out of packets, drop the head of the fattest flow (the writer holds less than the pool), one
+    // with a packet at its head if any, as stream frames only take part of the pool
+    Flow *fattest = &priority, *fattest_any = &priority;
+    for (Flow &flow: flows) {
+      bool droppable = flow.head != -1 && !pool[flow.head].stream;
+      fattest = droppable && (flow.backlog > fattest -> backlog || fattest -> head == -1) ? &flow : fattest;
+      fattest_any = flow.backlog > fattest_any -> backlog ? &flow : fattest_any;
+    }
+    fattest = fattest -> head == -1 ? fattest_any : fattest;
+    free_packet(flow_pop(*fattest));
+    ++ queue_overflows;
+  }
+  int index = free_list;
+  free_list = pool[index].next;
+  pthread_mutex_unlock(&queue_lock);
+  return &pool[index].message;
+}
+
+bool queue_enqueue(Message *message, int type) {
+  Packet &packet = *(Packet *) message;
+  int index = &packet - pool;
+  u32 length = message -> length - HEADER_LENGTH;
+  bool stream = message -> type != NET_REQUEST;
+  type = stream ? PACKET_BULK : type == PACKET_AUTO ? packet_class(message -> data, length) : type;
+  u32 hash = stream ? (load32(message -> data) ^ seed) * 2654435761u : 0;
+  hash = type == PACKET_BULK && !stream ? flow_hash(message -> data, length, seed) : hash;
+
+  pthread_mutex_lock(&queue_lock);
+  bool wake = queued == 0 || type != PACKET_BULK;
+  packet.enqueued = now_us();
+  packet.flow = type == PACKET_BULK ? (int) (hash & (QUEUE_FLOWS - 1)) : -1;
+  packet.next = -1;
+  packet.stream = stream;
+  queue_stream_frames += stream;
+  ++ queue_classes[type];
+
+  if (type == PACKET_TCP_CONTROL) {
+    ack_filter(*message);
+  }
+  Flow &flow = packet.flow == -1 ? priority : flows[packet.flow];
+  if (flow.tail == -1) {
+    flow.head = index;
+  } else {
+    pool[flow.tail].next = index;
+  }
+  flow.tail = index;
+  flow.backlog += message -> length;
+  queued_bytes += message -> length;
+  ++ queued;
+
+  if (packet.flow != -1 && flow.list == FLOW_IDLE) {
+    flow.list = FLOW_NEW;
+    flow.deficit = QUEUE_QUANTUM;
+    list_push(new_flows, packet.flow);
+    ++ queue_flows;
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return wake;
+}
+
+Message* queue_dequeue(bool allow_priority, bool allow_bulk) {
+  u64 now = now_us();
+  pthread_mutex_lock(&queue_lock);
+  int index = allow_priority ? flow_pop(priority) : -1;
+  while (index == -1 && allow_bulk) {
+    FlowList &list = new_flows.head != -1 ? new_flows : old_flows;
+    if (list.head == -1) {
+      break;
+    }
+    int id = list.head;
+    Flow &flow = flows[id];
+    if (flow.deficit <= 0) {
+      flow.deficit += QUEUE_QUANTUM;
+      list_pop(list);
+      flow.list = FLOW_OLD;
+      list_push(old_flows, id);
+      continue;
+    }
+
+    index = codel_dequeue(flow, now);
+    if (index == -1) {
+      // Empty, a new flow goes through the old list once so it can not starve others by coming back
+      list_pop(list);
+      if (&list == &new_flows && old_flows.head != -1) {
+        flow.list = FLOW_OLD;
+        list_push(old_flows, id);
+      } else {
+        flow.list = FLOW_IDLE;
+        -- queue_flows;
+      }
+      continue;
+    }
+    flow.deficit -= pool[index].message.length;
+  }
+
+  if (index != -1) {
+    u32 sojourn = now - pool[index].enqueued;
+    queue_sojourn_us = (queue_sojourn_us * 7 + sojourn) / 8;
+    queue_sojourn_max_us = sojourn > queue_sojourn_max_us ? sojourn : queue_sojourn_max_us;
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return index == -1 ? nullptr : &pool[index].message;
+}
+
+void queue_watch_room(int fd) {
+  pthread_mutex_lock(&queue_lock);
+  if (queue_stream_frames <= QUEUE_STREAM_FRAMES / 2) {
+    eventfd_write(fd, 1);
+  } else {
+    room_fd = fd;
+  }
+  pthread_mutex_unlock(&queue_lock);
+}
+
+void queue_release(Message *message) {
+  pthread_mutex_lock(&queue_lock);
+  free_packet((Packet *) message - pool);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+bool queue_prioritized(const Message *message) {
+  return ((const Packet *) message) -> flow == -1;
+}
+
+bool queue_empty() {
+  return queued == 0;
+}
+
+u32 queue_bytes() {
+  return queued_bytes;
+}
+
+bool queue_priority_pending() {
+  return priority.head != -1;
+}
+
+bool queue_bulk_pending() {
+  return new_flows.head != -1 || old_flows.head != -1;
+}
@@ -0,0 +1,59 @@
+// Upstream queue (FQ-CoDel) of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+# include "packet.h"
+
+// Parameters
+# define QUEUE_PACKETS                256   // packet pool shared by all flows
+# define QUEUE_FLOWS                  1024  // flow buckets, must be a power of 2
+# define QUEUE_QUANTUM                1520  // bytes per DRR round
+# define CODEL_TARGET                 5000  // us
+# define CODEL_INTERVAL               100000 // us
+# define QUEUE_STREAM_FRAMES          (QUEUE_PACKETS / 2) // stream frames the splitter may have queued
+
+// Packets are hashed by 5-tuple into a fixed table of flow queues, so memory stays bounded no matter
+// how many flows there are. Flows are served by deficit round robin, with newly active (sparse)
+// flows first, and each flow runs CoDel on the sojourn time of its head packet, marking ECN-capable
+// packets instead of dropping them. When the pool runs out, the fattest flow loses its head packet.
+// Ahead of all flows, a strict priority FIFO takes pure ACKs and SYNs, DNS and small non-TCP
+// packets, so download ACKs never wait behind upload data. FIN/RST stay in their flow behind the data
+// they end.
+// A pure ACK entering it drops the still queued older ACKs of its connection that it makes redundant.
+// Frames of split TCP streams (any type but NET_REQUEST) are queued by stream id as bulk flows, and
+// are never dropped, as their bytes have been acknowledged to the app already
+
+// Statistics
+extern u32 queue_drops, queue_marks, queue_overflows;
+extern u32 queue_flows; // flows with packets queued or still owing a round
+extern u32 queue_classes[PACKET_CLASSES]; // packets enqueued per class
+extern u32 queue_acks_filtered;
+extern u32 queue_sojourn_us, queue_sojourn_max_us; // moving average and max, from enqueue to dequeue
+extern volatile u32 queue_stream_frames; // stream frames queued or being written
+
+// Reset the queue, must be called while no thread is using it
+void queue_init();
+
+// Producer: take a free packet (never fails, makes room by dropping), fill it and enqueue as packet
+// class 'type' (PACKET_AUTO to classify it here), enqueue returns whether the consumer should be woken
+// (the queue was empty, or the packet has priority)
+Message* queue_reserve();
+bool queue_enqueue(Message *message, int type);
+
+// Write the eventfd 'fd' once stream frames have drained to half of QUEUE_STREAM_FRAMES (once per call)
+void queue_watch_room(int fd);
+
+// Consumer: next packet to send from the allowed queues (nullptr if none), and give it back once written
+Message* queue_dequeue(bool priority, bool bulk);
+void queue_release(Message *message);
+
+// Whether a dequeued packet came from the priority queue
+bool queue_prioritized(const Message *message);
+
+bool queue_empty();
+u32 queue_bytes();
+bool queue_priority_pending();
+bool queue_bulk_pending();
@@ -0,0 +1,424 @@
+// Header compression of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "packet.h"
+# include "rohc.h"
+
+// Native C++
+# include <atomic>
+# include <cstring>
+
+// Fields of a HEADER_DELTA frame the context does not predict, after the context id, these flags,
+// the CRC-8 and the TCP flags
+# define DELTA_TOS_TTL                0x01  // TOS and TTL
+# define DELTA_ID                     0x02  // a new IP ID step
+# define DELTA_SEQUENCE               0x04  // sequence number, from the end of the last payload
+# define DELTA_ACK                    0x08
+# define DELTA_WINDOW                 0x10
+# define DELTA_URGENT                 0x20
+# define DELTA_TIMESTAMP              0x40  // TSval and TSecr, the options being NOP NOP timestamp both times
+# define DELTA_OPTIONS                0x80  // the length of the options, then the options as they are
+# define DELTA_FIXED                  3     // context id, flags and CRC
+# define TIMESTAMP_OPTIONS            12
+# define TCP_MAX_OPTIONS              40
+
+struct Context {
+  bool valid;
+  bool resync;  // asked for already (receiver)
+  u8 header[ROHC_MAX_HEADER];
+  u32 length;   // of 'header'
+  u32 payload;  // of the last packet
+  u16 id_step;
+  u16 packets;  // since the full header (sender)
+};
+
+struct Table {
+  Context contexts[ROHC_CONTEXTS];
+  u32 generation;
+};
+
+static bool enabled;
+static Table sender, receiver;
+static std::atomic<u32> generation;
+static std::atomic<bool> requests[ROHC_CONTEXTS];
+
+// Statistics
+u32 rohc_contexts_sent, rohc_deltas_sent, rohc_contexts_received, rohc_deltas_received;
+u32 rohc_resyncs_sent, rohc_resyncs_received;
+u64 rohc_up_in, rohc_up_out, rohc_down_in, rohc_down_out;
+
+// CRC-8 (polynomial 0x07), a nibble at a time
+static const u8 crc_nibbles[16] = {
+  0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d};
+
+static u8 crc8(const u8 *data, u32 length) {
+  u8 crc = 0;
+  for (u32 i = 0; i < length; ++ i) {
+    crc ^= data[i];
+    crc = (u8) (crc << 4) ^ crc_nibbles[crc >> 4];
+    crc = (u8) (crc << 4) ^ crc_nibbles[crc >> 4];
+  }
+  return crc;
+}
+
+static u8* put_varint(u8 *ptr, u32 value) {
+  for (; value >= 128; value >>= 7) {
+    *ptr ++ = (u8) (value | 128);
+  }
+  *ptr ++ = (u8) value;
+  return ptr;
+}
+
+static bool get_varint(const u8 *&ptr, const u8 *end, u32 &value) {
+  value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (ptr == end) {
+      return false;
+    }
+    u8 byte = *ptr ++;
+    value |= (u32) (byte & 127) << shift;
+    if (!(byte & 128)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Length of the headers a context can take (IPv4 without options, not fragmented, with a valid
+// checksum and nothing after the datagram, then TCP or UDP), 0 if the packet does not fit
+static u32 header_length(const u8 *packet, u32 length) {
+  if (length < IPV4_MIN_HEADER || packet[0] != 0x45 || (load16(packet + IPV4_FRAGMENT) & 0x3fff) != 0 ||
+      load16(packet + IPV4_TOTAL_LENGTH) != length || checksum(packet, IPV4_MIN_HEADER) != 0) {
+    return 0;
+  }
+  const u8 *transport = packet + IPV4_MIN_HEADER;
+  if (packet[IPV4_PROTOCOL] == IPPROTO_TCP && length >= IPV4_MIN_HEADER + TCP_MIN_HEADER) {
+    u32 size = IPV4_MIN_HEADER + (transport[TCP_OFFSET] >> 4) * 4u;
+    return size >= IPV4_MIN_HEADER + TCP_MIN_HEADER && size <= length ? size : 0;
+  }
+  if (packet[IPV4_PROTOCOL] == IPPROTO_UDP && length >= IPV4_MIN_HEADER + UDP_HEADER) {
+    return IPV4_MIN_HEADER + UDP_HEADER;
+  }
+  return 0;
+}
+
+// Whether the packet belongs to the flow of the context, with the fields it keeps unchanged
+static bool same_flow(const u8 *packet, const Context &context) {
+  const u8 *last = context.header;
+  return packet[IPV4_PROTOCOL] == last[IPV4_PROTOCOL] &&
+    load16(packet + IPV4_FRAGMENT) == load16(last + IPV4_FRAGMENT) &&
+    memcmp(packet + IPV4_SOURCE, last + IPV4_SOURCE, 12) == 0 && // addresses and ports
+    (packet[IPV4_PROTOCOL] != IPPROTO_TCP ||
+     (packet[IPV4_MIN_HEADER + TCP_OFFSET] & 0x0f) == (last[IPV4_MIN_HEADER + TCP_OFFSET] & 0x0f));
+}
+
+static bool timestamps(const u8 *options, u32 length) {
+  return length == TIMESTAMP_OPTIONS && options[0] == TCP_OPTION_NOP && options[1] == TCP_OPTION_NOP &&
+    options[2] == TCP_OPTION_TIMESTAMP && options[3] == 10;
+}
+
+static void reset(Table &table, u32 current) {
+  for (Context &context: table.contexts) {
+    context.valid = context.resync = false;
+  }
+  table.generation = current;
+}
+
+// Compress a data frame in place against its context, or set the context up, 'asked' are the
+// contexts the peer asked for again (if any)
+static void pack(Table &table, Message &frame, std::atomic<bool> *asked) {
+  u8 *packet = frame.data;
+  u32 length = frame.length - HEADER_LENGTH, size = header_length(packet, length);
+  if (size == 0) {
+    return;
+  }
+  u8 id = (u8) (flow_hash(packet, length, 0) & (ROHC_CONTEXTS - 1));
+  Context &context = table.contexts[id];
+  u32 payload = length - size;
+  bool again = asked && asked[id].load(std::memory_order_relaxed) && asked[id].exchange(false);
+  if (!context.valid || again || context.packets >= ROHC_REFRESH || !same_flow(packet, context)) {
+    memcpy(context.header, packet, size);
+    context.valid = true;
+    context.length = size;
+    context.payload = payload;
+    context.id_step = 1;
+    context.packets = 0;
+    memmove(packet + 1, packet, length);
+    packet[0] = id;
+    frame.type = HEADER_FULL;
+    frame.length += 1;
+    return;
+  }
+
+  // Only what the context does not predict
+  const u8 *last = context.header, *transport = packet + IPV4_MIN_HEADER, *last_transport = last + IPV4_MIN_HEADER;
+  bool tcp = packet[IPV4_PROTOCOL] == IPPROTO_TCP;
+  u8 delta[ROHC_MAX_HEADER], *ptr = delta + DELTA_FIXED, flags = 0;
+  if (tcp) {
+    *ptr ++ = transport[TCP_FLAGS];
+  }
+  if (packet[IPV4_TOS] != last[IPV4_TOS] || packet[IPV4_TTL] != last[IPV4_TTL]) {
+    flags |= DELTA_TOS_TTL;
+    *ptr ++ = packet[IPV4_TOS];
+    *ptr ++ = packet[IPV4_TTL];
+  }
+  u16 step = load16(packet + IPV4_ID) - load16(last + IPV4_ID);
+  if (step != context.id_step) {
+    flags |= DELTA_ID;
+    ptr = put_varint(ptr, step);
+  }
+  if (tcp) {
+    u32 sequence = load32(transport + TCP_SEQUENCE) - load32(last_transport + TCP_SEQUENCE) - context.payload;
+    u32 ack = load32(transport + TCP_ACK_NUMBER) - load32(last_transport + TCP_ACK_NUMBER);
+    if (sequence) {
+      flags |= DELTA_SEQUENCE;
+      ptr = put_varint(ptr, sequence);
+    }
+    if (ack) {
+      flags |= DELTA_ACK;
+      ptr = put_varint(ptr, ack);
+    }
+    if (load16(transport + TCP_WINDOW) != load16(last_transport + TCP_WINDOW)) {
+      flags |= DELTA_WINDOW;
+      memcpy(ptr, transport + TCP_WINDOW, 2);
+      ptr += 2;
+    }
+    if (load16(transport + TCP_URGENT) != load16(last_transport + TCP_URGENT)) {
+      flags |= DELTA_URGENT;
+      memcpy(ptr, transport + TCP_URGENT, 2);
+      ptr += 2;
+    }
+    const u8 *options = transport + TCP_MIN_HEADER, *last_options = last_transport + TCP_MIN_HEADER;
+    u32 options_length = size - IPV4_MIN_HEADER - TCP_MIN_HEADER, last_length = context.length - IPV4_MIN_HEADER - TCP_MIN_HEADER;
+    if (options_length == last_length && memcmp(options, last_options, options_length) == 0) {
+      // As before
+    } else if (timestamps(options, options_length) && timestamps(last_options, last_length)) {
+      flags |= DELTA_TIMESTAMP;
+      ptr = put_varint(ptr, load32(options + 4) - load32(last_options + 4));
+      ptr = put_varint(ptr, load32(options + 8) - load32(last_options + 8));
+    } else {
+      flags |= DELTA_OPTIONS;
+      *ptr ++ = (u8) options_length;
+      memcpy(ptr, options, options_length);
+      ptr += options_length;
+    }
+    memcpy(ptr, transport + TCP_CHECKSUM, 2);
+  } else {
+    memcpy(ptr, transport + UDP_CHECKSUM, 2);
+  }
+  ptr += 2;
+  delta[0] = id;
+  delta[1] = flags;
+  delta[2] = crc8(packet, size);
+
+  memcpy(context.header, packet, size);
+  context.length = size;
+  context.payload = payload;
+  context.id_step = step;
+  ++ context.packets;
+  u32 compressed = ptr - delta;
+  memmove(packet + compressed, packet + size, payload);
+  memcpy(packet, delta, compressed);
+  frame.type = HEADER_DELTA;
+  frame.length = HEADER_LENGTH + compressed + payload;
+}
+
+// Rebuild the headers of a HEADER_DELTA frame from its context, false if the frame is malformed or
+// the headers do not match their CRC
+static bool rebuild(Context &context, Message &frame) {
+  u8 *data = frame.data, header[ROHC_MAX_HEADER];
+  const u8 *ptr = data + DELTA_FIXED, *end = data + frame.length - HEADER_LENGTH;
+  if (frame.length < HEADER_LENGTH + DELTA_FIXED + 2) {
+    return false;
+  }
+  u8 flags = data[1];
+  memcpy(header, context.header, context.length);
+  u8 *transport = header + IPV4_MIN_HEADER;
+  bool tcp = header[IPV4_PROTOCOL] == IPPROTO_TCP;
+  if (tcp && ptr < end) {
+    transport[TCP_FLAGS] = *ptr ++;
+  }
+  if (flags & DELTA_TOS_TTL) {
+    if (end - ptr < 2) {
+      return false;
+    }
+    header[IPV4_TOS] = *ptr ++;
+    header[IPV4_TTL] = *ptr ++;
+  }
+  u32 step = context.id_step;
+  if ((flags & DELTA_ID) && !get_varint(ptr, end, step)) {
+    return false;
+  }
+  store16(header + IPV4_ID, load16(header + IPV4_ID) + step);
+
+  u32 size = IPV4_MIN_HEADER + UDP_HEADER;
+  if (tcp) {
+    u32 sequence = 0, ack = 0, options_length = context.length - IPV4_MIN_HEADER - TCP_MIN_HEADER;
+    if (((flags & DELTA_SEQUENCE) && !get_varint(ptr, end, sequence)) || ((flags & DELTA_ACK) && !get_varint(ptr, end, ack))) {
+      return false;
+    }
+    store32(transport + TCP_SEQUENCE, load32(transport + TCP_SEQUENCE) + context.payload + sequence);
+    store32(transport + TCP_ACK_NUMBER, load32(transport + TCP_ACK_NUMBER) + ack);
+    if ((flags & DELTA_WINDOW) && end - ptr >= 2) {
+      memcpy(transport + TCP_WINDOW, ptr, 2);
+      ptr += 2;
+    }
+    if ((flags & DELTA_URGENT) && end - ptr >= 2) {
+      memcpy(transport + TCP_URGENT, ptr, 2);
+      ptr += 2;
+    }
+    u8 *options = transport + TCP_MIN_HEADER;
+    if ((flags & DELTA_TIMESTAMP) && (flags & DELTA_OPTIONS)) {
+      return false;
+    } else if (flags & DELTA_TIMESTAMP) {
+      u32 value, echo;
+      if (!timestamps(options, options_length) || !get_varint(ptr, end, value) || !get_varint(ptr, end, echo)) {
+        return false;
+      }
+      store32(options + 4, load32(options + 4) + value);
+      store32(options + 8, load32(options + 8) + echo);
+    } else if (flags & DELTA_OPTIONS) {
+      if (ptr == end || *ptr > TCP_MAX_OPTIONS || (*ptr & 3) || end - ptr - 1 < *ptr) {
+        return false;
+      }
+      options_length = *ptr ++;
+      memcpy(options, ptr, options_length);
+      ptr += options_length;
+    }
+    size = IPV4_MIN_HEADER + TCP_MIN_HEADER + options_length;
+    transport[TCP_OFFSET] = (u8) ((TCP_MIN_HEADER + options_length) / 4 << 4 | (transport[TCP_OFFSET] & 0x0f));
+  } else if (flags & ~(DELTA_TOS_TTL | DELTA_ID)) {
+    return false;
+  }
+  if (end - ptr < 2) {
+    return false;
+  }
+  memcpy(transport + (tcp ? TCP_CHECKSUM : UDP_CHECKSUM), ptr, 2);
+  ptr += 2;
+
+  // Lengths and the IP checksum follow from the rest
+  u32 payload = end - ptr;
+  if (size + payload > DATA_MAX_LENGTH) {
+    return false;
+  }
+  store16(header + IPV4_TOTAL_LENGTH, size + payload);
+  if (!tcp) {
+    store16(transport + UDP_LENGTH, UDP_HEADER + payload);
+  }
+  store16(header + IPV4_CHECKSUM, 0);
+  store16(header + IPV4_CHECKSUM, checksum(header, IPV4_MIN_HEADER));
+  if (crc8(header, size) != data[2]) {
+    return false;
+  }
+
+  memcpy(context.header, header, size);
+  context.length = size;
+  context.payload = payload;
+  context.id_step = (u16) step;
+  memmove(data + size, ptr, payload);
+  memcpy(data, header, size);
+  frame.length = HEADER_LENGTH + size + payload;
+  return true;
+}
+
+// Decompress a frame in place against the table, a lost context is asked for once
+static bool unpack(Table &table, Message &frame, bool &resync) {
+  resync = false;
+  if (frame.length <= HEADER_LENGTH) {
+    return false;
+  }
+  Context &context = table.contexts[frame.data[0]];
+  bool taken;
+  if (frame.type == HEADER_FULL) {
+    u32 length = frame.length - HEADER_LENGTH - 1, size = header_length(frame.data + 1, length);
+    taken = size != 0;
+    if (taken) {
+      memmove(frame.data, frame.data + 1, length);
+      memcpy(context.header, frame.data, size);
+      context.valid = true;
+      context.resync = false;
+      context.length = size;
+      context.payload = length - size;
+      context.id_step = 1;
+      frame.length -= 1;
+    }
+  } else {
+    taken = context.valid && rebuild(context, frame);
+  }
+  if (!taken) {
+    context.valid = false;
+    resync = !context.resync;
+    context.resync = true;
+    return false;
+  }
+  frame.type = NET_REPLY;
+  return true;
+}
+
+bool rohc_configure(bool enable) {
+  enabled = false;
+  if (!enable) {
+    return true;
+  }
+  rohc_contexts_sent = rohc_deltas_sent = rohc_contexts_received = rohc_deltas_received = 0;
+  rohc_resyncs_sent = rohc_resyncs_received = 0;
+  rohc_up_in = rohc_up_out = rohc_down_in = rohc_down_out = 0;
+  enabled = true;
+  return true;
+}
+
+bool rohc_enabled() {
+  return enabled;
+}
+
+void rohc_connection() {
+  ++ generation;
+}
+
+void rohc_frames(Message **frames, int count) {
+  if (!enabled) {
+    return;
+  }
+  u32 current = generation;
+  if (sender.generation != current) {
+    reset(sender, current);
+    for (auto &asked: requests) {
+      asked = false;
+    }
+  }
+  for (int i = 0; i < count; ++ i) {
+    Message &frame = *frames[i];
+    if (frame.type != NET_REQUEST) {
+      continue;
+    }
+    rohc_up_in += frame.length;
+    pack(sender, frame, requests);
+    rohc_up_out += frame.length;
+    rohc_contexts_sent += frame.type == HEADER_FULL;
+    rohc_deltas_sent += frame.type == HEADER_DELTA;
+  }
+}
+
+bool rohc_open(Message &frame, bool &resync) {
+  u32 current = generation;
+  if (receiver.generation != current) {
+    reset(receiver, current);
+  }
+  u32 length = frame.length;
+  bool delta = frame.type == HEADER_DELTA;
+  if (!unpack(receiver, frame, resync)) {
+    rohc_resyncs_sent += resync;
+    return false;
+  }
+  rohc_down_in += length;
+  rohc_down_out += frame.length;
+  rohc_contexts_received += !delta;
+  rohc_deltas_received += delta;
+  return true;
+}
+
+void rohc_resync(u8 context) {
+  requests[context & (ROHC_CONTEXTS - 1)] = true;
+  ++ rohc_resyncs_received;
+}
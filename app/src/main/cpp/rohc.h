@@ -0,0 +1,45 @@
+// Header compression of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define ROHC_CONTEXTS                256   // per direction, must be a power of 2 and at most 256
+# define ROHC_MAX_HEADER              80    // IPv4 without options and TCP with the most options
+# define ROHC_REFRESH                 256   // packets of a flow between full headers
+
+// A ROHC-like scheme for the headers of inner TCP/UDP packets (IPv4 without options or fragments).
+// Each direction keeps a context per flow (the id is a byte, from the flow hash), which a
+// HEADER_FULL frame sets up with the full packet. After that, HEADER_DELTA frames carry only what
+// the context does not predict: the IP ID unless it moved by the last step, the sequence number
+// unless it follows the last payload, the acknowledgment, window and timestamp option as deltas,
+// the TCP flags and the TCP/UDP checksum (the IP checksum and lengths are rebuilt). A CRC-8 of the
+// rebuilt headers catches a context gone stale; the receiver then drops the frame and sends
+// HEADER_RESYNC once, and the sender starts the context over. Contexts also start over on a new
+// primary connection, and every ROHC_REFRESH packets of a flow. Received frames are taken
+// whatever the setting
+
+// Statistics
+extern u32 rohc_contexts_sent, rohc_deltas_sent, rohc_contexts_received, rohc_deltas_received;
+extern u32 rohc_resyncs_sent, rohc_resyncs_received;
+extern u64 rohc_up_in, rohc_up_out, rohc_down_in, rohc_down_out; // frame bytes with full and compressed headers
+
+// Switch header compression of sent frames, before open
+bool rohc_configure(bool enabled);
+bool rohc_enabled();
+
+// A new primary connection, contexts start over both ways
+void rohc_connection();
+
+// Compress data frames in place, in sending order (writer thread)
+void rohc_frames(Message **frames, int count);
+
+// Decompress a HEADER_FULL or HEADER_DELTA frame in place, in receiving order, false if it is
+// dropped, with 'resync' set if the sender should be asked for the context again
+bool rohc_open(Message &frame, bool &resync);
+
+// The peer asked for a context again
+void rohc_resync(u8 context);
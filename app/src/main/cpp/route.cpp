@@ -0,0 +1,404 @@
+// Route table of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "packet.h"
+# include "route.h"
+
+// Native C++
+# include <arpa/inet.h>
+# include <atomic>
+# include <cerrno>
+# include <cstring>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sched.h>
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <unistd.h>
+
+# define ROUTE_MAGIC                  0x346f3652 // "4o6R"
+# define ROUTE_FILE_HEADER            8
+# define ROUTE_RECORD                 6
+# define ROUTE_TBL24                  (1 << 24)
+# define ROUTE_GROUP                  0x8000 // entry of the /24 table refers to a group
+# define ROUTE_DATAGRAM_MAX           65535
+
+// A DIR-24-8 table, mapped once and zeroed by giving its pages back before it is built again, with
+// groups mapped for as many /24s as the prefixes longer than /24 may split
+struct Table {
+  u16 *tbl24;
+  u16 *tbl8;
+  u32 capacity, groups, prefixes;
+  bool built;
+};
+
+// A flow of an app on the bypass path, its socket stands for the source port towards destinations
+struct Flow {
+  int fd;
+  u32 app_address;
+  u16 app_port;
+  bool used;
+  u64 last_us;
+};
+
+// Two slots, the send thread looks up in the installed one, and announces it in 'in_use' while it does
+static Table tables[2];
+static std::atomic<Table*> current, in_use;
+static pthread_mutex_t install_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tun_fd = -1;
+static u32 tun_mtu;
+static Flow flows[ROUTE_BYPASS_SOCKETS];
+static u8 datagram[ROUTE_DATAGRAM_MAX];
+static u16 ip_id;
+
+// Statistics
+u32 route_hits[ROUTE_ACTIONS];
+u32 route_loads, route_prefixes, route_groups;
+u32 route_bypass_up, route_bypass_down, route_bypass_tunneled, route_bypass_oversized;
+
+static u32 mask(u32 length) {
+  return length ? 0xffffffffu << (32 - length) : 0;
+}
+
+static u32 lookup(const Table &table, u32 address) {
+  u32 entry = table.tbl24[address >> 8];
+  if (entry & ROUTE_GROUP) {
+    entry = table.tbl8[(entry & ~ROUTE_GROUP) << 8 | (address & 0xff)];
+  }
+  return entry;
+}
+
+// Give the pages of the table in a slot back, the mappings stay
+static void release(Table &table) {
+  if (table.built) {
+    madvise(table.tbl24, ROUTE_TBL24 * sizeof(u16), MADV_DONTNEED);
+    if (table.tbl8) {
+      madvise(table.tbl8, table.capacity * 256 * sizeof(u16), MADV_DONTNEED);
+    }
+    table.built = false;
+  }
+}
+
+// Give the pages of the last table in the slot back, then map its /24 table the first time and its
+// groups whenever it needs more than it has, false if out of memory
+static bool prepare(Table &table, u32 groups) {
+  u32 size24 = ROUTE_TBL24 * sizeof(u16), size8 = table.capacity * 256 * sizeof(u16);
+  release(table);
+  if (table.tbl24 == nullptr) {
+    void *tbl24 = mmap(nullptr, size24, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tbl24 == MAP_FAILED) {
+      error("Failed to map a route table (%d bytes)", size24);
+      return false;
+    }
+    table.tbl24 = (u16 *) tbl24;
+  }
+  if (groups > table.capacity) {
+    if (table.tbl8) {
+      munmap(table.tbl8, size8);
+      table.tbl8 = nullptr;
+      table.capacity = 0;
+    }
+    size8 = groups * 256 * sizeof(u16);
+    void *tbl8 = mmap(nullptr, size8, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (tbl8 == MAP_FAILED) {
+      error("Failed to map the groups of a route table (%d bytes)", size8);
+      return false;
+    }
+    table.tbl8 = (u16 *) tbl8;
+    table.capacity = groups;
+  }
+  table.groups = table.prefixes = 0;
+  table.built = true;
+  return true;
+}
+
+// Fill in the prefixes shortest first, so longer ones overwrite the parts they cover, and all up to
+// /24 are in before a group copies the entry it splits, false if the groups run out
+static bool build(Table &table, const u8 *records, u32 count) {
+  for (u32 length = 0; length <= 32; ++ length) {
+    for (u32 i = 0; i < count; ++ i) {
+      const u8 *record = records + i * ROUTE_RECORD;
+      if (record[4] != length) {
+        continue;
+      }
+      u32 address = load32(record) & mask(length);
+      u16 action = record[5];
+      if (length <= 24) {
+        u32 start = address >> 8, span = 1u << (24 - length);
+        for (u32 j = 0; j < span; ++ j) {
+          table.tbl24[start + j] = action;
+        }
+        continue;
+      }
+      u16 &entry = table.tbl24[address >> 8];
+      if (!(entry & ROUTE_GROUP)) {
+        if (table.groups == table.capacity) {
+          error("Route table splits more than %d /24s", ROUTE_GROUPS);
+          return false;
+        }
+        u16 *group = table.tbl8 + table.groups * 256;
+        for (u32 j = 0; j < 256; ++ j) {
+          group[j] = entry;
+        }
+        entry = (u16) (ROUTE_GROUP | table.groups ++);
+      }
+      u16 *group = table.tbl8 + (u32) (entry & ~ROUTE_GROUP) * 256;
+      u32 start = address & 0xff, span = 1u << (32 - length);
+      for (u32 j = 0; j < span; ++ j) {
+        group[start + j] = action;
+      }
+    }
+  }
+  table.prefixes = count;
+  return true;
+}
+
+// The file mapped read only, after its header and records have been checked, nullptr if refused
+static const u8* map_file(const char *path, u32 &count, u32 &size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat info;
+  if (fd == -1 || fstat(fd, &info) != 0 || info.st_size < ROUTE_FILE_HEADER || info.st_size > 0x7fffffff) {
+    error("Failed to open the route table at %s", path);
+    if (fd != -1) {
+      close(fd);
+    }
+    return nullptr;
+  }
+  size = (u32) info.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    error("Failed to map the route table at %s (%d bytes)", path, size);
+    return nullptr;
+  }
+  const u8 *file = (const u8 *) mapped;
+  count = load32(file + 4);
+  bool valid = load32(file) == ROUTE_MAGIC && count <= (size - ROUTE_FILE_HEADER) / ROUTE_RECORD
+    && size == ROUTE_FILE_HEADER + count * ROUTE_RECORD;
+  for (u32 i = 0; valid && i < count; ++ i) {
+    const u8 *record = file + ROUTE_FILE_HEADER + i * ROUTE_RECORD;
+    valid = record[4] <= 32 && record[5] < ROUTE_ACTIONS;
+  }
+  if (!valid) {
+    error("Route table at %s malformed", path);
+    munmap(mapped, size);
+    return nullptr;
+  }
+  return file;
+}
+
+bool route_load(const char *path) {
+  pthread_mutex_lock(&install_lock);
+  Table *old = current.load();
+  Table *table = nullptr;
+  if (path && *path) {
+    u32 count, size;
+    const u8 *file = map_file(path, count, size);
+    if (file == nullptr) {
+      pthread_mutex_unlock(&install_lock);
+      return false;
+    }
+    const u8 *records = file + ROUTE_FILE_HEADER;
+
+    // Each prefix longer than /24 splits one /24 at most
+    u32 groups = 0;
+    for (u32 i = 0; i < count; ++ i) {
+      groups += records[i * ROUTE_RECORD + 4] > 24;
+    }
+    groups = groups < ROUTE_GROUPS ? groups : ROUTE_GROUPS;
+
+    // The slot the send thread has left, see below
+    table = old == &tables[0] ? &tables[1] : &tables[0];
+    bool built = prepare(*table, groups) && build(*table, records, count);
+    munmap((void *) file, size);
+    if (!built) {
+      pthread_mutex_unlock(&install_lock);
+      return false;
+    }
+  }
+
+  // Swap, then wait for the send thread to leave the old table before its slot may be rebuilt
+  current.store(table);
+  while (old && in_use.load() == old) {
+    sched_yield();
+  }
+  if (table == nullptr && old) {
+    release(*old);
+  }
+  memset(route_hits, 0, sizeof(route_hits));
+  route_loads += table != nullptr;
+  route_prefixes = table ? table -> prefixes : 0;
+  route_groups = table ? table -> groups : 0;
+  pthread_mutex_unlock(&install_lock);
+  return true;
+}
+
+bool route_enabled() {
+  return current.load() != nullptr;
+}
+
+u32 route_lookup(u32 address) {
+  Table *table = current.load(std::memory_order_acquire);
+  if (table == nullptr) {
+    return ROUTE_TUNNEL;
+  }
+
+  // Announce the table, then make sure it was not swapped meanwhile, or the installer may miss it
+  in_use.store(table);
+  for (Table *now; (now = current.load()) != table; table = now) {
+    in_use.store(now);
+    if (now == nullptr) {
+      return ROUTE_TUNNEL;
+    }
+  }
+  u32 action = lookup(*table, address);
+  in_use.store(nullptr, std::memory_order_release);
+  return action;
+}
+
+void route_start(int tun, u32 mtu, void (*protect)(int fd)) {
+  tun_fd = tun;
+  tun_mtu = mtu < ROUTE_DATAGRAM_MAX ? mtu : ROUTE_DATAGRAM_MAX;
+  for (Flow &flow: flows) {
+    flow = Flow();
+    flow.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (flow.fd != -1) {
+      protect(flow.fd);
+    }
+  }
+  route_bypass_up = route_bypass_down = route_bypass_tunneled = route_bypass_oversized = 0;
+}
+
+void route_stop() {
+  for (Flow &flow: flows) {
+    if (flow.fd != -1) {
+      close(flow.fd);
+      flow.fd = -1;
+    }
+  }
+  tun_fd = -1;
+}
+
+// The flow of an app port, a socket no flow has used for ROUTE_BYPASS_IDLE taken over for it, nullptr if
+// all are busy
+static Flow* flow_of(u32 app_address, u16 app_port, u64 now) {
+  Flow *idle = nullptr;
+  for (Flow &flow: flows) {
+    if (flow.fd == -1) {
+      continue;
+    }
+    if (flow.used && flow.app_address == app_address && flow.app_port == app_port) {
+      return &flow;
+    }
+    if (!flow.used || now - flow.last_us > ROUTE_BYPASS_IDLE * 1000000ull) {
+      if (idle == nullptr || (idle -> used && (!flow.used || flow.last_us < idle -> last_us))) {
+        idle = &flow;
+      }
+    }
+  }
+  if (idle) {
+    // Replies still on the way to the last flow are not for this one
+    while (recv(idle -> fd, datagram, ROUTE_DATAGRAM_MAX, MSG_DONTWAIT) >= 0);
+    idle -> app_address = app_address;
+    idle -> app_port = app_port;
+    idle -> used = true;
+  }
+  return idle;
+}
+
+bool route_input(const u8 *packet, u32 length) {
+  if (!is_ipv4(packet, length) || current.load(std::memory_order_relaxed) == nullptr) {
+    return false;
+  }
+  u32 action = route_lookup(load32(packet + IPV4_DESTINATION));
+  ++ route_hits[action];
+  if (action == ROUTE_DROP) {
+    return true;
+  }
+  if (action != ROUTE_BYPASS) {
+    return false;
+  }
+
+  // Whole datagrams only, fragments are left to the tunnel as they can not be relayed one by one
+  const u8 *udp = transport_header(packet, length, IPPROTO_UDP, UDP_HEADER);
+  u32 header = ipv4_header_length(packet), total = load16(packet + IPV4_TOTAL_LENGTH);
+  Flow *flow = nullptr;
+  if (udp && !(load16(packet + IPV4_FRAGMENT) & IPV4_MORE_FRAGMENTS) && total <= length
+    && load16(udp + UDP_LENGTH) >= UDP_HEADER && header + load16(udp + UDP_LENGTH) <= total) {
+    u64 now = now_us();
+    flow = flow_of(load32(packet + IPV4_SOURCE), load16(udp), now);
+    if (flow) {
+      flow -> last_us = now;
+    }
+  }
+  if (flow == nullptr) {
+    ++ route_bypass_tunneled;
+    return false;
+  }
+  sockaddr_in destination = {};
+  destination.sin_family = AF_INET;
+  destination.sin_port = htons(load16(udp + TRANSPORT_DESTINATION));
+  destination.sin_addr.s_addr = htonl(load32(packet + IPV4_DESTINATION));
+  sendto(flow -> fd, udp + UDP_HEADER, load16(udp + UDP_LENGTH) - UDP_HEADER, MSG_DONTWAIT | MSG_NOSIGNAL,
+    (sockaddr *) &destination, sizeof(sockaddr_in));
+  ++ route_bypass_up;
+  return true;
+}
+
+int route_poll(pollfd *fds) {
+  if (tun_fd == -1) {
+    return 0;
+  }
+  for (int i = 0; i < ROUTE_BYPASS_SOCKETS; ++ i) {
+    fds[i] = {flows[i].used ? flows[i].fd : -1, POLLIN, 0};
+  }
+  return ROUTE_BYPASS_SOCKETS;
+}
+
+void route_serve(const pollfd *fds, int count) {
+  for (int i = 0; i < count; ++ i) {
+    Flow &flow = flows[i];
+    if (!(fds[i].revents & POLLIN) || !flow.used) {
+      continue;
+    }
+    sockaddr_in source;
+    socklen_t source_length = sizeof(sockaddr_in);
+    u8 *packet = datagram, *udp = packet + IPV4_MIN_HEADER;
+    ssize_t payload;
+    while ((payload = recvfrom(flow.fd, udp + UDP_HEADER, ROUTE_DATAGRAM_MAX - IPV4_MIN_HEADER - UDP_HEADER,
+      MSG_DONTWAIT | MSG_TRUNC, (sockaddr *) &source, &source_length)) >= 0) {
+      flow.last_us = now_us();
+      source_length = sizeof(sockaddr_in);
+
+      // A reply the tun MTU does not take would not have come through the tunnel in one piece either
+      u32 total = IPV4_MIN_HEADER + UDP_HEADER + (u32) payload;
+      if (total > tun_mtu) {
+        ++ route_bypass_oversized;
+        continue;
+      }
+
+      // From the destination to the app, as if the reply had come through the tunnel
+      memset(packet, 0, IPV4_MIN_HEADER + UDP_HEADER);
+      packet[0] = 0x45;
+      store16(packet + IPV4_TOTAL_LENGTH, (u16) total);
+      store16(packet + IPV4_ID, ip_id ++);
+      packet[IPV4_TTL] = IPV4_DEFAULT_TTL;
+      packet[IPV4_PROTOCOL] = IPPROTO_UDP;
+      store32(packet + IPV4_SOURCE, ntohl(source.sin_addr.s_addr));
+      store32(packet + IPV4_DESTINATION, flow.app_address);
+      store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+      store16(udp, ntohs(source.sin_port));
+      store16(udp + TRANSPORT_DESTINATION, flow.app_port);
+      store16(udp + UDP_LENGTH, (u16) (UDP_HEADER + payload));
+      u16 sum = transport_checksum(packet);
+      store16(udp + UDP_CHECKSUM, sum ? sum : 0xffff);
+      if (write(tun_fd, packet, total) != (ssize_t) total) {
+        debug("Failed to write a bypassed reply to tun");
+      }
+      ++ route_bypass_down;
+    }
+  }
+}
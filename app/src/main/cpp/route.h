@@ -0,0 +1,69 @@
+// Route table of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Native C++
+# include <poll.h>
+
+// Parameters
+# define ROUTE_GROUPS                 16384 // /24s that prefixes longer than /24 may split, per table
+# define ROUTE_BYPASS_SOCKETS         16    // flows on the bypass path at once, more go through the tunnel
+# define ROUTE_BYPASS_IDLE            60    // s, a flow keeps its socket at least this long
+
+// Actions, what becomes of a packet to a prefix
+# define ROUTE_TUNNEL                 0     // to the server, without a route as well
+# define ROUTE_BYPASS                 1     // UDP goes out of the VPN through a protected socket
+# define ROUTE_DROP                   2
+# define ROUTE_ACTIONS                3
+
+// Route table: the longest prefix that matches the destination of a packet read from tun decides
+// its action. Prefixes come from a file of 8 bytes "4o6R" and a count, then 6 bytes per prefix (the
+// address, the length and the action, big endian), which is mapped and turned into a DIR-24-8 table:
+// 2^24 entries for the /24s, and groups of 256 entries for the /24s that longer prefixes split, so
+// a lookup takes one memory access, or two in split /24s, however many prefixes there are. Entries
+// that no prefix covers stay zero and never take memory. Each of the two slots maps 32 MBytes for
+// the /24s and 512 bytes per prefix longer than /24 for groups (at most 8 MBytes), up to 80 MBytes
+// of address space in all. The mappings are not reserved, so only the pages entries are written to
+// take memory: 2 bytes per /24 a prefix covers (32 MBytes with a default route) and the groups in
+// use. A slot gives its pages back when it is built again or the table is removed. Tables swap at
+// any time as filters do.
+// Bypassed UDP is relayed through sockets protected from the VPN, one per source port of an app, and
+// their replies are written to tun from the destination. Other packets to a bypassed prefix go
+// through the tunnel, since terminating them would take a stack of their own. There is one server
+// connection, so an action naming another would have nothing to steer to
+
+// Statistics
+extern u32 route_hits[ROUTE_ACTIONS];
+extern u32 route_loads, route_prefixes, route_groups;
+extern u32 route_bypass_up, route_bypass_down, route_bypass_tunneled;
+extern u32 route_bypass_oversized; // replies dropped as larger than the tun MTU
+
+// Map, check and install the table in 'path' (nullptr or empty to remove it), any time, returns false
+// if the file is refused and keeps the table installed then
+bool route_load(const char *path);
+
+bool route_enabled();
+
+// Action for a destination (host order, send thread)
+u32 route_lookup(u32 address);
+
+// Open the sockets of the bypass path for a session on 'tun' of 'mtu' bytes, each passed to 'protect'
+// so it leaves the VPN (before the threads start), and close them after
+void route_start(int tun, u32 mtu, void (*protect)(int fd));
+void route_stop();
+
+// Steer a packet read from tun (send thread), returns false if it goes through the tunnel, otherwise
+// it has been dropped or relayed on the bypass path
+bool route_input(const u8 *packet, u32 length);
+
+// Fill 'fds' with the bypass sockets the send thread polls, returns the number of entries (at most
+// ROUTE_BYPASS_SOCKETS)
+int route_poll(pollfd *fds);
+
+// Write the replies on the entries route_poll filled to tun once poll returns, dropping those the tun
+// MTU does not take (send thread)
+void route_serve(const pollfd *fds, int count);
@@ -0,0 +1,112 @@
+// Traffic shaper of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "packet.h"
+# include "shaper.h"
+
+// Native C++
+# include <errno.h>
+# include <poll.h>
+# include <pthread.h>
+
+// Token bucket, tokens are kept in byte-microseconds so refills do not lose precision
+struct Bucket {
+  u32 rate, burst;
+  i64 tokens;
+  u64 last_us;
+};
+
+static Bucket buckets[SHAPER_DIRECTIONS][SHAPER_TIERS];
+static pthread_mutex_t shaper_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 shaper_delayed[SHAPER_DIRECTIONS];
+u64 shaper_delay_us[SHAPER_DIRECTIONS];
+
+static void refill(Bucket &bucket, u64 now) {
+  i64 full = (i64) bucket.burst * 1000000;
+  bucket.tokens += (i64) (now - bucket.last_us) * bucket.rate;
+  bucket.tokens = bucket.tokens > full ? full : bucket.tokens;
+  bucket.last_us = now;
+}
+
+// Microseconds until the bucket has tokens again
+static u64 bucket_delay(Bucket &bucket, u64 now) {
+  if (bucket.rate == 0) {
+    return 0;
+  }
+  refill(bucket, now);
+  return bucket.tokens > 0 ? 0 : (u64) -bucket.tokens / bucket.rate + 1;
+}
+
+void shaper_init() {
+  u64 now = now_us();
+  pthread_mutex_lock(&shaper_lock);
+  for (auto &direction: buckets) {
+    for (Bucket &bucket: direction) {
+      bucket.tokens = (i64) bucket.burst * 1000000;
+      bucket.last_us = now;
+    }
+  }
+  for (int i = 0; i < SHAPER_DIRECTIONS; ++ i) {
+    shaper_delayed[i] = 0;
+    shaper_delay_us[i] = 0;
+  }
+  pthread_mutex_unlock(&shaper_lock);
+}
+
+void shaper_configure(int direction, int tier, u32 rate, u32 burst) {
+  if (direction < 0 || direction >= SHAPER_DIRECTIONS || tier < 0 || tier >= SHAPER_TIERS) {
+    error("Invalid shaper direction %d or tier %d", direction, tier);
+    return;
+  }
+  pthread_mutex_lock(&shaper_lock);
+  Bucket &bucket = buckets[direction][tier];
+  refill(bucket, now_us());
+  bucket.rate = rate;
+  bucket.burst = burst < SHAPER_MIN_BURST ? SHAPER_MIN_BURST : burst;
+  if (bucket.tokens > (i64) bucket.burst * 1000000) {
+    bucket.tokens = (i64) bucket.burst * 1000000;
+  }
+  pthread_mutex_unlock(&shaper_lock);
+}
+
+u32 shaper_rate(int direction, int tier) {
+  return buckets[direction][tier].rate;
+}
+
+int shaper_tier(const u8 *packet, u32 length) {
+  return packet_class(packet, length) == PACKET_BULK ? SHAPER_BULK : SHAPER_PRIORITY;
+}
+
+u64 shaper_delay(int direction, int tier) {
+  u64 now = now_us();
+  pthread_mutex_lock(&shaper_lock);
+  u64 delay = bucket_delay(buckets[direction][SHAPER_TOTAL], now);
+  u64 own = bucket_delay(buckets[direction][tier], now);
+  pthread_mutex_unlock(&shaper_lock);
+  delay = own > delay ? own : delay;
+  return delay > SHAPER_MAX_SLEEP ? SHAPER_MAX_SLEEP : delay;
+}
+
+bool shaper_sleep(int direction, u64 delay, int wake, int shutdown) {
+  u64 start = now_us();
+  pollfd fds[2] = {{shutdown, POLLIN, 0}, {wake, POLLIN, 0}};
+  timespec timeout = {(time_t) (delay / 1000000), (long) (delay % 1000000) * 1000};
+  int ready = ppoll(fds, 2, &timeout, nullptr);
+  ++ shaper_delayed[direction];
+  shaper_delay_us[direction] += now_us() - start;
+  return !(ready < 0 && errno != EINTR) && !(ready > 0 && fds[0].revents);
+}
+
+void shaper_consume(int direction, int tier, u32 bytes) {
+  pthread_mutex_lock(&shaper_lock);
+  Bucket *charged[2] = {&buckets[direction][SHAPER_TOTAL], &buckets[direction][tier]};
+  for (Bucket *bucket: charged) {
+    if (bucket -> rate) {
+      bucket -> tokens -= (i64) bytes * 1000000;
+    }
+  }
+  pthread_mutex_unlock(&shaper_lock);
+}
@@ -0,0 +1,45 @@
+// Traffic shaper of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define SHAPER_UP                    0     // tun to socket, shaped by the writer
+# define SHAPER_DOWN                  1     // socket to tun, shaped by recv_thread
+# define SHAPER_DIRECTIONS            2
+# define SHAPER_TOTAL                 0
+# define SHAPER_PRIORITY              1     // TCP control, DNS and small packets
+# define SHAPER_BULK                  2
+# define SHAPER_TIERS                 3
+# define SHAPER_MIN_BURST             4096  // bytes, a bucket always holds at least a full frame
+# define SHAPER_MAX_SLEEP             20000 // us, sleeps are cut so a new configuration applies soon
+
+// Each direction has a token bucket for the total and one per tier, a packet is sent once both its
+// tier and the total have tokens left, and its size is charged to both afterwards (buckets may go
+// into debt by one packet). Rates are in bytes per second on the monotonic clock, 0 is unlimited
+
+// Statistics
+extern u32 shaper_delayed[SHAPER_DIRECTIONS]; // times a packet had to wait
+extern u64 shaper_delay_us[SHAPER_DIRECTIONS]; // total time waited
+
+// Refill all buckets, configuration is kept across sessions
+void shaper_init();
+
+// Set the rate and bucket size of one tier (or SHAPER_TOTAL), any thread, any time
+void shaper_configure(int direction, int tier, u32 rate, u32 burst);
+u32 shaper_rate(int direction, int tier);
+
+// Tier of an inner IPv4 packet
+int shaper_tier(const u8 *packet, u32 length);
+
+// Microseconds until 'tier' may send (0 now), capped by SHAPER_MAX_SLEEP
+u64 shaper_delay(int direction, int tier);
+
+// Sleep for a delay, returns early once 'wake' is readable (if not -1) and false once 'shutdown' is
+bool shaper_sleep(int direction, u64 delay, int wake, int shutdown);
+
+// Charge a sent packet
+void shaper_consume(int direction, int tier, u32 bytes);
@@ -0,0 +1,569 @@
+// Split TCP of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "packet.h"
+# include "queue.h"
+# include "stream.h"
+# include "timer.h"
+# include "writer.h"
+
+// Native C++
+# include <cstring>
+# include <pthread.h>
+# include <sys/mman.h>
+# include <unistd.h>
+
+# define STREAM_BUCKETS               (STREAM_MAX * 2)
+# define STREAM_WINDOW_MAX            65535 // no window scaling
+# define STREAM_SEGMENT_MAX           (IPV4_MIN_HEADER + TCP_MIN_HEADER + TCP_OPTION_MSS_LENGTH + STREAM_MSS)
+
+# define STATE_FREE                   0
+# define STATE_SYN_RECEIVED           1     // SYN-ACK sent, the app has not acknowledged it yet
+# define STATE_ESTABLISHED            2
+
+// A terminated connection, 'app' is the side on tun and 'peer' the destination it connected to
+struct Stream {
+  u32 id;
+  u8 state;
+  int chain;                  // next stream in the bucket, -1 at the end
+  u32 app_address, peer_address;
+  u16 app_port, peer_port;
+  u32 app_mss;
+
+  // Upstream, bytes of the app are taken as long as the server has credit for them
+  u32 receive_next;
+  u32 up_credit;
+  u32 advertised;             // window in the last segment to the app
+  u32 window_edge;            // sequence number that window ends at, bytes before it are always taken
+  bool up_closed;
+
+  // Downstream, bytes of the server from 'send_una' on, 'buffered' of them in the ring
+  u32 iss, send_una, send_next;
+  u32 buffered;
+  u32 app_window;
+  u32 down_credit;            // bytes the app took that have not been credited to the server yet
+  bool down_closed, fin_sent, filled;
+  u64 progress_us;            // last time the app acknowledged anything, or sending started
+  u32 retries;
+};
+
+static bool enabled;
+static int tun_fd = -1;
+static Stream streams[STREAM_MAX];
+static int buckets[STREAM_BUCKETS];
+alignas(4096) static u8 buffers[STREAM_MAX][STREAM_BUFFER]; // pages given back once a stream closes
+static u32 serial;
+static u16 ip_id;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static void tick_fire(Timer *timer);
+static Timer tick = {tick_fire};
+
+// Statistics
+u32 stream_opened, stream_passed, stream_reset, stream_retransmitted, stream_deferred;
+u32 stream_active;
+u64 stream_up_bytes, stream_down_bytes;
+
+static u32 bucket_of(u32 app_address, u16 app_port, u32 peer_address, u16 peer_port) {
+  u32 hash = app_address * 2654435761u ^ peer_address * 0x85ebca6bu ^ ((u32) app_port << 16 | peer_port);
+  hash ^= hash >> 15;
+  hash *= 0x2c1b3c6du;
+  hash ^= hash >> 12;
+  return hash & (STREAM_BUCKETS - 1);
+}
+
+static Stream* find(const u8 *packet, const u8 *tcp) {
+  u32 app_address = load32(packet + IPV4_SOURCE), peer_address = load32(packet + IPV4_DESTINATION);
+  u16 app_port = load16(tcp), peer_port = load16(tcp + TRANSPORT_DESTINATION);
+  for (int slot = buckets[bucket_of(app_address, app_port, peer_address, peer_port)]; slot != -1; slot = streams[slot].chain) {
+    Stream &stream = streams[slot];
+    if (stream.app_address == app_address && stream.peer_address == peer_address
+      && stream.app_port == app_port && stream.peer_port == peer_port) {
+      return &stream;
+    }
+  }
+  return nullptr;
+}
+
+static void release(Stream &stream) {
+  int slot = (int) (&stream - streams);
+  int *link = &buckets[bucket_of(stream.app_address, stream.app_port, stream.peer_address, stream.peer_port)];
+  while (*link != slot) {
+    link = &streams[*link].chain;
+  }
+  *link = stream.chain;
+  if (stream.filled) {
+    madvise(buffers[slot], STREAM_BUFFER, MADV_DONTNEED);
+  }
+  stream.state = STATE_FREE;
+  -- stream_active;
+}
+
+static void schedule() {
+  if (!timer_pending(&tick)) {
+    timer_schedule(&tick, STREAM_TICK);
+  }
+}
+
+// Window for the app: the credit of the stream, within its share of the room for stream frames in
+// the writer queue
+static u32 window(const Stream &stream) {
+  u32 queued = queue_stream_frames;
+  u32 room = queued < QUEUE_STREAM_FRAMES ? (QUEUE_STREAM_FRAMES - queued) * STREAM_MSS / stream_active : 0;
+  u32 size = stream.up_credit < room ? stream.up_credit : room;
+  return size < STREAM_WINDOW_MAX ? size : STREAM_WINDOW_MAX;
+}
+
+// Window to advertise: its edge never moves back, and moves on by whole segments only, or the app
+// would cut its segments to the gap and spend a stream frame on each piece (silly window, RFC 1122)
+static u32 offer(const Stream &stream) {
+  u32 edge = stream.receive_next + (stream.up_closed ? 0 : window(stream));
+  if ((int) (edge - stream.window_edge) < STREAM_MSS) {
+    edge = (int) (stream.window_edge - stream.receive_next) > 0 ? stream.window_edge : stream.receive_next;
+  }
+  return edge - stream.receive_next;
+}
+
+// Write a segment to the app, with 'length' bytes of the ring from 'sequence' on
+static void emit(Stream &stream, u8 flags, u32 sequence, u32 length) {
+  u8 segment[STREAM_SEGMENT_MAX];
+  u32 options = (flags & TCP_SYN) ? TCP_OPTION_MSS_LENGTH : 0;
+  u32 total = IPV4_MIN_HEADER + TCP_MIN_HEADER + options + length;
+  memset(segment, 0, IPV4_MIN_HEADER + TCP_MIN_HEADER);
+  segment[0] = 0x45;
+  store16(segment + IPV4_TOTAL_LENGTH, (u16) total);
+  store16(segment + IPV4_ID, ip_id ++);
+  store16(segment + IPV4_FRAGMENT, IPV4_DONT_FRAGMENT);
+  segment[IPV4_TTL] = IPV4_DEFAULT_TTL;
+  segment[IPV4_PROTOCOL] = IPPROTO_TCP;
+  store32(segment + IPV4_SOURCE, stream.peer_address);
+  store32(segment + IPV4_DESTINATION, stream.app_address);
+  store16(segment + IPV4_CHECKSUM, checksum(segment, IPV4_MIN_HEADER));
+
+  u8 *tcp = segment + IPV4_MIN_HEADER;
+  store16(tcp, stream.peer_port);
+  store16(tcp + TRANSPORT_DESTINATION, stream.app_port);
+  store32(tcp + TCP_SEQUENCE, sequence);
+  store32(tcp + TCP_ACK_NUMBER, stream.receive_next);
+  tcp[TCP_OFFSET] = (u8) ((TCP_MIN_HEADER + options) / 4 << 4);
+  tcp[TCP_FLAGS] = flags;
+  stream.advertised = offer(stream);
+  stream.window_edge = stream.receive_next + stream.advertised;
+  store16(tcp + TCP_WINDOW, (u16) stream.advertised);
+  if (options) {
+    tcp[TCP_MIN_HEADER] = TCP_OPTION_MSS;
+    tcp[TCP_MIN_HEADER + 1] = TCP_OPTION_MSS_LENGTH;
+    store16(tcp + TCP_MIN_HEADER + 2, STREAM_MSS);
+  }
+  if (length) {
+    const u8 *ring = buffers[&stream - streams];
+    u32 offset = (sequence - stream.iss - 1) & (STREAM_BUFFER - 1);
+    u32 first = length < STREAM_BUFFER - offset ? length : STREAM_BUFFER - offset;
+    memcpy(tcp + TCP_MIN_HEADER + options, ring + offset, first);
+    memcpy(tcp + TCP_MIN_HEADER + options + first, ring, length - first);
+  }
+  store16(tcp + TCP_CHECKSUM, transport_checksum(segment));
+  if (write(tun_fd, segment, total) != (ssize_t) total) {
+    debug("Failed to write a segment of stream %d to tun", stream.id);
+  }
+}
+
+// Send what the app has room for, then the FIN once the server closed and all is sent, returns
+// whether anything was sent (the ACK goes with it)
+static bool push(Stream &stream) {
+  if (stream.state != STATE_ESTABLISHED) {
+    return false;
+  }
+  bool idle = stream.send_next == stream.send_una, sent = false;
+  while (!stream.fin_sent) {
+    u32 in_flight = stream.send_next - stream.send_una;
+    if (in_flight >= stream.buffered || in_flight >= stream.app_window) {
+      break;
+    }
+    u32 size = stream.buffered - in_flight;
+    size = size < stream.app_window - in_flight ? size : stream.app_window - in_flight;
+    size = size < stream.app_mss ? size : stream.app_mss;
+    emit(stream, TCP_ACK | (size == stream.buffered - in_flight ? TCP_PSH : 0), stream.send_next, size);
+    stream.send_next += size;
+    sent = true;
+  }
+  if (stream.down_closed && !stream.fin_sent && stream.send_next - stream.send_una == stream.buffered) {
+    emit(stream, TCP_FIN | TCP_ACK, stream.send_next, 0);
+    ++ stream.send_next;
+    stream.fin_sent = true;
+    sent = true;
+  }
+  if (sent) {
+    stream.progress_us = idle ? now_us() : stream.progress_us;
+    schedule();
+  }
+  return sent;
+}
+
+// Credit the server with the bytes the app took, false if the control queue is full
+static bool credit(Stream &stream) {
+  Message frame = {HEADER_LENGTH + STREAM_ID_LENGTH + sizeof(u32), STREAM_WINDOW};
+  store32(frame.data, stream.id);
+  store32(frame.data + STREAM_ID_LENGTH, stream.down_credit);
+  if (!writer_control(frame)) {
+    return false;
+  }
+  stream.down_credit = 0;
+  return true;
+}
+
+// Give a stream up on both ends (any thread)
+static void reset(Stream &stream) {
+  emit(stream, TCP_RST | TCP_ACK, stream.send_next, 0);
+  Message frame = {HEADER_LENGTH + STREAM_ID_LENGTH + 1, STREAM_CLOSE};
+  store32(frame.data, stream.id);
+  frame.data[STREAM_ID_LENGTH] = STREAM_RESET;
+  writer_control(frame);
+  ++ stream_reset;
+  release(stream);
+}
+
+// STREAM_CLOSE behind the data of the stream (send thread)
+static void close_frame(const Stream &stream, u8 reason) {
+  Message *frame = writer_reserve();
+  frame -> length = HEADER_LENGTH + STREAM_ID_LENGTH + 1;
+  frame -> type = STREAM_CLOSE;
+  store32(frame -> data, stream.id);
+  frame -> data[STREAM_ID_LENGTH] = reason;
+  writer_commit(frame);
+}
+
+static u32 option_mss(const u8 *tcp) {
+  const u8 *option = tcp + TCP_MIN_HEADER, *end = tcp + (tcp[TCP_OFFSET] >> 4) * 4;
+  while (option < end && *option != TCP_OPTION_END) {
+    if (*option == TCP_OPTION_NOP) {
+      ++ option;
+      continue;
+    }
+    if (option + 1 >= end || option[1] < 2) {
+      break;
+    }
+    if (*option == TCP_OPTION_MSS && option[1] == TCP_OPTION_MSS_LENGTH && option + TCP_OPTION_MSS_LENGTH <= end) {
+      u32 mss = load16(option + 2);
+      return mss < STREAM_MSS ? mss : STREAM_MSS;
+    }
+    option += option[1];
+  }
+  return STREAM_APP_MSS;
+}
+
+// A new stream for a SYN of the app, nullptr if all are taken
+static Stream* accept(const u8 *packet, const u8 *tcp) {
+  int slot = 0;
+  while (slot < STREAM_MAX && streams[slot].state != STATE_FREE) {
+    ++ slot;
+  }
+  if (slot == STREAM_MAX) {
+    return nullptr;
+  }
+  Stream &stream = streams[slot];
+  stream = Stream();
+  stream.id = (++ serial * STREAM_MAX + slot) & ~STREAM_PROXIED;
+  stream.state = STATE_SYN_RECEIVED;
+  stream.app_address = load32(packet + IPV4_SOURCE);
+  stream.peer_address = load32(packet + IPV4_DESTINATION);
+  stream.app_port = load16(tcp);
+  stream.peer_port = load16(tcp + TRANSPORT_DESTINATION);
+  stream.app_mss = option_mss(tcp);
+  u32 bucket = bucket_of(stream.app_address, stream.app_port, stream.peer_address, stream.peer_port);
+  stream.chain = buckets[bucket];
+  buckets[bucket] = slot;
+
+  // The SYN takes a sequence number on either side, so data starts right after the ISS
+  stream.receive_next = stream.window_edge = load32(tcp + TCP_SEQUENCE) + 1;
+  stream.up_credit = STREAM_WINDOW_INITIAL;
+  stream.iss = (u32) now_us() * 2654435761u ^ stream.id * 0x9e3779b9u;
+  stream.send_una = stream.send_next = stream.iss + 1;
+  stream.app_window = load16(tcp + TCP_WINDOW);
+  stream.progress_us = now_us();
+  ++ stream_opened;
+  ++ stream_active;
+  return &stream;
+}
+
+// Take an acknowledgement of the app
+static void acknowledge(Stream &stream, u32 ack, u32 window) {
+  stream.app_window = window;
+  u32 acked = ack - stream.send_una;
+  if (acked == 0 || acked > stream.send_next - stream.send_una) {
+    return;
+  }
+  u32 data = acked < stream.buffered ? acked : stream.buffered; // the rest is the FIN
+  stream.buffered -= data;
+  stream.down_credit += data;
+  stream.send_una = ack;
+  stream.progress_us = now_us();
+  stream.retries = 0;
+}
+
+// A segment of the app on its stream, returns whether the message was committed as STREAM_DATA
+static bool segment(Stream &stream, Message *message, const u8 *tcp, u32 headers, u32 payload) {
+  u8 flags = tcp[TCP_FLAGS];
+  u32 sequence = load32(tcp + TCP_SEQUENCE);
+  if (flags & TCP_RST) {
+    close_frame(stream, STREAM_RESET);
+    ++ stream_reset;
+    release(stream);
+    return false;
+  }
+  if (flags & TCP_SYN) {
+    // The SYN again, the SYN-ACK is late
+    if (stream.state == STATE_SYN_RECEIVED) {
+      emit(stream, TCP_SYN | TCP_ACK, stream.iss, 0);
+    } else {
+      emit(stream, TCP_ACK, stream.send_next, 0);
+    }
+    return false;
+  }
+  if (!(flags & TCP_ACK)) {
+    return false;
+  }
+  u32 ack = load32(tcp + TCP_ACK_NUMBER);
+  if (stream.state == STATE_SYN_RECEIVED) {
+    if (ack != stream.iss + 1) {
+      return false;
+    }
+    stream.state = STATE_ESTABLISHED;
+    stream.retries = 0;
+  }
+  acknowledge(stream, ack, load16(tcp + TCP_WINDOW));
+
+  // An old sequence number without data is a window probe, it is answered like an old segment
+  bool committed = false, reply = !payload && sequence != stream.receive_next;
+  if (payload) {
+    reply = true;
+    if (sequence != stream.receive_next || stream.up_closed) {
+      // Out of order or again, the ACK tells the app where to go on from
+    } else if ((int) (sequence + payload - stream.window_edge) > 0
+      && (payload > stream.up_credit || queue_stream_frames >= QUEUE_STREAM_FRAMES)) {
+      // Beyond the window and without room, a dropped segment would make the app back off
+      ++ stream_deferred;
+      schedule();
+    } else {
+      // The payload moves down in place to follow the stream id
+      u8 *data = message -> data;
+      memmove(data + STREAM_ID_LENGTH, data + headers, payload);
+      store32(data, stream.id);
+      message -> type = STREAM_DATA;
+      message -> length = HEADER_LENGTH + STREAM_ID_LENGTH + payload;
+      writer_commit(message);
+      committed = true;
+      stream.receive_next += payload;
+      stream.up_credit -= payload;
+      stream_up_bytes += payload;
+    }
+  }
+  if ((flags & TCP_FIN) && !stream.up_closed && sequence + payload == stream.receive_next) {
+    ++ stream.receive_next;
+    stream.up_closed = true;
+    close_frame(stream, STREAM_FIN);
+    reply = true;
+  }
+
+  if (stream.down_credit >= STREAM_CREDIT_STEP && !credit(stream)) {
+    schedule();
+  }
+  if (push(stream)) {
+    reply = false;
+  }
+  if (reply) {
+    emit(stream, TCP_ACK, stream.send_next, 0);
+  }
+  if (!stream.up_closed && stream.advertised < STREAM_MSS && stream.up_credit >= STREAM_MSS) {
+    // Closed for room in the writer queue, the tick opens it again
+    schedule();
+  }
+  if (stream.up_closed && stream.fin_sent && stream.send_una == stream.send_next) {
+    release(stream);
+  }
+  return committed;
+}
+
+// Retransmissions to the app, window probes and updates, and credit the control queue had no room for
+static void tick_fire(Timer *timer) {
+  pthread_mutex_lock(&stream_lock);
+  u64 now = now_us();
+  bool due = false;
+  for (Stream &stream: streams) {
+    if (stream.state == STATE_FREE) {
+      continue;
+    }
+    bool waiting = stream.state == STATE_SYN_RECEIVED || stream.send_next != stream.send_una;
+    bool blocked = !waiting && stream.buffered && stream.app_window == 0;
+    if ((waiting || blocked) && now - stream.progress_us >= (u64) STREAM_RTO * 1000 << stream.retries) {
+      if (waiting && stream.retries == STREAM_RETRIES) {
+        debug("Stream %d given up after %d retransmissions", stream.id, STREAM_RETRIES);
+        reset(stream);
+        continue;
+      }
+      stream.progress_us = now;
+      stream.retries += stream.retries < STREAM_RETRIES;
+      ++ stream_retransmitted;
+      if (stream.state == STATE_SYN_RECEIVED) {
+        emit(stream, TCP_SYN | TCP_ACK, stream.iss, 0);
+      } else if (waiting) {
+        // Go back to the first byte not acknowledged
+        stream.send_next = stream.send_una;
+        stream.fin_sent = false;
+        push(stream);
+      } else {
+        // Zero window probe, an old sequence number makes the app tell its window
+        emit(stream, TCP_ACK, stream.send_next - 1, 0);
+      }
+    }
+    due |= waiting || blocked;
+
+    // The app holds back for room in the writer queue, not for credit of the server
+    bool stalled = !stream.up_closed && stream.advertised < STREAM_MSS && stream.up_credit >= STREAM_MSS;
+    if (stalled && stream.state == STATE_ESTABLISHED && offer(stream) >= STREAM_MSS) {
+      emit(stream, TCP_ACK, stream.send_next, 0);
+    }
+    due |= stalled;
+    due |= stream.down_credit >= STREAM_CREDIT_STEP && !credit(stream);
+  }
+  if (due) {
+    timer_schedule(timer, STREAM_TICK);
+  }
+  pthread_mutex_unlock(&stream_lock);
+}
+
+bool stream_configure(bool enable) {
+  enabled = enable;
+  stream_opened = stream_passed = stream_reset = stream_retransmitted = stream_deferred = 0;
+  stream_up_bytes = stream_down_bytes = 0;
+  return true;
+}
+
+bool stream_enabled() {
+  return enabled;
+}
+
+void stream_start(int tun) {
+  pthread_mutex_lock(&stream_lock);
+  tun_fd = tun;
+  for (int slot = 0; slot < STREAM_MAX; ++ slot) {
+    if (streams[slot].state != STATE_FREE && streams[slot].filled) {
+      madvise(buffers[slot], STREAM_BUFFER, MADV_DONTNEED);
+    }
+    streams[slot].state = STATE_FREE;
+  }
+  for (int &bucket: buckets) {
+    bucket = -1;
+  }
+  stream_active = 0;
+  pthread_mutex_unlock(&stream_lock);
+}
+
+void stream_connection() {
+  pthread_mutex_lock(&stream_lock);
+  for (Stream &stream: streams) {
+    if (stream.state != STATE_FREE) {
+      emit(stream, TCP_RST | TCP_ACK, stream.send_next, 0);
+      ++ stream_reset;
+      release(stream);
+    }
+  }
+  pthread_mutex_unlock(&stream_lock);
+}
+
+bool stream_input(Message *message) {
+  if (!enabled) {
+    return false;
+  }
+  const u8 *packet = message -> data;
+  u32 length = message -> length - HEADER_LENGTH;
+  const u8 *tcp = transport_header(packet, length, IPPROTO_TCP, TCP_MIN_HEADER);
+  if (tcp == nullptr || (load16(packet + IPV4_FRAGMENT) & IPV4_MORE_FRAGMENTS)) {
+    return false;
+  }
+  u32 headers = ipv4_header_length(packet) + (tcp[TCP_OFFSET] >> 4) * 4u;
+  u32 total = load16(packet + IPV4_TOTAL_LENGTH);
+  if ((tcp[TCP_OFFSET] >> 4) * 4u < TCP_MIN_HEADER || total > length || headers > total) {
+    return false;
+  }
+
+  pthread_mutex_lock(&stream_lock);
+  Stream *stream = find(packet, tcp);
+  if (stream == nullptr) {
+    // Connections from before split TCP was on, or beyond the table, go on as packets
+    bool syn = (tcp[TCP_FLAGS] & (TCP_SYN | TCP_ACK | TCP_RST | TCP_FIN)) == TCP_SYN;
+    stream = syn ? accept(packet, tcp) : nullptr;
+    if (stream == nullptr) {
+      stream_passed += syn;
+      pthread_mutex_unlock(&stream_lock);
+      return false;
+    }
+
+    // The SYN becomes the STREAM_OPEN, the handshake completes here while the server connects
+    u8 *data = message -> data;
+    store32(data, stream -> id);
+    store32(data + STREAM_ID_LENGTH, stream -> peer_address);
+    store16(data + STREAM_ID_LENGTH + sizeof(u32), stream -> peer_port);
+    message -> type = STREAM_OPEN;
+    message -> length = HEADER_LENGTH + STREAM_ID_LENGTH + sizeof(u32) + sizeof(u16);
+    writer_commit(message);
+    emit(*stream, TCP_SYN | TCP_ACK, stream -> iss, 0);
+    schedule();
+    pthread_mutex_unlock(&stream_lock);
+    return true;
+  }
+  if (!segment(*stream, message, tcp, headers, total - headers)) {
+    writer_discard(message);
+  }
+  pthread_mutex_unlock(&stream_lock);
+  return true;
+}
+
+void stream_deliver(const Message &frame) {
+  u32 length = frame.length - HEADER_LENGTH;
+  if (length < STREAM_ID_LENGTH) {
+    return;
+  }
+  u32 id = load32(frame.data);
+  const u8 *data = frame.data + STREAM_ID_LENGTH;
+  length -= STREAM_ID_LENGTH;
+
+  // Frames of a stream closed here already are dropped
+  pthread_mutex_lock(&stream_lock);
+  Stream &stream = streams[id & (STREAM_MAX - 1)];
+  if (stream.state == STATE_FREE || stream.id != id) {
+    pthread_mutex_unlock(&stream_lock);
+    return;
+  }
+  if (frame.type == STREAM_DATA) {
+    if (stream.down_closed || stream.buffered + length > STREAM_BUFFER) {
+      error("Stream %d from the server overran its credit", id);
+      reset(stream);
+    } else {
+      u8 *ring = buffers[&stream - streams];
+      u32 offset = (stream.send_una + stream.buffered - stream.iss - 1) & (STREAM_BUFFER - 1);
+      u32 first = length < STREAM_BUFFER - offset ? length : STREAM_BUFFER - offset;
+      memcpy(ring + offset, data, first);
+      memcpy(ring, data + first, length - first);
+      stream.buffered += length;
+      stream.filled = true;
+      stream_down_bytes += length;
+      push(stream);
+    }
+  } else if (frame.type == STREAM_CLOSE && length >= 1) {
+    if (data[0] == STREAM_FIN) {
+      stream.down_closed = true;
+      push(stream);
+    } else {
+      emit(stream, TCP_RST | TCP_ACK, stream.send_next, 0);
+      ++ stream_reset;
+      release(stream);
+    }
+  } else if (frame.type == STREAM_WINDOW && length >= sizeof(u32)) {
+    stream.up_credit += load32(data);
+    if (stream.state == STATE_ESTABLISHED && stream.advertised < STREAM_MSS && offer(stream) >= STREAM_MSS) {
+      emit(stream, TCP_ACK, stream.send_next, 0);
+    }
+  }
+  pthread_mutex_unlock(&stream_lock);
+}
@@ -0,0 +1,50 @@
+// Split TCP of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define STREAM_MAX                   64    // terminated connections, must be a power of 2, SYNs beyond go as packets
+# define STREAM_BUFFER                1048576 // bytes from the server held per stream, must be a power of 2
+# define STREAM_WINDOW_INITIAL        STREAM_BUFFER // credit of either end when a stream opens, both ends must agree
+# define STREAM_CREDIT_STEP           (STREAM_BUFFER / 4) // bytes the app takes before they are credited back
+# define STREAM_MSS                   1460  // announced to the app, so a segment fits in a frame
+# define STREAM_APP_MSS               536   // segments to an app that announced no MSS
+# define STREAM_TICK                  20    // ms, retransmissions and window updates while any are due
+# define STREAM_RTO                   200   // ms, doubled on each retransmission to the app
+# define STREAM_RETRIES               6     // retransmissions before the app is given up
+
+// Split TCP: TCP connections of apps are terminated here instead of riding the tunnel as packets,
+// so the inner TCP no longer retransmits and backs off over the outer one. The handshake is
+// answered at once from the tun side, and only the byte streams travel, multiplexed over the tunnel
+// by stream id (STREAM_OPEN with the destination, STREAM_DATA, STREAM_CLOSE). Bytes of the app are
+// acknowledged once framed into the writer queue; bytes of the server are held until the app
+// acknowledges them and retransmitted from here. Each end grants the other credit (STREAM_WINDOW)
+// as it drains a stream, so a slow app or destination stalls its own stream only. The stack is
+// small on purpose: no window scaling, SACK or timestamps (the tun side has no loss to speak of and
+// a round trip of microseconds), and out of order segments are dropped for the app to resend
+
+// Statistics
+extern u32 stream_opened, stream_passed, stream_reset, stream_retransmitted, stream_deferred;
+extern u32 stream_active;
+extern u64 stream_up_bytes, stream_down_bytes;
+
+// Switch split TCP (the server must take STREAM_* frames), before backend
+bool stream_configure(bool enabled);
+bool stream_enabled();
+
+// Reset the streams of the last session, writing to 'tun' from now on (before the threads start)
+void stream_start(int tun);
+
+// A new primary connection, the streams of the old one are reset
+void stream_connection();
+
+// Take a packet read from tun (send thread), returns false if it goes as a packet, otherwise the
+// message has been committed to the writer or discarded
+bool stream_input(Message *message);
+
+// Handle a STREAM_* frame from the server (receiving order)
+void stream_deliver(const Message &frame);
@@ -0,0 +1,247 @@
+// Hierarchical timer wheel of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "timer.h"
+
+// Native C++
+# include <cstring>
+# include <errno.h>
+# include <poll.h>
+# include <pthread.h>
+# include <sys/timerfd.h>
+# include <unistd.h>
+
+# define TIMER_NEVER                  (~0ull)
+# define TIMER_MAX_DELAY              ((1u << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1)
+
+// Wheel, level 1 holds the next 64 ticks, level N holds ticks 64^(N-1) ~ 64^N away
+// Slot lists are doubly linked so that cancelling is O(1), and each level has an occupancy bitmap.
+// Timers join a list at its tail, so moving them from one list to the next keeps their order
+static Timer* slots[TIMER_WHEEL_LEVELS + 2][TIMER_WHEEL_SLOTS]; // level 0 unused, last level is the expired list
+static Timer* tails[TIMER_WHEEL_LEVELS + 2][TIMER_WHEEL_SLOTS];
+static u64 occupied[TIMER_WHEEL_LEVELS + 1];
+static u64 wheel_now;          // next tick to process
+static u64 wheel_armed;        // tick the timerfd is armed for, TIMER_NEVER if disarmed
+static u64 wheel_start_us;
+static u32 wheel_align;
+static int timerfd = -1;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 timer_fired, timer_jitter_max_us;
+u64 timer_jitter_sum_us;
+
+static u64 wheel_tick_now() {
+  return (now_us() - wheel_start_us) / 1000;
+}
+
+static void wheel_link(Timer *timer, int level, int index) {
+  timer -> level = level;
+  timer -> index = index;
+  timer -> prev = tails[level][index];
+  timer -> next = nullptr;
+  if (timer -> prev) {
+    timer -> prev -> next = timer;
+  } else {
+    slots[level][index] = timer;
+  }
+  tails[level][index] = timer;
+  if (level <= TIMER_WHEEL_LEVELS) {
+    occupied[level] |= 1ull << index;
+  }
+}
+
+static void wheel_unlink(Timer *timer) {
+  int level = timer -> level, index = timer -> index;
+  if (timer -> prev) {
+    timer -> prev -> next = timer -> next;
+  } else {
+    slots[level][index] = timer -> next;
+  }
+  if (timer -> next) {
+    timer -> next -> prev = timer -> prev;
+  } else {
+    tails[level][index] = timer -> prev;
+  }
+  if (level <= TIMER_WHEEL_LEVELS && slots[level][index] == nullptr) {
+    occupied[level] &= ~(1ull << index);
+  }
+  timer -> level = 0;
+  timer -> prev = timer -> next = nullptr;
+}
+
+// Put a timer into the level matching its distance from now
+static void wheel_insert(Timer *timer) {
+  u64 expires = timer -> expires;
+  if (expires < wheel_now) {
+    wheel_link(timer, 1, wheel_now & TIMER_WHEEL_MASK);
+    return;
+  }
+
+  u64 delta = expires - wheel_now;
+  int level = 1;
+  while (level < TIMER_WHEEL_LEVELS && delta >= (1ull << (level * TIMER_WHEEL_BITS))) {
+    ++ level;
+  }
+  wheel_link(timer, level, (expires >> ((level - 1) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK);
+}
+
+// Re-insert all timers of a higher level slot, returns the slot index
+static int wheel_cascade(int level) {
+  int index = (wheel_now >> ((level - 1) * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+  Timer *timer = slots[level][index];
+  slots[level][index] = tails[level][index] = nullptr;
+  occupied[level] &= ~(1ull << index);
+  while (timer) {
+    Timer *next = timer -> next;
+    wheel_insert(timer);
+    timer = next;
+  }
+  return index;
+}
+
+// Earliest tick at which the wheel has work, TIMER_NEVER if empty
+static u64 wheel_next_tick() {
+  int index = wheel_now & TIMER_WHEEL_MASK;
+  u64 ahead = occupied[1] & (~0ull << index);
+  u64 tick = ahead ? wheel_now - index + __builtin_ctzll(ahead) : TIMER_NEVER;
+
+  // Wrapped level 1 slots and cascades are both handled at the next boundary (which may be now)
+  bool pending = (occupied[1] & ~(~0ull << index)) != 0;
+  for (int level = 2; level <= TIMER_WHEEL_LEVELS; ++ level) {
+    pending = pending || occupied[level];
+  }
+  u64 boundary = index ? wheel_now - index + TIMER_WHEEL_SLOTS : wheel_now;
+  return pending && boundary < tick ? boundary : tick;
+}
+
+// Arm the timerfd for the earliest work (called with the lock held)
+static void wheel_rearm() {
+  u64 tick = wheel_next_tick();
+  if (tick == wheel_armed) {
+    return;
+  }
+  wheel_armed = tick;
+
+  itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  if (tick != TIMER_NEVER) {
+    u64 at = wheel_start_us + tick * 1000;
+    spec.it_value.tv_sec = at / 1000000;
+    spec.it_value.tv_nsec = (at % 1000000) * 1000;
+  }
+  timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+// Move everything due up to 'now' into the expired list
+static void wheel_advance(u64 now) {
+  while (wheel_now <= now) {
+    int index = wheel_now & TIMER_WHEEL_MASK;
+    if (index == 0) {
+      for (int level = 2; level <= TIMER_WHEEL_LEVELS && wheel_cascade(level) == 0; ++ level);
+    }
+    while (slots[1][index]) {
+      Timer *timer = slots[1][index];
+      wheel_unlink(timer);
+      wheel_link(timer, TIMER_WHEEL_LEVELS + 1, 0);
+    }
+
+    // Skip empty ticks until the next occupied slot or level boundary
+    u64 ahead = occupied[1] & (~0ull << index) & ~(1ull << index);
+    u64 next = ahead ? wheel_now - index + __builtin_ctzll(ahead) : wheel_now - index + TIMER_WHEEL_SLOTS;
+    wheel_now = next < now + 1 ? next : now + 1;
+  }
+}
+
+void timer_init() {
+  pthread_mutex_lock(&wheel_lock);
+  for (int level = 1; level <= TIMER_WHEEL_LEVELS + 1; ++ level) {
+    for (int index = 0; index < TIMER_WHEEL_SLOTS; ++ index) {
+      while (slots[level][index]) {
+        wheel_unlink(slots[level][index]);
+      }
+    }
+  }
+  if (timerfd == -1) {
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  }
+  wheel_start_us = now_us();
+  wheel_now = 0;
+  wheel_armed = TIMER_NEVER;
+  timer_fired = timer_jitter_max_us = 0;
+  timer_jitter_sum_us = 0;
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+void timer_schedule(Timer *timer, u32 delay) {
+  pthread_mutex_lock(&wheel_lock);
+  if (timer -> level) {
+    wheel_unlink(timer);
+  }
+  timer -> expires = wheel_tick_now() + (delay < TIMER_MAX_DELAY ? delay : TIMER_MAX_DELAY);
+  if (wheel_align && delay >= wheel_align && delay < TIMER_MAX_DELAY) {
+    u64 base = wheel_start_us / 1000;
+    timer -> expires = (base + timer -> expires + wheel_align - 1) / wheel_align * wheel_align - base;
+  }
+  wheel_insert(timer);
+  wheel_rearm();
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+void timer_align(u32 granularity) {
+  wheel_align = granularity;
+}
+
+void timer_cancel(Timer *timer) {
+  pthread_mutex_lock(&wheel_lock);
+  if (timer -> level) {
+    wheel_unlink(timer);
+  }
+  pthread_mutex_unlock(&wheel_lock);
+}
+
+bool timer_pending(Timer *timer) {
+  return timer -> level != 0;
+}
+
+void* timer_thread(void *shutdown) {
+  pollfd fds[2] = {{timerfd, POLLIN, 0}, {*(int *) shutdown, POLLIN, 0}};
+  while (true) {
+    int ready = poll(fds, 2, -1);
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ready < 0 || fds[1].revents) {
+      break;
+    }
+    u64 expirations;
+    if (read(timerfd, &expirations, sizeof(u64)) != sizeof(u64)) {
+      continue;
+    }
+
+    pthread_mutex_lock(&wheel_lock);
+    wheel_armed = TIMER_NEVER;
+    wheel_advance(wheel_tick_now());
+
+    // Fire one by one, callbacks may schedule or cancel timers (including themselves)
+    Timer* &expired = slots[TIMER_WHEEL_LEVELS + 1][0];
+    while (expired) {
+      Timer *timer = expired;
+      wheel_unlink(timer);
+
+      u64 late = now_us() - (wheel_start_us + timer -> expires * 1000);
+      timer_jitter_sum_us += late;
+      timer_jitter_max_us = late > timer_jitter_max_us ? late : timer_jitter_max_us;
+      ++ timer_fired;
+
+      pthread_mutex_unlock(&wheel_lock);
+      timer -> callback(timer);
+      pthread_mutex_lock(&wheel_lock);
+    }
+    wheel_rearm();
+    pthread_mutex_unlock(&wheel_lock);
+  }
+  debug("Timer thread ends");
+  return nullptr;
+}
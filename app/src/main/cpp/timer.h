@@ -0,0 +1,49 @@
+// Hierarchical timer wheel of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define TIMER_WHEEL_BITS             6     // 64 slots per level
+# define TIMER_WHEEL_LEVELS           4     // 1 ms ticks, 2^24 ms (about 4.6 hours) range
+# define TIMER_WHEEL_SLOTS            (1 << TIMER_WHEEL_BITS)
+# define TIMER_WHEEL_MASK             (TIMER_WHEEL_SLOTS - 1)
+
+// Timer, owned by the caller and linked into the wheel while scheduled
+struct Timer {
+  void (*callback)(Timer *);
+  void *arg;
+
+  // Internal
+  u64 expires;  // tick (ms) on the wheel clock
+  int level;    // 0 if not scheduled, 1 ~ TIMER_WHEEL_LEVELS in the wheel, TIMER_WHEEL_LEVELS + 1 if about to fire
+  int index;
+  Timer *prev, *next;
+};
+
+// Statistics
+extern u32 timer_fired, timer_jitter_max_us;
+extern u64 timer_jitter_sum_us;
+
+// Reset the wheel and its clock (dropping scheduled timers), must be called before any other timer function
+void timer_init();
+
+// Schedule (or reschedule) a timer 'delay' milliseconds from now (clamped to the wheel range), O(1).
+// Timers due on the same tick and scheduled as far ahead fire in the order they were scheduled
+void timer_schedule(Timer *timer, u32 delay);
+
+// Coalesce timers: delays of at least 'granularity' ms are rounded up to a multiple of it on the
+// monotonic clock, so idle timers fire together (0 to disable)
+void timer_align(u32 granularity);
+
+// Cancel a timer if scheduled, O(1)
+void timer_cancel(Timer *timer);
+
+// Whether the timer is waiting to fire
+bool timer_pending(Timer *timer);
+
+// Timer thread, fires callbacks until the eventfd '*(int *) shutdown' becomes readable
+void* timer_thread(void *shutdown);
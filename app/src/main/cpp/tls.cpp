@@ -0,0 +1,910 @@
+// Kernel TLS of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "chacha.h"
+# include "crypto.h"
+# include "gcm.h"
+# include "hash.h"
+# include "packet.h"
+# include "tls.h"
+# include "x25519.h"
+
+// Native C++
+# include <atomic>
+# include <cstdlib>
+# include <cstring>
+# include <errno.h>
+# include <poll.h>
+# include <pthread.h>
+# include <unistd.h>
+
+// Networks
+# include <arpa/inet.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+
+// Kernel interface of linux/tls.h, spelled out as older NDK headers lack ChaCha20-Poly1305
+# ifndef TCP_ULP
+# define TCP_ULP                      31
+# endif
+# ifndef SOL_TLS
+# define SOL_TLS                      282
+# endif
+# define KTLS_TX                      1
+# define KTLS_RX                      2
+# define KTLS_VERSION                 0x0304
+# define KTLS_AES_GCM_256             52
+# define KTLS_CHACHA20_POLY1305       54
+
+struct KtlsAesGcm {
+  u16 version, cipher;
+  u8 iv[8], key[32], salt[4], sequence[8];
+};
+
+struct KtlsChacha {
+  u16 version, cipher;
+  u8 iv[12], key[32], sequence[8];
+};
+
+// Records and handshake messages (RFC 8446)
+# define RECORD_HEADER                5
+# define RECORD_TAG                   16
+# define RECORD_EXPANSION             256   // most a peer may add to a record
+# define RECORD_CHANGE_CIPHER         20
+# define RECORD_ALERT                 21
+# define RECORD_HANDSHAKE             22
+# define RECORD_DATA                  23
+# define HANDSHAKE_CLIENT_HELLO       1
+# define HANDSHAKE_SERVER_HELLO       2
+# define HANDSHAKE_TICKET             4
+# define HANDSHAKE_EXTENSIONS         8
+# define HANDSHAKE_FINISHED           20
+# define HANDSHAKE_LENGTH             4096  // server messages reassembled at once
+# define EXTENSION_GROUPS             10
+# define EXTENSION_PSK                41
+# define EXTENSION_VERSIONS           43
+# define EXTENSION_PSK_MODES          45
+# define EXTENSION_KEY_SHARE          51
+# define GROUP_X25519                 0x001d
+# define PSK_KE                       0     // resumption, without an exchange
+# define PSK_DHE_KE                   1
+# define TICKET_NONCE_LENGTH          64
+
+struct Suite {
+  u16 id;
+  int hash;
+  int cipher;
+  u16 kernel;
+  const char *name;
+};
+
+static const Suite suites[2] = {
+  {0x1302, HASH_SHA384, CRYPTO_AES_GCM, KTLS_AES_GCM_256, "TLS_AES_256_GCM_SHA384"},
+  {0x1303, HASH_SHA256, CRYPTO_CHACHA, KTLS_CHACHA20_POLY1305, "TLS_CHACHA20_POLY1305_SHA256"}
+};
+
+// SHA-256 of "HelloRetryRequest", the random of a server asking for another key share
+static const u8 retry_random[32] = {
+  0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11, 0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+  0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e, 0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c};
+
+// Record keys of one direction
+struct Traffic {
+  const Suite *suite;
+  u8 key[TLS_KEY_LENGTH], iv[GCM_NONCE_LENGTH];
+  u64 sequence;
+  GcmKey gcm;
+  ChachaKey chacha;
+};
+
+// Session of a socket, records are read into 'record' one at a time and opened in place
+struct Connection {
+  std::atomic<bool> ready;
+  int fd, cancel;
+  u64 established_us;
+  Traffic send, recv;
+  bool ulp, kernel_send, kernel_recv, corked;
+  u8 resumption[HASH_MAX_LENGTH];
+  u8 record[RECORD_HEADER + TLS_RECORD_LENGTH + RECORD_EXPANSION];
+  u32 record_length;            // bytes of the next record read so far
+  u32 plain_head, plain_length; // opened application data not taken yet
+  u8 unsent[RECORD_HEADER + TLS_RECORD_LENGTH + 1 + RECORD_TAG];
+  u32 unsent_head, unsent_length; // rest of a record cut short by MSG_DONTWAIT
+};
+
+struct Ticket {
+  bool valid;
+  const Suite *suite;
+  u8 identity[TLS_TICKET_LENGTH];
+  u32 identity_length;
+  u8 psk[HASH_MAX_LENGTH];
+  u32 age_add, lifetime;
+  u64 received_us;
+};
+
+// Server messages of a handshake, reassembled across records
+struct Reader {
+  u8 buffer[HANDSHAKE_LENGTH];
+  u32 length;
+};
+
+static bool enabled;
+static const Suite *suite = &suites[0];
+static u8 psk[TLS_KEY_LENGTH];
+static Connection connections[TLS_CONNECTIONS];
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static Ticket tickets[TLS_TICKETS];
+static pthread_mutex_t tickets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Records sealed in user space are built here, one sender at a time
+static u8 sending[TLS_SEND_RECORDS * (RECORD_HEADER + TLS_RECORD_LENGTH + 1 + RECORD_TAG)];
+static pthread_mutex_t sending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Statistics
+u32 tls_handshakes, tls_resumed, tls_tickets, tls_offloaded, tls_handshake_us;
+
+static inline u32 load24(const u8 *ptr) {
+  return (u32) ptr[0] << 16 | (u32) ptr[1] << 8 | ptr[2];
+}
+
+static inline void store24(u8 *ptr, u32 value) {
+  ptr[0] = (u8) (value >> 16);
+  ptr[1] = (u8) (value >> 8);
+  ptr[2] = (u8) value;
+}
+
+// HKDF-Expand-Label, "tls13 " is prepended to the label
+static void expand_label(int hash, const u8 *secret, const char *label, const u8 *context, u32 context_length, u8 *out, u32 length) {
+  u8 info[2 + 1 + 6 + 16 + 1 + TICKET_NONCE_LENGTH];
+  u32 label_length = strlen(label);
+  store16(info, length);
+  info[2] = 6 + label_length;
+  memcpy(info + 3, "tls13 ", 6);
+  memcpy(info + 9, label, label_length);
+  info[9 + label_length] = context_length;
+  if (context_length) {
+    memcpy(info + 10 + label_length, context, context_length);
+  }
+  hkdf_expand(hash, secret, info, 10 + label_length + context_length, out, length);
+}
+
+// Derive-Secret, with the transcript already hashed
+static void derive_secret(int hash, const u8 *secret, const char *label, const u8 *transcript, u8 *out) {
+  expand_label(hash, secret, label, transcript, hash_length(hash), out, hash_length(hash));
+}
+
+static void traffic_init(Traffic &traffic, const Suite *with, const u8 *secret) {
+  traffic.suite = with;
+  expand_label(with -> hash, secret, "key", nullptr, 0, traffic.key, TLS_KEY_LENGTH);
+  expand_label(with -> hash, secret, "iv", nullptr, 0, traffic.iv, GCM_NONCE_LENGTH);
+  traffic.sequence = 0;
+  if (with -> cipher == CRYPTO_AES_GCM) {
+    gcm_init(traffic.gcm, traffic.key);
+  } else {
+    chacha_init(traffic.chacha, traffic.key);
+  }
+}
+
+// The nonce is the IV with the record sequence number XORed into its end
+static void nonce_for(const Traffic &traffic, u8 *nonce) {
+  memcpy(nonce, traffic.iv, GCM_NONCE_LENGTH);
+  for (int i = 0; i < 8; ++ i) {
+    nonce[GCM_NONCE_LENGTH - 1 - i] ^= (u8) (traffic.sequence >> (i * 8));
+  }
+}
+
+// Seal the 'length' bytes after the header at 'out' as a record of 'type', returns the record length
+static u32 seal_record(Traffic &traffic, u8 type, u8 *out, u32 length) {
+  u32 inner = length + 1;
+  u8 *data = out + RECORD_HEADER, *tag = data + inner;
+  data[length] = type;
+  out[0] = RECORD_DATA;
+  store16(out + 1, 0x0303);
+  store16(out + 3, inner + RECORD_TAG);
+  u8 nonce[GCM_NONCE_LENGTH];
+  nonce_for(traffic, nonce);
+  ++ traffic.sequence;
+  if (traffic.suite -> cipher == CRYPTO_AES_GCM) {
+    gcm_seal(traffic.gcm, nonce, out, RECORD_HEADER, data, inner, tag);
+  } else {
+    ChachaJob job = {nonce, out, RECORD_HEADER, data, inner, tag};
+    chacha_seal(traffic.chacha, &job, 1);
+  }
+  return RECORD_HEADER + inner + RECORD_TAG;
+}
+
+// Open a whole record in place, returns its inner type with 'length' set to the content, or -1 if it
+// is forged or malformed
+static int open_record(Traffic &traffic, u8 *record, u32 &length) {
+  u32 body = load16(record + 3);
+  if (body <= RECORD_TAG) {
+    return -1;
+  }
+  u32 inner = body - RECORD_TAG;
+  u8 *data = record + RECORD_HEADER, *tag = data + inner;
+  u8 nonce[GCM_NONCE_LENGTH];
+  nonce_for(traffic, nonce);
+  bool authentic = traffic.suite -> cipher == CRYPTO_AES_GCM ?
+    gcm_open(traffic.gcm, nonce, record, RECORD_HEADER, data, inner, tag) :
+    chacha_open(traffic.chacha, nonce, record, RECORD_HEADER, data, inner, tag);
+  if (!authentic) {
+    return -1;
+  }
+  ++ traffic.sequence;
+  while (inner && data[inner - 1] == 0) {
+    -- inner;
+  }
+  if (inner == 0) {
+    return -1;
+  }
+  length = inner - 1;
+  return data[length];
+}
+
+// Hand the keys of a direction to the kernel, records from the next sequence number on are its own
+static bool offload(int fd, int direction, const Traffic &traffic) {
+  if (traffic.suite -> cipher == CRYPTO_AES_GCM) {
+    KtlsAesGcm info = {KTLS_VERSION, KTLS_AES_GCM_256};
+    memcpy(info.salt, traffic.iv, 4);
+    memcpy(info.iv, traffic.iv + 4, 8);
+    memcpy(info.key, traffic.key, TLS_KEY_LENGTH);
+    store64(info.sequence, traffic.sequence);
+    return setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+  }
+  KtlsChacha info = {KTLS_VERSION, KTLS_CHACHA20_POLY1305};
+  memcpy(info.iv, traffic.iv, GCM_NONCE_LENGTH);
+  memcpy(info.key, traffic.key, TLS_KEY_LENGTH);
+  store64(info.sequence, traffic.sequence);
+  return setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) == 0;
+}
+
+// Wait for 'events' until the deadline, false on timeout (ETIMEDOUT) or once 'cancel' is readable
+static bool wait_for(int fd, int cancel, short events, u64 deadline) {
+  u64 now = now_us();
+  if (now >= deadline) {
+    errno = ETIMEDOUT;
+    return false;
+  }
+  pollfd fds[2] = {{fd, events, 0}, {cancel, POLLIN, 0}};
+  int ready = poll(fds, 2, (int) ((deadline - now + 999) / 1000));
+  if (ready < 0) {
+    return errno == EINTR;
+  }
+  if (ready == 0) {
+    errno = ETIMEDOUT;
+    return false;
+  }
+  if (fds[1].revents) {
+    errno = ECANCELED;
+    return false;
+  }
+  return true;
+}
+
+// Send what goes until the deadline, or without waiting if it is 0, returns the bytes sent or -1 on
+// errors (and on timeout)
+static int send_some(int fd, int cancel, const u8 *data, u32 length, int flags, u64 deadline) {
+  u32 sent = 0;
+  while (sent < length) {
+    int single = send(fd, data + sent, length - sent, flags | MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (single > 0) {
+      sent += single;
+    } else if (single < 0 && errno != EAGAIN && errno != EINTR) {
+      return -1;
+    } else if (deadline == 0) {
+      break;
+    } else if (!wait_for(fd, cancel, POLLOUT, deadline)) {
+      return -1;
+    }
+  }
+  return (int) sent;
+}
+
+static bool send_all(int fd, int cancel, const u8 *data, u32 length, int flags, u64 deadline) {
+  return send_some(fd, cancel, data, length, flags, deadline) == (int) length;
+}
+
+// Read towards a whole record, waiting (until the deadline) only for one already started unless
+// 'wait'; returns 1 once it is whole, 0 at the end of the stream and -1 on errors (EAGAIN if nothing
+// has arrived)
+static int fill_record(Connection &connection, u64 deadline, bool wait) {
+  while (true) {
+    u32 needed = connection.record_length < RECORD_HEADER ? RECORD_HEADER : RECORD_HEADER + load16(connection.record + 3);
+    if (needed > sizeof(connection.record)) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    if (connection.record_length == needed && needed > RECORD_HEADER) {
+      return 1;
+    }
+    int got = recv(connection.fd, connection.record + connection.record_length, needed - connection.record_length, MSG_DONTWAIT);
+    if (got > 0) {
+      connection.record_length += got;
+      continue;
+    }
+    if (got == 0) {
+      return 0;
+    }
+    if (errno != EAGAIN && errno != EINTR) {
+      return -1;
+    }
+    if (!wait && connection.record_length == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (!wait_for(connection.fd, connection.cancel, POLLIN, deadline)) {
+      return -1;
+    }
+  }
+}
+
+// Next whole handshake message at the start of the reader, reading records (opened with 'keys'
+// unless nullptr) as needed, returns its length with the header, or 0 on failure
+static u32 next_message(Connection &connection, Reader &reader, Traffic *keys, u64 deadline) {
+  while (reader.length < 4 || reader.length < 4 + load24(reader.buffer + 1)) {
+    if (reader.length >= 4 && 4 + load24(reader.buffer + 1) > HANDSHAKE_LENGTH) {
+      error("Handshake message too long (%d bytes)", load24(reader.buffer + 1));
+      return 0;
+    }
+    if (fill_record(connection, deadline, true) <= 0) {
+      error("Handshake interrupted (%s)", strerror(errno));
+      return 0;
+    }
+    connection.record_length = 0;
+    u32 content = load16(connection.record + 3);
+    int type = connection.record[0];
+    if (type == RECORD_CHANGE_CIPHER) {
+      continue; // middlebox compatibility
+    }
+    if (keys && type == RECORD_DATA) {
+      type = open_record(*keys, connection.record, content);
+    } else if (keys && type == RECORD_HANDSHAKE) {
+      type = -1;
+    }
+    if (type == RECORD_ALERT) {
+      error("Handshake refused by the server (alert %d)", content >= 2 ? connection.record[RECORD_HEADER + 1] : -1);
+      return 0;
+    }
+    if (type != RECORD_HANDSHAKE || reader.length + content > HANDSHAKE_LENGTH) {
+      error("Bad handshake record (type %d, %d bytes)", type, content);
+      return 0;
+    }
+    memcpy(reader.buffer + reader.length, connection.record + RECORD_HEADER, content);
+    reader.length += content;
+  }
+  return 4 + load24(reader.buffer + 1);
+}
+
+static void consume(Hash &transcript, Reader &reader, u32 length) {
+  hash_update(transcript, reader.buffer, length);
+  reader.length -= length;
+  memmove(reader.buffer, reader.buffer + length, reader.length);
+}
+
+static inline u8* extension(u8 *ptr, u16 type, u16 length) {
+  store16(ptr, type);
+  store16(ptr + 2, length);
+  return ptr + 4;
+}
+
+// The newest unexpired ticket of the suite, taken out for one use
+static bool take_ticket(Ticket &ticket) {
+  pthread_mutex_lock(&tickets_lock);
+  u64 now = now_us();
+  int newest = -1;
+  for (int i = 0; i < TLS_TICKETS; ++ i) {
+    Ticket &candidate = tickets[i];
+    if (candidate.valid && candidate.suite == suite && now - candidate.received_us < (u64) candidate.lifetime * 1000000 &&
+        (newest == -1 || candidate.received_us > tickets[newest].received_us)) {
+      newest = i;
+    }
+  }
+  if (newest != -1) {
+    ticket = tickets[newest];
+    tickets[newest].valid = false;
+  }
+  pthread_mutex_unlock(&tickets_lock);
+  return newest != -1;
+}
+
+// NewSessionTicket, replaces the oldest ticket kept
+static bool store_ticket(const Connection &connection, const u8 *message, u32 length) {
+  if (length < 11) {
+    return false;
+  }
+  u32 lifetime = load32(message), age_add = load32(message + 4), nonce_length = message[8];
+  const u8 *nonce = message + 9;
+  if (11 + nonce_length > length) {
+    return false;
+  }
+  u32 identity_length = load16(nonce + nonce_length);
+  if (11 + nonce_length + identity_length > length) {
+    return false;
+  }
+  if (lifetime == 0 || identity_length == 0 || identity_length > TLS_TICKET_LENGTH || nonce_length > TICKET_NONCE_LENGTH) {
+    return true; // not usable, but well-formed
+  }
+  pthread_mutex_lock(&tickets_lock);
+  Ticket *slot = &tickets[0];
+  for (int i = 0; i < TLS_TICKETS; ++ i) {
+    if (!tickets[i].valid || (slot -> valid && tickets[i].received_us < slot -> received_us)) {
+      slot = &tickets[i];
+    }
+  }
+  const Suite *with = connection.send.suite;
+  slot -> suite = with;
+  memcpy(slot -> identity, nonce + nonce_length + 2, identity_length);
+  slot -> identity_length = identity_length;
+  expand_label(with -> hash, connection.resumption, "resumption", nonce, nonce_length, slot -> psk, hash_length(with -> hash));
+  slot -> age_add = age_add;
+  slot -> lifetime = lifetime;
+  slot -> received_us = now_us();
+  slot -> valid = true;
+  pthread_mutex_unlock(&tickets_lock);
+  ++ tls_tickets;
+  return true;
+}
+
+// Post-handshake messages in an opened record, only tickets are expected
+static bool take_messages(const Connection &connection, u32 length) {
+  const u8 *ptr = connection.record + RECORD_HEADER, *end = ptr + length;
+  while (end - ptr >= 4) {
+    u32 size = load24(ptr + 1);
+    if (ptr[0] != HANDSHAKE_TICKET || (u32) (end - ptr - 4) < size || !store_ticket(connection, ptr + 4, size)) {
+      error("Unexpected post-handshake message (type %d)", ptr[0]);
+      return false;
+    }
+    ptr += 4 + size;
+  }
+  return ptr == end;
+}
+
+// A slot for a new session of 'fd', one of a closed socket with the same number, a free one or the oldest
+static Connection& claim(int fd, int cancel) {
+  pthread_mutex_lock(&connections_lock);
+  Connection *slot = nullptr;
+  for (int i = 0; i < TLS_CONNECTIONS && slot == nullptr; ++ i) {
+    if (connections[i].fd == fd) {
+      slot = &connections[i];
+    }
+  }
+  for (int i = 0; i < TLS_CONNECTIONS && slot == nullptr; ++ i) {
+    if (connections[i].fd == -1) {
+      slot = &connections[i];
+    }
+  }
+  for (int i = 0; i < TLS_CONNECTIONS && slot == nullptr; ++ i) {
+    slot = &connections[i];
+    for (int j = i + 1; j < TLS_CONNECTIONS; ++ j) {
+      slot = connections[j].established_us < slot -> established_us ? &connections[j] : slot;
+    }
+  }
+  slot -> ready = false;
+  slot -> fd = fd;
+  slot -> cancel = cancel;
+  slot -> established_us = now_us();
+  slot -> ulp = slot -> kernel_send = slot -> kernel_recv = slot -> corked = false;
+  slot -> record_length = slot -> plain_head = slot -> plain_length = 0;
+  slot -> unsent_head = slot -> unsent_length = 0;
+  pthread_mutex_unlock(&connections_lock);
+  return *slot;
+}
+
+static Connection* find(int fd) {
+  if (!enabled) {
+    return nullptr;
+  }
+  for (int i = 0; i < TLS_CONNECTIONS; ++ i) {
+    if (connections[i].ready && connections[i].fd == fd) {
+      return &connections[i];
+    }
+  }
+  return nullptr;
+}
+
+static bool refuse(Connection &connection, const char *reason) {
+  error("TLS handshake failed: %s", reason);
+  connection.fd = -1;
+  return false;
+}
+
+bool tls_handshake(int fd, int cancel) {
+  u64 start = now_us(), deadline = start + TLS_TIMEOUT * 1000ull;
+  Connection &connection = claim(fd, cancel);
+  int hash = suite -> hash;
+  u32 size = hash_length(hash);
+  Ticket ticket;
+  bool resumed = take_ticket(ticket);
+
+  // ClientHello with the PSK extension last, a resumption also allows the server to skip the exchange
+  u8 secret[X25519_LENGTH], share[X25519_LENGTH];
+  u8 hello[RECORD_HEADER + 256 + TLS_TICKET_LENGTH + HASH_MAX_LENGTH];
+  u8 *message = hello + RECORD_HEADER, *ptr = message + 4;
+  store16(ptr, 0x0303);
+  arc4random_buf(ptr + 2, 32);
+  ptr[34] = 0; // no legacy session
+  store16(ptr + 35, 2);
+  store16(ptr + 37, suite -> id);
+  ptr[39] = 1;
+  ptr[40] = 0;
+  u8 *extensions = ptr + 41;
+  ptr = extension(extensions + 2, EXTENSION_VERSIONS, 3);
+  ptr[0] = 2;
+  store16(ptr + 1, 0x0304);
+  ptr += 3;
+  arc4random_buf(secret, X25519_LENGTH);
+  x25519_public(share, secret);
+  ptr = extension(ptr, EXTENSION_GROUPS, 4);
+  store16(ptr, 2);
+  store16(ptr + 2, GROUP_X25519);
+  ptr = extension(ptr + 4, EXTENSION_KEY_SHARE, 6 + X25519_LENGTH);
+  store16(ptr, 4 + X25519_LENGTH);
+  store16(ptr + 2, GROUP_X25519);
+  store16(ptr + 4, X25519_LENGTH);
+  memcpy(ptr + 6, share, X25519_LENGTH);
+  ptr = extension(ptr + 6 + X25519_LENGTH, EXTENSION_PSK_MODES, resumed ? 3 : 2);
+  ptr[0] = resumed ? 2 : 1;
+  ptr[1] = PSK_DHE_KE;
+  ptr[2] = PSK_KE;
+  ptr += resumed ? 3 : 2;
+  const u8 *identity = resumed ? ticket.identity : (const u8 *) TLS_PSK_IDENTITY;
+  u32 identity_length = resumed ? ticket.identity_length : strlen(TLS_PSK_IDENTITY);
+  u32 age = resumed ? (u32) ((now_us() - ticket.received_us) / 1000) + ticket.age_add : 0;
+  ptr = extension(ptr, EXTENSION_PSK, 2 + 2 + identity_length + 4 + 2 + 1 + size);
+  store16(ptr, 2 + identity_length + 4);
+  store16(ptr + 2, identity_length);
+  memcpy(ptr + 4, identity, identity_length);
+  store32(ptr + 4 + identity_length, age);
+  u8 *binders = ptr + 8 + identity_length;
+  store16(binders, 1 + size);
+  binders[2] = size;
+  ptr = binders + 3 + size;
+  store16(extensions, ptr - extensions - 2);
+  message[0] = HANDSHAKE_CLIENT_HELLO;
+  store24(message + 1, ptr - message - 4);
+
+  // The binder proves the PSK over the hello up to the binders
+  u8 early[HASH_MAX_LENGTH], empty[HASH_MAX_LENGTH], binder_key[HASH_MAX_LENGTH], finished_key[HASH_MAX_LENGTH], digest[HASH_MAX_LENGTH];
+  hash_digest(hash, nullptr, 0, empty);
+  hkdf_extract(hash, nullptr, 0, resumed ? ticket.psk : psk, resumed ? size : TLS_KEY_LENGTH, early);
+  derive_secret(hash, early, resumed ? "res binder" : "ext binder", empty, binder_key);
+  expand_label(hash, binder_key, "finished", nullptr, 0, finished_key, size);
+  hash_digest(hash, message, binders - message, digest);
+  hmac(hash, finished_key, size, digest, size, binders + 3);
+
+  Hash transcript;
+  hash_init(transcript, hash);
+  hash_update(transcript, message, ptr - message);
+  hello[0] = RECORD_HANDSHAKE;
+  store16(hello + 1, 0x0301);
+  store16(hello + 3, ptr - message);
+  if (!send_all(fd, cancel, hello, ptr - hello, 0, deadline)) {
+    return refuse(connection, strerror(errno));
+  }
+
+  // ServerHello, which must take the PSK, and the key share unless resuming without an exchange
+  Reader reader;
+  reader.length = 0;
+  u32 length = next_message(connection, reader, nullptr, deadline);
+  if (length == 0 || reader.buffer[0] != HANDSHAKE_SERVER_HELLO || reader.length != length || length < 4 + 38) {
+    return refuse(connection, "no ServerHello");
+  }
+  ptr = reader.buffer + 4;
+  const u8 *end = reader.buffer + length, *server_share = nullptr;
+  if (memcmp(ptr + 2, retry_random, 32) == 0) {
+    return refuse(connection, "the server asks for another key share");
+  }
+  ptr += 34;
+  ptr += 1 + ptr[0];
+  if (end - ptr < 5 || load16(ptr) != suite -> id) {
+    return refuse(connection, "the server chose another cipher suite");
+  }
+  ptr += 3;
+  bool version = false, selected = false;
+  if (end - ptr < 2 || load16(ptr) != end - ptr - 2) {
+    return refuse(connection, "malformed ServerHello");
+  }
+  for (ptr += 2; end - ptr >= 4; ptr += 4 + load16(ptr + 2)) {
+    u32 type = load16(ptr), extension_length = load16(ptr + 2);
+    const u8 *body = ptr + 4;
+    if (end - body < extension_length) {
+      return refuse(connection, "malformed ServerHello");
+    }
+    if (type == EXTENSION_VERSIONS && extension_length == 2 && load16(body) == 0x0304) {
+      version = true;
+    } else if (type == EXTENSION_PSK && extension_length == 2 && load16(body) == 0) {
+      selected = true;
+    } else if (type == EXTENSION_KEY_SHARE && extension_length == 4 + X25519_LENGTH && load16(body) == GROUP_X25519 && load16(body + 2) == X25519_LENGTH) {
+      server_share = body + 4;
+    }
+  }
+  if (!version || !selected || (server_share == nullptr && !resumed)) {
+    return refuse(connection, "the server did not accept TLS 1.3 with the PSK");
+  }
+  u8 shared[HASH_MAX_LENGTH] = {0}, zeros[HASH_MAX_LENGTH] = {0};
+  if (server_share) {
+    x25519(shared, secret, server_share);
+    if (memcmp(shared, zeros, X25519_LENGTH) == 0) {
+      return refuse(connection, "bad key share");
+    }
+  }
+  consume(transcript, reader, length);
+
+  // Handshake keys
+  u8 derived[HASH_MAX_LENGTH], handshake_secret[HASH_MAX_LENGTH], client_secret[HASH_MAX_LENGTH], server_secret[HASH_MAX_LENGTH];
+  derive_secret(hash, early, "derived", empty, derived);
+  hkdf_extract(hash, derived, size, shared, server_share ? X25519_LENGTH : size, handshake_secret);
+  hash_final(transcript, digest);
+  derive_secret(hash, handshake_secret, "c hs traffic", digest, client_secret);
+  derive_secret(hash, handshake_secret, "s hs traffic", digest, server_secret);
+  traffic_init(connection.send, suite, client_secret);
+  traffic_init(connection.recv, suite, server_secret);
+
+  // EncryptedExtensions (nothing is asked for) and Finished of the server
+  length = next_message(connection, reader, &connection.recv, deadline);
+  if (length == 0 || reader.buffer[0] != HANDSHAKE_EXTENSIONS) {
+    return refuse(connection, "no EncryptedExtensions");
+  }
+  consume(transcript, reader, length);
+  length = next_message(connection, reader, &connection.recv, deadline);
+  if (length != 4 + size || reader.buffer[0] != HANDSHAKE_FINISHED || reader.length != length) {
+    return refuse(connection, "no server Finished");
+  }
+  u8 verify[HASH_MAX_LENGTH];
+  hash_final(transcript, digest);
+  expand_label(hash, server_secret, "finished", nullptr, 0, finished_key, size);
+  hmac(hash, finished_key, size, digest, size, verify);
+  u8 difference = 0;
+  for (u32 i = 0; i < size; ++ i) {
+    difference |= verify[i] ^ reader.buffer[4 + i];
+  }
+  if (difference) {
+    return refuse(connection, "server Finished does not verify");
+  }
+  consume(transcript, reader, length);
+
+  // Application secrets, over the transcript up to the server Finished
+  u8 master[HASH_MAX_LENGTH], client_application[HASH_MAX_LENGTH], server_application[HASH_MAX_LENGTH];
+  derive_secret(hash, handshake_secret, "derived", empty, derived);
+  hkdf_extract(hash, derived, size, zeros, size, master);
+  hash_final(transcript, digest);
+  derive_secret(hash, master, "c ap traffic", digest, client_application);
+  derive_secret(hash, master, "s ap traffic", digest, server_application);
+
+  // Finished of the client
+  u8 finished[RECORD_HEADER + 4 + HASH_MAX_LENGTH + 1 + RECORD_TAG];
+  message = finished + RECORD_HEADER;
+  message[0] = HANDSHAKE_FINISHED;
+  store24(message + 1, size);
+  expand_label(hash, client_secret, "finished", nullptr, 0, finished_key, size);
+  hmac(hash, finished_key, size, digest, size, message + 4);
+  hash_update(transcript, message, 4 + size);
+  if (!send_all(fd, cancel, finished, seal_record(connection.send, RECORD_HANDSHAKE, finished, 4 + size), 0, deadline)) {
+    return refuse(connection, strerror(errno));
+  }
+  hash_final(transcript, digest);
+  derive_secret(hash, master, "res master", digest, connection.resumption);
+  traffic_init(connection.send, suite, client_application);
+  traffic_init(connection.recv, suite, server_application);
+
+  // Sending goes to the kernel at once, receiving after the tickets
+  connection.ulp = setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+  connection.kernel_send = connection.ulp && offload(fd, KTLS_TX, connection.send);
+  if (connection.kernel_send) {
+    ++ tls_offloaded;
+  }
+  connection.ready = true;
+  ++ tls_handshakes;
+  if (resumed) {
+    ++ tls_resumed;
+  }
+  tls_handshake_us = now_us() - start;
+  debug("TLS handshake (%s) on %d with %s in %d us, records sealed %s", resumed ? (server_share ? "resumed" : "resumed without exchange") : "full", fd, suite -> name,
+    tls_handshake_us, connection.kernel_send ? "by the kernel" : "in user space");
+  return true;
+}
+
+const char* tls_mode(int fd) {
+  Connection *connection = find(fd);
+  if (connection == nullptr) {
+    return "none";
+  }
+  if (connection -> kernel_send) {
+    return connection -> kernel_recv ? "kernel" : "kernel (sending)";
+  }
+  return "user space";
+}
+
+// Seal what fits into TLS_SEND_RECORDS records and send them, returns the plaintext bytes taken.
+// Without MSG_DONTWAIT they are sent whole (until TLS_TIMEOUT). With it, records nothing of went out
+// are taken back, their sequence numbers used again, and the rest of one cut short stays with the
+// connection: the next call sends it before anything else, or fails with EAGAIN
+static int send_records(Connection &connection, const msghdr *message, int flags) {
+  u64 deadline = (flags & MSG_DONTWAIT) ? 0 : now_us() + TLS_TIMEOUT * 1000ull;
+  if (connection.unsent_length) {
+    int sent = send_some(connection.fd, connection.cancel, connection.unsent + connection.unsent_head, connection.unsent_length, flags & MSG_MORE, deadline);
+    if (sent < 0) {
+      return -1;
+    }
+    connection.unsent_head += sent;
+    connection.unsent_length -= sent;
+    if (connection.unsent_length) {
+      errno = EAGAIN;
+      return -1;
+    }
+  }
+  pollfd writable = {connection.fd, POLLOUT, 0};
+  if (deadline == 0 && message -> msg_iovlen && poll(&writable, 1, 0) == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  pthread_mutex_lock(&sending_lock);
+  u32 total = 0, offset = 0, ends[TLS_SEND_RECORDS], lengths[TLS_SEND_RECORDS];
+  int records = 0;
+  size_t index = 0;
+  while (records < TLS_SEND_RECORDS && index < message -> msg_iovlen) {
+    u8 *record = sending + total;
+    u32 length = 0;
+    while (length < TLS_RECORD_LENGTH && index < message -> msg_iovlen) {
+      const iovec &vector = message -> msg_iov[index];
+      u32 chunk = vector.iov_len - offset < TLS_RECORD_LENGTH - length ? vector.iov_len - offset : TLS_RECORD_LENGTH - length;
+      memcpy(record + RECORD_HEADER + length, (u8 *) vector.iov_base + offset, chunk);
+      length += chunk;
+      offset += chunk;
+      if (offset == vector.iov_len) {
+        ++ index;
+        offset = 0;
+      }
+    }
+    if (length) {
+      total += seal_record(connection.send, RECORD_DATA, record, length);
+      ends[records] = total;
+      lengths[records ++] = length;
+    }
+  }
+  int sent = send_some(connection.fd, connection.cancel, sending, total, flags & MSG_MORE, deadline);
+  int whole = 0, taken = 0;
+  for (; sent >= 0 && whole < records && ends[whole] <= (u32) sent; ++ whole) {
+    taken += lengths[whole];
+  }
+  if (whole < records && sent > (int) (whole ? ends[whole - 1] : 0)) {
+    connection.unsent_head = 0;
+    connection.unsent_length = ends[whole] - sent;
+    memcpy(connection.unsent, sending + sent, connection.unsent_length);
+    taken += lengths[whole ++];
+  }
+  connection.send.sequence -= records - whole;
+  pthread_mutex_unlock(&sending_lock);
+  if (sent < 0) {
+    return -1;
+  }
+  if (taken == 0 && records) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return taken;
+}
+
+int tls_sendmsg(int fd, const msghdr *message, int flags) {
+  Connection *connection = find(fd);
+  if (connection == nullptr) {
+    return sendmsg(fd, message, flags);
+  }
+  if (!connection -> kernel_send) {
+    return send_records(*connection, message, flags);
+  }
+
+  // MSG_MORE would leave the kernel's record open past an uncork, so TCP_CORK holds the segments
+  // back instead, which the uncork releases as for plain frames
+  bool more = flags & MSG_MORE;
+  if (more && !connection -> corked) {
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &enable, sizeof(int));
+    connection -> corked = true;
+  }
+  int sent = sendmsg(fd, message, flags & ~MSG_MORE);
+  if (!more && connection -> corked) {
+    int disable = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &disable, sizeof(int));
+    connection -> corked = false;
+  }
+  return sent;
+}
+
+int tls_send(int fd, const u8 *data, u32 length, int flags) {
+  iovec vector = {(void *) data, length};
+  msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  return tls_sendmsg(fd, &message, flags);
+}
+
+int tls_recv(int fd, u8 *buffer, u32 length) {
+  Connection *connection = find(fd);
+  u64 deadline = now_us() + TLS_TIMEOUT * 1000ull;
+  bool progressed = false;
+  while (connection && connection -> plain_length == 0 && !connection -> kernel_recv) {
+    int filled = fill_record(*connection, deadline, progressed);
+    if (filled <= 0) {
+      return filled;
+    }
+    connection -> record_length = 0;
+    progressed = true;
+    u32 content = 0;
+    int type = connection -> record[0] == RECORD_DATA ? open_record(connection -> recv, connection -> record, content) : -1;
+    if (type == RECORD_DATA) {
+      // The first data record follows the tickets, the kernel takes over from the next one
+      connection -> plain_head = RECORD_HEADER;
+      connection -> plain_length = content;
+      if (connection -> ulp && offload(fd, KTLS_RX, connection -> recv)) {
+        connection -> kernel_recv = true;
+      }
+    } else if (type == RECORD_HANDSHAKE) {
+      if (!take_messages(*connection, content)) {
+        errno = EPROTO;
+        return -1;
+      }
+    } else if (type == RECORD_ALERT && content >= 2 && connection -> record[RECORD_HEADER + 1] == 0) {
+      return 0; // close_notify
+    } else {
+      error("Bad record from the server (type %d)", type);
+      errno = type == RECORD_ALERT ? ECONNRESET : EBADMSG;
+      return -1;
+    }
+  }
+  if (connection == nullptr || connection -> plain_length == 0) {
+    return recv(fd, buffer, length, MSG_DONTWAIT);
+  }
+  u32 taken = length < connection -> plain_length ? length : connection -> plain_length;
+  memcpy(buffer, connection -> record + connection -> plain_head, taken);
+  connection -> plain_head += taken;
+  connection -> plain_length -= taken;
+  return taken;
+}
+
+bool tls_unsent(int fd) {
+  Connection *connection = find(fd);
+  return connection && connection -> unsent_length;
+}
+
+bool tls_pending(int fd) {
+  Connection *connection = find(fd);
+  return connection && connection -> plain_length;
+}
+
+bool tls_configure(const u8 *key, u32 length, int cipher) {
+  enabled = false;
+  for (int i = 0; i < TLS_CONNECTIONS; ++ i) {
+    connections[i].ready = false;
+    connections[i].fd = -1;
+  }
+  for (int i = 0; i < TLS_TICKETS; ++ i) {
+    tickets[i].valid = false;
+  }
+  if (key == nullptr || length == 0) {
+    return true;
+  }
+  if (length != TLS_KEY_LENGTH) {
+    error("Key must be %d bytes (got %d)", TLS_KEY_LENGTH, length);
+    return false;
+  }
+  if (cipher == CRYPTO_AUTO) {
+    cipher = gcm_accelerated() ? CRYPTO_AES_GCM : CRYPTO_CHACHA;
+  }
+  suite = &suites[cipher == CRYPTO_AES_GCM ? 0 : 1];
+  memcpy(psk, key, TLS_KEY_LENGTH);
+  tls_handshakes = tls_resumed = tls_tickets = tls_offloaded = tls_handshake_us = 0;
+  enabled = true;
+  return true;
+}
+
+bool tls_enabled() {
+  return enabled;
+}
+
+const char* tls_suite() {
+  return enabled ? suite -> name : "off";
+}
@@ -0,0 +1,58 @@
+// Kernel TLS of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Native C++
+# include <sys/socket.h>
+
+// Parameters
+# define TLS_KEY_LENGTH               32
+# define TLS_PSK_IDENTITY             "4over6"
+# define TLS_RECORD_LENGTH            16384 // plaintext bytes per record
+# define TLS_CONNECTIONS              4     // sockets with a session at once (primary, standby, retired, handshaking)
+# define TLS_TICKETS                  4     // resumption tickets kept, each used once
+# define TLS_TICKET_LENGTH            1024
+# define TLS_SEND_RECORDS             4     // records sealed per send in user space
+# define TLS_TIMEOUT                  4000  // ms, for the handshake and for the rest of a record
+
+// The tunnel can run over TLS 1.3 instead of sealing frames one by one. The handshake runs here,
+// with the pre-shared key as an external PSK (identity TLS_PSK_IDENTITY) and an X25519 exchange for
+// forward secrecy; a ticket from an earlier connection (the primary's, for the standby) resumes
+// instead, without the exchange if the server allows it. The record keys are then handed to the
+// kernel (TCP_ULP "tls"), so the socket keeps plain send/recv (and splice) and the writer's
+// coalescing. Without kernel support, records are sealed and opened here instead, behind the same
+// calls. Reception stays in user space up to the first application record, so the tickets sent
+// after the handshake are taken first. The cipher suite follows the frame cipher
+// (TLS_AES_256_GCM_SHA384 or TLS_CHACHA20_POLY1305_SHA256), both ends must agree
+
+// Statistics
+extern u32 tls_handshakes, tls_resumed, tls_tickets, tls_offloaded, tls_handshake_us;
+
+// Set the key (nullptr to disable) and cipher, before open, returns false if the key is refused
+bool tls_configure(const u8 *key, u32 length, int cipher);
+bool tls_enabled();
+const char* tls_suite();
+
+// Handshake on a connected socket, false if it failed or 'cancel' became readable
+bool tls_handshake(int fd, int cancel);
+
+// Where records of a socket are sealed and opened
+const char* tls_mode(int fd);
+
+// As sendmsg/send, and recv with MSG_DONTWAIT (waiting for the rest of a started record), on any
+// socket, with or without a session. Sends without MSG_DONTWAIT wait up to TLS_TIMEOUT for records
+// sealed in user space to go out whole
+int tls_sendmsg(int fd, const msghdr *message, int flags);
+int tls_send(int fd, const u8 *data, u32 length, int flags);
+int tls_recv(int fd, u8 *buffer, u32 length);
+
+// Whether the rest of a record cut short by MSG_DONTWAIT waits to be sent by the next tls_sendmsg on
+// the socket (one without data only sends that), the bytes it carries were taken already
+bool tls_unsent(int fd);
+
+// Whether opened data is waiting in user space, so polling the socket would miss it
+bool tls_pending(int fd);
@@ -0,0 +1,479 @@
+// Socket writer of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "compress.h"
+# include "crypto.h"
+# include "dedup.h"
+# include "pool.h"
+# include "queue.h"
+# include "rohc.h"
+# include "shaper.h"
+# include "tls.h"
+# include "writer.h"
+
+// Native C++
+# include <atomic>
+# include <cstring>
+# include <errno.h>
+# include <fcntl.h>
+# include <linux/sockios.h>
+# include <poll.h>
+# include <pthread.h>
+# include <sys/eventfd.h>
+# include <sys/ioctl.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <unistd.h>
+
+// Data frames taken from the queue but not completely written yet, in order
+static Message *inflight[WRITER_BATCH];
+static int inflight_count;
+
+// Frames being sealed by the workers, and those handed back in order but not taken yet (the ring
+// holds at most WRITER_BATCH frames, as the writer never has more outside the queue)
+static PoolStage sealing;
+static Message *sealed_ring[WRITER_BATCH];
+static u32 sealed_head, sealed_tail;
+static pthread_mutex_t sealed_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pooled;
+static u32 pooled_bytes;
+
+// Control ring (multiple producers)
+static Message control_ring[WRITER_CONTROL_LENGTH];
+static u32 control_head, control_tail;
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Wakeups
+static int wake_fd = -1, shutdown_fd = -1, source_fd = -1;
+
+// Energy mode, piggyback frame is protected by control_lock, bursts are tracked by the writer thread
+static std::atomic<bool> energy;
+static Message piggyback;
+static u64 piggyback_due_us; // 0 if none
+static u64 burst_until_us, hold_until_us;
+
+// Socket
+static std::atomic<int> attached_fd;
+static std::atomic<u32> attached_generation;
+
+// Statistics
+u32 writer_frames, writer_partial, writer_controls, writer_corked, writer_socket_frames;
+u32 writer_notsent, writer_bursts, writer_wakeups;
+u64 writer_bytes;
+volatile u64 writer_last_us;
+
+static void wake(int fd) {
+  eventfd_write(fd, 1);
+}
+
+// Workers encrypt frames already numbered by the writer
+static void seal_task(Message **frames, bool *passed, int count) {
+  crypto_encrypt(frames, count);
+}
+
+static void seal_deliver(Message **frames, const bool *passed, int count) {
+  pthread_mutex_lock(&sealed_lock);
+  for (int i = 0; i < count; ++ i) {
+    sealed_ring[(sealed_head ++) & (WRITER_BATCH - 1)] = frames[i];
+  }
+  pthread_mutex_unlock(&sealed_lock);
+  wake(wake_fd);
+}
+
+void writer_init(int shutdown, int source) {
+  if (wake_fd == -1) {
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  }
+  eventfd_t value;
+  eventfd_read(wake_fd, &value);
+  shutdown_fd = shutdown;
+  source_fd = source;
+
+  queue_init();
+  pool_stage_init(sealing, seal_task, seal_deliver);
+  inflight_count = 0;
+  sealed_head = sealed_tail = 0;
+  pooled = 0;
+  pooled_bytes = 0;
+  control_head = control_tail = 0;
+  piggyback_due_us = burst_until_us = hold_until_us = 0;
+  attached_fd = -1;
+  writer_frames = writer_partial = writer_controls = writer_corked = writer_socket_frames = 0;
+  writer_notsent = writer_bursts = writer_wakeups = 0;
+  writer_bytes = 0;
+  writer_last_us = now_us();
+}
+
+void writer_attach(int fd) {
+  // Only a little unsent data is left to the kernel, POLLOUT waits until it drains below that
+  u32 lowat = WRITER_NOTSENT_LOWAT;
+  setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(u32));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  attached_fd = fd;
+  ++ attached_generation;
+  wake(wake_fd);
+}
+
+Message* writer_reserve() {
+  return queue_reserve();
+}
+
+void writer_commit(Message *message) {
+  writer_commit_class(message, PACKET_AUTO);
+}
+
+void writer_commit_class(Message *message, int type) {
+  if (queue_enqueue(message, type)) {
+    wake(wake_fd);
+  }
+}
+
+void writer_discard(Message *message) {
+  queue_release(message);
+}
+
+bool writer_control(const Message &message) {
+  pthread_mutex_lock(&control_lock);
+  bool queued = control_head - control_tail < WRITER_CONTROL_LENGTH;
+  if (queued) {
+    Message &slot = control_ring[control_head & (WRITER_CONTROL_LENGTH - 1)];
+    memcpy(&slot, &message, message.length);
+    ++ control_head;
+  }
+  pthread_mutex_unlock(&control_lock);
+  if (queued) {
+    wake(wake_fd);
+  }
+  return queued;
+}
+
+void writer_piggyback(const Message &message, u32 slack) {
+  if (!energy) {
+    writer_control(message);
+    return;
+  }
+  pthread_mutex_lock(&control_lock);
+  memcpy(&piggyback, &message, message.length);
+  piggyback_due_us = now_us() + (u64) slack * 1000;
+  pthread_mutex_unlock(&control_lock);
+  wake(wake_fd);
+}
+
+void writer_energy(bool enabled) {
+  energy = enabled;
+  if (wake_fd != -1) {
+    wake(wake_fd);
+  }
+}
+
+// Whether the radio is (about to be) up anyway, so held data can go along, always in normal mode.
+// A burst opens for urgent frames, for an overdue piggyback frame, for a large backlog, or at the
+// aligned boundary after bulk data was first held, called with control_lock held
+static bool burst_open(u64 now, bool urgent) {
+  if (!energy || now < burst_until_us) {
+    return true;
+  }
+  if (queue_bulk_pending() && hold_until_us == 0) {
+    hold_until_us = (now / (WRITER_BURST_INTERVAL * 1000) + 1) * WRITER_BURST_INTERVAL * 1000;
+  }
+  bool due = piggyback_due_us && now >= piggyback_due_us;
+  if (urgent || due || (hold_until_us && now >= hold_until_us) || queue_bytes() >= WRITER_BURST_BYTES) {
+    burst_until_us = now + WRITER_BURST_TAIL * 1000;
+    hold_until_us = 0;
+    ++ writer_bursts;
+    return true;
+  }
+  return false;
+}
+
+// Whether the producer has more packets to frame right away
+static bool source_pending() {
+  pollfd fds = {source_fd, POLLIN, 0};
+  return poll(&fds, 1, 0) > 0;
+}
+
+// Push out anything held back by MSG_MORE
+static void uncork(int fd) {
+  int disable = 0;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &disable, sizeof(int));
+}
+
+// Writer thread
+void* writer_thread(void *_) {
+  // The first frame may be partially written, it is finished before anything else (frame boundary)
+  int fd = -1;
+  u32 offset = 0, generation = attached_generation - 1;
+  bool partial_control = false;
+  u64 corked_us = 0; // when the oldest held back frame was written, 0 if nothing held back
+
+  iovec iov[WRITER_BATCH];
+  bool control[WRITER_BATCH];
+  bool blocked = false;
+  while (true) {
+    // Wait for writability, or for a socket to be attached
+    pollfd fds[2] = {{shutdown_fd, POLLIN, 0}, blocked ? pollfd {fd, POLLOUT, 0} : pollfd {wake_fd, POLLIN, 0}};
+    if (blocked || fd == -1) {
+      if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+        break;
+      }
+      if (fds[0].revents) {
+        break;
+      }
+      if (!blocked && fds[1].revents) {
+        eventfd_t value;
+        eventfd_read(wake_fd, &value);
+      }
+    }
+    if (attached_generation != generation) {
+      // Framing restarts on a new connection
+      generation = attached_generation;
+      fd = attached_fd;
+      writer_socket_frames = 0;
+      offset = 0;
+      partial_control = false;
+      blocked = false;
+      corked_us = 0;
+      continue;
+    }
+    if (fd == -1) {
+      continue;
+    }
+
+    // Gather: unfinished frame, then control frames, then data frames
+    // (a piggyback frame joins the control frames once a burst is open)
+    int count = 0, data = 0;
+    u64 now = now_us();
+    pthread_mutex_lock(&control_lock);
+    bool open = burst_open(now, control_head != control_tail || queue_priority_pending());
+    if (open && piggyback_due_us && control_head - control_tail < WRITER_CONTROL_LENGTH) {
+      memcpy(&control_ring[(control_head ++) & (WRITER_CONTROL_LENGTH - 1)], &piggyback, piggyback.length);
+      piggyback_due_us = 0;
+    }
+    u32 controls = control_tail, controls_end = control_head;
+    pthread_mutex_unlock(&control_lock);
+    if (offset && !partial_control) {
+      Message &message = *inflight[data ++];
+      iov[count] = {(u8 *) &message + offset, message.length - offset};
+      control[count ++] = false;
+    }
+    for (; controls != controls_end && count < WRITER_BATCH; ++ controls) {
+      Message &message = control_ring[controls & (WRITER_CONTROL_LENGTH - 1)];
+      u32 skip = (count == 0) ? offset : 0;
+      iov[count] = {(u8 *) &message + skip, message.length - skip};
+      control[count ++] = true;
+    }
+
+    // Frames sealed by the workers join in order
+    pthread_mutex_lock(&sealed_lock);
+    for (; sealed_tail != sealed_head; ++ sealed_tail) {
+      Message *message = sealed_ring[sealed_tail & (WRITER_BATCH - 1)];
+      inflight[inflight_count ++] = message;
+      -- pooled;
+      pooled_bytes -= message -> length;
+    }
+    pthread_mutex_unlock(&sealed_lock);
+    for (; data < inflight_count && count < WRITER_BATCH; ++ data) {
+      iov[count] = {(u8 *) inflight[data], inflight[data] -> length};
+      control[count ++] = false;
+    }
+
+    // Data beyond the unsent budget of the kernel stays queued, where flows are still scheduled
+    int notsent = 0;
+    ioctl(fd, SIOCOUTQNSD, &notsent);
+    writer_notsent = notsent;
+    u32 budget = notsent < WRITER_NOTSENT_LIMIT ? WRITER_NOTSENT_LIMIT - notsent : 0, bytes = pooled_bytes;
+    // Then the shaper, which paces each tier by its own and the total token bucket, and energy mode
+    u64 shaped = 0;
+    int fresh = inflight_count;
+    while (inflight_count + pooled < WRITER_BATCH && bytes < budget) {
+      u64 priority_delay = shaper_delay(SHAPER_UP, SHAPER_PRIORITY);
+      u64 bulk_delay = shaper_delay(SHAPER_UP, SHAPER_BULK);
+      if (!open) {
+        u64 hold = hold_until_us > now ? hold_until_us - now : 1;
+        bulk_delay = hold > bulk_delay ? hold : bulk_delay;
+      }
+      Message *message = queue_dequeue(priority_delay == 0, bulk_delay == 0);
+      if (message == nullptr) {
+        // Wait for the first tier with packets to get tokens (or for the burst)
+        shaped = queue_priority_pending() ? priority_delay : 0;
+        if (queue_bulk_pending() && (shaped == 0 || bulk_delay < shaped)) {
+          shaped = bulk_delay;
+        }
+        break;
+      }
+      // Charged to the queue it came from, which the packet filter may have chosen
+      shaper_consume(SHAPER_UP, queue_prioritized(message) ? SHAPER_PRIORITY : SHAPER_BULK, message -> length);
+      inflight[inflight_count ++] = message;
+      bytes += message -> length;
+    }
+
+    // Frames are packed once dequeued, then sealed in sending order, by the writer for a small batch
+    // or by the workers for a larger one (and for anything behind frames still with them)
+    int sealing_count = inflight_count - fresh;
+    dedup_frames(inflight + fresh, sealing_count);
+    compress_frames(inflight + fresh, sealing_count);
+    rohc_frames(inflight + fresh, sealing_count);
+    if (crypto_enabled() && pool_workers() && sealing_count && (pooled || sealing_count > POOL_BATCH)) {
+      crypto_wrap(inflight + fresh, sealing_count);
+      for (int i = fresh; i < inflight_count; ++ i) {
+        pooled_bytes += inflight[i] -> length;
+      }
+      pooled += sealing_count;
+      for (int i = fresh; i < inflight_count; i += POOL_BATCH) {
+        pool_submit(sealing, inflight + i, inflight_count - i < POOL_BATCH ? inflight_count - i : POOL_BATCH);
+      }
+      inflight_count = fresh;
+    } else if (crypto_enabled()) {
+      crypto_seal(inflight + fresh, sealing_count);
+    }
+    for (; fresh < inflight_count && count < WRITER_BATCH; ++ fresh) {
+      iov[count] = {(u8 *) inflight[fresh], inflight[fresh] -> length};
+      control[count ++] = false;
+    }
+    // Nothing to write unless TLS has the rest of a record cut short, which goes out first anyway
+    bool idle = count == 0 && !tls_unsent(fd);
+    if (idle && shaped) {
+      // Nothing is held back while pacing, priority packets and control frames still wake us up
+      if (corked_us) {
+        uncork(fd);
+        corked_us = 0;
+      }
+      if (!shaper_sleep(SHAPER_UP, shaped, wake_fd, shutdown_fd)) {
+        break;
+      }
+      eventfd_t value;
+      eventfd_read(wake_fd, &value);
+      continue;
+    }
+    if (idle && pooled) {
+      // Frames are with the workers, their delivery wakes us up
+      pollfd sealing_fds[2] = {{wake_fd, POLLIN, 0}, {shutdown_fd, POLLIN, 0}};
+      if (poll(sealing_fds, 2, -1) > 0 && sealing_fds[1].revents) {
+        break;
+      }
+      eventfd_t value;
+      eventfd_read(wake_fd, &value);
+      continue;
+    }
+    if (idle && !queue_empty()) {
+      // Frames held back by MSG_MORE count as unsent too
+      if (corked_us) {
+        uncork(fd);
+        corked_us = 0;
+      }
+      blocked = true;
+      continue;
+    }
+    if (idle) {
+      // Idle, sleep until woken, or until the coalescing deadline if frames are held back, or until
+      // a piggyback frame is due
+      blocked = false;
+      if (corked_us && !source_pending()) {
+        uncork(fd);
+        corked_us = 0;
+      }
+      pollfd idle[2] = {{wake_fd, POLLIN, 0}, {shutdown_fd, POLLIN, 0}};
+      u64 until = corked_us ? corked_us + WRITER_CORK_DEADLINE : 0;
+      pthread_mutex_lock(&control_lock);
+      if (piggyback_due_us && (until == 0 || piggyback_due_us < until)) {
+        until = piggyback_due_us;
+      }
+      pthread_mutex_unlock(&control_lock);
+      now = now_us();
+      u64 remaining = until > now ? until - now : 0;
+      timespec timeout = {(time_t) (remaining / 1000000), (long) (remaining % 1000000) * 1000};
+      int ready = queue_empty() ? ppoll(idle, 2, until ? &timeout : nullptr, nullptr) : 1;
+      if (ready > 0 && idle[1].revents) {
+        break;
+      }
+      if (ready == 0 && corked_us) {
+        uncork(fd);
+        corked_us = 0;
+      }
+      eventfd_t value;
+      eventfd_read(wake_fd, &value);
+      continue;
+    }
+
+    // Coalesce with MSG_MORE while more packets are on the way (bulk), flush at once otherwise
+    // (interactive, control) and never hold a frame back past the deadline
+    now = now_us();
+    bool more = (!queue_empty() || pooled || source_pending()) && count && !control[count - 1];
+    if (more && !corked_us) {
+      corked_us = now;
+    }
+    int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    if (more && now - corked_us < WRITER_CORK_DEADLINE) {
+      flags |= MSG_MORE;
+      ++ writer_corked;
+    } else {
+      corked_us = 0;
+    }
+
+    msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = iov;
+    header.msg_iovlen = count;
+    ssize_t written = tls_sendmsg(fd, &header, flags);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        // Held back frames count against TCP_NOTSENT_LOWAT, so the socket would stay unwritable
+        // until the kernel's cork timer
+        if (corked_us) {
+          uncork(fd);
+          corked_us = 0;
+        }
+        blocked = true;
+        continue;
+      }
+      // Let recv_thread notice and fail over, then wait to be attached again
+      error("Failed to write socket %d (%s)", fd, strerror(errno));
+      shutdown(fd, SHUT_RDWR);
+      fd = -1;
+      blocked = false;
+      continue;
+    }
+    // The radio wakes up for a write after a silence, and stays up for the tail of a burst
+    if (now - writer_last_us >= WRITER_WAKEUP_GAP * 1000) {
+      ++ writer_wakeups;
+    }
+    writer_last_us = now_us();
+    writer_bytes += written;
+    if (energy) {
+      burst_until_us = writer_last_us + WRITER_BURST_TAIL * 1000;
+    }
+
+    // Release completely written frames
+    u32 released = 0;
+    for (int i = 0; i < count; ++ i) {
+      if ((size_t) written < iov[i].iov_len) {
+        offset = (i == 0 ? offset : 0) + written;
+        partial_control = control[i];
+        ++ writer_partial;
+        break;
+      }
+      written -= iov[i].iov_len;
+      offset = 0;
+      ++ writer_frames;
+      ++ writer_socket_frames;
+      if (control[i]) {
+        pthread_mutex_lock(&control_lock);
+        ++ control_tail;
+        pthread_mutex_unlock(&control_lock);
+        ++ writer_controls;
+      } else {
+        queue_release(inflight[released ++]);
+      }
+    }
+    blocked = offset != 0 || tls_unsent(fd);
+    if (released) {
+      inflight_count -= released;
+      memmove(inflight, inflight + released, inflight_count * sizeof(Message *));
+    }
+  }
+  debug("Writer thread ends");
+  return nullptr;
+}
@@ -0,0 +1,62 @@
+// Socket writer of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "message.h"
+
+// Parameters
+# define WRITER_CONTROL_LENGTH        16    // control frames, must be a power of 2
+# define WRITER_BATCH                 64    // frames per writev
+# define WRITER_CORK_DEADLINE         500   // us, longest a frame is held back for coalescing
+# define WRITER_NOTSENT_LOWAT         16384 // bytes, TCP_NOTSENT_LOWAT
+# define WRITER_NOTSENT_LIMIT         32768 // bytes of unsent data the writer leaves to the kernel
+# define WRITER_BURST_INTERVAL        250   // ms, energy mode releases held bulk data at multiples of this
+# define WRITER_BURST_TAIL            50    // ms, a burst stays open this long after the last write
+# define WRITER_BURST_BYTES           65536 // bytes, energy mode never holds more than this
+# define WRITER_WAKEUP_GAP            100   // ms of silence before a write counts as a new wakeup
+
+// The writer thread is the only one writing to the primary socket. Data frames come from a
+// single producer (send_thread) through the FQ-CoDel queue, control frames from any thread, and
+// control frames go ahead of queued data at the next frame boundary. While the producer has more
+// packets pending, frames are coalesced into full segments with MSG_MORE, until the source goes
+// idle or the deadline passes. The kernel only gets a small unsent budget, so any backlog builds
+// up in the queue, where flows are isolated and CoDel keeps the sojourn time down.
+// In energy mode, bulk data is held until a burst opens (on the aligned boundary, for urgent frames,
+// or for a large backlog), so the radio wakes up less often, and heartbeats ride on those bursts
+
+// Statistics
+extern u32 writer_frames, writer_partial, writer_controls, writer_corked;
+extern u32 writer_socket_frames; // frames on the current socket
+extern u32 writer_notsent; // unsent bytes in the kernel, last seen
+extern u32 writer_bursts, writer_wakeups;
+extern u64 writer_bytes;
+extern volatile u64 writer_last_us; // last time anything was written
+
+// Reset queues, must be called before the writer thread starts, waits end once 'shutdown' is readable
+// 'source' is the descriptor the producer reads packets from
+void writer_init(int shutdown, int source);
+
+// Switch to a (new) primary socket, an unfinished frame is restarted on it
+void writer_attach(int fd);
+
+// Data frames (single producer): reserve a slot, fill it and commit (as packet class 'type', or
+// classified by the queue), or discard it if unused
+Message* writer_reserve();
+void writer_commit(Message *message);
+void writer_commit_class(Message *message, int type);
+void writer_discard(Message *message);
+
+// Control frames (any thread), returns false if the control queue is full
+bool writer_control(const Message &message);
+
+// Control frame that can wait up to 'slack' ms for the next burst in energy mode (a control frame
+// otherwise), replaces the one still waiting
+void writer_piggyback(const Message &message, u32 slack);
+
+// Switch energy mode, any time
+void writer_energy(bool enabled);
+
+// Writer thread, runs until shutdown
+void* writer_thread(void *_);
@@ -0,0 +1,156 @@
+// X25519 of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "x25519.h"
+
+// Field element, 16 limbs of 16 bits (with room for carries)
+typedef i64 Field[16];
+
+static const Field a24 = {0xdb41, 1}; // (486662 - 2) / 4
+
+// Propagate carries, the one out of the top limb wraps around times 38 (2^256 = 38 mod p)
+static void carry(Field o) {
+  for (int i = 0; i < 16; ++ i) {
+    o[i] += (i64) 1 << 16;
+    i64 c = o[i] >> 16;
+    o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+    o[i] -= c * ((i64) 1 << 16);
+  }
+}
+
+// Swap p and q if b is 1, without branching
+static void swap(Field p, Field q, int b) {
+  i64 mask = ~((i64) b - 1);
+  for (int i = 0; i < 16; ++ i) {
+    i64 t = mask & (p[i] ^ q[i]);
+    p[i] ^= t;
+    q[i] ^= t;
+  }
+}
+
+static void pack(u8 *o, const Field n) {
+  Field m, t;
+  for (int i = 0; i < 16; ++ i) {
+    t[i] = n[i];
+  }
+  carry(t);
+  carry(t);
+  carry(t);
+  for (int j = 0; j < 2; ++ j) {
+    m[0] = t[0] - 0xffed;
+    for (int i = 1; i < 15; ++ i) {
+      m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+      m[i - 1] &= 0xffff;
+    }
+    m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+    int b = (int) ((m[15] >> 16) & 1);
+    m[14] &= 0xffff;
+    swap(t, m, 1 - b);
+  }
+  for (int i = 0; i < 16; ++ i) {
+    o[2 * i] = (u8) t[i];
+    o[2 * i + 1] = (u8) (t[i] >> 8);
+  }
+}
+
+static void unpack(Field o, const u8 *n) {
+  for (int i = 0; i < 16; ++ i) {
+    o[i] = n[2 * i] + ((i64) n[2 * i + 1] << 8);
+  }
+  o[15] &= 0x7fff;
+}
+
+static void add(Field o, const Field a, const Field b) {
+  for (int i = 0; i < 16; ++ i) {
+    o[i] = a[i] + b[i];
+  }
+}
+
+static void sub(Field o, const Field a, const Field b) {
+  for (int i = 0; i < 16; ++ i) {
+    o[i] = a[i] - b[i];
+  }
+}
+
+static void mul(Field o, const Field a, const Field b) {
+  i64 t[31] = {0};
+  for (int i = 0; i < 16; ++ i) {
+    for (int j = 0; j < 16; ++ j) {
+      t[i + j] += a[i] * b[j];
+    }
+  }
+  for (int i = 0; i < 15; ++ i) {
+    t[i] += 38 * t[i + 16];
+  }
+  for (int i = 0; i < 16; ++ i) {
+    o[i] = t[i];
+  }
+  carry(o);
+  carry(o);
+}
+
+// a^(p - 2)
+static void invert(Field o, const Field a) {
+  Field c;
+  for (int i = 0; i < 16; ++ i) {
+    c[i] = a[i];
+  }
+  for (int i = 253; i >= 0; -- i) {
+    mul(c, c, c);
+    if (i != 2 && i != 4) {
+      mul(c, c, a);
+    }
+  }
+  for (int i = 0; i < 16; ++ i) {
+    o[i] = c[i];
+  }
+}
+
+void x25519(u8 *shared, const u8 *scalar, const u8 *point) {
+  u8 z[32];
+  for (int i = 0; i < 32; ++ i) {
+    z[i] = scalar[i];
+  }
+  z[31] = (z[31] & 127) | 64;
+  z[0] &= 248;
+
+  Field x, a = {1}, b, c = {0}, d = {1}, e, f;
+  unpack(x, point);
+  for (int i = 0; i < 16; ++ i) {
+    b[i] = x[i];
+  }
+  for (int i = 254; i >= 0; -- i) {
+    int bit = (z[i >> 3] >> (i & 7)) & 1;
+    swap(a, b, bit);
+    swap(c, d, bit);
+    add(e, a, c);
+    sub(a, a, c);
+    add(c, b, d);
+    sub(b, b, d);
+    mul(d, e, e);
+    mul(f, a, a);
+    mul(a, c, a);
+    mul(c, b, e);
+    add(e, a, c);
+    sub(a, a, c);
+    mul(b, a, a);
+    sub(c, d, f);
+    mul(a, c, a24);
+    add(a, a, d);
+    mul(c, c, a);
+    mul(a, d, f);
+    mul(d, b, x);
+    mul(b, e, e);
+    swap(a, b, bit);
+    swap(c, d, bit);
+  }
+  invert(c, c);
+  mul(a, a, c);
+  pack(shared, a);
+}
+
+void x25519_public(u8 *key, const u8 *scalar) {
+  static const u8 base[32] = {9};
+  x25519(key, scalar, base);
+}
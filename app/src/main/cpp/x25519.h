@@ -0,0 +1,17 @@
+// X25519 of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+# include "common.h"
+
+// Parameters
+# define X25519_LENGTH                32
+
+// RFC 7748 Diffie-Hellman on Curve25519, a constant-time Montgomery ladder over 16-bit limbs in
+// 64-bit integers (as in TweetNaCl), portable and only used twice per handshake
+
+// 'shared' = 'scalar' * 'point', and the public key of a scalar
+void x25519(u8 *shared, const u8 *scalar, const u8 *point);
+void x25519_public(u8 *key, const u8 *scalar);
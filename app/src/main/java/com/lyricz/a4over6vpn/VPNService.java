@@ -26,7 +26,27 @@ public class VPNService extends VpnService {
     // Parameters
     static int NO_DELAY = 0;
     static int TIMER_INTERVAL = 1000;
-    static int MTU = 1500;
+    static int LIVENESS_PROBE_INTERVAL = 200;
+    static int LIVENESS_DETECT_TARGET = 2000;
+    static int SHAPER_UP = 0, SHAPER_DOWN = 1;
+    static int SHAPER_TOTAL = 0, SHAPER_PRIORITY = 1, SHAPER_BULK = 2;
+    static int SHAPER_UP_RATE = 0;                      // bytes per second, 0 for unlimited
+    static int SHAPER_DOWN_RATE = 0;
+    static int SHAPER_BURST = 65536;
+    static boolean ENERGY_MODE = false;
+    static byte[] TUNNEL_KEY = null;                    // 32-byte pre-shared key, null for cleartext frames
+    static int CIPHER_AUTO = 0, CIPHER_AES_GCM = 1, CIPHER_CHACHA = 2;
+    static int TUNNEL_CIPHER = CIPHER_AUTO;             // AES-GCM with AES instructions, ChaCha20-Poly1305 without
+    static boolean TUNNEL_TLS = false;                  // TLS 1.3 with TUNNEL_KEY as PSK instead of sealed frames
+    static boolean TUNNEL_COMPRESS = false;             // LZ4 payload compression, the server must take COMPRESSED frames
+    static boolean TUNNEL_HEADERS = false;              // TCP/UDP header compression, the server must take HEADER_* frames
+    static int TUNNEL_CACHE_MB = 0;                     // byte cache per direction, 0 for none, the server must take DEDUPED frames
+    static boolean TUNNEL_SPLIT = false;                // terminate TCP here and relay the bytes, the server must take STREAM_* frames
+    static int TUNNEL_PROXY_PORT = 0;                   // local SOCKS5/HTTP CONNECT proxy on 127.0.0.1, 0 for none, the same frames
+    static String TUNNEL_FILTER = null;                 // classic BPF on packets from tun, "count,code jt jf k,...", null for none
+                                                        // e.g. "5,32 0 0 16,84 0 0 4026531840,21 0 1 3758096384,6 0 0 0,6 0 0 1" drops multicast
+    static String TUNNEL_ROUTES = null;                 // route table in the files directory (prefixes to tunnel, bypass or drop), null for none
+    static int WORKERS = -1;                            // frame transform workers, -1 for one per core besides the first
 
     static String TAG = "VPNService";
     static String COMMAND = "VPNCommand";
@@ -83,6 +103,20 @@ public class VPNService extends VpnService {
         Log.d(TAG, "Start VPN Service with " + addr + "@" + port);
         serverIPv6Address = addr;
 
+        liveness(LIVENESS_PROBE_INTERVAL, LIVENESS_DETECT_TARGET);
+        shaper(SHAPER_UP, SHAPER_TOTAL, SHAPER_UP_RATE, SHAPER_BURST);
+        shaper(SHAPER_DOWN, SHAPER_TOTAL, SHAPER_DOWN_RATE, SHAPER_BURST);
+        energy(ENERGY_MODE);
+        tls(TUNNEL_TLS ? TUNNEL_KEY : null, TUNNEL_CIPHER);
+        crypto(TUNNEL_TLS ? null : TUNNEL_KEY, TUNNEL_CIPHER);
+        compress(TUNNEL_COMPRESS);
+        headers(TUNNEL_HEADERS);
+        cache(getCacheDir() + "/bytecache", TUNNEL_CACHE_MB);
+        split(TUNNEL_SPLIT);
+        proxy(TUNNEL_PROXY_PORT);
+        filter(TUNNEL_FILTER);
+        routes(TUNNEL_ROUTES == null ? null : getFilesDir() + "/" + TUNNEL_ROUTES);
+        workers(WORKERS);
         sockfd = open(addr, port);
         String info = request();
 
@@ -104,7 +138,7 @@ public class VPNService extends VpnService {
                     .addDnsServer(settings[2])                  // dns0
                     .addDnsServer(settings[3])                  // dns1
                     .addDnsServer(settings[4])                  // dns2
-                    .setMtu(MTU)                                // mtu
+                    .setMtu(mtu())                              // mtu, the path MTU learned by the engine
                     .establish();
 
             IPv4Address = settings[0];
@@ -166,6 +200,45 @@ public class VPNService extends VpnService {
      * A native method that is implemented by the 'native-lib' native library,
      * which is packaged with this application.
      */
+    // Configure liveness probing (milliseconds)
+    public native void liveness(int probeInterval, int detectTarget);
+
+    // Configure a shaper token bucket (bytes per second, 0 for unlimited), can be changed while running
+    public native void shaper(int direction, int tier, int rate, int burst);
+
+    // Switch energy mode (bursty upstream, piggybacked heartbeats, coalesced timers), can be changed while running
+    public native void energy(boolean enabled);
+
+    // Set the pre-shared key (null for none) and cipher of frame encryption, before open
+    public native boolean crypto(byte[] key, int cipher);
+
+    // Run the tunnel over TLS 1.3 with a pre-shared key (null for none), before open
+    public native boolean tls(byte[] key, int cipher);
+
+    // Switch LZ4 compression of sent frames, before open
+    public native boolean compress(boolean enabled);
+
+    // Switch TCP/UDP header compression of sent frames, before open
+    public native boolean headers(boolean enabled);
+
+    // Map the byte cache in a file (megabytes per direction, 0 to disable), before open
+    public native boolean cache(String path, int megabytes);
+
+    // Switch split TCP (TCP of apps terminated here, only the bytes travel), before open
+    public native boolean split(boolean enabled);
+
+    // Listen for SOCKS5 and HTTP CONNECT on 127.0.0.1 (0 for none), before open
+    public native boolean proxy(int port);
+
+    // Install a packet filter (classic BPF in the iptables bytecode format, null for none), any time
+    public native boolean filter(String bytecode);
+
+    // Load a route table file of destination prefixes to tunnel, bypass or drop (null for none), any time
+    public native boolean routes(String path);
+
+    // Set the number of frame transform workers (-1 for one per core besides the first), before open
+    public native void workers(int count);
+
     // Open a new socket
     public native int open(String addr, String port);
 
@@ -175,6 +248,9 @@ public class VPNService extends VpnService {
     // Request for a VPN address
     public native String request();
 
+    // MTU for the tun, learned by path MTU discovery of earlier sessions
+    public native int mtu();
+
     // Tik-tok
     public native String tik();
 
@@ -0,0 +1,38 @@
+// Coalescing benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+
+// Parameters
+# define PHASE_DURATION               5000  // ms
+# define BULK_SIZE                    1400  // bytes per bulk packet
+# define PROBE_INTERVAL               10    // ms between interactive packets
+
+// Interactive packets alone and next to a bulk upload, over the wire when network
+// namespaces are available (segments are then cut at the MSS of a real link) or else on loopback:
+// echoed bulk throughput, round trips of the interactive flow, and how many frames went out in
+// how many TCP segments
+static void phase(Session &session, const char *name, u32 bulk_size) {
+  u32 frames = tik_value("Coalescing: "), segments = tik_value("frames in "), held = tik_value("segments, ");
+  SessionLoad load = session_load(session, PHASE_DURATION, bulk_size, PROBE_INTERVAL, false);
+  frames = tik_value("Coalescing: ") - frames;
+  segments = tik_value("frames in ") - segments;
+  held = tik_value("segments, ") - held;
+  printf("%-12s %6d kbit/s, interactive %d/%d echoed, RTT %d/%d/%d us (median/p99/max), %d frames in %d segments (%d.%02d per segment), %d held back\n",
+    name, load.bulk_kbps, load.echoed, load.probes, load.rtt_median_us, load.rtt_p99_us, load.rtt_max_us, frames, segments,
+    segments ? frames / segments : 0, segments ? frames * 100 / segments % 100 : 0, held);
+}
+
+int main() {
+  bool wire = wire_start();
+  const char *address = wire ? WIRE_SERVER : "127.0.0.1";
+  printf("Over %s\n", wire ? "the wire" : "loopback, network namespaces are not available");
+  u16 port = server_start(address);
+  Session session;
+  check(session_start(session, address, port), "session did not start");
+  phase(session, "Interactive", 0);
+  phase(session, "Mixed", BULK_SIZE);
+  session_stop(session);
+  return 0;
+}
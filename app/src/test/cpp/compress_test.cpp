@@ -0,0 +1,90 @@
+// Payload compression test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "compress.h"
+# include "harness.h"
+# include "packet.h"
+
+// Native C++
+# include <cstring>
+
+// Known answer (an LZ4 block with a long literal run and an overlapping match, from the reference
+// implementation) and a round trip at every level
+static const char *sample_text = "{\"tunnel\":\"4over6\",\"tunnel\":\"4over6\",\"tunnel\":\"4over6\",\"tunnel\":\"4over6\"}";
+static const u8 sample_block[30] = {
+  0xff, 0x04, 0x7b, 0x22, 0x74, 0x75, 0x6e, 0x6e, 0x65, 0x6c, 0x22, 0x3a, 0x22, 0x34, 0x6f, 0x76,
+  0x65, 0x72, 0x36, 0x22, 0x2c, 0x12, 0x00, 0x1e, 0x50, 0x65, 0x72, 0x36, 0x22, 0x7d};
+
+// DEDUPED frame of a UDP flow to 'port': its headers, then one literal chunk of 'chunk'
+static void deduped(Message &frame, u16 port, const u8 *chunk, u32 size) {
+  static u8 headers[DATA_MAX_LENGTH];
+  packet_udp(headers, IPV4_MIN_HEADER + UDP_HEADER + size, 0);
+  store16(headers + IPV4_MIN_HEADER + TRANSPORT_DESTINATION, port);
+  frame.type = DEDUPED;
+  frame.data[0] = NET_REQUEST;
+  frame.data[1] = IPV4_MIN_HEADER + UDP_HEADER;
+  memcpy(frame.data + 2, headers, IPV4_MIN_HEADER + UDP_HEADER);
+  u8 *ptr = frame.data + 2 + IPV4_MIN_HEADER + UDP_HEADER;
+  *ptr ++ = (u8) (size << 1 | 128);
+  *ptr ++ = (u8) (size >> 6);
+  memcpy(ptr, chunk, size);
+  frame.length = HEADER_LENGTH + (ptr + size - frame.data);
+}
+
+int main() {
+  check(compress_configure(true), "compression refused");
+  Message frame;
+  frame.type = COMPRESSED;
+  frame.length = HEADER_LENGTH + 1 + sizeof(sample_block);
+  frame.data[0] = NET_REPLY;
+  memcpy(frame.data + 1, sample_block, sizeof(sample_block));
+  check(compress_open(frame) && frame.type == NET_REPLY && frame.length == HEADER_LENGTH + strlen(sample_text)
+    && memcmp(frame.data, sample_text, strlen(sample_text)) == 0, "known answer not unpacked");
+
+  static u8 plain[DATA_MAX_LENGTH];
+  u32 size = sample_json(plain, 1400);
+  for (int level = 0; level < COMPRESS_LEVELS; ++ level) {
+    compress_level = level;
+    Message *frames[1] = {&frame};
+    frame.type = NET_REQUEST;
+    frame.length = HEADER_LENGTH + size;
+    memcpy(frame.data, plain, size);
+    compress_frames(frames, 1);
+    check(frame.type == COMPRESSED && frame.length < HEADER_LENGTH + size, "level %d did not pack", level);
+    printf("Level %d: %d -> %zu bytes\n", level, size, frame.length - HEADER_LENGTH);
+    check(compress_open(frame) && frame.type == NET_REQUEST && frame.length == HEADER_LENGTH + size
+      && memcmp(frame.data, plain, size) == 0, "level %d did not round trip", level);
+  }
+
+  // Damaged blocks are refused
+  frame.type = COMPRESSED;
+  frame.length = HEADER_LENGTH + 1 + sizeof(sample_block) - 3;
+  frame.data[0] = NET_REPLY;
+  memcpy(frame.data + 1, sample_block, sizeof(sample_block) - 3);
+  check(!compress_open(frame), "truncated block unpacked");
+  check(compress_rejected == 1, "%d rejected", compress_rejected);
+
+  // DEDUPED frames have verdicts by the flow of the headers they carry: random chunks of one flow
+  // leave the JSON of another packed
+  static u8 noise[1200];
+  u64 state = 0x4f3663;
+  for (u8 &byte: noise) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    byte = (u8) (state >> 56);
+  }
+  compress_level = 0;
+  Message *frames[1] = {&frame};
+  deduped(frame, 5000, noise, sizeof(noise));
+  compress_frames(frames, 1);
+  check(frame.type == DEDUPED && compress_missed == 1, "random chunk packed");
+  deduped(frame, 5001, plain, size);
+  u32 length = frame.length;
+  compress_frames(frames, 1);
+  check(frame.type == COMPRESSED && compress_bypassed == 0, "flow of JSON chunks skipped with the one of random chunks");
+  check(compress_open(frame) && frame.type == DEDUPED && frame.length == length, "packed DEDUPED frame did not round trip");
+  deduped(frame, 5000, noise, sizeof(noise));
+  compress_frames(frames, 1);
+  check(frame.type == DEDUPED && compress_bypassed == 1, "flow of random chunks not skipped");
+  return 0;
+}
@@ -0,0 +1,255 @@
+// Frame encryption test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "chacha.h"
+# include "crypto.h"
+# include "gcm.h"
+# include "harness.h"
+# include "hash.h"
+# include "packet.h"
+
+// Native C++
+# include <cstring>
+
+// Networks
+# include <poll.h>
+
+// GCM test case 16 (McGrew & Viega), AES-256 with AAD, and batches sealed as frame by frame
+static bool gcm_self_test() {
+  static const u8 test_key[32] = {
+    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08,
+    0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08};
+  static const u8 nonce[12] = {0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88};
+  static const u8 aad[20] = {
+    0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef, 0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+    0xab, 0xad, 0xda, 0xd2};
+  static const u8 plain[60] = {
+    0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+    0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda, 0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+    0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+    0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39};
+  static const u8 cipher[60] = {
+    0x52, 0x2d, 0xc1, 0xf0, 0x99, 0x56, 0x7d, 0x07, 0xf4, 0x7f, 0x37, 0xa3, 0x2a, 0x84, 0x42, 0x7d,
+    0x64, 0x3a, 0x8c, 0xdc, 0xbf, 0xe5, 0xc0, 0xc9, 0x75, 0x98, 0xa2, 0xbd, 0x25, 0x55, 0xd1, 0xaa,
+    0x8c, 0xb0, 0x8e, 0x48, 0x59, 0x0d, 0xbb, 0x3d, 0xa7, 0xb0, 0x8b, 0x10, 0x56, 0x82, 0x88, 0x38,
+    0xc5, 0xf6, 0x1e, 0x63, 0x93, 0xba, 0x7a, 0x0a, 0xbc, 0xc9, 0xf6, 0x62};
+  static const u8 tag[16] = {
+    0x76, 0xfc, 0x6e, 0xce, 0x0f, 0x4e, 0x17, 0x68, 0xcd, 0xdf, 0x88, 0x53, 0xbb, 0x2d, 0x55, 0x1b};
+
+  GcmKey test;
+  u8 data[60], computed[16];
+  gcm_init(test, test_key);
+  memcpy(data, plain, 60);
+  gcm_seal(test, nonce, aad, 20, data, 60, computed);
+  if (memcmp(data, cipher, 60) || memcmp(computed, tag, 16)) {
+    return false;
+  }
+  if (!gcm_open(test, nonce, aad, 20, data, 60, tag) || memcmp(data, plain, 60)) {
+    return false;
+  }
+
+  // A batch over more than one group, of every length up to a few passes and a full frame, as
+  // frames sealed one by one
+  static u8 batch[GCM_BATCH * 3][1500], single[1500], tags[GCM_BATCH * 3][16], nonces[GCM_BATCH * 3][12];
+  GcmJob jobs[GCM_BATCH * 3];
+  for (int i = 0; i < GCM_BATCH * 3; ++ i) {
+    u32 length = i + 1 < GCM_BATCH * 3 ? i * 5 : 1500;
+    memcpy(nonces[i], nonce, 12);
+    nonces[i][11] ^= i;
+    for (u32 j = 0; j < length; ++ j) {
+      batch[i][j] = (u8) (i + j * 7);
+    }
+    jobs[i] = {nonces[i], aad, (u32) (i % 21), batch[i], length, tags[i]};
+  }
+  gcm_seal_batch(test, jobs, GCM_BATCH * 3);
+  for (int i = 0; i < GCM_BATCH * 3; ++ i) {
+    for (u32 j = 0; j < jobs[i].length; ++ j) {
+      single[j] = (u8) (i + j * 7);
+    }
+    gcm_seal(test, nonces[i], aad, jobs[i].aad_length, single, jobs[i].length, computed);
+    if (memcmp(single, batch[i], jobs[i].length) || memcmp(computed, tags[i], 16)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// RFC 8439 2.8.2, sealed in a batch of copies that fills every lane and then some, and a frame
+// longer than one pass opened and forged
+static bool chacha_self_test() {
+  static const u8 test_key[32] = {
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f};
+  static const u8 nonce[12] = {0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+  static const u8 aad[12] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+  static const char plain[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+  static const u8 cipher[114] = {
+    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+    0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe, 0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+    0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+    0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+    0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c, 0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+    0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+    0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+    0x61, 0x16};
+  static const u8 tag[16] = {
+    0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a, 0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+
+  ChachaKey test;
+  chacha_init(test, test_key);
+  static u8 data[CHACHA_MAX_LANES + 1][114], computed[CHACHA_MAX_LANES + 1][16];
+  ChachaJob jobs[CHACHA_MAX_LANES + 1];
+  for (int i = 0; i <= CHACHA_MAX_LANES; ++ i) {
+    memcpy(data[i], plain, 114);
+    jobs[i] = {nonce, aad, 12, data[i], 114, computed[i]};
+  }
+  chacha_seal(test, jobs, CHACHA_MAX_LANES + 1);
+  for (int i = 0; i <= CHACHA_MAX_LANES; ++ i) {
+    if (memcmp(data[i], cipher, 114) || memcmp(computed[i], tag, 16)) {
+      return false;
+    }
+  }
+  if (!chacha_open(test, nonce, aad, 12, data[0], 114, tag) || memcmp(data[0], plain, 114)) {
+    return false;
+  }
+
+  static u8 frame[1500], copy[1500];
+  u8 frame_tag[16];
+  for (int i = 0; i < 1500; ++ i) {
+    frame[i] = copy[i] = (u8) i;
+  }
+  ChachaJob job = {nonce, aad, 12, frame, 1500, frame_tag};
+  chacha_seal(test, &job, 1);
+  frame[1499] ^= 1;
+  if (chacha_open(test, nonce, aad, 12, frame, 1500, frame_tag)) {
+    return false;
+  }
+  frame[1499] ^= 1;
+  return chacha_open(test, nonce, aad, 12, frame, 1500, frame_tag) && memcmp(frame, copy, 1500) == 0;
+}
+
+// Session key as the server derives it from the pre-shared key and the salt of a SALT frame
+static void session_keys(const u8 *shared, const Message &salt, GcmKey &gcm, ChachaKey &chacha) {
+  u8 secret[HASH_MAX_LENGTH], key[CRYPTO_KEY_LENGTH];
+  hkdf_extract(HASH_SHA256, salt.data, CRYPTO_SALT_LENGTH, shared, CRYPTO_KEY_LENGTH, secret);
+  hkdf_expand(HASH_SHA256, secret, (const u8 *) CRYPTO_KEY_INFO, sizeof(CRYPTO_KEY_INFO) - 1, key, CRYPTO_KEY_LENGTH);
+  gcm_init(gcm, key);
+  chacha_init(chacha, key);
+}
+
+static void nonce_for(u8 *nonce, u32 direction, u64 counter) {
+  store32(nonce, direction);
+  store64(nonce + 4, counter);
+}
+
+// A downstream frame sealed by the server, 'counter' and then the inner type and data, then the tag
+static Message sealed_down(int cipher, const GcmKey &gcm, const ChachaKey &chacha, u64 counter, const char *text) {
+  Message frame;
+  u32 length = 1 + strlen(text); // with the inner type
+  frame.type = cipher == CRYPTO_CHACHA ? SEALED_CHACHA : SEALED;
+  frame.length = HEADER_LENGTH + CRYPTO_COUNTER_LENGTH + length + CRYPTO_TAG_LENGTH;
+  store64(frame.data, counter);
+  u8 *inner = frame.data + CRYPTO_COUNTER_LENGTH, nonce[GCM_NONCE_LENGTH];
+  inner[0] = NET_REPLY;
+  memcpy(inner + 1, text, length - 1);
+  nonce_for(nonce, CRYPTO_DOWN, counter);
+  if (cipher == CRYPTO_CHACHA) {
+    ChachaJob job = {nonce, (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length};
+    chacha_seal(chacha, &job, 1);
+  } else {
+    gcm_seal(gcm, nonce, (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length);
+  }
+  return frame;
+}
+
+// An upstream frame sealed here, opened as the server would
+static bool open_up(int cipher, const GcmKey &gcm, const ChachaKey &chacha, Message frame, u8 *inner_type) {
+  u32 length = frame.length - HEADER_LENGTH - CRYPTO_COUNTER_LENGTH - CRYPTO_TAG_LENGTH;
+  u8 *inner = frame.data + CRYPTO_COUNTER_LENGTH, nonce[GCM_NONCE_LENGTH];
+  nonce_for(nonce, CRYPTO_UP, load64(frame.data));
+  bool opened = cipher == CRYPTO_CHACHA ?
+    chacha_open(chacha, nonce, (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length) :
+    gcm_open(gcm, nonce, (const u8 *) &frame, HEADER_LENGTH, inner, length, inner + length);
+  *inner_type = inner[0];
+  return opened;
+}
+
+// Both ciphers against known answers, then each session keyed apart from the others, so the
+// counters starting over never reuse a nonce, and replays refused across a whole session, and frames
+// in clear refused on a keyed one
+int main() {
+  check(gcm_self_test(), "AES-GCM known answer failed on %s", gcm_engine());
+  check(chacha_self_test(), "ChaCha20-Poly1305 known answer failed on %s", chacha_engine());
+
+  u8 shared[CRYPTO_KEY_LENGTH];
+  for (int i = 0; i < CRYPTO_KEY_LENGTH; ++ i) {
+    shared[i] = (u8) i;
+  }
+  for (int cipher = CRYPTO_AES_GCM; cipher <= CRYPTO_CHACHA; ++ cipher) {
+    check(crypto_configure(shared, CRYPTO_KEY_LENGTH, cipher), "key refused");
+    Message salts[2], sealed[2];
+    for (int session = 0; session < 2; ++ session) {
+      crypto_session();
+      check(crypto_salt(salts[session]) && salts[session].type == SALT, "no salt frame");
+      Message *frame = &sealed[session];
+      frame -> type = NET_REQUEST;
+      frame -> length = HEADER_LENGTH + 5;
+      memcpy(frame -> data, "hello", 5);
+      crypto_seal(&frame, 1);
+      check(load64(frame -> data) == 1, "counter did not start over");
+    }
+    check(memcmp(salts[0].data, salts[1].data, CRYPTO_SALT_LENGTH) != 0, "salt repeated");
+    check(memcmp(sealed[0].data, sealed[1].data, sealed[0].length - HEADER_LENGTH) != 0,
+      "same counter and plain text sealed the same in two sessions (%s)", crypto_cipher());
+
+    // The server opens frames of the current session only
+    GcmKey gcm, old_gcm;
+    ChachaKey chacha, old_chacha;
+    session_keys(shared, salts[1], gcm, chacha);
+    session_keys(shared, salts[0], old_gcm, old_chacha);
+    u8 type = 0;
+    check(open_up(cipher, gcm, chacha, sealed[1], &type) && type == NET_REQUEST, "server can not open a frame (%s)", crypto_cipher());
+    check(!open_up(cipher, gcm, chacha, sealed[0], &type), "frame of an earlier session opened");
+
+    // Counters only go up over the session, a frame of an earlier session does not open at all
+    Message frame = sealed_down(cipher, gcm, chacha, 1, "one");
+    check(crypto_open(frame) && frame.type == NET_REPLY && memcmp(frame.data, "one", 3) == 0, "frame 1 refused (%s)", crypto_cipher());
+    frame = sealed_down(cipher, gcm, chacha, 3, "three");
+    check(crypto_open(frame), "frame 3 refused");
+    frame = sealed_down(cipher, gcm, chacha, 1, "one");
+    check(!crypto_open(frame), "frame 1 replayed");
+    frame = sealed_down(cipher, gcm, chacha, 2, "two");
+    check(!crypto_open(frame), "frame 2 accepted after frame 3");
+    frame = sealed_down(cipher, old_gcm, old_chacha, 4, "four");
+    check(!crypto_open(frame), "frame of an earlier session accepted");
+    frame = sealed_down(cipher, gcm, chacha, 4, "four");
+    frame.data[CRYPTO_COUNTER_LENGTH + 2] ^= 1;
+    check(!crypto_open(frame), "forged frame accepted");
+    check(crypto_opened == 2 && crypto_rejected == 4, "%d opened, %d rejected", crypto_opened, crypto_rejected);
+    printf("%s (%s): sessions keyed apart, replays refused\n", crypto_cipher(), crypto_engine());
+  }
+  crypto_configure(nullptr, 0, CRYPTO_AUTO);
+  Message salt;
+  check(!crypto_salt(salt), "salt frame without a key");
+
+  // A packet in clear on a keyed session never reaches the tun, whoever sent it
+  HarnessBytes key;
+  key.length = CRYPTO_KEY_LENGTH;
+  memcpy(key.bytes, shared, CRYPTO_KEY_LENGTH);
+  check(Java_com_lyricz_a4over6vpn_VPNService_crypto(harness_env(), nullptr, &key, CRYPTO_AUTO), "key refused");
+  u16 port = server_start("127.0.0.1");
+  Session session;
+  check(session_start(session, "127.0.0.1", port), "session did not start");
+  Message injected;
+  injected.type = NET_REPLY;
+  injected.length = HEADER_LENGTH + 64;
+  packet_udp(injected.data, 64, 1);
+  check(server_inject(0, injected), "can not inject");
+  check(wait_for([] { return crypto_rejected == 1; }, 2000), "frame in clear not rejected");
+  pollfd app = {session.app, POLLIN, 0};
+  check(poll(&app, 1, 500) == 0, "frame in clear written to the tun");
+  session_stop(session);
+  printf("Frame in clear on a keyed session dropped\n");
+  return 0;
+}
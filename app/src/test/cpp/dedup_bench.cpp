@@ -0,0 +1,50 @@
+// Byte cache benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "dedup.h"
+# include "harness.h"
+# include "packet.h"
+
+// Native C++
+# include <cstring>
+# include <unistd.h>
+
+// Parameters
+# define BENCH_ROUNDS                 20    // fetch pairs, the stores start over before each
+# define STORE_MB                     64    // per direction
+
+// Packing and restoring throughput on one core, for a first fetch (every chunk new, so inserted by
+// both ends) and for a second one (every chunk found)
+int main() {
+  static Message frame, original;
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/dedup_bench.%d", (int) getpid());
+  check(dedup_configure(path, STORE_MB), "byte cache not mapped at %s", path);
+  u64 pack_us[2] = {0, 0}, unpack_us[2] = {0, 0}, total[2] = {0, 0}, sent[2] = {0, 0};
+  for (int round = 0; round < BENCH_ROUNDS; ++ round) {
+    dedup_connection();
+    for (int fetch = 0; fetch < 2; ++ fetch) {
+      for (u32 offset = 0, size; (size = packet_fetch(fetch, offset, original.data)) > 0; offset += size) {
+        original.length = HEADER_LENGTH + IPV4_MIN_HEADER + TCP_MIN_HEADER + size;
+        original.type = NET_REQUEST;
+        memcpy(&frame, &original, original.length);
+        Message *packed[1] = {&frame};
+        u64 start = now_us();
+        dedup_frames(packed, 1);
+        u64 middle = now_us();
+        sent[fetch] += frame.length;
+        check(frame.type != DEDUPED || dedup_open(frame), "fetch %d offset %d not restored", fetch, offset);
+        pack_us[fetch] += middle - start;
+        unpack_us[fetch] += now_us() - middle;
+        total[fetch] += original.length;
+      }
+    }
+  }
+  for (int fetch = 0; fetch < 2; ++ fetch) {
+    printf("%s fetch: %d%% of frame bytes sent, packs %d Mbit/s, restores %d Mbit/s\n", fetch ? "Second" : "First",
+      (u32) (sent[fetch] * 100 / total[fetch]), (u32) (total[fetch] * 8 / (pack_us[fetch] ? pack_us[fetch] : 1)),
+      (u32) (total[fetch] * 8 / (unpack_us[fetch] ? unpack_us[fetch] : 1)));
+  }
+  return 0;
+}
@@ -0,0 +1,55 @@
+// Byte cache test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "dedup.h"
+# include "harness.h"
+# include "packet.h"
+
+// Native C++
+# include <cstring>
+# include <unistd.h>
+
+// Parameters
+# define STORE_MB                     16    // per direction
+# define SAVING_FLOOR                 50    // percent of the frame bytes of the second fetch saved at least
+
+// Fetch twice, from the sending store into the receiving one as if the server reflected the
+// frames: every segment must come out as it went in, and the second fetch out of the cache
+int main() {
+  static Message frame, original;
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/dedup_test.%d", (int) getpid());
+  check(dedup_configure(path, STORE_MB) && dedup_enabled(), "byte cache not mapped at %s", path);
+  check(access(path, F_OK) != 0, "byte cache file left at %s", path);
+  dedup_connection();
+
+  u64 frames[2] = {0, 0}, sent[2] = {0, 0};
+  for (int fetch = 0; fetch < 2; ++ fetch) {
+    for (u32 offset = 0, size; (size = packet_fetch(fetch, offset, original.data)) > 0; offset += size) {
+      original.length = HEADER_LENGTH + IPV4_MIN_HEADER + TCP_MIN_HEADER + size;
+      original.type = NET_REQUEST;
+      memcpy(&frame, &original, original.length);
+      Message *packed[1] = {&frame};
+      dedup_frames(packed, 1);
+      check(frame.type == DEDUPED, "fetch %d offset %d not packed", fetch, offset);
+      frames[fetch] += original.length;
+      sent[fetch] += frame.length;
+      check(dedup_open(frame), "fetch %d offset %d not restored", fetch, offset);
+      check(frame.length == original.length && frame.type == NET_REQUEST &&
+        memcmp(frame.data, original.data, original.length - HEADER_LENGTH) == 0, "fetch %d differs at offset %d", fetch, offset);
+    }
+  }
+  check(dedup_rejected == 0, "%d frames rejected", dedup_rejected);
+
+  u32 saving = (u32) ((frames[1] - sent[1]) * 100 / frames[1]);
+  printf("First fetch %d%% of frame bytes, second %d%% (%d%% saved), %d/%d chunks hit\n", (u32) (sent[0] * 100 / frames[0]),
+    (u32) (sent[1] * 100 / frames[1]), saving, dedup_hits, dedup_chunks);
+  check(saving >= SAVING_FLOOR, "second fetch only %d%% saved", saving);
+
+  // Unmapped, received frames are refused
+  check(dedup_configure(nullptr, 0) && !dedup_enabled(), "byte cache not switched off");
+  frame.type = DEDUPED;
+  check(!dedup_open(frame), "frame restored without a store");
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Failover test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "shaper.h"
+
+// Networks
+# include <sys/socket.h>
+
+// Parameters
+# define ECHO_PACKETS                 200
+# define ECHO_SIZE                    1000
+# define ECHO_TIMEOUT                 2000  // ms
+# define STANDBY_TIMEOUT              5000  // ms for a standby to become ready
+# define FAILOVER_TIMEOUT             1000  // ms from killing the primary to traffic flowing again
+# define FAILOVERS                    3
+# define LOAD_DURATION                2000  // ms of bulk upload the last primary is reset during
+# define LOAD_SIZE                    1400
+# define LOAD_INTERVAL                10    // ms between probes of the load
+# define LOAD_KILL                    500   // ms into the upload
+# define LOAD_STALL                   200   // ms the server stops reading before, so the writer waits
+# define LAG_RATE                     20000 // bytes/s the client takes frames at meanwhile
+# define LAG_PACKETS                  50    // echoed ahead, so the receiver sees the reset seconds late
+# define LAG_SIZE                     1200
+
+static void* load_thread(void *arg) {
+  session_load(*(Session *) arg, LOAD_DURATION, LOAD_SIZE, LOAD_INTERVAL, false);
+  return nullptr;
+}
+
+// The server kills the primary connection a few times, each time the standby takes over, traffic
+// flows again without packets lost after the promotion, and a new standby is built. The last time
+// it resets the primary during a bulk upload it stopped reading, while the writer waits for the
+// socket to drain: the writer fails first, as the receiver is behind, and has to be woken up once
+// the receiver promotes the standby
+int main() {
+  u16 port = server_start("127.0.0.1");
+  Session session;
+  check(session_start(session, "127.0.0.1", port), "session did not start");
+  check(session_echo(session, ECHO_PACKETS, ECHO_SIZE, ECHO_TIMEOUT) == ECHO_PACKETS, "packets lost before failover");
+
+  for (int i = 0; i < FAILOVERS; ++ i) {
+    check(wait_for([] { return tik_has("Standby: ready"); }, STANDBY_TIMEOUT), "no standby after %d failovers", i);
+    int primary = server_connections() - 2;
+    u64 start = now_us();
+    server_kill(primary);
+    check(wait_for([=] { return tik_value("failovers: ") == (u32) i + 1; }, FAILOVER_TIMEOUT),
+      "no failover within %d ms of killing the primary", FAILOVER_TIMEOUT);
+    u32 detected = (u32) (now_us() - start);
+    check(session_echo(session, ECHO_PACKETS, ECHO_SIZE, ECHO_TIMEOUT) == ECHO_PACKETS, "packets lost after failover %d", i + 1);
+    printf("Failover %d: seen %d us after the kill, promotion took %d ms\n", i + 1, detected, tik_value("(last "));
+  }
+
+  check(wait_for([] { return tik_has("Standby: ready"); }, STANDBY_TIMEOUT), "no standby before the upload");
+  Java_com_lyricz_a4over6vpn_VPNService_shaper(harness_env(), nullptr, SHAPER_DOWN, SHAPER_TOTAL, LAG_RATE, 0);
+  static u8 packet[LAG_SIZE];
+  u32 echoed = server_frames(NET_REQUEST);
+  for (u32 i = 0; i < LAG_PACKETS; ++ i) {
+    packet_udp(packet, LAG_SIZE, i);
+    send(session.app, packet, LAG_SIZE, 0);
+  }
+  check(wait_for([=] { return server_frames(NET_REQUEST) == echoed + LAG_PACKETS; }, ECHO_TIMEOUT), "lag packets not echoed");
+  pthread_t loader;
+  pthread_create(&loader, nullptr, load_thread, &session);
+  usleep(LOAD_KILL * 1000);
+  server_stall(true);
+  usleep(LOAD_STALL * 1000);
+  server_reset(server_connections() - 2);
+  server_stall(false);
+  check(wait_for([] { return tik_value("failovers: ") == FAILOVERS + 1; }, STANDBY_TIMEOUT), "no failover during the upload");
+  pthread_join(loader, nullptr);
+  Java_com_lyricz_a4over6vpn_VPNService_shaper(harness_env(), nullptr, SHAPER_DOWN, SHAPER_TOTAL, 0, 0);
+
+  // Echo once the lag let go and a new standby is up
+  check(wait_for([] { return tik_has("Standby: ready"); }, STANDBY_TIMEOUT), "no standby after the upload");
+  static u8 stale[DATA_MAX_LENGTH];
+  while (recv(session.app, stale, sizeof(stale), MSG_DONTWAIT) > 0) {
+  }
+  check(session_echo(session, ECHO_PACKETS, ECHO_SIZE, ECHO_TIMEOUT) == ECHO_PACKETS, "packets lost after failover during the upload");
+  printf("Failover during an upload: promotion took %d ms\n", tik_value("(last "));
+
+  // Standby sockets are protected from the VPN before their SYN goes out
+  check(harness_protected >= FAILOVERS + 2, "standby sockets not protected (%d)", harness_protected);
+  check(harness_protected_connected == 0, "%d sockets protected after connecting", harness_protected_connected);
+  printf("Teardown in %d us\n", (u32) session_stop(session));
+  return 0;
+}
@@ -0,0 +1,224 @@
+// Packet filter test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "filter.h"
+# include "harness.h"
+# include "packet.h"
+
+// Native C++
+# include <atomic>
+# include <cstring>
+
+// Parameters
+# define MUTATED_PACKETS              4096  // sample packets changed and cut short, both engines must agree on
+# define SWAPS                        2000  // installs while the send thread runs
+
+// Classic BPF, as "tcpdump -ddd" prints it
+# define LD(size, k)                  {BPF_LD | size | BPF_ABS, 0, 0, k}
+# define LD_IND(size, k)              {BPF_LD | size | BPF_IND, 0, 0, k}
+# define JUMP(op, k, jt, jf)          {BPF_JMP | op | BPF_K, jt, jf, k}
+# define JUMP_X(op, jt, jf)           {BPF_JMP | op | BPF_X, jt, jf, 0}
+# define ALU(op, k)                   {BPF_ALU | op | BPF_K, 0, 0, k}
+# define ALU_X(op)                    {BPF_ALU | op | BPF_X, 0, 0, 0}
+# define RET(k)                       {BPF_RET | BPF_K, 0, 0, k}
+
+// DNS and new TCP connections ahead of everything, QUIC as packets, fragments as they come
+static const sock_filter classify[] = {
+  LD(BPF_B, IPV4_PROTOCOL),
+  JUMP(BPF_JEQ, IPPROTO_UDP, 0, 7),
+  LD(BPF_H, IPV4_FRAGMENT),
+  JUMP(BPF_JSET, 0x1fff, 11, 0),
+  {BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0},
+  LD_IND(BPF_H, TRANSPORT_DESTINATION),
+  JUMP(BPF_JEQ, DNS_PORT, 6, 0),
+  JUMP(BPF_JEQ, 443, 6, 0),
+  {BPF_JMP | BPF_JA, 0, 0, 6},
+  JUMP(BPF_JEQ, IPPROTO_TCP, 0, 5),
+  {BPF_LDX | BPF_B | BPF_MSH, 0, 0, 0},
+  LD_IND(BPF_B, TCP_FLAGS),
+  JUMP(BPF_JSET, TCP_SYN, 0, 2),
+  RET(FILTER_PRIORITY),
+  RET(FILTER_PACKET),
+  RET(FILTER_PASS)};
+static const u32 classify_verdicts[SAMPLE_PACKETS] = {
+  FILTER_PRIORITY, FILTER_PASS, FILTER_PASS, FILTER_PRIORITY, FILTER_PASS,
+  FILTER_PASS, FILTER_PACKET, FILTER_PASS, FILTER_PASS, FILTER_PASS};
+
+// Every arithmetic operation, divisions by a power of 2 and not, and scratch memory
+static const sock_filter arithmetic[] = {
+  {BPF_LD | BPF_W | BPF_LEN, 0, 0, 0},
+  {BPF_ST, 0, 0, 0},
+  ALU(BPF_DIV, 4),
+  ALU(BPF_MOD, 7),
+  {BPF_MISC | BPF_TAX, 0, 0, 0},
+  LD(BPF_H, IPV4_TOTAL_LENGTH),
+  ALU(BPF_MUL, 3),
+  ALU_X(BPF_SUB),
+  ALU(BPF_LSH, 1),
+  ALU(BPF_RSH, 2),
+  ALU(BPF_XOR, 0x5a),
+  ALU(BPF_OR, 0x100),
+  ALU(BPF_AND, 0xfff),
+  ALU_X(BPF_ADD),
+  ALU(BPF_SUB, 9),
+  ALU(BPF_ADD, 3),
+  {BPF_ALU | BPF_NEG, 0, 0, 0},
+  {BPF_ST, 0, 0, 3},
+  {BPF_LDX | BPF_MEM, 0, 0, 0},
+  {BPF_LD | BPF_MEM, 0, 0, 3},
+  ALU_X(BPF_DIV),
+  ALU_X(BPF_MUL),
+  ALU_X(BPF_XOR),
+  ALU_X(BPF_OR),
+  ALU_X(BPF_AND),
+  {BPF_LDX | BPF_IMM, 0, 0, 5},
+  ALU_X(BPF_MOD),
+  {BPF_RET | BPF_A, 0, 0, 0}};
+
+// Compares and shifts with the X register, which may be 32 or more
+static const sock_filter registers[] = {
+  LD(BPF_W, IPV4_SOURCE),
+  ALU(BPF_RSH, 24),
+  {BPF_MISC | BPF_TAX, 0, 0, 0},
+  LD(BPF_B, IPV4_TTL),
+  JUMP_X(BPF_JGT, 0, 2),
+  ALU_X(BPF_LSH),
+  {BPF_JMP | BPF_JA, 0, 0, 1},
+  ALU_X(BPF_RSH),
+  JUMP_X(BPF_JGE, 0, 1),
+  ALU(BPF_DIV, 3),
+  JUMP_X(BPF_JSET, 0, 2),
+  {BPF_MISC | BPF_TXA, 0, 0, 0},
+  {BPF_JMP | BPF_JA, 0, 0, 2},
+  {BPF_LD | BPF_IMM, 0, 0, 4},
+  JUMP_X(BPF_JEQ, 0, 1),
+  RET(FILTER_BULK),
+  {BPF_LDX | BPF_W | BPF_LEN, 0, 0, 0},
+  {BPF_MISC | BPF_TXA, 0, 0, 0},
+  ALU(BPF_MOD, 5),
+  {BPF_RET | BPF_A, 0, 0, 0}};
+
+// Loads fused with the compare after them, and one that must not be as a jump lands on the compare
+static const sock_filter fused[] = {
+  LD(BPF_W, IPV4_DESTINATION),
+  JUMP(BPF_JEQ, 0x08080808, 0, 3),
+  LD(BPF_B, IPV4_MIN_HEADER),
+  JUMP(BPF_JSET, 0x08, 4, 0),
+  RET(FILTER_DROP),
+  LD(BPF_H, IPV4_TOTAL_LENGTH),
+  JUMP(BPF_JEQ, 1500, 0, 1),
+  RET(FILTER_BULK),
+  LD(BPF_B, IPV4_PROTOCOL),
+  JUMP(BPF_JEQ, IPPROTO_TCP, 0, 1),
+  LD(BPF_B, 0),
+  JUMP(BPF_JEQ, 0x45, 0, 1),
+  RET(FILTER_PRIORITY),
+  RET(FILTER_PASS)};
+
+// What the kernel refuses: a jump past the end, a division by zero, an ancillary load, scratch
+// memory out of range, a shift by 32, an unknown opcode, and no return at the end
+static const sock_filter refused[][2] = {
+  {JUMP(BPF_JEQ, 0, 1, 0), RET(FILTER_PASS)},
+  {ALU(BPF_DIV, 0), RET(FILTER_PASS)},
+  {LD(BPF_B, 0xfffff000), RET(FILTER_PASS)},
+  {{BPF_ST, 0, 0, BPF_MEMWORDS}, RET(FILTER_PASS)},
+  {ALU(BPF_LSH, 32), RET(FILTER_PASS)},
+  {{0xffff, 0, 0, 0}, RET(FILTER_PASS)},
+  {RET(FILTER_PASS), {BPF_LD | BPF_W | BPF_LEN, 0, 0, 0}}};
+
+static u32 expected(const sock_filter *code, const u8 *packet, u32 length) {
+  u32 verdict = bpf_interpret(code, packet, length);
+  return verdict < FILTER_VERDICTS ? verdict : FILTER_PASS;
+}
+
+// The compiled program must agree with the reference interpreter on the samples, and on copies with
+// bytes of the headers changed and cut short
+static void agree(const char *name, const sock_filter *code, u32 count) {
+  static u8 packet[SAMPLE_MAX_LENGTH];
+  check(filter_install(code, count) && filter_enabled() && filter_insns == count, "%s refused", name);
+  u32 state = 0x9e3779b9, runs = 0;
+  for (u32 i = 0; i < MUTATED_PACKETS; ++ i) {
+    u32 length = packet_sample(i, packet);
+    for (u32 j = 0; i >= SAMPLE_PACKETS && j < 4; ++ j) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      packet[state % 64] = (u8) (state >> 8);
+    }
+    if (i >= SAMPLE_PACKETS && (state & 0x300) == 0) {
+      length = state % length;
+    }
+    u32 want = expected(code, packet, length), got = filter_run(packet, length);
+    check(got == want, "%s: sample %d (%d bytes) %u compiled, %u interpreted", name, i % SAMPLE_PACKETS, length, got, want);
+    ++ runs;
+  }
+  u32 counted = 0;
+  for (u32 verdict: filter_verdicts) {
+    counted += verdict;
+  }
+  check(counted == runs, "%s: %d verdicts counted of %d", name, counted, runs);
+  printf("%s: %d instructions as %d operations, agrees on %d packets\n", name, count, filter_ops, runs);
+}
+
+// Send thread, running whichever program is installed
+static std::atomic<bool> swapping;
+static std::atomic<u32> unexpected;
+
+static void* send_thread(void *_) {
+  static u8 packet[SAMPLE_MAX_LENGTH];
+  for (u32 i = 0; swapping; ++ i) {
+    u32 length = packet_sample(i, packet), verdict = filter_run(packet, length);
+    u32 first = classify_verdicts[i % SAMPLE_PACKETS], second = expected(fused, packet, length);
+    unexpected += verdict != first && verdict != second;
+  }
+  return nullptr;
+}
+
+int main() {
+  static u8 packet[SAMPLE_MAX_LENGTH];
+  check(filter_run(packet, packet_sample(0, packet)) == FILTER_PASS, "verdict without a program");
+
+  agree("Classify", classify, sizeof(classify) / sizeof(sock_filter));
+  for (u32 i = 0; i < SAMPLE_PACKETS; ++ i) {
+    u32 length = packet_sample(i, packet);
+    check(filter_run(packet, length) == classify_verdicts[i], "sample %d classified %d", i, filter_run(packet, length));
+  }
+  agree("Arithmetic", arithmetic, sizeof(arithmetic) / sizeof(sock_filter));
+  agree("Registers", registers, sizeof(registers) / sizeof(sock_filter));
+  agree("Fused", fused, sizeof(fused) / sizeof(sock_filter));
+
+  // Refused programs leave the installed one in place
+  for (u32 i = 0; i < sizeof(refused) / sizeof(refused[0]); ++ i) {
+    check(!filter_install(refused[i], 2), "program %d taken", i);
+    check(filter_enabled() && filter_insns == sizeof(fused) / sizeof(sock_filter), "program %d replaced the installed one", i);
+  }
+
+  // The text form, as "iptables -m bpf --bytecode" takes it
+  check(filter_install_text("4,48 0 0 9,21 0 1 6,6 0 0 2,6 0 0 1") && filter_insns == 4, "text program refused");
+  check(filter_run(packet, packet_sample(0, packet)) == FILTER_PRIORITY, "text program: TCP not prioritized");
+  check(filter_run(packet, packet_sample(3, packet)) == FILTER_PASS, "text program: UDP not passed");
+  check(!filter_install_text("2,6 0 0 1") && !filter_install_text("1,6 0 0") && !filter_install_text("1,6 0 0 1 x"),
+    "malformed text taken");
+  check(filter_insns == 4, "malformed text replaced the installed program");
+
+  // Programs swap under the send thread, which never runs a slot being rewritten
+  filter_install(classify, sizeof(classify) / sizeof(sock_filter));
+  swapping = true;
+  pthread_t sender;
+  pthread_create(&sender, nullptr, send_thread, nullptr);
+  for (u32 i = 0; i < SWAPS; ++ i) {
+    if (i % 2) {
+      filter_install(fused, sizeof(fused) / sizeof(sock_filter));
+    } else {
+      filter_install(classify, sizeof(classify) / sizeof(sock_filter));
+    }
+  }
+  swapping = false;
+  pthread_join(sender, nullptr);
+  check(unexpected == 0, "%d verdicts of neither program during %d swaps", unexpected.load(), SWAPS);
+
+  check(filter_install(nullptr, 0) && !filter_enabled() && filter_insns == 0, "program not removed");
+  check(filter_run(packet, packet_sample(0, packet)) == FILTER_PASS, "verdict after removal");
+  return 0;
+}
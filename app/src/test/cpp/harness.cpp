@@ -0,0 +1,1258 @@
+// Host test harness of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "packet.h"
+# include "proxy.h"
+# include "stream.h"
+# include "tls.h"
+
+// Native C++
+# include <algorithm>
+# include <atomic>
+# include <csignal>
+# include <cstdarg>
+# include <cstring>
+# include <deque>
+# include <fcntl.h>
+# include <map>
+# include <sched.h>
+# include <string>
+# include <sys/ioctl.h>
+# include <sys/wait.h>
+# include <unistd.h>
+# include <vector>
+
+// Networks
+# include <arpa/inet.h>
+# include <linux/if.h>
+# include <linux/if_tun.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <poll.h>
+# include <sys/socket.h>
+
+// Java side
+static JNIEnv env;
+static JavaVM vm;
+static _jobject service_object;
+volatile u32 harness_protected, harness_protected_connected;
+
+jstring JNIEnv::NewStringUTF(const char *bytes) {
+  return (jstring) strdup(bytes);
+}
+
+const char* JNIEnv::GetStringUTFChars(jstring string, jboolean *copy) {
+  return (const char *) string;
+}
+
+void JNIEnv::ReleaseStringUTFChars(jstring string, const char *chars) {}
+
+jsize JNIEnv::GetArrayLength(_jarray *array) {
+  return ((HarnessBytes *) array) -> length;
+}
+
+jbyte* JNIEnv::GetByteArrayElements(jbyteArray array, jboolean *copy) {
+  return ((HarnessBytes *) array) -> bytes;
+}
+
+void JNIEnv::ReleaseByteArrayElements(jbyteArray array, jbyte *elements, jint mode) {}
+
+jint JNIEnv::GetJavaVM(JavaVM **result) {
+  *result = &vm;
+  return JNI_OK;
+}
+
+jobject JNIEnv::NewGlobalRef(jobject object) {
+  return object;
+}
+
+void JNIEnv::DeleteGlobalRef(jobject object) {}
+
+void JNIEnv::DeleteLocalRef(jobject object) {}
+
+jclass JNIEnv::GetObjectClass(jobject object) {
+  return nullptr;
+}
+
+jmethodID JNIEnv::GetMethodID(jclass cls, const char *name, const char *signature) {
+  return nullptr;
+}
+
+// VpnService.protect(int)
+jboolean JNIEnv::CallBooleanMethod(jobject object, jmethodID method, ...) {
+  va_list args;
+  va_start(args, method);
+  int fd = va_arg(args, int);
+  va_end(args);
+  sockaddr_storage peer;
+  socklen_t length = sizeof(peer);
+  __sync_fetch_and_add(&harness_protected, 1);
+  if (getpeername(fd, (sockaddr *) &peer, &length) == 0) {
+    __sync_fetch_and_add(&harness_protected_connected, 1);
+  }
+  return 1;
+}
+
+jint JavaVM::AttachCurrentThread(JNIEnv **result, void *args) {
+  *result = &env;
+  return JNI_OK;
+}
+
+jint JavaVM::DetachCurrentThread() {
+  return JNI_OK;
+}
+
+jint JavaVM::GetEnv(void **result, jint version) {
+  *result = &env;
+  return JNI_OK;
+}
+
+JNIEnv* harness_env() {
+  return &env;
+}
+
+jstring harness_string(const char *chars) {
+  return (jstring) chars;
+}
+
+// Network namespaces of the wire, the client one is where the test runs
+static int client_ns = -1, server_ns = -1;
+
+// Stand-in server
+struct Connection {
+  int fd;
+  u16 peer_port;
+  pthread_mutex_t lock; // sends, of the connection thread and of the host
+};
+
+static Connection connections[SERVER_CONNECTIONS];
+static std::atomic<int> connection_count;
+static std::atomic<u32> frames[256];
+static std::atomic<bool> stalled;
+static std::atomic<u32> hop_mtu;
+static std::atomic<bool> hop_silent;
+static int listen_fd = -1;
+
+// The tun of the host behind the server (-1 for reflecting), and the connection its packets go to,
+// the last one the client sent packets on
+static int host_tun = -1;
+static std::atomic<int> host_connection(-1);
+
+static bool recv_all(int fd, u8 *buffer, u32 length) {
+  for (u32 received = 0; received < length; ) {
+    ssize_t single = recv(fd, buffer + received, length - received, 0);
+    if (single <= 0) {
+      return false;
+    }
+    received += single;
+  }
+  return true;
+}
+
+// Turn a packet around, the way a host behind the server would answer it, false if none would
+static bool reflect(u8 *packet, u32 length) {
+  if (!is_ipv4(packet, length)) {
+    return true;
+  }
+  u8 address[4];
+  memcpy(address, packet + IPV4_SOURCE, 4);
+  memcpy(packet + IPV4_SOURCE, packet + IPV4_DESTINATION, 4);
+  memcpy(packet + IPV4_DESTINATION, address, 4);
+  u32 header = ipv4_header_length(packet);
+  u8 protocol = packet[IPV4_PROTOCOL];
+  if (protocol == IPPROTO_UDP && length >= header + 4 && load16(packet + header + TRANSPORT_DESTINATION) == SERVER_DISCARD_PORT) {
+    return false;
+  }
+  if ((protocol == IPPROTO_UDP || protocol == IPPROTO_TCP) && length >= header + 4) {
+    u16 port = load16(packet + header);
+    store16(packet + header, load16(packet + header + TRANSPORT_DESTINATION));
+    store16(packet + header + TRANSPORT_DESTINATION, port);
+  } else if (protocol == IPPROTO_ICMP && length >= header + ICMP_HEADER && packet[header] == ICMP_ECHO_REQUEST) {
+    packet[header] = ICMP_ECHO_REPLY;
+    store16(packet + header + ICMP_CHECKSUM, 0);
+    store16(packet + header + ICMP_CHECKSUM, checksum(packet + header, length - header));
+  }
+  return true;
+}
+
+static bool server_send(int index, const Message &message) {
+  Connection &connection = connections[index];
+  pthread_mutex_lock(&connection.lock);
+  bool sent = send(connection.fd, &message, message.length, MSG_NOSIGNAL) == (ssize_t) message.length;
+  pthread_mutex_unlock(&connection.lock);
+  return sent;
+}
+
+// Streams relayed to the host, each with a thread taking the bytes of the host as its credit allows
+struct Relay {
+  u32 id;
+  int fd, connection;
+  u32 credit;         // bytes it may still send to the client
+  u32 taken;          // bytes written to the host, not yet credited back
+  bool closed;        // reset by the client
+  pthread_mutex_t lock;
+  pthread_cond_t more;
+};
+
+static std::map<u32, Relay*> relays;
+static pthread_mutex_t relays_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void relay_control(int connection, u8 type, u32 id, u32 value) {
+  Message message = {HEADER_LENGTH + STREAM_ID_LENGTH, type};
+  store32(message.data, id);
+  if (type == STREAM_WINDOW) {
+    store32(message.data + STREAM_ID_LENGTH, value);
+    message.length += sizeof(u32);
+  } else {
+    message.data[STREAM_ID_LENGTH] = (u8) value;
+    message.length += 1;
+  }
+  server_send(connection, message);
+}
+
+static void* relay_down_thread(void *arg) {
+  Relay &relay = *(Relay *) arg;
+  static thread_local Message message;
+  while (true) {
+    pthread_mutex_lock(&relay.lock);
+    while (relay.credit == 0 && !relay.closed) {
+      pthread_cond_wait(&relay.more, &relay.lock);
+    }
+    u32 room = relay.closed ? 0 : std::min(relay.credit, (u32) (DATA_MAX_LENGTH - STREAM_ID_LENGTH));
+    pthread_mutex_unlock(&relay.lock);
+    ssize_t length = room ? recv(relay.fd, message.data + STREAM_ID_LENGTH, room, 0) : 0;
+    pthread_mutex_lock(&relay.lock);
+    bool closed = relay.closed;
+    relay.credit -= length > 0 ? (u32) length : 0;
+    pthread_mutex_unlock(&relay.lock);
+    if (closed) {
+      break;
+    }
+    if (length <= 0) {
+      relay_control(relay.connection, STREAM_CLOSE, relay.id, length == 0 ? STREAM_FIN : STREAM_RESET);
+      break;
+    }
+    message.type = STREAM_DATA;
+    message.length = HEADER_LENGTH + STREAM_ID_LENGTH + (u32) length;
+    store32(message.data, relay.id);
+    if (!server_send(relay.connection, message)) {
+      break;
+    }
+  }
+  pthread_mutex_lock(&relays_lock);
+  auto found = relays.find(relay.id);
+  if (found != relays.end() && found -> second == &relay) {
+    relays.erase(found);
+  }
+  close(relay.fd);
+  pthread_mutex_unlock(&relays_lock);
+  delete &relay;
+  return nullptr;
+}
+
+// A STREAM_* frame of the client, as the server would serve it, connecting from its namespace
+static void relay_frame(int connection, const Message &message) {
+  if (message.length < HEADER_LENGTH + STREAM_ID_LENGTH) {
+    return;
+  }
+  u32 id = load32(message.data), length = message.length - HEADER_LENGTH - STREAM_ID_LENGTH;
+  const u8 *data = message.data + STREAM_ID_LENGTH;
+  pthread_mutex_lock(&relays_lock);
+  auto found = relays.find(id);
+  Relay *relay = found == relays.end() ? nullptr : found -> second;
+  if (message.type == STREAM_OPEN && length >= sizeof(u32) + sizeof(u16)) {
+    sockaddr_in destination = {};
+    destination.sin_family = AF_INET;
+    destination.sin_addr.s_addr = htonl(load32(data));
+    destination.sin_port = htons(load16(data + sizeof(u32)));
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    if (connect(fd, (sockaddr *) &destination, sizeof(destination)) != 0) {
+      close(fd);
+      relay_control(connection, STREAM_CLOSE, id, STREAM_RESET);
+    } else {
+      relay = new Relay{id, fd, connection, STREAM_WINDOW_INITIAL, 0, false};
+      pthread_mutex_init(&relay -> lock, nullptr);
+      pthread_cond_init(&relay -> more, nullptr);
+      relays[id] = relay;
+      pthread_t thread;
+      pthread_create(&thread, nullptr, relay_down_thread, relay);
+      pthread_detach(thread);
+    }
+  } else if (relay && message.type == STREAM_DATA) {
+    if (send(relay -> fd, data, length, MSG_NOSIGNAL) != (ssize_t) length) {
+      relay_control(connection, STREAM_CLOSE, id, STREAM_RESET);
+    } else if ((relay -> taken += length) >= STREAM_CREDIT_STEP) {
+      relay_control(connection, STREAM_WINDOW, id, relay -> taken);
+      relay -> taken = 0;
+    }
+  } else if (relay && message.type == STREAM_WINDOW && length >= sizeof(u32)) {
+    pthread_mutex_lock(&relay -> lock);
+    relay -> credit += load32(data);
+    pthread_cond_signal(&relay -> more);
+    pthread_mutex_unlock(&relay -> lock);
+  } else if (relay && message.type == STREAM_CLOSE && length >= 1) {
+    if (data[0] == STREAM_FIN) {
+      shutdown(relay -> fd, SHUT_WR);
+    } else {
+      pthread_mutex_lock(&relay -> lock);
+      relay -> closed = true;
+      pthread_cond_signal(&relay -> more);
+      pthread_mutex_unlock(&relay -> lock);
+      shutdown(relay -> fd, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&relays_lock);
+}
+
+// Next frame of a connection, once the server reads again
+static bool recv_frame(int fd, Message &message) {
+  while (stalled) {
+    usleep(1000);
+  }
+  return recv_all(fd, (u8 *) &message, sizeof(u32)) && message.length >= HEADER_LENGTH
+    && message.length <= sizeof(Message) && recv_all(fd, (u8 *) &message + sizeof(u32), message.length - sizeof(u32));
+}
+
+// Whether a packet is too big for the hop behind the server, which drops it
+static bool beyond_hop(const u8 *packet, u32 length) {
+  return hop_mtu && length > hop_mtu && is_ipv4(packet, length) && (load16(packet + IPV4_FRAGMENT) & IPV4_DONT_FRAGMENT);
+}
+
+// Replace a packet too big for the hop with the "fragmentation needed" its router answers, quoting
+// the header and 8 bytes
+static void hop_answer(Message &message) {
+  static thread_local u8 quote[60 + 8];
+  u32 quoted = ipv4_header_length(message.data) + 8;
+  memcpy(quote, message.data, quoted);
+  u8 *packet = message.data, *icmp = packet + IPV4_MIN_HEADER;
+  u32 total = IPV4_MIN_HEADER + ICMP_HEADER + quoted;
+  memset(packet, 0, IPV4_MIN_HEADER + ICMP_HEADER);
+  packet[0] = 0x45;
+  store16(packet + IPV4_TOTAL_LENGTH, (u16) total);
+  packet[IPV4_TTL] = IPV4_DEFAULT_TTL;
+  packet[IPV4_PROTOCOL] = IPPROTO_ICMP;
+  inet_pton(AF_INET, SERVER_HOP_ROUTER, packet + IPV4_SOURCE);
+  memcpy(packet + IPV4_DESTINATION, quote + IPV4_SOURCE, 4);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+  icmp[0] = ICMP_UNREACHABLE;
+  icmp[ICMP_CODE] = ICMP_FRAGMENTATION_NEEDED;
+  store16(icmp + ICMP_NEXT_HOP_MTU, (u16) hop_mtu);
+  memcpy(icmp + ICMP_HEADER, quote, quoted);
+  store16(icmp + ICMP_CHECKSUM, checksum(icmp, ICMP_HEADER + quoted));
+  message.length = HEADER_LENGTH + total;
+}
+
+static void* connection_thread(void *arg) {
+  int index = (int) (long) arg, fd = connections[index].fd;
+  static thread_local Message message;
+  if (host_tun >= 0) {
+    setns(server_ns, CLONE_NEWNET);
+  }
+  while (recv_frame(fd, message)) {
+    ++ frames[message.type];
+    if (message.type == IP_REQUEST) {
+      message.type = IP_REPLY;
+      message.length = HEADER_LENGTH + sizeof(SERVER_IP_REPLY) - 1;
+      memcpy(message.data, SERVER_IP_REPLY, sizeof(SERVER_IP_REPLY) - 1);
+    } else if (message.type == NET_REQUEST && host_tun >= 0) {
+      host_connection = index;
+      write(host_tun, message.data, message.length - HEADER_LENGTH);
+      continue;
+    } else if (message.type == NET_REQUEST && beyond_hop(message.data, message.length - HEADER_LENGTH)) {
+      if (hop_silent) {
+        continue;
+      }
+      message.type = NET_REPLY;
+      hop_answer(message);
+    } else if (message.type == NET_REQUEST) {
+      message.type = NET_REPLY;
+      if (!reflect(message.data, message.length - HEADER_LENGTH)) {
+        continue;
+      }
+    } else if (message.type >= STREAM_OPEN && message.type <= STREAM_WINDOW && host_tun >= 0) {
+      relay_frame(index, message);
+      continue;
+    } else if (message.type != HEARTBEAT) {
+      continue;
+    }
+    if (!server_send(index, message)) {
+      break;
+    }
+  }
+  shutdown(fd, SHUT_RDWR);
+  return nullptr;
+}
+
+static void* accept_thread(void *_) {
+  while (true) {
+    sockaddr_in peer;
+    socklen_t length = sizeof(peer);
+    int fd = accept(listen_fd, (sockaddr *) &peer, &length);
+    if (fd < 0 || connection_count == SERVER_CONNECTIONS) {
+      break;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    int index = connection_count;
+    connections[index].fd = fd;
+    connections[index].peer_port = ntohs(peer.sin_port);
+    pthread_mutex_init(&connections[index].lock, nullptr);
+    ++ connection_count;
+    pthread_t thread;
+    pthread_create(&thread, nullptr, connection_thread, (void *) (long) index);
+    pthread_detach(thread);
+  }
+  return nullptr;
+}
+
+u16 server_start(const char *address) {
+  if (server_ns != -1 && strcmp(address, WIRE_SERVER) == 0) {
+    setns(server_ns, CLONE_NEWNET);
+  }
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (client_ns != -1) {
+    setns(client_ns, CLONE_NEWNET);
+  }
+  int enable = 1;
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  inet_pton(AF_INET, address, &local.sin_addr);
+  socklen_t length = sizeof(local);
+  check(bind(listen_fd, (sockaddr *) &local, length) == 0 && listen(listen_fd, SERVER_CONNECTIONS) == 0,
+    "server can not listen on %s (%s)", address, strerror(errno));
+  getsockname(listen_fd, (sockaddr *) &local, &length);
+  pthread_t thread;
+  pthread_create(&thread, nullptr, accept_thread, nullptr);
+  pthread_detach(thread);
+  return ntohs(local.sin_port);
+}
+
+int server_connections() {
+  return connection_count;
+}
+
+u32 server_frames(u8 type) {
+  return frames[type];
+}
+
+bool server_inject(int index, const Message &message) {
+  return server_send(index, message);
+}
+
+void server_kill(int index) {
+  shutdown(connections[index].fd, SHUT_RDWR);
+}
+
+void server_hop(u32 mtu, bool silent) {
+  hop_mtu = mtu;
+  hop_silent = silent;
+}
+
+void server_stall(bool stall) {
+  stalled = stall;
+}
+
+void server_reset(int index) {
+  sockaddr unspecified = {};
+  unspecified.sa_family = AF_UNSPEC;
+  connect(connections[index].fd, &unspecified, sizeof(unspecified));
+}
+
+u16 server_peer_port(int index) {
+  return connections[index].peer_port;
+}
+
+// Wire
+static int wire_tuns[2];
+static std::atomic<u16> dropped_port;
+static std::atomic<u32> rate_kbps, delay_ms, loss_percent;
+
+// Packets held by the delay of each direction, in the order they are due
+struct Delayed {
+  u64 due_us;
+  std::vector<u8> packet;
+};
+
+static std::deque<Delayed> delayed[2];
+static pthread_mutex_t delayed_lock[2] = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+static pthread_cond_t delayed_more[2] = {PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static bool link_up(int control, ifreq &request) {
+  if (ioctl(control, SIOCGIFFLAGS, &request) != 0) {
+    return false;
+  }
+  request.ifr_flags |= IFF_UP;
+  return ioctl(control, SIOCSIFFLAGS, &request) == 0;
+}
+
+// Loopback of the current namespace up, for local connections
+static bool loopback_up() {
+  int control = socket(AF_INET, SOCK_DGRAM, 0);
+  ifreq request = {};
+  strncpy(request.ifr_name, "lo", IFNAMSIZ - 1);
+  bool up = link_up(control, request);
+  close(control);
+  return up;
+}
+
+static int tun_create(const char *name, const char *local, const char *peer, u32 queue) {
+  int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+  ifreq request = {};
+  request.ifr_flags = IFF_TUN | IFF_NO_PI;
+  strncpy(request.ifr_name, name, IFNAMSIZ - 1);
+  if (fd < 0 || ioctl(fd, TUNSETIFF, &request) < 0) {
+    return -1;
+  }
+
+  // Address, peer and up, as "ip addr add local peer peer dev name && ip link set name up" would
+  int control = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in *address = (sockaddr_in *) &request.ifr_addr;
+  address -> sin_family = AF_INET;
+  inet_pton(AF_INET, local, &address -> sin_addr);
+  bool up = ioctl(control, SIOCSIFADDR, &request) == 0;
+  address = (sockaddr_in *) &request.ifr_dstaddr;
+  address -> sin_family = AF_INET;
+  inet_pton(AF_INET, peer, &address -> sin_addr);
+  up = up && ioctl(control, SIOCSIFDSTADDR, &request) == 0;
+  request.ifr_qlen = (int) queue;
+  up = up && ioctl(control, SIOCSIFTXQLEN, &request) == 0 && link_up(control, request);
+  close(control);
+  return up ? fd : -1;
+}
+
+static void* relay_thread(void *arg) {
+  long from = (long) arg;
+  u8 packet[2048];
+  u64 next_us = 0;
+  u32 random = 0x9e3779b9 + (u32) from;
+  while (true) {
+    ssize_t length = read(wire_tuns[from], packet, sizeof(packet));
+    if (length <= 0) {
+      break;
+    }
+    const u8 *tcp = transport_header(packet, (u32) length, IPPROTO_TCP, TCP_MIN_HEADER);
+    u16 port = dropped_port;
+    if (port && tcp && (load16(tcp) == port || load16(tcp + TRANSPORT_DESTINATION) == port)) {
+      continue;
+    }
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+    if (random % 100 < loss_percent) {
+      continue;
+    }
+    if (u32 kbps = rate_kbps) {
+      u64 now = now_us();
+      next_us = (next_us > now ? next_us : now) + (u64) length * 8000 / kbps;
+      if (next_us > now) {
+        usleep((u32) (next_us - now));
+      }
+    }
+    if (u32 delay = delay_ms) {
+      pthread_mutex_lock(&delayed_lock[from]);
+      delayed[from].push_back({now_us() + delay * 1000ull, std::vector<u8>(packet, packet + length)});
+      pthread_cond_signal(&delayed_more[from]);
+      pthread_mutex_unlock(&delayed_lock[from]);
+      continue;
+    }
+    write(wire_tuns[1 - from], packet, length);
+  }
+  return nullptr;
+}
+
+static void* delay_thread(void *arg) {
+  long from = (long) arg;
+  while (true) {
+    pthread_mutex_lock(&delayed_lock[from]);
+    while (delayed[from].empty()) {
+      pthread_cond_wait(&delayed_more[from], &delayed_lock[from]);
+    }
+    Delayed front = std::move(delayed[from].front());
+    delayed[from].pop_front();
+    pthread_mutex_unlock(&delayed_lock[from]);
+    u64 now = now_us();
+    if (front.due_us > now) {
+      usleep((u32) (front.due_us - now));
+    }
+    write(wire_tuns[1 - from], front.packet.data(), front.packet.size());
+  }
+  return nullptr;
+}
+
+bool wire_start() {
+  if (unshare(CLONE_NEWNET) != 0 && unshare(CLONE_NEWUSER | CLONE_NEWNET) != 0) {
+    return false;
+  }
+  client_ns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  wire_tuns[0] = tun_create("wire0", WIRE_CLIENT, WIRE_SERVER, WIRE_QUEUE);
+  bool up = loopback_up();
+  if (unshare(CLONE_NEWNET) != 0) {
+    return false;
+  }
+  server_ns = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+  wire_tuns[1] = tun_create("wire1", WIRE_SERVER, WIRE_CLIENT, WIRE_QUEUE);
+  up = up && loopback_up();
+  setns(client_ns, CLONE_NEWNET);
+  if (wire_tuns[0] < 0 || wire_tuns[1] < 0 || !up) {
+    return false;
+  }
+  for (long side = 0; side < 2; ++ side) {
+    pthread_t thread;
+    pthread_create(&thread, nullptr, relay_thread, (void *) side);
+    pthread_detach(thread);
+    pthread_create(&thread, nullptr, delay_thread, (void *) side);
+    pthread_detach(thread);
+  }
+  return true;
+}
+
+void wire_drop(u16 port) {
+  dropped_port = port;
+}
+
+void wire_rate(u32 kbps) {
+  rate_kbps = kbps;
+}
+
+void wire_delay(u32 ms) {
+  delay_ms = ms;
+}
+
+void wire_loss(u32 percent) {
+  loss_percent = percent;
+}
+
+// Host behind the stand-in server
+static void* host_tun_thread(void *_) {
+  static Message message;
+  while (true) {
+    ssize_t length = read(host_tun, message.data, DATA_MAX_LENGTH);
+    if (length <= 0) {
+      break;
+    }
+    message.type = NET_REPLY;
+    message.length = HEADER_LENGTH + (u32) length;
+    int connection = host_connection;
+    if (connection >= 0) {
+      server_send(connection, message);
+    }
+  }
+  return nullptr;
+}
+
+// Bytes of a download are their offset modulo a prime, so a byte lost or repeated shows
+# define HOST_PATTERN                 251
+
+// Serves a connection by the first byte: 'U' takes bytes until the end and answers how many (u64),
+// 'D' sends the pattern until the app goes, 'P' echoes messages of HOST_PING_SIZE bytes
+static void* host_serve_thread(void *arg) {
+  int fd = (int) (long) arg;
+  static thread_local u8 buffer[HOST_PATTERN * 256];
+  u8 mode = 0;
+  recv_all(fd, &mode, 1);
+  if (mode == 'U') {
+    u64 taken = 0;
+    for (ssize_t length; (length = recv(fd, buffer, sizeof(buffer), 0)) > 0; ) {
+      taken += length;
+    }
+    send(fd, &taken, sizeof(taken), MSG_NOSIGNAL);
+  } else if (mode == 'D') {
+    for (u32 i = 0; i < sizeof(buffer); ++ i) {
+      buffer[i] = (u8) (i % HOST_PATTERN);
+    }
+    while (send(fd, buffer, sizeof(buffer), MSG_NOSIGNAL) > 0) {}
+  } else if (mode == 'P') {
+    while (recv_all(fd, buffer, HOST_PING_SIZE) && send(fd, buffer, HOST_PING_SIZE, MSG_NOSIGNAL) == HOST_PING_SIZE) {}
+  }
+  close(fd);
+  return nullptr;
+}
+
+static void* host_accept_thread(void *arg) {
+  int listen_host = (int) (long) arg;
+  while (true) {
+    int fd = accept4(listen_host, nullptr, nullptr, SOCK_CLOEXEC), enable = 1;
+    if (fd < 0) {
+      break;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    pthread_t thread;
+    pthread_create(&thread, nullptr, host_serve_thread, (void *) (long) fd);
+    pthread_detach(thread);
+  }
+  return nullptr;
+}
+
+bool server_host() {
+  if (server_ns == -1) {
+    return false;
+  }
+  setns(server_ns, CLONE_NEWNET);
+  host_tun = tun_create("host0", SESSION_REMOTE, SESSION_LOCAL, SESSION_QUEUE);
+  int listen_host = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), enable = 1;
+  setns(client_ns, CLONE_NEWNET);
+  setsockopt(listen_host, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_port = htons(HOST_PORT);
+  inet_pton(AF_INET, SESSION_REMOTE, &local.sin_addr);
+  if (host_tun < 0 || bind(listen_host, (sockaddr *) &local, sizeof(local)) != 0 || listen(listen_host, SERVER_CONNECTIONS) != 0) {
+    return false;
+  }
+  pthread_t thread;
+  pthread_create(&thread, nullptr, host_tun_thread, nullptr);
+  pthread_detach(thread);
+  pthread_create(&thread, nullptr, host_accept_thread, (void *) (long) listen_host);
+  pthread_detach(thread);
+  return true;
+}
+
+// TLS peer
+bool peer_start(TlsPeer &peer, const u8 *key, int connections) {
+  if (system("openssl version > /dev/null 2>&1") != 0) {
+    return false;
+  }
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(local);
+  check(bind(listener, (sockaddr *) &local, length) == 0 && getsockname(listener, (sockaddr *) &local, &length) == 0,
+    "no free port for the TLS peer");
+  close(listener);
+  peer.port = ntohs(local.sin_port);
+  char hex[2 * TLS_KEY_LENGTH + 1], accept[32], count[16];
+  for (int i = 0; i < TLS_KEY_LENGTH; ++ i) {
+    snprintf(hex + 2 * i, 3, "%02x", key[i]);
+  }
+  snprintf(accept, sizeof(accept), "127.0.0.1:%d", peer.port);
+  snprintf(count, sizeof(count), "%d", connections);
+  int input[2], output[2];
+  check(pipe(input) == 0 && pipe(output) == 0, "no pipes for the TLS peer");
+  peer.pid = fork();
+  if (peer.pid == 0) {
+    dup2(input[0], 0);
+    dup2(output[1], 1);
+    dup2(open("/dev/null", O_WRONLY), 2);
+    execlp("openssl", "openssl", "s_server", "-quiet", "-tls1_3", "-nocert", "-psk", hex, "-psk_identity", TLS_PSK_IDENTITY,
+      "-ciphersuites", "TLS_CHACHA20_POLY1305_SHA256", "-accept", accept, "-naccept", count, nullptr);
+    _exit(1);
+  }
+  close(input[0]);
+  close(output[1]);
+  peer.input = input[1];
+  peer.output = output[0];
+  return true;
+}
+
+void peer_stop(TlsPeer &peer) {
+  kill(peer.pid, SIGTERM);
+  waitpid(peer.pid, nullptr, 0);
+  close(peer.input);
+  close(peer.output);
+}
+
+int peer_connect(TlsPeer &peer, u32 timeout) {
+  sockaddr_in remote = {};
+  remote.sin_family = AF_INET;
+  remote.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  remote.sin_port = htons(peer.port);
+  int fd = -1;
+  bool connected = wait_for([&] {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (sockaddr *) &remote, sizeof(remote)) == 0) {
+      return true;
+    }
+    close(fd);
+    return false;
+  }, timeout);
+  check(connected, "TLS peer did not come up");
+  return fd;
+}
+
+// Session
+static void* backend_thread(void *arg) {
+  Session &session = *(Session *) arg;
+  Java_com_lyricz_a4over6vpn_VPNService_backend(&env, &service_object, session.tun);
+  return nullptr;
+}
+
+bool session_start(Session &session, const char *address, u16 port, bool tun) {
+  int pair[2] = {-1, -1};
+  if (tun) {
+    pair[1] = tun_create("app0", SESSION_LOCAL, SESSION_REMOTE, SESSION_QUEUE);
+  } else {
+    socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, pair);
+  }
+  session.app = pair[0];
+  session.tun = pair[1];
+  if (session.tun < 0) {
+    return false;
+  }
+  std::string service = std::to_string(port);
+  if (Java_com_lyricz_a4over6vpn_VPNService_open(&env, &service_object, harness_string(address), harness_string(service.c_str())) < 0) {
+    return false;
+  }
+  const char *info = (const char *) Java_com_lyricz_a4over6vpn_VPNService_request(&env, &service_object);
+  if (*info == '\0') {
+    return false;
+  }
+  Java_com_lyricz_a4over6vpn_VPNService_initialize(&env, &service_object);
+  pthread_create(&session.backend, nullptr, backend_thread, &session);
+  return true;
+}
+
+u64 session_stop(Session &session) {
+  u64 start = now_us();
+  Java_com_lyricz_a4over6vpn_VPNService_terminate(&env, &service_object);
+  pthread_join(session.backend, nullptr);
+  u64 elapsed = now_us() - start;
+  if (session.app >= 0) {
+    close(session.app);
+  }
+  close(session.tun);
+  return elapsed;
+}
+
+void packet_udp(u8 *packet, u32 length, u32 sequence) {
+  memset(packet, 0, length);
+  packet[0] = 0x45;
+  store16(packet + IPV4_TOTAL_LENGTH, (u16) length);
+  packet[IPV4_TTL] = IPV4_DEFAULT_TTL;
+  packet[IPV4_PROTOCOL] = IPPROTO_UDP;
+  inet_pton(AF_INET, SESSION_LOCAL, packet + IPV4_SOURCE);
+  inet_pton(AF_INET, SESSION_REMOTE, packet + IPV4_DESTINATION);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+  u8 *udp = packet + IPV4_MIN_HEADER;
+  store16(udp, 40000);
+  store16(udp + TRANSPORT_DESTINATION, SERVER_ECHO_PORT);
+  store16(udp + UDP_LENGTH, (u16) (length - IPV4_MIN_HEADER));
+  for (u32 i = UDP_HEADER; i + IPV4_MIN_HEADER < length; ++ i) {
+    udp[i] = (u8) (sequence + i);
+  }
+  store32(udp + UDP_HEADER, sequence);
+}
+
+u32 sample_json(u8 *buffer, u32 length) {
+  u32 size = 0, seed = 1;
+  while (size + 64 < length) {
+    seed = seed * 1103515245 + 12345;
+    size += sprintf((char *) buffer + size, "{\"id\":%u,\"name\":\"device-%u\",\"rssi\":-%u,\"ok\":true},",
+      seed >> 20, (seed >> 8) & 255, (seed >> 4) & 63);
+  }
+  return size;
+}
+
+void packet_ping(u8 *packet, u32 length, u32 sequence) {
+  packet_udp(packet, length, sequence);
+  packet[IPV4_PROTOCOL] = IPPROTO_ICMP;
+  store16(packet + IPV4_CHECKSUM, 0);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+  u8 *icmp = packet + IPV4_MIN_HEADER;
+  icmp[0] = ICMP_ECHO_REQUEST;
+  icmp[1] = 0;
+  store16(icmp + ICMP_CHECKSUM, 0);
+  store16(icmp + ICMP_ID, 1);
+  store16(icmp + ICMP_SEQUENCE, (u16) sequence);
+  store16(icmp + ICMP_CHECKSUM, checksum(icmp, length - IPV4_MIN_HEADER));
+}
+
+u32 packet_fetch(int fetch, u32 offset, u8 *packet) {
+  static const u32 prefix[2] = {211, 187}, segment[2] = {1360, 1208};
+  u32 total = prefix[fetch] + FETCH_LENGTH, size = total - offset < segment[fetch] ? total - offset : segment[fetch];
+  u32 header = IPV4_MIN_HEADER + TCP_MIN_HEADER;
+  memset(packet, 0, header);
+  packet[0] = 0x45;
+  store16(packet + IPV4_TOTAL_LENGTH, header + size);
+  packet[IPV4_PROTOCOL] = IPPROTO_TCP;
+  store16(packet + IPV4_MIN_HEADER, 80);
+  store32(packet + IPV4_MIN_HEADER + TCP_SEQUENCE, offset);
+  packet[IPV4_MIN_HEADER + TCP_OFFSET] = TCP_MIN_HEADER / 4 << 4;
+  for (u32 i = 0; i < size; ++ i) {
+    u32 at = offset + i;
+    if (at < prefix[fetch]) {
+      packet[header + i] = (u8) ('A' + (at + fetch) % 26);
+    } else {
+      // SplitMix64 of the 8-byte word the byte is in
+      u32 content = at - prefix[fetch];
+      u64 z = (content / 8 + 1) * 0x9e3779b97f4a7c15ull;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      packet[header + i] = (u8) ((z ^ (z >> 31)) >> (content % 8 * 8));
+    }
+  }
+  return size;
+}
+
+// IPv4 packet from 10.0.0.2 with the transport header zeroed, 'length' bytes in all
+static u8* sample_header(u8 *packet, u32 length, u8 protocol, u32 destination) {
+  memset(packet, 0, length);
+  packet[0] = 0x45;
+  store16(packet + IPV4_TOTAL_LENGTH, (u16) length);
+  store16(packet + IPV4_FRAGMENT, IPV4_DONT_FRAGMENT);
+  packet[IPV4_TTL] = IPV4_DEFAULT_TTL;
+  packet[IPV4_PROTOCOL] = protocol;
+  store32(packet + IPV4_SOURCE, 0x0a000002);
+  store32(packet + IPV4_DESTINATION, destination);
+  return packet + IPV4_MIN_HEADER;
+}
+
+static u32 sample_tcp(u8 *packet, u32 length, u16 port, u8 flags) {
+  u8 *tcp = sample_header(packet, length, IPPROTO_TCP, 0x5db8d822);
+  store16(tcp, 40000);
+  store16(tcp + TRANSPORT_DESTINATION, port);
+  tcp[TCP_OFFSET] = (length >= IPV4_MIN_HEADER + 32 ? 32 : TCP_MIN_HEADER) / 4 << 4;
+  tcp[TCP_FLAGS] = flags;
+  return length;
+}
+
+static u32 sample_udp(u8 *packet, u32 length, u32 destination, u16 port) {
+  u8 *udp = sample_header(packet, length, IPPROTO_UDP, destination);
+  store16(udp, 50000);
+  store16(udp + TRANSPORT_DESTINATION, port);
+  store16(udp + UDP_LENGTH, (u16) (length - IPV4_MIN_HEADER));
+  return length;
+}
+
+u32 packet_sample(u32 index, u8 *packet) {
+  switch (index % SAMPLE_PACKETS) {
+    case 0: return sample_tcp(packet, 44, 443, TCP_SYN);
+    case 1: return sample_tcp(packet, 52, 443, TCP_ACK);
+    case 2: return sample_tcp(packet, 1500, 443, TCP_ACK | TCP_PSH);
+    case 3: return sample_udp(packet, 60, 0x08080808, DNS_PORT);
+    case 4: return sample_udp(packet, 160, 0xeffffffa, 1900);
+    case 5: return sample_udp(packet, 90, 0xe00000fb, 5353);
+    case 6: return sample_udp(packet, 1350, 0x8efa4a64, 443);
+    case 7: sample_header(packet, 84, IPPROTO_ICMP, 0x08080808)[0] = ICMP_ECHO_REQUEST; return 84;
+    case 8: sample_udp(packet, 600, 0x8efa4a64, 443); store16(packet + IPV4_FRAGMENT, 185); return 600;
+    default: memset(packet, 0, 80); packet[0] = 0x60; return 80;
+  }
+}
+
+// 'size' bytes at 'offset' if the packet has them, the kernel ends the program with 0 otherwise
+static bool bpf_fetch(const u8 *packet, u32 length, u64 offset, u32 size, u32 &value) {
+  if (offset + size > length) {
+    return false;
+  }
+  const u8 *ptr = packet + offset;
+  value = size == 4 ? load32(ptr) : size == 2 ? load16(ptr) : *ptr;
+  return true;
+}
+
+u32 bpf_interpret(const sock_filter *code, const u8 *packet, u32 length) {
+  u32 a = 0, x = 0, memory[BPF_MEMWORDS] = {0};
+  for (u32 pc = 0; ; ++ pc) {
+    const sock_filter &insn = code[pc];
+    u32 k = insn.k, value = 0;
+    switch (insn.code) {
+      case BPF_LD | BPF_W | BPF_ABS: if (!bpf_fetch(packet, length, k, 4, a)) return 0; break;
+      case BPF_LD | BPF_H | BPF_ABS: if (!bpf_fetch(packet, length, k, 2, a)) return 0; break;
+      case BPF_LD | BPF_B | BPF_ABS: if (!bpf_fetch(packet, length, k, 1, a)) return 0; break;
+      case BPF_LD | BPF_W | BPF_IND: if (!bpf_fetch(packet, length, (u64) x + k, 4, a)) return 0; break;
+      case BPF_LD | BPF_H | BPF_IND: if (!bpf_fetch(packet, length, (u64) x + k, 2, a)) return 0; break;
+      case BPF_LD | BPF_B | BPF_IND: if (!bpf_fetch(packet, length, (u64) x + k, 1, a)) return 0; break;
+      case BPF_LD | BPF_MEM: a = memory[k]; break;
+      case BPF_LD | BPF_IMM: a = k; break;
+      case BPF_LD | BPF_W | BPF_LEN: a = length; break;
+      case BPF_LDX | BPF_MEM: x = memory[k]; break;
+      case BPF_LDX | BPF_IMM: x = k; break;
+      case BPF_LDX | BPF_W | BPF_LEN: x = length; break;
+      case BPF_LDX | BPF_B | BPF_MSH: if (!bpf_fetch(packet, length, k, 1, value)) return 0; x = (value & 0x0f) * 4; break;
+      case BPF_ST: memory[k] = a; break;
+      case BPF_STX: memory[k] = x; break;
+      case BPF_ALU | BPF_ADD | BPF_K: a += k; break;
+      case BPF_ALU | BPF_SUB | BPF_K: a -= k; break;
+      case BPF_ALU | BPF_MUL | BPF_K: a *= k; break;
+      case BPF_ALU | BPF_DIV | BPF_K: a /= k; break;
+      case BPF_ALU | BPF_MOD | BPF_K: a %= k; break;
+      case BPF_ALU | BPF_AND | BPF_K: a &= k; break;
+      case BPF_ALU | BPF_OR | BPF_K: a |= k; break;
+      case BPF_ALU | BPF_XOR | BPF_K: a ^= k; break;
+      case BPF_ALU | BPF_LSH | BPF_K: a <<= k; break;
+      case BPF_ALU | BPF_RSH | BPF_K: a >>= k; break;
+      case BPF_ALU | BPF_ADD | BPF_X: a += x; break;
+      case BPF_ALU | BPF_SUB | BPF_X: a -= x; break;
+      case BPF_ALU | BPF_MUL | BPF_X: a *= x; break;
+      case BPF_ALU | BPF_DIV | BPF_X: if (x == 0) return 0; a /= x; break;
+      case BPF_ALU | BPF_MOD | BPF_X: if (x == 0) return 0; a %= x; break;
+      case BPF_ALU | BPF_AND | BPF_X: a &= x; break;
+      case BPF_ALU | BPF_OR | BPF_X: a |= x; break;
+      case BPF_ALU | BPF_XOR | BPF_X: a ^= x; break;
+      case BPF_ALU | BPF_LSH | BPF_X: a = x < 32 ? a << x : 0; break;
+      case BPF_ALU | BPF_RSH | BPF_X: a = x < 32 ? a >> x : 0; break;
+      case BPF_ALU | BPF_NEG: a = -a; break;
+      case BPF_JMP | BPF_JA: pc += k; break;
+      case BPF_JMP | BPF_JEQ | BPF_K: pc += a == k ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGT | BPF_K: pc += a > k ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGE | BPF_K: pc += a >= k ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JSET | BPF_K: pc += (a & k) ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JEQ | BPF_X: pc += a == x ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGT | BPF_X: pc += a > x ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JGE | BPF_X: pc += a >= x ? insn.jt : insn.jf; break;
+      case BPF_JMP | BPF_JSET | BPF_X: pc += (a & x) ? insn.jt : insn.jf; break;
+      case BPF_RET | BPF_K: return k;
+      case BPF_RET | BPF_A: return a;
+      case BPF_MISC | BPF_TAX: x = a; break;
+      case BPF_MISC | BPF_TXA: a = x; break;
+      default: return 0;
+    }
+  }
+}
+
+u32 session_echo(Session &session, u32 count, u32 size, u32 timeout) {
+  static u8 packet[DATA_MAX_LENGTH];
+  u32 echoed = 0;
+  u64 deadline = 0;
+  for (u32 sent = 0; sent < count || now_us() < deadline; ) {
+    if (sent < count) {
+      packet_udp(packet, size, sent);
+      if (send(session.app, packet, size, 0) == (ssize_t) size && ++ sent == count) {
+        deadline = now_us() + (u64) timeout * 1000;
+      }
+    }
+    pollfd fds = {session.app, POLLIN, 0};
+    while (echoed < count && poll(&fds, 1, sent < count ? 0 : 10) > 0) {
+      ssize_t length = recv(session.app, packet, sizeof(packet), 0);
+      if (length == (ssize_t) size && packet[IPV4_PROTOCOL] == IPPROTO_UDP) {
+        ++ echoed;
+      }
+    }
+    if (echoed == count) {
+      break;
+    }
+  }
+  return echoed;
+}
+
+// Load
+# define LOAD_PROBE_PORT              40001 // source port, packet_udp sends from 40000
+# define LOAD_PROBE_SIZE              100
+# define LOAD_TAIL                    1000  // ms to wait for echoes after the load stops
+
+static std::atomic<bool> load_running;
+static u32 load_bulk_size;
+static std::vector<u64> load_sent_us, load_rtt_us;
+
+static void* load_bulk_thread(void *arg) {
+  Session &session = *(Session *) arg;
+  static u8 packet[DATA_MAX_LENGTH];
+  for (u32 sequence = 0; load_running; ++ sequence) {
+    packet_udp(packet, load_bulk_size, sequence);
+    store16(packet + IPV4_MIN_HEADER + TRANSPORT_DESTINATION, SERVER_DISCARD_PORT);
+    pollfd fds = {session.app, POLLOUT, 0};
+    if (poll(&fds, 1, 10) > 0) {
+      send(session.app, packet, load_bulk_size, MSG_DONTWAIT);
+    }
+  }
+  return nullptr;
+}
+
+static void* load_echo_thread(void *arg) {
+  Session &session = *(Session *) arg;
+  static u8 packet[DATA_MAX_LENGTH];
+  pollfd fds = {session.app, POLLIN, 0};
+  for (u64 deadline = 0; load_running || (deadline ? now_us() < deadline : (deadline = now_us() + LOAD_TAIL * 1000)); ) {
+    if (poll(&fds, 1, 10) <= 0) {
+      continue;
+    }
+    ssize_t length = recv(session.app, packet, sizeof(packet), 0);
+    u64 now = now_us();
+    if (length < IPV4_MIN_HEADER + UDP_HEADER + 4) {
+      continue;
+    }
+    const u8 *transport = packet + IPV4_MIN_HEADER;
+    bool probe = packet[IPV4_PROTOCOL] == IPPROTO_ICMP ? transport[0] == ICMP_ECHO_REPLY
+      : load16(transport + TRANSPORT_DESTINATION) == LOAD_PROBE_PORT;
+    u32 sequence = load32(transport + UDP_HEADER);
+    if (probe && sequence < load_sent_us.size() && load_sent_us[sequence]) {
+      load_rtt_us.push_back(now - load_sent_us[sequence]);
+      load_sent_us[sequence] = 0;
+    }
+  }
+  return nullptr;
+}
+
+SessionLoad session_load(Session &session, u32 duration, u32 bulk_size, u32 interval, bool ping) {
+  load_running = true;
+  u32 taken = server_frames(NET_REQUEST);
+  load_sent_us.assign(duration / interval + 1, 0);
+  load_rtt_us.clear();
+  load_bulk_size = bulk_size;
+  pthread_t bulk, echo;
+  if (bulk_size) {
+    pthread_create(&bulk, nullptr, load_bulk_thread, &session);
+  }
+  pthread_create(&echo, nullptr, load_echo_thread, &session);
+
+  static u8 packet[LOAD_PROBE_SIZE];
+  u64 start = now_us();
+  for (u32 sequence = 0; sequence < load_sent_us.size(); ++ sequence) {
+    u64 due = start + (u64) sequence * interval * 1000, now = now_us();
+    if (due > now) {
+      usleep((u32) (due - now));
+    }
+    if (ping) {
+      packet_ping(packet, LOAD_PROBE_SIZE, sequence);
+    } else {
+      packet_udp(packet, LOAD_PROBE_SIZE, sequence);
+      store16(packet + IPV4_MIN_HEADER, LOAD_PROBE_PORT);
+    }
+    load_sent_us[sequence] = now_us();
+    send(session.app, packet, LOAD_PROBE_SIZE, 0);
+  }
+  u64 elapsed = now_us() - start;
+  taken = server_frames(NET_REQUEST) - taken - (u32) load_sent_us.size();
+  load_running = false;
+  if (bulk_size) {
+    pthread_join(bulk, nullptr);
+  }
+  pthread_join(echo, nullptr);
+
+  SessionLoad load = {bulk_size ? (u32) ((u64) taken * bulk_size * 8000 / elapsed) : 0, (u32) load_sent_us.size(), (u32) load_rtt_us.size()};
+  std::sort(load_rtt_us.begin(), load_rtt_us.end());
+  if (!load_rtt_us.empty()) {
+    load.rtt_median_us = (u32) load_rtt_us[load_rtt_us.size() / 2];
+    load.rtt_p99_us = (u32) load_rtt_us[load_rtt_us.size() * 99 / 100];
+    load.rtt_max_us = (u32) load_rtt_us.back();
+  }
+  return load;
+}
+
+// Host load
+static u16 via_port;
+static bool via_http;
+
+// The request of a SOCKS5 or HTTP CONNECT proxy for the host, and the success reply it waits for
+static void proxy_request(int fd) {
+  u8 reply[PROXY_HANDSHAKE];
+  if (via_http) {
+    char request[128];
+    int size = snprintf(request, sizeof(request), "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n\r\n",
+      SESSION_REMOTE, HOST_PORT, SESSION_REMOTE, HOST_PORT);
+    check(send(fd, request, size, MSG_NOSIGNAL) == size, "proxy connection lost");
+    u32 length = 0;
+    while (length < 4 || memcmp(reply + length - 4, "\r\n\r\n", 4) != 0) {
+      check(length < sizeof(reply) && recv_all(fd, reply + length, 1), "proxy reply cut short");
+      ++ length;
+    }
+    check(memcmp(reply, "HTTP/1.1 200", 12) == 0, "proxy refused: %.*s", (int) length, reply);
+    return;
+  }
+  u8 request[10] = {5, 1, 0};
+  check(send(fd, request, 3, MSG_NOSIGNAL) == 3 && recv_all(fd, reply, 2) && reply[1] == 0, "proxy greeting refused");
+  request[3] = 1;
+  inet_pton(AF_INET, SESSION_REMOTE, request + 4);
+  store16(request + 8, HOST_PORT);
+  check(send(fd, request, 10, MSG_NOSIGNAL) == 10 && recv_all(fd, reply, 10) && reply[1] == 0, "proxy refused the host");
+}
+
+static int host_connect(char mode, TcpLoad &load) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), enable = 1;
+  timeval timeout = {HOST_TIMEOUT / 1000, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  sockaddr_in host = {};
+  host.sin_family = AF_INET;
+  host.sin_port = htons(via_port ? via_port : HOST_PORT);
+  inet_pton(AF_INET, via_port ? "127.0.0.1" : SESSION_REMOTE, &host.sin_addr);
+  u64 start = now_us();
+  check(connect(fd, (sockaddr *) &host, sizeof(host)) == 0, "host not reached (%s)", strerror(errno));
+  if (via_port) {
+    proxy_request(fd);
+  }
+  load.connect_us = (u32) (now_us() - start);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+  check(send(fd, &mode, 1, MSG_NOSIGNAL) == 1, "host connection lost");
+  return fd;
+}
+
+TcpLoad host_upload(u32 duration) {
+  static u8 buffer[65536];
+  TcpLoad load = {};
+  int fd = host_connect('U', load);
+  u64 start = now_us(), end = start + duration * 1000ull, sent = 0, taken = 0;
+  for (ssize_t length; now_us() < end && (length = send(fd, buffer, sizeof(buffer), MSG_NOSIGNAL)) > 0; ) {
+    sent += length;
+  }
+  shutdown(fd, SHUT_WR);
+  check(recv_all(fd, (u8 *) &taken, sizeof(taken)), "upload not answered");
+  check(taken == sent, "host took %llu bytes of %llu", (unsigned long long) taken, (unsigned long long) sent);
+  load.kbps = (u32) (taken * 8000 / (now_us() - start));
+  close(fd);
+  return load;
+}
+
+TcpLoad host_download(u32 duration) {
+  static u8 buffer[65536];
+  TcpLoad load = {};
+  int fd = host_connect('D', load);
+  u64 start = now_us(), end = start + duration * 1000ull, got = 0;
+  for (ssize_t length; now_us() < end && (length = recv(fd, buffer, sizeof(buffer), 0)) > 0; ) {
+    for (ssize_t i = 0; i < length; ++ i) {
+      check(buffer[i] == (got + i) % HOST_PATTERN, "download corrupt at byte %llu", (unsigned long long) (got + i));
+    }
+    got += length;
+  }
+  load.kbps = (u32) (got * 8000 / (now_us() - start));
+  close(fd);
+  return load;
+}
+
+TcpLoad host_ping(u32 rounds) {
+  u8 buffer[HOST_PING_SIZE], echo[HOST_PING_SIZE];
+  TcpLoad load = {};
+  int fd = host_connect('P', load);
+  std::vector<u64> rtt_us;
+  for (u32 i = 0; i < rounds; ++ i) {
+    memset(buffer, (int) i, HOST_PING_SIZE);
+    u64 start = now_us();
+    check(send(fd, buffer, HOST_PING_SIZE, MSG_NOSIGNAL) == HOST_PING_SIZE && recv_all(fd, echo, HOST_PING_SIZE),
+      "round trip %d lost", i);
+    check(memcmp(buffer, echo, HOST_PING_SIZE) == 0, "round trip %d echoed other bytes", i);
+    rtt_us.push_back(now_us() - start);
+  }
+  std::sort(rtt_us.begin(), rtt_us.end());
+  load.rtt_median_us = (u32) rtt_us[rtt_us.size() / 2];
+  load.rtt_p99_us = (u32) rtt_us[rtt_us.size() * 99 / 100];
+  close(fd);
+  return load;
+}
+
+void host_via(u16 port, bool http) {
+  via_port = port;
+  via_http = http;
+}
+
+u32 tik_value(const char *label) {
+  const char *status = (const char *) Java_com_lyricz_a4over6vpn_VPNService_tik(&env, &service_object);
+  const char *found = strstr(status, label);
+  u32 value = found ? (u32) strtoul(found + strlen(label), nullptr, 10) : 0;
+  free((void *) status);
+  return value;
+}
+
+bool tik_has(const char *text) {
+  const char *status = (const char *) Java_com_lyricz_a4over6vpn_VPNService_tik(&env, &service_object);
+  bool found = strstr(status, text) != nullptr;
+  free((void *) status);
+  return found;
+}
+
+void route_file(const char *path, const RoutePrefix *prefixes, u32 count) {
+  std::vector<u8> file(8 + count * 6);
+  memcpy(file.data(), "4o6R", 4);
+  store32(file.data() + 4, count);
+  for (u32 i = 0; i < count; ++ i) {
+    u8 *record = file.data() + 8 + i * 6;
+    store32(record, prefixes[i].address);
+    record[4] = prefixes[i].length;
+    record[5] = prefixes[i].action;
+  }
+  FILE *output = fopen(path, "wb");
+  check(output && fwrite(file.data(), 1, file.size(), output) == file.size() && fclose(output) == 0,
+    "can not write %s", path);
+}
@@ -0,0 +1,244 @@
+// Host test harness of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+// Android Includes
+# include <jni.h>
+
+// Native C++
+# include <cstdio>
+# include <cstdlib>
+# include <pthread.h>
+# include <unistd.h>
+
+// Networks
+# include <linux/filter.h>
+
+// Backend
+# include "common.h"
+# include "message.h"
+
+// Parameters
+# define HARNESS_SKIP                 77    // exit code of a test that can not run here, ctest SKIP_RETURN_CODE
+# define SERVER_CONNECTIONS           64    // connections the stand-in server takes over a test
+# define SERVER_IP_REPLY              "10.99.0.1 0.0.0.0 10.99.0.53 10.99.0.54 10.99.0.55" // address, route, DNS
+# define SESSION_LOCAL                "10.99.0.1"
+# define SESSION_REMOTE               "10.99.0.2" // echoed by the stand-in server
+# define SERVER_ECHO_PORT             7     // UDP port of packet_udp
+# define SERVER_DISCARD_PORT          9     // UDP packets to it are taken and not reflected
+# define SERVER_HOP_ROUTER            "10.99.0.254" // router of the hop behind the server, see server_hop
+# define WIRE_CLIENT                  "10.200.0.1"
+# define WIRE_SERVER                  "10.200.0.2"
+# define WIRE_QUEUE                   64    // packets each tun of the wire holds, as a router queue would
+# define SESSION_QUEUE                500   // packets the tun of a session on one holds, as the one of Android does
+# define HOST_PORT                    5001  // TCP port the host behind the server serves, see host_upload
+# define HOST_TIMEOUT                 10000 // ms a transfer with the host may stall before the bench gives up
+# define HOST_PING_SIZE               64    // bytes of the messages of host_ping
+# define FETCH_LENGTH                 98304 // bytes of the content packet_fetch serves
+# define SAMPLE_PACKETS               10    // packets of the mix packet_sample builds
+# define SAMPLE_MAX_LENGTH            1500
+
+// Tests are plain programs linked with the backend: a failed check ends one with a message and exit
+// code 1, and one that can not run here exits with HARNESS_SKIP. The backend runs as the service
+// would run it, through its JNI entry points, against a stand-in server on loopback or on a wire of
+// two tun devices in network namespaces of their own, where connections can be blackholed
+# define check(condition, ...) do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: ", __FILE__, __LINE__); \
+      fprintf(stderr, __VA_ARGS__); \
+      fprintf(stderr, "\n"); \
+      exit(1); \
+    } \
+  } while (0)
+
+// JNI entry points of native-lib.cpp
+extern "C" {
+jstring Java_com_lyricz_a4over6vpn_VPNService_tik(JNIEnv* env, jobject thiz);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_backend(JNIEnv* env, jobject thiz, jint fd);
+void Java_com_lyricz_a4over6vpn_VPNService_initialize(JNIEnv* env, jobject thiz);
+void Java_com_lyricz_a4over6vpn_VPNService_liveness(JNIEnv* env, jobject thiz, jint probe, jint target);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_crypto(JNIEnv* env, jobject thiz, jbyteArray j_key, jint cipher);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_tls(JNIEnv* env, jobject thiz, jbyteArray j_key, jint cipher);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_compress(JNIEnv* env, jobject thiz, jboolean enabled);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_headers(JNIEnv* env, jobject thiz, jboolean enabled);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_cache(JNIEnv* env, jobject thiz, jstring j_path, jint megabytes);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_split(JNIEnv* env, jobject thiz, jboolean enabled);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_proxy(JNIEnv* env, jobject thiz, jint port);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_filter(JNIEnv* env, jobject thiz, jstring j_bytecode);
+jboolean Java_com_lyricz_a4over6vpn_VPNService_routes(JNIEnv* env, jobject thiz, jstring j_path);
+void Java_com_lyricz_a4over6vpn_VPNService_workers(JNIEnv* env, jobject thiz, jint count);
+void Java_com_lyricz_a4over6vpn_VPNService_energy(JNIEnv* env, jobject thiz, jboolean enabled);
+void Java_com_lyricz_a4over6vpn_VPNService_shaper(JNIEnv* env, jobject thiz, jint direction, jint tier, jint rate, jint burst);
+jint Java_com_lyricz_a4over6vpn_VPNService_open(JNIEnv* env, jobject thiz, jstring j_addr, jstring j_port);
+jstring Java_com_lyricz_a4over6vpn_VPNService_request(JNIEnv* env, jobject thiz);
+jint Java_com_lyricz_a4over6vpn_VPNService_mtu(JNIEnv* env, jobject thiz);
+void Java_com_lyricz_a4over6vpn_VPNService_terminate(JNIEnv* env, jobject thiz);
+}
+
+// Java side: strings are C strings, byte arrays are HarnessBytes, and protect() records whether the
+// socket it is given is connected already (it must not be, or its SYN went into the VPN)
+struct HarnessBytes : _jbyteArray {
+  jsize length;
+  jbyte bytes[64];
+};
+
+extern volatile u32 harness_protected, harness_protected_connected;
+
+JNIEnv* harness_env();
+jstring harness_string(const char *chars);
+
+// Stand-in server, answers IP requests, echoes heartbeats and reflects NET_REQUEST packets with
+// their addresses and ports swapped (ICMP echo requests are answered, UDP to the discard port is
+// not), on every connection it takes. Connections are numbered in the order they are accepted
+u16 server_start(const char *address);
+int server_connections();
+u32 server_frames(u8 type);
+// Send 'message' as it is on connection 'index', as anyone on the path could
+bool server_inject(int index, const Message &message);
+void server_kill(int index);
+void server_reset(int index); // with a reset, so the client fails to write as well as to read
+
+// Put a hop of 'mtu' bytes behind the stand-in server (0 for none): packets with DF set beyond it
+// are answered with a "fragmentation needed" from SERVER_HOP_ROUTER, or dropped if 'silent' (a black
+// hole), instead of being reflected
+void server_hop(u32 mtu, bool silent);
+
+// Stop reading frames on every connection (true), as a server that falls behind, until called again
+void server_stall(bool stall);
+u16 server_peer_port(int index);
+
+// Put a host at SESSION_REMOTE behind the stand-in server, instead of reflecting packets: NET_REQUEST
+// packets go to a tun in the namespace of the server and what the host sends back returns as
+// NET_REPLY, and a STREAM_OPEN connects to the host with a socket, whose bytes are relayed as
+// STREAM_DATA with the credit of split TCP. Returns false without the wire, before server_start
+bool server_host();
+
+// Wire, the client reaches WIRE_SERVER through two tun devices relayed here, returns false if
+// network namespaces can not be made (the test should skip), before any thread starts
+bool wire_start();
+
+// Drop the packets of the connection from client port 'port' both ways (0 for none)
+void wire_drop(u16 port);
+
+// Pace each direction of the wire at 'kbps' kbit/s (0 for as fast as the relay goes), what does
+// not fit into the queue of WIRE_QUEUE packets is dropped there
+void wire_rate(u32 kbps);
+
+// Hold each packet 'ms' longer on the way each direction (0 for none), after the pacing
+void wire_delay(u32 ms);
+
+// Drop 'percent' of the packets each direction at random (0 for none)
+void wire_loss(u32 percent);
+
+// A session of the backend as the service runs it, with a datagram socket pair for the tun, or with
+// a real tun of SESSION_LOCAL if 'tun' (after wire_start), which apps reach SESSION_REMOTE through
+// with sockets of the kernel
+struct Session {
+  int app;   // the side apps write packets to and read them from, -1 on a real tun
+  int tun;   // the side the backend takes as tun
+  pthread_t backend;
+};
+
+bool session_start(Session &session, const char *address, u16 port, bool tun = false);
+
+// Terminate and join, returns how long backend() took to return (us)
+u64 session_stop(Session &session);
+
+// Send 'count' UDP packets of 'size' bytes to SESSION_REMOTE and count the echoed ones, waiting at
+// most 'timeout' ms for the last
+u32 session_echo(Session &session, u32 count, u32 size, u32 timeout);
+
+// Load for benchmarks: a bulk UDP upload of 'bulk_size' byte packets to the discard port sent as
+// fast as the tun takes them (none if 0), next to a probe flow of one small packet every 'interval'
+// ms, UDP or ICMP echo requests if 'ping', whose echoes are timed
+struct SessionLoad {
+  u32 bulk_kbps;     // bulk data the server took
+  u32 probes, echoed;
+  u32 rtt_median_us, rtt_p99_us, rtt_max_us;
+};
+
+SessionLoad session_load(Session &session, u32 duration, u32 bulk_size, u32 interval, bool ping);
+
+// TCP of an app with the host behind the server (see server_host), through a session on a real tun:
+// an upload and a download of as much as goes in 'duration' ms, and 'rounds' round trips of
+// HOST_PING_SIZE byte messages, each on a connection of its own. A byte lost, repeated or changed
+// either way fails the check
+struct TcpLoad {
+  u32 connect_us;    // until connect() returned
+  u32 kbps;          // bytes the host took, or the app got
+  u32 rtt_median_us, rtt_p99_us;
+};
+
+TcpLoad host_upload(u32 duration);
+TcpLoad host_download(u32 duration);
+TcpLoad host_ping(u32 rounds);
+
+// Reach the host through the local proxy of the backend on 'port' from now on, SOCKS5 or HTTP
+// CONNECT if 'http' (0 for through the tun)
+void host_via(u16 port, bool http);
+
+// TLS 1.3 peer: openssl s_server with 'key' as external PSK (identity TLS_PSK_IDENTITY), serving
+// 'connections' connections one after another on loopback. Its -psk hashes with SHA-256, so only
+// TLS_CHACHA20_POLY1305_SHA256 (CRYPTO_CHACHA) agrees. What is written to 'input' goes to the client,
+// what the client sends comes out of 'output'. Returns false without openssl (the test should skip)
+struct TlsPeer {
+  pid_t pid;
+  int input, output;
+  u16 port;
+};
+
+bool peer_start(TlsPeer &peer, const u8 *key, int connections);
+void peer_stop(TlsPeer &peer);
+
+// A socket connected to the peer, once it listens (within 'timeout' ms)
+int peer_connect(TlsPeer &peer, u32 timeout);
+
+// Number after 'label' in the status the UI shows, 0 if absent, and whether the status shows 'text'
+u32 tik_value(const char *label);
+bool tik_has(const char *text);
+
+// Wait up to 'timeout' ms for 'condition' to hold, returns whether it did
+template <typename Condition>
+bool wait_for(Condition condition, u32 timeout) {
+  for (u64 deadline = now_us() + (u64) timeout * 1000; !condition(); ) {
+    if (now_us() > deadline) {
+      return false;
+    }
+    usleep(1000);
+  }
+  return true;
+}
+
+// UDP packet of 'length' bytes from SESSION_LOCAL to SESSION_REMOTE carrying 'sequence'
+void packet_udp(u8 *packet, u32 length, u32 sequence);
+
+// Telemetry-like JSON of up to 'length' bytes, as compressible as such app traffic, returns its size
+u32 sample_json(u8 *buffer, u32 length);
+
+// ICMP echo request of 'length' bytes from SESSION_LOCAL to SESSION_REMOTE carrying 'sequence'
+void packet_ping(u8 *packet, u32 length, u32 sequence);
+
+// Segment at 'offset' of a download fetched twice (0 or 1): the same random content, so only a
+// byte cache can save anything, behind a response header of another length each time, in segments
+// of another size each time. Writes the TCP packet, returns its payload size, 0 past the end
+u32 packet_fetch(int fetch, u32 offset, u8 *packet);
+
+// Packet 'index' of what a phone sends: handshakes, ACKs and data of TCP, DNS, SSDP and mDNS
+// chatter, QUIC, pings, a later fragment, and something not IPv4, returns its length
+u32 packet_sample(u32 index, u8 *packet);
+
+// Reference classic BPF interpreter, on the instructions as given (the program must have passed the
+// checks of the kernel), as the kernel runs a program on a raw socket
+u32 bpf_interpret(const sock_filter *code, const u8 *packet, u32 length);
+
+// A prefix of a route table file, the address in host order
+struct RoutePrefix {
+  u32 address;
+  u8 length;
+  u8 action;
+};
+
+// Write a route table file of 'count' prefixes at 'path', as the app downloads one
+void route_file(const char *path, const RoutePrefix *prefixes, u32 count);
@@ -0,0 +1,38 @@
+// Latency under load benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+
+// Parameters
+# define LINK_RATE                    10000 // kbit/s each way
+# define PHASE_DURATION               10000 // ms
+# define BULK_SIZE                    1400  // bytes per bulk packet
+# define PING_INTERVAL                20    // ms
+
+// Pings over a wire paced at a fixed rate, idle and next to a bulk upload that sends far more than
+// the link takes: the queue in front of the writer has to keep the ping round trips close to the
+// idle ones however much the upload backs up
+static void phase(Session &session, const char *name, u32 bulk_size) {
+  u32 drops = tik_value("active flows, "), marks = tik_value("dropped, "), overflows = tik_value("marked, ");
+  SessionLoad load = session_load(session, PHASE_DURATION, bulk_size, PING_INTERVAL, true);
+  printf("%-6s ping %d/%d answered, RTT %d/%d/%d us (median/p99/max), bulk %d kbit/s, FQ-CoDel %d dropped, %d marked, %d overflows\n",
+    name, load.echoed, load.probes, load.rtt_median_us, load.rtt_p99_us, load.rtt_max_us, load.bulk_kbps,
+    tik_value("active flows, ") - drops, tik_value("dropped, ") - marks, tik_value("marked, ") - overflows);
+}
+
+int main() {
+  if (!wire_start()) {
+    printf("Skipped, network namespaces are not available\n");
+    return HARNESS_SKIP;
+  }
+  wire_rate(LINK_RATE);
+  printf("Link of %d kbit/s each way\n", LINK_RATE);
+  u16 port = server_start(WIRE_SERVER);
+  Session session;
+  check(session_start(session, WIRE_SERVER, port), "session did not start");
+  phase(session, "Idle", 0);
+  phase(session, "Loaded", BULK_SIZE);
+  session_stop(session);
+  return 0;
+}
@@ -0,0 +1,54 @@
+// Liveness test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+
+// Parameters
+# define PROBE_INTERVAL               100   // ms
+# define DETECT_TARGET                1000  // ms
+# define DETECT_SLACK                 500   // ms past the target a detection may take (two probe periods, jitter)
+# define ECHO_PACKETS                 100
+# define ECHO_SIZE                    500
+# define ECHO_TIMEOUT                 2000  // ms
+# define STANDBY_TIMEOUT              5000  // ms for a standby to become ready
+
+// The wire blackholes the primary connection, which neither closes nor answers, so only probing
+// notices: the peer must be declared dead within the detection target and the standby take over
+int main() {
+  if (!wire_start()) {
+    printf("Skipped, network namespaces are not available\n");
+    return HARNESS_SKIP;
+  }
+  JNIEnv *env = harness_env();
+
+  // Non-positive values are refused, the defaults stay
+  Java_com_lyricz_a4over6vpn_VPNService_liveness(env, nullptr, 0, DETECT_TARGET);
+  Java_com_lyricz_a4over6vpn_VPNService_liveness(env, nullptr, PROBE_INTERVAL, -1);
+  u16 port = server_start(WIRE_SERVER);
+  Session session;
+  check(session_start(session, WIRE_SERVER, port), "session did not start");
+  check(tik_value("(target ") == 2000, "refused values were taken (target %d ms)", tik_value("(target "));
+  check(tik_value("Timers: ") < 100, "timer wheel spinning (%d fired)", tik_value("Timers: "));
+  session_stop(session);
+
+  Java_com_lyricz_a4over6vpn_VPNService_liveness(env, nullptr, PROBE_INTERVAL, DETECT_TARGET);
+  check(session_start(session, WIRE_SERVER, port), "session did not restart");
+  check(session_echo(session, ECHO_PACKETS, ECHO_SIZE, ECHO_TIMEOUT) == ECHO_PACKETS, "packets lost before the blackhole");
+  check(wait_for([] { return tik_has("Standby: ready"); }, STANDBY_TIMEOUT), "no standby");
+
+  // Idle, so the probes are what goes unacknowledged
+  u64 start = now_us();
+  wire_drop(server_peer_port(server_connections() - 2));
+  check(wait_for([] { return tik_value("failovers: ") == 1; }, DETECT_TARGET + DETECT_SLACK + 1000),
+    "blackhole not detected");
+  u32 elapsed = (u32) ((now_us() - start) / 1000), detection = tik_value("last detection: ");
+  printf("Blackhole detected in %d ms (peer silent for %d ms, target %d ms, %d probes)\n", elapsed, detection,
+    DETECT_TARGET, tik_value("Probes: "));
+  check(elapsed >= DETECT_TARGET - PROBE_INTERVAL, "declared dead too early (%d ms)", elapsed);
+  check(elapsed <= DETECT_TARGET + DETECT_SLACK, "detection took %d ms, target %d ms", elapsed, DETECT_TARGET);
+  check(session_echo(session, ECHO_PACKETS, ECHO_SIZE, ECHO_TIMEOUT) == ECHO_PACKETS, "packets lost after failover");
+  wire_drop(0);
+  session_stop(session);
+  return 0;
+}
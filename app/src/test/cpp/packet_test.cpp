@@ -0,0 +1,132 @@
+// Packet classification test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "packet.h"
+
+// Native C++
+# include <cstring>
+
+// IPv4 TCP segment with 'flags' and 'payload' bytes of data, returns its length
+static u32 segment(u8 *packet, u8 flags, u32 payload) {
+  u32 length = IPV4_MIN_HEADER + TCP_MIN_HEADER + payload;
+  packet_udp(packet, length, 0);
+  packet[IPV4_PROTOCOL] = IPPROTO_TCP;
+  u8 *tcp = packet + IPV4_MIN_HEADER;
+  memset(tcp, 0, TCP_MIN_HEADER);
+  store16(tcp, 40000);
+  store16(tcp + TRANSPORT_DESTINATION, 443);
+  tcp[TCP_OFFSET] = (TCP_MIN_HEADER / 4) << 4;
+  tcp[TCP_FLAGS] = flags;
+  return length;
+}
+
+// SYN-ish segment with TCP 'options' (a multiple of 4 bytes) and 'payload' bytes of data, carrying
+// a valid checksum, returns its length
+static u32 segment_with(u8 *packet, u8 flags, const u8 *options, u32 options_length, u32 payload) {
+  u32 length = segment(packet, flags, options_length + payload);
+  u8 *tcp = packet + IPV4_MIN_HEADER;
+  tcp[TCP_OFFSET] = ((TCP_MIN_HEADER + options_length) / 4) << 4;
+  store32(tcp + TCP_SEQUENCE, 0x9e3779b9 * payload);
+  memcpy(tcp + TCP_MIN_HEADER, options, options_length);
+  for (u32 i = 0; i < payload; ++ i) {
+    tcp[TCP_MIN_HEADER + options_length + i] = (u8) (i * 37 + payload);
+  }
+  store16(tcp + TCP_CHECKSUM, 0);
+  store16(tcp + TCP_CHECKSUM, transport_checksum(packet));
+  return length;
+}
+
+// MSS clamping on SYNs and SYN-ACKs, with the option at an even and an odd offset: the checksum
+// adjusted incrementally (RFC 1624) must equal the one computed over the clamped segment anew, and
+// segments needing no clamp must stay untouched
+static void clamping() {
+  static u8 packet[DATA_MAX_LENGTH], original[DATA_MAX_LENGTH];
+  const u16 mss = 1360, values[] = {1460, 65535, 0x8001, 1361, 1360, 536};
+  const u8 flag_sets[] = {TCP_SYN, TCP_SYN | TCP_ACK};
+  const u32 payloads[] = {0, 1, 77};
+  for (u16 value: values) {
+    u8 even[12] = {TCP_OPTION_MSS, TCP_OPTION_MSS_LENGTH, (u8) (value >> 8), (u8) value, TCP_OPTION_NOP, 3, 3, 7, 4, 2,
+      TCP_OPTION_NOP, TCP_OPTION_NOP};
+    u8 odd[8] = {TCP_OPTION_NOP, TCP_OPTION_MSS, TCP_OPTION_MSS_LENGTH, (u8) (value >> 8), (u8) value, TCP_OPTION_NOP,
+      TCP_OPTION_NOP, TCP_OPTION_END};
+    for (u8 flags: flag_sets) {
+      for (int at_odd = 0; at_odd < 2; ++ at_odd) {
+        for (u32 payload: payloads) {
+          u32 length = segment_with(packet, flags, at_odd ? odd : even, at_odd ? sizeof(odd) : sizeof(even), payload);
+          memcpy(original, packet, length);
+          u8 *tcp = packet + IPV4_MIN_HEADER, *option = tcp + TCP_MIN_HEADER + at_odd;
+          bool clamped = tcp_clamp_mss(packet, length, mss);
+          if (value <= mss) {
+            check(!clamped && memcmp(packet, original, length) == 0, "MSS %d changed though below %d", value, mss);
+            continue;
+          }
+          check(clamped && load16(option + 2) == mss, "MSS %d not clamped (flags 0x%02x, %s offset)", value, flags,
+            at_odd ? "odd" : "even");
+          u16 adjusted = load16(tcp + TCP_CHECKSUM);
+          store16(tcp + TCP_CHECKSUM, 0);
+          u16 computed = transport_checksum(packet);
+          check(adjusted == computed, "MSS %d clamped at %s offset (flags 0x%02x, %d bytes of data): checksum 0x%04x, computed 0x%04x",
+            value, at_odd ? "an odd" : "an even", flags, payload, adjusted, computed);
+          store16(tcp + TCP_CHECKSUM, adjusted);
+          check(memcmp(packet, original, length) != 0 && transport_checksum(packet) == 0, "clamped segment does not verify");
+        }
+      }
+    }
+  }
+
+  // No MSS option, or not a SYN: nothing to clamp
+  u8 none[4] = {TCP_OPTION_NOP, TCP_OPTION_NOP, 4, 2}, mss_option[4] = {TCP_OPTION_MSS, TCP_OPTION_MSS_LENGTH, 0x05, 0xb4};
+  u32 length = segment_with(packet, TCP_SYN, none, sizeof(none), 0);
+  memcpy(original, packet, length);
+  check(!tcp_clamp_mss(packet, length, mss) && memcmp(packet, original, length) == 0, "SYN without MSS option changed");
+  length = segment_with(packet, TCP_ACK, mss_option, sizeof(mss_option), 10);
+  memcpy(original, packet, length);
+  check(!tcp_clamp_mss(packet, length, mss) && memcmp(packet, original, length) == 0, "MSS option of a segment without SYN changed");
+}
+
+// Only SYNs and pure ACKs go ahead of their flow: a FIN or RST must stay behind the data it ends,
+// and MSS clamping keeps the checksum valid
+int main() {
+  static u8 packet[DATA_MAX_LENGTH];
+  struct {
+    u8 flags;
+    u32 payload;
+    int expected;
+  } cases[] = {
+    {TCP_SYN, 0, PACKET_TCP_CONTROL},
+    {TCP_SYN | TCP_ACK, 0, PACKET_TCP_CONTROL},
+    {TCP_ACK, 0, PACKET_TCP_CONTROL},
+    {TCP_ACK | TCP_PSH, 0, PACKET_TCP_CONTROL},
+    {TCP_ACK | TCP_PSH, 10, PACKET_BULK},
+    {TCP_ACK | TCP_FIN, 0, PACKET_BULK},
+    {TCP_ACK | TCP_FIN, 100, PACKET_BULK},
+    {TCP_RST, 0, PACKET_BULK},
+    {TCP_ACK | TCP_RST, 0, PACKET_BULK},
+    {TCP_SYN | TCP_FIN, 0, PACKET_BULK},
+  };
+  for (auto &c: cases) {
+    u32 length = segment(packet, c.flags, c.payload);
+    int found = packet_class(packet, length);
+    check(found == c.expected, "flags 0x%02x with %d bytes: class %d, expected %d", c.flags, c.payload, found, c.expected);
+    check(tcp_pure_ack(packet, length) == (c.expected == PACKET_TCP_CONTROL && !(c.flags & TCP_SYN)),
+      "flags 0x%02x with %d bytes: pure ACK misjudged", c.flags, c.payload);
+  }
+
+  // A TCP header cut short is no segment to classify by its flags
+  u32 length = segment(packet, TCP_ACK, 0) - 1;
+  store16(packet + IPV4_TOTAL_LENGTH, (u16) length);
+  check(!tcp_pure_ack(packet, length) && packet_class(packet, length) != PACKET_TCP_CONTROL, "truncated header taken as a pure ACK");
+
+  // DNS, small and large datagrams
+  packet_udp(packet, 60, 0);
+  store16(packet + IPV4_MIN_HEADER + TRANSPORT_DESTINATION, DNS_PORT);
+  check(packet_class(packet, 60) == PACKET_DNS, "DNS query not classified");
+  packet_udp(packet, PACKET_SMALL_LENGTH, 0);
+  check(packet_class(packet, PACKET_SMALL_LENGTH) == PACKET_SMALL, "small datagram not classified");
+  packet_udp(packet, PACKET_SMALL_LENGTH + 1, 0);
+  check(packet_class(packet, PACKET_SMALL_LENGTH + 1) == PACKET_BULK, "large datagram not classified");
+  clamping();
+  return 0;
+}
@@ -0,0 +1,101 @@
+// Path MTU discovery test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "packet.h"
+# include "pmtu.h"
+
+// Native C++
+# include <cstring>
+# include <poll.h>
+# include <sys/socket.h>
+
+// Parameters
+# define HOP_MTU                      1400  // of the hop behind the server that answers
+# define HOLE_MTU                     1300  // of the one that drops silently, found as the plateau below
+# define HOLE_FOUND                   1280
+# define ECHO_TIMEOUT                 2000  // ms
+# define SEARCH_TIMEOUT               (PMTU_PROBES + 3) * PMTU_PROBE_TIMEOUT // ms
+
+static void set_dont_fragment(u8 *packet) {
+  store16(packet + IPV4_FRAGMENT, IPV4_DONT_FRAGMENT);
+  store16(packet + IPV4_CHECKSUM, 0);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+}
+
+// Send an echo request of 'size' bytes with DF set, returns what comes back on the tun (0 if nothing)
+static u32 ping(Session &session, u32 size, u8 *reply) {
+  static u8 packet[PMTU_MAX];
+  packet_ping(packet, size, size);
+  set_dont_fragment(packet);
+  check(send(session.app, packet, size, 0) == (ssize_t) size, "echo request not taken");
+  pollfd fds = {session.app, POLLIN, 0};
+  if (poll(&fds, 1, ECHO_TIMEOUT) != 1) {
+    return 0;
+  }
+  ssize_t length = recv(session.app, reply, PMTU_MAX, 0);
+  return length > 0 ? (u32) length : 0;
+}
+
+// Whether the status shows 'mtu' as found
+static bool found(u32 mtu) {
+  char status[64];
+  snprintf(status, sizeof(status), "Path MTU: %d bytes (verified)", mtu);
+  return tik_has(status);
+}
+
+// A hop that answers: the search takes the next-hop MTU of the router, the tun of the next session
+// gets it, and oversized packets with DF set are answered on the tun with it meanwhile, as from their
+// destination, quoting their header
+static void answering(u16 port) {
+  JNIEnv *env = harness_env();
+  check(Java_com_lyricz_a4over6vpn_VPNService_mtu(env, nullptr) == PMTU_INITIAL, "first tun MTU is not PMTU_INITIAL");
+  server_hop(HOP_MTU, false);
+  Session session;
+  check(session_start(session, "127.0.0.1", port), "session did not start");
+  check(wait_for([] { return found(HOP_MTU); }, SEARCH_TIMEOUT), "search did not find the hop of %d bytes", HOP_MTU);
+  check(tik_value("probes echoed, ") > 0, "answers of the router not counted");
+
+  static u8 reply[PMTU_MAX], quoted[PMTU_INITIAL];
+  packet_ping(quoted, PMTU_INITIAL, PMTU_INITIAL);
+  set_dont_fragment(quoted);
+  u32 answers = tik_value("too big received, ");
+  u32 length = ping(session, PMTU_INITIAL, reply);
+  const u8 *icmp = reply + IPV4_MIN_HEADER;
+  check(length == IPV4_MIN_HEADER + ICMP_HEADER + IPV4_MIN_HEADER + 8 && reply[IPV4_PROTOCOL] == IPPROTO_ICMP
+    && checksum(reply, IPV4_MIN_HEADER) == 0 && checksum(icmp, length - IPV4_MIN_HEADER) == 0,
+    "answer of %d bytes malformed", length);
+  check(icmp[0] == ICMP_UNREACHABLE && icmp[ICMP_CODE] == ICMP_FRAGMENTATION_NEEDED && load16(icmp + ICMP_NEXT_HOP_MTU) == HOP_MTU,
+    "answer is type %d code %d, next hop MTU %d", icmp[0], icmp[ICMP_CODE], load16(icmp + ICMP_NEXT_HOP_MTU));
+  check(load32(reply + IPV4_SOURCE) == load32(quoted + IPV4_DESTINATION) && memcmp(icmp + ICMP_HEADER, quoted, IPV4_MIN_HEADER + 8) == 0,
+    "answer not from the destination or not quoting the packet");
+  check(wait_for([answers] { return tik_value("too big received, ") > answers; }, ECHO_TIMEOUT), "answer not counted");
+  check(ping(session, HOP_MTU, reply) == HOP_MTU && icmp[0] == ICMP_ECHO_REPLY, "packet that fits the hop not echoed");
+  printf("Answering hop: %d bytes found, %d byte DF packet answered\n", HOP_MTU, PMTU_INITIAL);
+  session_stop(session);
+  check(Java_com_lyricz_a4over6vpn_VPNService_mtu(env, nullptr) == HOP_MTU, "next tun MTU is not the one found");
+}
+
+// A hop that drops silently: sizes beyond go unanswered for PMTU_PROBES rounds and are given up,
+// while echoes of apps, of the very sizes probed, reach them
+static void black_hole(u16 port) {
+  server_hop(HOLE_MTU, true);
+  Session session;
+  check(session_start(session, "127.0.0.1", port), "session did not start");
+  static u8 reply[PMTU_MAX];
+  const u8 *icmp = reply + IPV4_MIN_HEADER;
+  check(ping(session, HOLE_FOUND, reply) == HOLE_FOUND && icmp[0] == ICMP_ECHO_REPLY && load16(icmp + ICMP_SEQUENCE) == HOLE_FOUND,
+    "echo of the app taken by the search");
+  check(wait_for([] { return found(HOLE_FOUND); }, SEARCH_TIMEOUT), "search did not find the black hole at %d bytes", HOLE_MTU);
+  printf("Black hole: %d bytes found for a hop of %d\n", HOLE_FOUND, HOLE_MTU);
+  session_stop(session);
+  server_hop(0, false);
+}
+
+int main() {
+  u16 port = server_start("127.0.0.1");
+  answering(port);
+  black_hole(port);
+  return 0;
+}
@@ -0,0 +1,64 @@
+// Worker pool benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "crypto.h"
+# include "harness.h"
+# include "pool.h"
+
+// Native C++
+# include <cstring>
+
+// Parameters
+# define BENCH_TIME                   200000 // us per worker count
+# define BENCH_SIZE                   1500  // bytes per frame
+
+// Sealing throughput with 0 (inline) up to the given number of workers (one per core besides the
+// first by default), split as the writer splits it: frames are numbered on the submitting thread and
+// encrypted on the workers. Frames go round twice the window, a task is only refilled once the one
+// two windows earlier has been delivered
+static Message frames[POOL_WINDOW * 2][POOL_BATCH];
+
+static void encrypt_task(Message **batch, bool *passed, int count) {
+  crypto_encrypt(batch, count);
+  memset(passed, true, count);
+}
+
+static void deliver_task(Message **batch, const bool *passed, int count) {
+}
+
+int main(int argc, char **argv) {
+  int requested = argc > 1 ? atoi(argv[1]) : -1;
+  u8 key[CRYPTO_KEY_LENGTH] = {};
+  check(crypto_configure(key, CRYPTO_KEY_LENGTH, CRYPTO_AUTO), "key refused");
+  printf("%s (%s), %d-byte frames\n", crypto_cipher(), crypto_engine(), BENCH_SIZE);
+  PoolStage stage;
+  pool_stage_init(stage, encrypt_task, deliver_task);
+  pool_start(requested);
+  int most = pool_workers();
+  pool_stop();
+  for (int count = 0; count <= most; ++ count) {
+    pool_start(count);
+    u64 start = now_us(), elapsed, total = 0;
+    do {
+      Message *batch[POOL_BATCH];
+      for (int i = 0; i < POOL_BATCH; ++ i) {
+        batch[i] = &frames[stage.submitted & (POOL_WINDOW * 2 - 1)][i];
+        batch[i] -> length = HEADER_LENGTH + BENCH_SIZE;
+        batch[i] -> type = NET_REQUEST;
+      }
+      crypto_wrap(batch, POOL_BATCH);
+      pool_submit(stage, batch, POOL_BATCH);
+      total += BENCH_SIZE * POOL_BATCH;
+      elapsed = now_us() - start;
+    } while (elapsed < BENCH_TIME);
+    while (!pool_idle(stage)) {
+      usleep(100);
+    }
+    elapsed = now_us() - start;
+    u32 stolen = pool_steals, reordered = pool_reordered;
+    pool_stop();
+    printf("%d workers: %d Mbit/s (%d stolen, %d out of order)\n", count, (u32) (total * 8 / elapsed), stolen, reordered);
+  }
+  return 0;
+}
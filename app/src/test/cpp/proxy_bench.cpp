@@ -0,0 +1,66 @@
+// Local proxy benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+
+// Native C++
+# include <arpa/inet.h>
+# include <cerrno>
+# include <sys/resource.h>
+# include <sys/socket.h>
+
+// Parameters
+# define PROXY_PORT                   1080
+# define TRANSFER_TIME                3000  // ms of an upload and of a download
+# define PING_ROUNDS                  200   // round trips of small messages
+
+static u64 cpu_us() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (u64) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Whether the backend listens for the proxy yet, it opens the listener once its threads run, told by
+// the port being taken, as a connection would count as an app refused
+static bool listening() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in proxy = {};
+  proxy.sin_family = AF_INET;
+  proxy.sin_port = htons(PROXY_PORT);
+  proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bool taken = bind(fd, (sockaddr *) &proxy, sizeof(proxy)) != 0 && errno == EADDRINUSE;
+  close(fd);
+  return taken;
+}
+
+// TCP of an app with the host behind the server over a wire as fast as the relay goes, through the
+// tun as packets and split, and through the local proxy with SOCKS5 and HTTP CONNECT, where no tun
+// packets nor inner TCP are in between. The CPU time is the one of the whole process, the wire, the
+// server and the host do the same work whichever way the app goes
+int main() {
+  if (!wire_start()) {
+    printf("Skipped, network namespaces are not available\n");
+    return HARNESS_SKIP;
+  }
+  check(server_host(), "no host behind the server");
+  u16 port = server_start(WIRE_SERVER);
+  const char *names[4] = {"Packets:", "Split:", "SOCKS5:", "HTTP:"};
+  for (int way = 0; way < 4; ++ way) {
+    check(Java_com_lyricz_a4over6vpn_VPNService_split(harness_env(), nullptr, (jboolean) (way == 1)), "split TCP not switched");
+    check(Java_com_lyricz_a4over6vpn_VPNService_proxy(harness_env(), nullptr, way >= 2 ? PROXY_PORT : 0), "proxy not switched");
+    host_via(way >= 2 ? PROXY_PORT : 0, way == 3);
+    Session session;
+    check(session_start(session, WIRE_SERVER, port, true), "session did not start");
+    check(way < 2 || wait_for(listening, 1000), "proxy not listening");
+    TcpLoad ping = host_ping(PING_ROUNDS);
+    u64 cpu = cpu_us();
+    TcpLoad upload = host_upload(TRANSFER_TIME), download = host_download(TRANSFER_TIME);
+    u64 megabytes = ((u64) upload.kbps + download.kbps) * TRANSFER_TIME / 8000000;
+    printf("%-9s connect %4d us, up %7d kbit/s, down %7d kbit/s, %d us CPU per MByte, round trips %d/%d us (median/p99)\n",
+      names[way], ping.connect_us, upload.kbps, download.kbps, (u32) ((cpu_us() - cpu) / (megabytes ? megabytes : 1)),
+      ping.rtt_median_us, ping.rtt_p99_us);
+    session_stop(session);
+  }
+  return 0;
+}
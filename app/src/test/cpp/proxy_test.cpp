@@ -0,0 +1,94 @@
+// Local proxy test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "proxy.h"
+
+// Native C++
+# include <arpa/inet.h>
+# include <cerrno>
+# include <cstring>
+# include <sys/socket.h>
+
+// Parameters
+# define PROXY_PORT                   1080
+# define TRANSFER_TIME                500   // ms of an upload and of a download
+# define PING_ROUNDS                  20
+# define CLOSE_TIMEOUT                2000  // ms for the streams of the session to close
+
+static int proxy_connect() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in proxy = {};
+  proxy.sin_family = AF_INET;
+  proxy.sin_port = htons(PROXY_PORT);
+  proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (sockaddr *) &proxy, sizeof(proxy)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Whether the backend listens yet, told by the port being taken, as a connection would count
+static bool listening() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in proxy = {};
+  proxy.sin_family = AF_INET;
+  proxy.sin_port = htons(PROXY_PORT);
+  proxy.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bool taken = bind(fd, (sockaddr *) &proxy, sizeof(proxy)) != 0 && errno == EADDRINUSE;
+  close(fd);
+  return taken;
+}
+
+// What the proxy does not take is answered and closed: an HTTP method other than CONNECT, and a
+// SOCKS5 greeting without "no authentication"
+static void refused() {
+  static const char http[] = "GET / HTTP/1.1\r\nHost: " SESSION_REMOTE "\r\n\r\n", socks[] = {5, 1, 2};
+  const char *requests[2] = {http, socks};
+  const u32 sizes[2] = {sizeof(http) - 1, sizeof(socks)};
+  for (int i = 0; i < 2; ++ i) {
+    int fd = proxy_connect();
+    char reply[512];
+    check(fd >= 0 && send(fd, requests[i], sizes[i], MSG_NOSIGNAL) == (ssize_t) sizes[i], "proxy not reached");
+    u32 length = 0;
+    for (ssize_t single; (single = recv(fd, reply + length, sizeof(reply) - 1 - length, 0)) > 0; ) {
+      length += (u32) single;
+    }
+    reply[length] = '\0';
+    check(i ? length == 2 && reply[1] == (char) 0xff : strncmp(reply, "HTTP/1.1 405", 12) == 0,
+      "%s request answered with %d bytes", i ? "SOCKS5" : "HTTP", length);
+    close(fd);
+  }
+  check(wait_for([] { return proxy_refused == 2; }, CLOSE_TIMEOUT), "%d of 2 apps refused", proxy_refused);
+}
+
+// Apps set up with the proxy reach the host with SOCKS5 and HTTP CONNECT, every byte in order both
+// ways, ends and resets go through, and their streams are gone after
+int main() {
+  if (!wire_start()) {
+    printf("Skipped, network namespaces are not available\n");
+    return HARNESS_SKIP;
+  }
+  check(server_host(), "no host behind the server");
+  u16 port = server_start(WIRE_SERVER);
+  check(Java_com_lyricz_a4over6vpn_VPNService_proxy(harness_env(), nullptr, PROXY_PORT), "proxy not switched on");
+  Session session;
+  check(session_start(session, WIRE_SERVER, port, true), "session did not start");
+  check(wait_for(listening, CLOSE_TIMEOUT), "proxy not listening");
+  refused();
+  for (int http = 0; http < 2; ++ http) {
+    host_via(PROXY_PORT, http);
+    u32 accepted = proxy_accepted, frames = server_frames(STREAM_OPEN);
+    TcpLoad ping = host_ping(PING_ROUNDS), upload = host_upload(TRANSFER_TIME), download = host_download(TRANSFER_TIME);
+    check(proxy_accepted - accepted == 3 && server_frames(STREAM_OPEN) - frames == 3, "%d apps accepted, %d streams reached the server",
+      proxy_accepted - accepted, server_frames(STREAM_OPEN) - frames);
+    check(wait_for([] { return proxy_active == 0; }, CLOSE_TIMEOUT), "%d streams left open", proxy_active);
+    printf("%s: connect %d us, round trips %d us (median), up %d kbit/s, down %d kbit/s\n", http ? "HTTP" : "SOCKS5",
+      ping.connect_us, ping.rtt_median_us, upload.kbps, download.kbps);
+  }
+  host_via(0, false);
+  session_stop(session);
+  return 0;
+}
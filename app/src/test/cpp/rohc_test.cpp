@@ -0,0 +1,112 @@
+// Header compression test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "packet.h"
+# include "rohc.h"
+
+// Native C++
+# include <cstring>
+
+// Parameters
+# define TRACE_PACKETS                4096
+# define LOST_PACKET                  (TRACE_PACKETS / 2 + 1)
+# define TIMESTAMP_OPTIONS            12
+# define SAVING_FLOOR                 5     // percent of the frame bytes the trace must save at least
+
+// The trace, the mix of a phone: an upload and a download (pure ACKs) with timestamps, a voice
+// call, and DNS queries each from a new port
+static u32 trace_packet(u32 i, u8 *packet) {
+  static const u8 phone[4] = {10, 0, 0, 2}, server[4] = {93, 184, 216, 34}, peer[4] = {198, 51, 100, 7}, dns[4] = {8, 8, 8, 8};
+  u32 kind = i % 8, length, header = IPV4_MIN_HEADER + TCP_MIN_HEADER + TIMESTAMP_OPTIONS;
+  memset(packet, 0, IPV4_MIN_HEADER + TCP_MIN_HEADER + TIMESTAMP_OPTIONS);
+  u8 *transport = packet + IPV4_MIN_HEADER;
+  packet[0] = 0x45;
+  packet[IPV4_TTL] = 64;
+  memcpy(packet + IPV4_SOURCE, phone, 4);
+  if (kind < 5 || kind == 6) {
+    bool upload = kind < 3;
+    u32 sent = i / 8 * 3 + (upload ? kind : (kind == 6 ? 2 : kind - 3));
+    length = upload ? 1400 : header;
+    packet[IPV4_PROTOCOL] = IPPROTO_TCP;
+    store16(packet + IPV4_FRAGMENT, 0x4000);
+    store16(packet + IPV4_ID, (u16) (sent + (upload ? 1000 : 5000)));
+    memcpy(packet + IPV4_DESTINATION, server, 4);
+    store16(transport, upload ? 40000 : 40001);
+    store16(transport + TRANSPORT_DESTINATION, 443);
+    store32(transport + TCP_SEQUENCE, upload ? 7000 + sent * (1400 - header) : 90000);
+    store32(transport + TCP_ACK_NUMBER, upload ? 30000 + i / 64 * 31 : 60000 + sent * 2896);
+    transport[TCP_OFFSET] = (TCP_MIN_HEADER + TIMESTAMP_OPTIONS) / 4 << 4;
+    transport[TCP_FLAGS] = TCP_ACK | (upload && kind == 2 ? 0x08 : 0);
+    store16(transport + TCP_WINDOW, upload ? 502 : 1024 + (sent / 16) % 4);
+    store16(transport + TCP_CHECKSUM, (u16) (i * 2654435761u >> 16));
+    u8 *options = transport + TCP_MIN_HEADER;
+    options[0] = options[1] = TCP_OPTION_NOP;
+    options[2] = TCP_OPTION_TIMESTAMP;
+    options[3] = 10;
+    store32(options + 4, 100000 + i / 4);
+    store32(options + 8, 700000 + i / 10);
+  } else {
+    bool voice = kind == 5;
+    length = voice ? IPV4_MIN_HEADER + UDP_HEADER + 172 : IPV4_MIN_HEADER + UDP_HEADER + 32;
+    packet[IPV4_PROTOCOL] = IPPROTO_UDP;
+    store16(packet + IPV4_ID, voice ? 0 : (u16) (i * 40503));
+    memcpy(packet + IPV4_DESTINATION, voice ? peer : dns, 4);
+    store16(transport, voice ? 5004 : (u16) (30000 + i));
+    store16(transport + TRANSPORT_DESTINATION, voice ? 5004 : DNS_PORT);
+    store16(transport + UDP_LENGTH, length - IPV4_MIN_HEADER);
+    store16(transport + UDP_CHECKSUM, (u16) (i * 40503 >> 3));
+  }
+  header = IPV4_MIN_HEADER + (packet[IPV4_PROTOCOL] == IPPROTO_TCP ? TCP_MIN_HEADER + TIMESTAMP_OPTIONS : UDP_HEADER);
+  for (u32 j = header; j < length; ++ j) {
+    packet[j] = (u8) (j * 7 + i);
+  }
+  store16(packet + IPV4_TOTAL_LENGTH, length);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+  return length;
+}
+
+// The trace goes through the sending side and comes back in through the receiving side, as if the
+// server reflected the frames, with one delta frame of the upload lost on the way: every other
+// packet must come out as it went in, and the lost context must be asked for exactly once
+int main() {
+  static Message frame, original;
+  check(rohc_configure(true) && rohc_enabled(), "header compression not switched on");
+  rohc_connection();
+  u64 headers = 0;
+  u32 lost = 0, resyncs = 0, dropped = 0;
+  for (u32 i = 0; i < TRACE_PACKETS; ++ i) {
+    u32 length = trace_packet(i, original.data);
+    original.length = frame.length = HEADER_LENGTH + length;
+    original.type = frame.type = NET_REQUEST;
+    memcpy(frame.data, original.data, length);
+    headers += IPV4_MIN_HEADER + (original.data[IPV4_PROTOCOL] == IPPROTO_TCP ? TCP_MIN_HEADER + TIMESTAMP_OPTIONS : UDP_HEADER);
+    Message *frames[1] = {&frame};
+    rohc_frames(frames, 1);
+    check(frame.type == HEADER_FULL || frame.type == HEADER_DELTA, "packet %d not compressed (type %d)", i, frame.type);
+    if (i == LOST_PACKET) {
+      lost = frame.type == HEADER_DELTA;
+      continue;
+    }
+    bool resync;
+    if (rohc_open(frame, resync)) {
+      check(frame.length == original.length && memcmp(frame.data, original.data, length) == 0, "trace differs at packet %d", i);
+    } else {
+      ++ dropped;
+      if (resync) {
+        rohc_resync(frame.data[0]);
+        ++ resyncs;
+      }
+    }
+  }
+  check(lost, "packet %d was not a delta frame", LOST_PACKET);
+  check(resyncs == 1 && rohc_resyncs_sent == 1 && rohc_resyncs_received == 1, "%d resyncs after one lost frame", resyncs);
+
+  u32 saving = (u32) ((rohc_up_in - rohc_up_out) * 100 / rohc_up_in);
+  printf("Trace of %d packets: %d%% of frame bytes saved, %d -> %d bytes per header, %d contexts, %d deltas, %d dropped after the loss\n",
+    TRACE_PACKETS, saving, (u32) (headers / TRACE_PACKETS), (u32) ((headers - (rohc_up_in - rohc_up_out)) / TRACE_PACKETS),
+    rohc_contexts_sent, rohc_deltas_sent, dropped);
+  check(saving >= SAVING_FLOOR, "only %d%% of frame bytes saved", saving);
+  return 0;
+}
@@ -0,0 +1,83 @@
+// Route table benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "route.h"
+
+// Native C++
+# include <vector>
+
+// Parameters
+# define BENCH_TIME                   200000 // us per address mix
+# define BENCH_ADDRESSES              65536 // addresses of a mix
+# define TABLE_PREFIXES               8000  // like a country list, mostly /12 to /24
+# define LONG_PREFIXES                500   // longer than /24
+
+static u64 state = 0x4f36526f75746573ull;
+
+static u64 split_mix() {
+  u64 z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+// Resident memory of the process (MBytes)
+static u32 resident_mb() {
+  long pages = 0, resident = 0;
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file) {
+    check(fscanf(file, "%ld %ld", &pages, &resident) == 2, "statm unreadable");
+    fclose(file);
+  }
+  return (u32) (resident * sysconf(_SC_PAGESIZE) / 1048576);
+}
+
+// Lookups per second through route_lookup, as the send thread does them, for uniformly random
+// addresses and for addresses within the prefixes, and the memory a table takes
+int main() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/route_bench.%d", (int) getpid());
+  std::vector<RoutePrefix> prefixes;
+  for (u32 i = 0; i < TABLE_PREFIXES + LONG_PREFIXES; ++ i) {
+    u64 random = split_mix();
+    u8 length = (u8) (i < TABLE_PREFIXES ? 12 + random % 13 : 25 + random % 8);
+    prefixes.push_back({(u32) (random >> 32) & (0xffffffffu << (32 - length)), length, (u8) (random % ROUTE_ACTIONS)});
+  }
+  route_file(path, prefixes.data(), (u32) prefixes.size());
+  u32 before = resident_mb();
+  check(route_load(path), "table refused");
+  printf("%d prefixes, %d split /24s, %d MBytes resident for the table\n", route_prefixes, route_groups, resident_mb() - before);
+
+  static u32 mixes[2][BENCH_ADDRESSES];
+  for (u32 i = 0; i < BENCH_ADDRESSES; ++ i) {
+    u64 random = split_mix();
+    const RoutePrefix &prefix = prefixes[(random >> 32) % prefixes.size()];
+    mixes[0][i] = (u32) random;
+    mixes[1][i] = prefix.address | ((u32) random & ~(0xffffffffu << (32 - prefix.length)));
+  }
+  for (int mix = 0; mix < 2; ++ mix) {
+    u64 start = now_us(), elapsed, lookups = 0;
+    u32 sink = 0;
+    do {
+      for (u32 i = 0; i < BENCH_ADDRESSES; ++ i) {
+        sink += route_lookup(mixes[mix][i]);
+      }
+      lookups += BENCH_ADDRESSES;
+      elapsed = now_us() - start;
+    } while (elapsed < BENCH_TIME);
+    printf("%s: %d M lookups/s (%d actions summed)\n", mix ? "Addresses in prefixes" : "Random addresses",
+      (u32) (lookups / elapsed), sink);
+  }
+
+  // A default route writes every entry of the /24 table
+  RoutePrefix everything = {0, 0, ROUTE_BYPASS};
+  route_file(path, &everything, 1);
+  before = resident_mb();
+  check(route_load(path), "default route refused");
+  printf("Default route: %d MBytes resident for the table\n", resident_mb() - before);
+  check(route_load(nullptr), "table not removed");
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,185 @@
+// Route table test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "packet.h"
+# include "route.h"
+
+// Native C++
+# include <arpa/inet.h>
+# include <cstring>
+# include <sys/socket.h>
+# include <vector>
+
+// Parameters
+# define TABLE_PREFIXES               4000
+# define CHECKED_ADDRESSES            200000 // lookups the table must agree with a plain scan on
+# define TUN_MTU                      1400
+# define REPLY_TIMEOUT                1000  // ms
+
+static u64 state = 0x4f36526f75746573ull;
+
+static u64 split_mix() {
+  u64 z = (state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static u32 mask(u32 length) {
+  return length ? 0xffffffffu << (32 - length) : 0;
+}
+
+// The action of the last of the longest prefixes that match, as a scan through the file finds it
+static u32 scan(const std::vector<RoutePrefix> &prefixes, u32 address) {
+  u32 action = ROUTE_TUNNEL;
+  int longest = -1;
+  for (const RoutePrefix &prefix: prefixes) {
+    if (prefix.length >= longest && ((prefix.address ^ address) & mask(prefix.length)) == 0) {
+      longest = prefix.length;
+      action = prefix.action;
+    }
+  }
+  return action;
+}
+
+// Prefixes of every length, many longer than /24 and some of those in the same /24, and repeated
+// prefixes with another action, where the last one counts
+static std::vector<RoutePrefix> random_table() {
+  std::vector<RoutePrefix> prefixes;
+  for (u32 i = 0; i < TABLE_PREFIXES; ++ i) {
+    u64 random = split_mix();
+    u8 length = (u8) (i % 3 == 0 ? 25 + random % 8 : random % 33), action = (u8) (random >> 8) % ROUTE_ACTIONS;
+    u32 address = (u32) (random >> 32);
+    if (i % 7 == 0 && !prefixes.empty()) {
+      address = (prefixes.back().address & 0xffffff00u) | (u32) (random & 0xff);
+    }
+    if (i % 11 == 0 && !prefixes.empty()) {
+      address = prefixes.back().address;
+      length = prefixes.back().length;
+    }
+    prefixes.push_back({address & mask(length), length, action});
+  }
+  return prefixes;
+}
+
+// Lookups give the action of the longest prefix, for random addresses and for the first, last and
+// random addresses of the prefixes
+static void agree(const std::vector<RoutePrefix> &prefixes) {
+  for (u32 i = 0; i < CHECKED_ADDRESSES; ++ i) {
+    u64 random = split_mix();
+    u32 address = (u32) random;
+    if (i % 2) {
+      const RoutePrefix &prefix = prefixes[(random >> 32) % prefixes.size()];
+      u32 host = i % 8 == 1 ? 0 : i % 8 == 3 ? ~0u : (u32) (random >> 16);
+      address = prefix.address | (host & ~mask(prefix.length));
+    }
+    u32 expected = scan(prefixes, address), got = route_lookup(address);
+    check(got == expected, "%08x looked up as %d, a scan gives %d", address, got, expected);
+  }
+}
+
+static void protect(int fd) {}
+
+// The bypass path relays a datagram to a local socket, and writes its replies to tun unless they
+// exceed the tun MTU
+static void bypass(const char *path) {
+  RoutePrefix loopback = {0x7f000000, 8, ROUTE_BYPASS};
+  route_file(path, &loopback, 1);
+  check(route_load(path), "loopback table refused");
+  int server = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0), tun[2];
+  sockaddr_in local = {};
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(local);
+  check(bind(server, (sockaddr *) &local, length) == 0 && getsockname(server, (sockaddr *) &local, &length) == 0, "no server socket");
+  socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, tun);
+  route_start(tun[0], TUN_MTU, protect);
+
+  static u8 packet[65536];
+  packet_udp(packet, 100, 1);
+  store32(packet + IPV4_DESTINATION, INADDR_LOOPBACK);
+  store16(packet + IPV4_CHECKSUM, 0);
+  store16(packet + IPV4_CHECKSUM, checksum(packet, IPV4_MIN_HEADER));
+  store16(packet + IPV4_MIN_HEADER + TRANSPORT_DESTINATION, ntohs(local.sin_port));
+  check(route_input(packet, 100) && route_bypass_up == 1, "datagram not bypassed");
+
+  // Replies that fit, that fit exactly, and one byte too many
+  sockaddr_in peer;
+  length = sizeof(peer);
+  check(recvfrom(server, packet, sizeof(packet), 0, (sockaddr *) &peer, &length) == 100 - IPV4_MIN_HEADER - UDP_HEADER,
+    "bypassed datagram not relayed");
+  const u32 sizes[3] = {100, TUN_MTU - IPV4_MIN_HEADER - UDP_HEADER + 1, TUN_MTU - IPV4_MIN_HEADER - UDP_HEADER};
+  for (u32 size: sizes) {
+    memset(packet, (u8) size, size);
+    sendto(server, packet, size, 0, (sockaddr *) &peer, length);
+  }
+  pollfd fds[ROUTE_BYPASS_SOCKETS];
+  u64 deadline = now_us() + REPLY_TIMEOUT * 1000ull;
+  while (route_bypass_down + route_bypass_oversized < 3 && now_us() < deadline) {
+    int count = route_poll(fds);
+    if (poll(fds, count, REPLY_TIMEOUT) > 0) {
+      route_serve(fds, count);
+    }
+  }
+  check(route_bypass_down == 2 && route_bypass_oversized == 1, "%d replies written, %d dropped as too big",
+    route_bypass_down, route_bypass_oversized);
+  for (u32 i = 0; i < 3; ++ i) {
+    if (sizes[i] + IPV4_MIN_HEADER + UDP_HEADER > TUN_MTU) {
+      continue;
+    }
+    ssize_t total = recv(tun[1], packet, sizeof(packet), MSG_DONTWAIT);
+    check(total == (ssize_t) (sizes[i] + IPV4_MIN_HEADER + UDP_HEADER) && load16(packet + IPV4_TOTAL_LENGTH) == total
+      && load32(packet + IPV4_SOURCE) == INADDR_LOOPBACK && load16(packet + IPV4_MIN_HEADER) == ntohs(local.sin_port),
+      "reply %d written as %d bytes", i, (int) total);
+  }
+  check(recv(tun[1], packet, sizeof(packet), MSG_DONTWAIT) < 0, "oversized reply written to tun");
+  printf("Bypass: %d datagram relayed, %d replies written, %d too big for an MTU of %d dropped\n", route_bypass_up,
+    route_bypass_down, route_bypass_oversized, TUN_MTU);
+  route_stop();
+  close(server);
+  close(tun[0]);
+  close(tun[1]);
+}
+
+int main() {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/route_test.%d", (int) getpid());
+  check(route_lookup(0x08080808) == ROUTE_TUNNEL && !route_enabled(), "action without a table");
+
+  // Two tables in turn, the second one built in the slot the first was not in
+  for (int round = 0; round < 2; ++ round) {
+    std::vector<RoutePrefix> prefixes = random_table();
+    route_file(path, prefixes.data(), (u32) prefixes.size());
+    check(route_load(path) && route_enabled() && route_prefixes == prefixes.size(), "table %d refused", round);
+    agree(prefixes);
+    printf("Table %d: %d prefixes, %d split /24s, agrees with a scan on %d addresses\n", round, route_prefixes,
+      route_groups, CHECKED_ADDRESSES);
+  }
+
+  // Malformed files and tables splitting too many /24s leave the installed table in place
+  u32 installed = route_prefixes;
+  RoutePrefix bad[2] = {{0x0a000000, 33, ROUTE_DROP}, {0x0a000000, 8, ROUTE_ACTIONS}};
+  for (const RoutePrefix &prefix: bad) {
+    route_file(path, &prefix, 1);
+    check(!route_load(path), "malformed prefix taken");
+  }
+  FILE *file = fopen(path, "wb");
+  fwrite("4o6R\0\0\0\2", 1, 8, file);
+  fclose(file);
+  check(!route_load(path), "truncated file taken");
+  check(!route_load("/nonexistent/routes"), "missing file taken");
+  std::vector<RoutePrefix> split;
+  for (u32 i = 0; i <= ROUTE_GROUPS; ++ i) {
+    split.push_back({0x0a000000 + (i << 8), 32, ROUTE_DROP});
+  }
+  route_file(path, split.data(), (u32) split.size());
+  check(!route_load(path), "%d split /24s taken", ROUTE_GROUPS + 1);
+  check(route_enabled() && route_prefixes == installed, "refused table replaced the installed one");
+
+  bypass(path);
+  check(route_load(nullptr) && !route_enabled() && route_lookup(0x7f000001) == ROUTE_TUNNEL, "table not removed");
+  unlink(path);
+  return 0;
+}
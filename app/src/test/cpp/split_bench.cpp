@@ -0,0 +1,50 @@
+// Split TCP benchmark of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+
+// Parameters
+# define LINK_RATE                    20000 // kbit/s each way
+# define TRANSFER_TIME                5000  // ms of an upload and of a download
+# define PING_ROUNDS                  50    // round trips of small messages
+# define SETTLE_TIME                  1000  // ms for what the last session left on the wire to drain
+
+// Round trip (ms) and loss (%) of the wire
+struct Path {
+  u32 rtt, loss;
+};
+
+static const Path paths[] = {{40, 0}, {40, 1}, {100, 5}};
+
+// TCP of an app with the host behind the server, over a paced wire with delay and loss, as inner
+// packets riding the tunnel connection and split at the client: with the inner TCP riding the
+// outer one, a loss costs both a retransmission and a back off, and the handshake costs a round trip.
+// Sessions start on a wire without loss, the loss is on while the app runs
+int main() {
+  if (!wire_start()) {
+    printf("Skipped, network namespaces are not available\n");
+    return HARNESS_SKIP;
+  }
+  check(server_host(), "no host behind the server");
+  u16 port = server_start(WIRE_SERVER);
+  wire_rate(LINK_RATE);
+  printf("Link of %d kbit/s each way\n", LINK_RATE);
+  for (const Path &path: paths) {
+    wire_delay(path.rtt / 2);
+    for (int split = 0; split < 2; ++ split) {
+      check(Java_com_lyricz_a4over6vpn_VPNService_split(harness_env(), nullptr, (jboolean) split), "split TCP not switched");
+      Session session;
+      check(session_start(session, WIRE_SERVER, port, true), "session did not start");
+      usleep(SETTLE_TIME * 1000);
+      wire_loss(path.loss);
+      TcpLoad ping = host_ping(PING_ROUNDS), upload = host_upload(TRANSFER_TIME), download = host_download(TRANSFER_TIME);
+      wire_loss(0);
+      printf("RTT %3d ms, %d%% loss, %-7s connect %6d us, up %5d kbit/s, down %5d kbit/s, round trips %d/%d us (median/p99)\n",
+        path.rtt, path.loss, split ? "split:" : "packet:", ping.connect_us, upload.kbps, download.kbps,
+        ping.rtt_median_us, ping.rtt_p99_us);
+      session_stop(session);
+    }
+  }
+  return 0;
+}
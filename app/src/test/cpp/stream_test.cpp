@@ -0,0 +1,42 @@
+// Split TCP test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "stream.h"
+
+// Parameters
+# define TRANSFER_TIME                500   // ms of an upload and of a download
+# define PING_ROUNDS                  20
+# define LOSS                         2     // % of the wire, the outer connection retransmits
+# define CLOSE_TIMEOUT                2000  // ms for the streams of the session to close
+
+// Connections of apps split at the client reach the host with every byte in order both ways, ends
+// and resets go through, and the split connections are gone after. The same with loss on the wire
+int main() {
+  if (!wire_start()) {
+    printf("Skipped, network namespaces are not available\n");
+    return HARNESS_SKIP;
+  }
+  check(server_host(), "no host behind the server");
+  u16 port = server_start(WIRE_SERVER);
+  check(Java_com_lyricz_a4over6vpn_VPNService_split(harness_env(), nullptr, true), "split TCP not switched on");
+  Session session;
+  check(session_start(session, WIRE_SERVER, port, true), "session did not start");
+  for (u32 loss = 0; loss <= LOSS; loss += LOSS) {
+    wire_loss(loss);
+    u32 opened = stream_opened, frames = server_frames(STREAM_OPEN);
+
+    // The upload ends with a FIN the host answers, the download with a reset of the app
+    TcpLoad ping = host_ping(PING_ROUNDS), upload = host_upload(TRANSFER_TIME), download = host_download(TRANSFER_TIME);
+    check(stream_opened - opened == 3 && server_frames(STREAM_OPEN) - frames == 3, "%d streams opened, %d reached the server",
+      stream_opened - opened, server_frames(STREAM_OPEN) - frames);
+    check(stream_passed == 0, "%d connections passed as packets", stream_passed);
+    check(wait_for([] { return stream_active == 0; }, CLOSE_TIMEOUT), "%d streams left open", stream_active);
+    printf("%d%% loss: connect %d us, round trips %d us (median), up %d kbit/s, down %d kbit/s, %d retransmitted to apps\n",
+      loss, ping.connect_us, ping.rtt_median_us, upload.kbps, download.kbps, stream_retransmitted);
+  }
+  wire_loss(0);
+  session_stop(session);
+  return 0;
+}
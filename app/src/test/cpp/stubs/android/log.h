@@ -0,0 +1,33 @@
+// Android log stub of 4over6 VPN client backend host tests
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+// Native C++
+# include <cstdarg>
+# include <cstdio>
+# include <cstdlib>
+
+enum {
+  ANDROID_LOG_DEBUG = 3,
+  ANDROID_LOG_INFO,
+  ANDROID_LOG_WARN,
+  ANDROID_LOG_ERROR
+};
+
+// Silent unless LOG is set in the environment, LOG=error for errors only
+static inline int __android_log_print(int level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+static inline int __android_log_print(int level, const char *tag, const char *format, ...) {
+  static const char *log = getenv("LOG");
+  if (log == nullptr || (log[0] == 'e' && level != ANDROID_LOG_ERROR)) {
+    return 0;
+  }
+  va_list args;
+  va_start(args, format);
+  fprintf(stderr, "[%s] ", tag);
+  vfprintf(stderr, format, args);
+  fprintf(stderr, "\n");
+  va_end(args);
+  return 0;
+}
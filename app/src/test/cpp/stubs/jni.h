@@ -0,0 +1,58 @@
+// JNI stub of 4over6 VPN client backend host tests
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+// Native C++
+# include <stdint.h>
+
+// The part of <jni.h> the backend uses, implemented by the harness without a Java VM: strings are
+// C strings and byte arrays are HarnessBytes
+typedef int32_t jint;
+typedef int64_t jlong;
+typedef uint8_t jboolean;
+typedef int8_t jbyte;
+typedef int32_t jsize;
+
+class _jobject {};
+class _jstring : public _jobject {};
+class _jclass : public _jobject {};
+class _jarray : public _jobject {};
+class _jbyteArray : public _jarray {};
+typedef _jobject* jobject;
+typedef _jstring* jstring;
+typedef _jclass* jclass;
+typedef _jbyteArray* jbyteArray;
+struct _jmethodID;
+typedef _jmethodID* jmethodID;
+
+# define JNIEXPORT __attribute__((visibility("default")))
+# define JNICALL
+# define JNI_OK 0
+# define JNI_ABORT 2
+# define JNI_VERSION_1_6 0x00010006
+
+struct JavaVM;
+
+struct JNIEnv {
+  jstring NewStringUTF(const char *bytes);
+  const char* GetStringUTFChars(jstring string, jboolean *copy);
+  void ReleaseStringUTFChars(jstring string, const char *chars);
+  jsize GetArrayLength(_jarray *array);
+  jbyte* GetByteArrayElements(jbyteArray array, jboolean *copy);
+  void ReleaseByteArrayElements(jbyteArray array, jbyte *elements, jint mode);
+  jint GetJavaVM(JavaVM **vm);
+  jobject NewGlobalRef(jobject object);
+  void DeleteGlobalRef(jobject object);
+  void DeleteLocalRef(jobject object);
+  jclass GetObjectClass(jobject object);
+  jmethodID GetMethodID(jclass cls, const char *name, const char *signature);
+  jboolean CallBooleanMethod(jobject object, jmethodID method, ...);
+};
+
+struct JavaVM {
+  jint AttachCurrentThread(JNIEnv **env, void *args);
+  jint DetachCurrentThread();
+  jint GetEnv(void **env, jint version);
+};
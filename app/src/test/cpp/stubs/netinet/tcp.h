@@ -0,0 +1,10 @@
+// <netinet/tcp.h> of 4over6 VPN client backend host tests
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# pragma once
+
+// Bionic takes the TCP options and tcp_info from the kernel headers, as the backend expects
+# include <sys/cdefs.h>
+# include <sys/types.h>
+# include <linux/tcp.h>
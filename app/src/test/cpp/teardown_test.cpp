@@ -0,0 +1,44 @@
+// Teardown test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+
+// Native C++
+# include <sys/socket.h>
+
+// Parameters
+# define SESSIONS                     20
+# define TEARDOWN_LIMIT               100   // ms from terminate() until backend() returns
+# define ECHO_PACKETS                 50
+# define ECHO_SIZE                    1200
+# define ECHO_TIMEOUT                 2000  // ms
+# define BACKLOG_PACKETS              200   // left unread by the app when stopping under load
+
+// Sessions start and stop in a loop: idle ones, where every thread sits in a blocking wait, and
+// loaded ones, with packets still going both ways. Every backend() must return within the limit,
+// however long the socket timeouts are
+int main() {
+  u16 port = server_start("127.0.0.1");
+  u64 slowest = 0, total = 0;
+  for (int i = 0; i < SESSIONS; ++ i) {
+    Session session;
+    check(session_start(session, "127.0.0.1", port), "session %d did not start", i);
+    check(session_echo(session, ECHO_PACKETS, ECHO_SIZE, ECHO_TIMEOUT) == ECHO_PACKETS, "session %d lost packets", i);
+    if (i % 2) {
+      static u8 packet[ECHO_SIZE];
+      for (int j = 0; j < BACKLOG_PACKETS; ++ j) {
+        packet_udp(packet, ECHO_SIZE, j);
+        send(session.app, packet, ECHO_SIZE, MSG_DONTWAIT);
+      }
+    } else {
+      usleep(50000);
+    }
+    u64 elapsed = session_stop(session);
+    slowest = elapsed > slowest ? elapsed : slowest;
+    total += elapsed;
+    check(elapsed < TEARDOWN_LIMIT * 1000, "session %d (%s) took %d us to stop", i, i % 2 ? "loaded" : "idle", (u32) elapsed);
+  }
+  printf("Teardown of %d sessions: %d us on average, %d us at most\n", SESSIONS, (u32) (total / SESSIONS), (u32) slowest);
+  return 0;
+}
@@ -0,0 +1,157 @@
+// Timer wheel test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "timer.h"
+
+// Native C++
+# include <atomic>
+# include <sys/eventfd.h>
+
+// Parameters
+# define SHORT_DELAY                  20    // ms, level 1
+# define MIDDLE_DELAY                 300   // ms, level 2 (64 ~ 4095 ticks away)
+# define LONG_DELAY                   4300  // ms, level 3 (4096 ~ 262143 ticks away), cascades through level 2
+# define BATCH                        8     // timers of the same deadline
+# define PERIODIC_ROUNDS              5
+# define LATE_LIMIT                   100   // ms a timer may fire late on a busy host
+# define FIRE_TIMEOUT                 (LONG_DELAY + 1000) // ms
+
+// What a timer saw when it fired
+struct Record {
+  int id;
+  u64 due_us, fired_us;
+  u32 rounds;
+};
+
+static std::atomic<int> fired_count;
+static int fired_order[4 * BATCH];
+
+static void record(Timer *timer) {
+  Record *record = (Record *) timer -> arg;
+  record -> fired_us = now_us();
+  fired_order[fired_count ++] = record -> id;
+}
+
+static std::atomic<u32> kicks;
+
+static void kick(Timer *timer) {
+  ++ kicks;
+}
+
+// The wheel clock only moves as timers fire, let one fire so the next timers are placed by their delay
+static void catch_up() {
+  static Timer timer;
+  timer = {};
+  timer.callback = kick;
+  u32 before = kicks;
+  timer_schedule(&timer, 0);
+  check(wait_for([before] { return kicks > before; }, FIRE_TIMEOUT), "timer due now did not fire");
+}
+
+static void periodic(Timer *timer) {
+  Record *record = (Record *) timer -> arg;
+  if (++ record -> rounds < PERIODIC_ROUNDS) {
+    timer_schedule(timer, SHORT_DELAY / 4);
+  }
+}
+
+static void prepare(Timer &timer, Record &record, int id, void (*callback)(Timer *)) {
+  timer = {};
+  timer.callback = callback;
+  timer.arg = &record;
+  record = {id, 0, 0, 0};
+}
+
+static void wait_fired(int count) {
+  check(wait_for([count] { return fired_count == count; }, FIRE_TIMEOUT), "%d of %d timers fired", (int) fired_count, count);
+}
+
+// Schedule, reschedule and cancel, and a callback rescheduling its own timer
+static void schedule_cancel() {
+  fired_count = 0;
+  static Timer timers[4];
+  static Record records[4];
+  for (int i = 0; i < 3; ++ i) {
+    prepare(timers[i], records[i], i, record);
+  }
+  prepare(timers[3], records[3], 3, periodic);
+  check(!timer_pending(&timers[0]), "timer pending before it was scheduled");
+  timer_cancel(&timers[0]);
+  timer_schedule(&timers[0], SHORT_DELAY);
+  timer_schedule(&timers[1], SHORT_DELAY);
+  timer_schedule(&timers[2], SHORT_DELAY);
+  records[2].due_us = now_us() + MIDDLE_DELAY * 1000ull;
+  timer_schedule(&timers[2], MIDDLE_DELAY);
+  timer_schedule(&timers[3], SHORT_DELAY / 4);
+  check(timer_pending(&timers[0]) && timer_pending(&timers[1]), "scheduled timers not pending");
+  timer_cancel(&timers[1]);
+  check(!timer_pending(&timers[1]), "cancelled timer pending");
+  wait_fired(1);
+  check(fired_order[0] == 0 && !timer_pending(&timers[0]), "scheduled timer did not fire alone");
+  wait_fired(2);
+  check(fired_order[1] == 2 && records[2].fired_us + 1000 > records[2].due_us,
+    "rescheduled timer fired at its first deadline");
+  check(wait_for([] { return records[3].rounds == PERIODIC_ROUNDS; }, FIRE_TIMEOUT), "periodic timer fired %d of %d rounds",
+    records[3].rounds, PERIODIC_ROUNDS);
+  usleep(2 * SHORT_DELAY * 1000);
+  check(fired_count == 2 && records[1].fired_us == 0 && !timer_pending(&timers[3]), "cancelled or finished timer fired");
+}
+
+// Batches of timers with one deadline each at levels 1, 2 and 3, those at level 3 cascading through
+// level 2 into level 1: each fires on time, not early, and a batch fires in the order it was scheduled
+static void cascade_order() {
+  fired_count = 0;
+  static Timer timers[3 * BATCH];
+  static Record records[3 * BATCH];
+  const u32 delays[3] = {SHORT_DELAY, MIDDLE_DELAY, LONG_DELAY};
+  for (int level = 0; level < 3; ++ level) {
+    // Scheduled until the batch shares its tick, should a millisecond pass amid it
+    Timer *batch = timers + level * BATCH;
+    bool shared = false;
+    while (!shared) {
+      catch_up();
+      for (int i = 0; i < BATCH; ++ i) {
+        prepare(batch[i], records[level * BATCH + i], level * BATCH + i, record);
+        records[level * BATCH + i].due_us = now_us() + delays[level] * 1000ull;
+        timer_schedule(&batch[i], delays[level]);
+      }
+      shared = batch[0].expires == batch[BATCH - 1].expires;
+      for (int i = 0; !shared && i < BATCH; ++ i) {
+        timer_cancel(&batch[i]);
+      }
+    }
+    check(batch[0].level == level + 1, "timer %d ms ahead at level %d, expected %d", delays[level], batch[0].level, level + 1);
+  }
+  wait_fired(3 * BATCH);
+  for (int i = 0; i < 3 * BATCH; ++ i) {
+    check(fired_order[i] == i, "timer %d fired as number %d", fired_order[i], i);
+    i64 late = (i64) records[i].fired_us - (i64) records[i].due_us;
+    check(late > -1000 && late < LATE_LIMIT * 1000, "timer %d fired %lld us off its deadline", i, (long long) late);
+  }
+}
+
+// The wheel with its thread as the backend runs them: scheduling and cancelling, cascading through
+// the levels in order, and the jitter statistics over what fired
+int main() {
+  int shutdown = eventfd(0, 0);
+  timer_init();
+  check(timer_fired == 0 && timer_jitter_max_us == 0 && timer_jitter_sum_us == 0, "statistics not reset");
+  pthread_t thread;
+  pthread_create(&thread, nullptr, timer_thread, &shutdown);
+  schedule_cancel();
+  cascade_order();
+
+  u32 fired = 2 + PERIODIC_ROUNDS + 3 * BATCH + kicks;
+  check(timer_fired == fired, "%d timers counted as fired, %d did", timer_fired, fired);
+  u64 mean = timer_jitter_sum_us / timer_fired;
+  check(mean <= timer_jitter_max_us && timer_jitter_max_us < LATE_LIMIT * 1000, "jitter %llu us mean, %d us max",
+    (unsigned long long) mean, timer_jitter_max_us);
+  printf("%d timers fired, jitter %llu us mean, %d us max\n", timer_fired, (unsigned long long) mean, timer_jitter_max_us);
+
+  u64 one = 1;
+  check(write(shutdown, &one, sizeof(one)) == sizeof(one), "no shutdown");
+  pthread_join(thread, nullptr);
+  return 0;
+}
@@ -0,0 +1,207 @@
+// TLS test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "crypto.h"
+# include "harness.h"
+# include "hash.h"
+# include "tls.h"
+# include "x25519.h"
+
+// Native C++
+# include <cerrno>
+# include <cstring>
+# include <poll.h>
+# include <sys/eventfd.h>
+
+// Networks
+# include <sys/socket.h>
+
+// Parameters
+# define PEER_TIMEOUT                 2000  // ms, to start and to answer
+# define CLIENT_BYTES                 (3 * TLS_RECORD_LENGTH + 100) // over records, the last one short
+# define SERVER_BYTES                 3000
+# define STALL_LIMIT                  (64 << 20) // bytes sent with MSG_DONTWAIT at most before EAGAIN
+# define STALL_CALL                   500   // ms a call with MSG_DONTWAIT may take at most
+# define STALL_BUFFER                 (TLS_RECORD_LENGTH / 3) // send buffer, records are cut short in it
+
+// Known answers: FIPS 180-2 "abc" for both hashes, RFC 5869 A.1 and RFC 7748 6.1
+static bool known_answers() {
+  static const u8 sha256_abc[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+  static const u8 sha384_abc[48] = {
+    0xcb, 0x00, 0x75, 0x3f, 0x45, 0xa3, 0x5e, 0x8b, 0xb5, 0xa0, 0x3d, 0x69, 0x9a, 0xc6, 0x50, 0x07,
+    0x27, 0x2c, 0x32, 0xab, 0x0e, 0xde, 0xd1, 0x63, 0x1a, 0x8b, 0x60, 0x5a, 0x43, 0xff, 0x5b, 0xed,
+    0x80, 0x86, 0x07, 0x2b, 0xa1, 0xe7, 0xcc, 0x23, 0x58, 0xba, 0xec, 0xa1, 0x34, 0xc8, 0x25, 0xa7};
+  static const u8 okm[42] = {
+    0x3c, 0xb2, 0x5f, 0x25, 0xfa, 0xac, 0xd5, 0x7a, 0x90, 0x43, 0x4f, 0x64, 0xd0, 0x36, 0x2f, 0x2a,
+    0x2d, 0x2d, 0x0a, 0x90, 0xcf, 0x1a, 0x5a, 0x4c, 0x5d, 0xb0, 0x2d, 0x56, 0xec, 0xc4, 0xc5, 0xbf,
+    0x34, 0x00, 0x72, 0x08, 0xd5, 0xb8, 0x87, 0x18, 0x58, 0x65};
+  static const u8 alice[32] = {
+    0x77, 0x07, 0x6d, 0x0a, 0x73, 0x18, 0xa5, 0x7d, 0x3c, 0x16, 0xc1, 0x72, 0x51, 0xb2, 0x66, 0x45,
+    0xdf, 0x4c, 0x2f, 0x87, 0xeb, 0xc0, 0x99, 0x2a, 0xb1, 0x77, 0xfb, 0xa5, 0x1d, 0xb9, 0x2c, 0x2a};
+  static const u8 bob_public[32] = {
+    0xde, 0x9e, 0xdb, 0x7d, 0x7b, 0x7d, 0xc1, 0xb4, 0xd3, 0x5b, 0x61, 0xc2, 0xec, 0xe4, 0x35, 0x37,
+    0x3f, 0x83, 0x43, 0xc8, 0x5b, 0x78, 0x67, 0x4d, 0xad, 0xfc, 0x7e, 0x14, 0x6f, 0x88, 0x2b, 0x4f};
+  static const u8 shared[32] = {
+    0x4a, 0x5d, 0x9d, 0x5b, 0xa4, 0xce, 0x2d, 0xe1, 0x72, 0x8e, 0x3b, 0xf4, 0x80, 0x35, 0x0f, 0x25,
+    0xe0, 0x7e, 0x21, 0xc9, 0x47, 0xd1, 0x9e, 0x33, 0x76, 0xf0, 0x9b, 0x3c, 0x1e, 0x16, 0x17, 0x42};
+
+  u8 digest[HASH_MAX_LENGTH], ikm[22], salt[13], info[10], prk[32], computed[42];
+  hash_digest(HASH_SHA256, (const u8 *) "abc", 3, digest);
+  bool passed = memcmp(digest, sha256_abc, 32) == 0;
+  hash_digest(HASH_SHA384, (const u8 *) "abc", 3, digest);
+  passed = passed && memcmp(digest, sha384_abc, 48) == 0;
+  memset(ikm, 0x0b, sizeof(ikm));
+  for (int i = 0; i < 13; ++ i) {
+    salt[i] = i;
+  }
+  for (int i = 0; i < 10; ++ i) {
+    info[i] = 0xf0 + i;
+  }
+  hkdf_extract(HASH_SHA256, salt, sizeof(salt), ikm, sizeof(ikm), prk);
+  hkdf_expand(HASH_SHA256, prk, info, sizeof(info), computed, sizeof(computed));
+  passed = passed && memcmp(computed, okm, sizeof(okm)) == 0;
+  x25519(computed, alice, bob_public);
+  return passed && memcmp(computed, shared, 32) == 0;
+}
+
+// Byte 'offset' of what either end sends, never a command letter of s_server
+static u8 pattern(u64 offset) {
+  return (u8) (0x80 + offset % 127);
+}
+
+static void fill(u8 *data, u32 length, u64 offset) {
+  for (u32 i = 0; i < length; ++ i) {
+    data[i] = pattern(offset + i);
+  }
+}
+
+// Read what the client sent from the server's output, checking it from 'offset', returns the bytes read
+static u32 peer_read(TlsPeer &peer, u64 offset, u32 timeout) {
+  static u8 buffer[65536];
+  pollfd readable = {peer.output, POLLIN, 0};
+  if (poll(&readable, 1, timeout) != 1) {
+    return 0;
+  }
+  ssize_t length = read(peer.output, buffer, sizeof(buffer));
+  check(length > 0, "openssl s_server is gone");
+  for (ssize_t i = 0; i < length; ++ i) {
+    check(buffer[i] == pattern(offset + i), "byte %llu mangled on the way to the server", (unsigned long long) (offset + i));
+  }
+  return (u32) length;
+}
+
+static void client_to_server(TlsPeer &peer, int fd) {
+  static u8 data[CLIENT_BYTES];
+  fill(data, CLIENT_BYTES, 0);
+  for (u32 sent = 0; sent < CLIENT_BYTES; ) {
+    int single = tls_send(fd, data + sent, CLIENT_BYTES - sent, MSG_NOSIGNAL);
+    check(single > 0, "send failed (%s)", strerror(errno));
+    sent += single;
+  }
+  u32 received = 0, single = 0;
+  while (received < CLIENT_BYTES && (single = peer_read(peer, received, PEER_TIMEOUT))) {
+    received += single;
+  }
+  check(received == CLIENT_BYTES, "server got %d of %d bytes", received, CLIENT_BYTES);
+}
+
+static void server_to_client(TlsPeer &peer, int fd) {
+  static u8 data[SERVER_BYTES], buffer[SERVER_BYTES];
+  fill(data, SERVER_BYTES, 0);
+  check(write(peer.input, data, SERVER_BYTES) == SERVER_BYTES, "openssl s_server is gone");
+  u32 received = 0;
+  for (u64 deadline = now_us() + PEER_TIMEOUT * 1000ull; received < SERVER_BYTES && now_us() < deadline; ) {
+    pollfd readable = {fd, POLLIN, 0};
+    if (!tls_pending(fd) && poll(&readable, 1, PEER_TIMEOUT) != 1) {
+      break;
+    }
+    int single = tls_recv(fd, buffer + received, SERVER_BYTES - received);
+    check(single > 0 || (single < 0 && errno == EAGAIN), "receive failed (%s)", single ? strerror(errno) : "closed");
+    received += single > 0 ? single : 0;
+  }
+  check(received == SERVER_BYTES && memcmp(buffer, data, SERVER_BYTES) == 0, "client got %d of %d bytes intact", received, SERVER_BYTES);
+}
+
+// With the server not reading, sends with MSG_DONTWAIT fail with EAGAIN at once instead of waiting,
+// and once it reads again, what they took (with the rest of a record cut short) arrives whole
+static void stalled(TlsPeer &peer, int fd) {
+  static u8 chunk[TLS_SEND_RECORDS * TLS_RECORD_LENGTH];
+  int buffer = STALL_BUFFER;
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+  u64 sent = 0, slowest = 0;
+  u32 again = 0;
+  bool cut = false, writable = true;
+  while (writable && sent < STALL_LIMIT) {
+    fill(chunk, sizeof(chunk), sent);
+    u64 start = now_us();
+    int single = tls_send(fd, chunk, sizeof(chunk), MSG_NOSIGNAL | MSG_DONTWAIT);
+    slowest = now_us() - start > slowest ? now_us() - start : slowest;
+    check(single > 0 || errno == EAGAIN, "send failed (%s)", strerror(errno));
+    sent += single > 0 ? single : 0;
+    cut = cut || tls_unsent(fd);
+    if (single < 0) {
+      ++ again;
+      pollfd output = {fd, POLLOUT, 0};
+      writable = poll(&output, 1, STALL_CALL) == 1;
+    }
+  }
+  check(!writable, "socket still writable after %llu bytes to a stalled server", (unsigned long long) sent);
+  check(cut || strcmp(tls_mode(fd), "user space") != 0, "no record cut short by the send buffer of %d bytes", STALL_BUFFER);
+  check(slowest < STALL_CALL * 1000ull, "a send with MSG_DONTWAIT took %llu ms", (unsigned long long) slowest / 1000);
+
+  u64 received = 0;
+  for (u64 deadline = now_us() + 10 * PEER_TIMEOUT * 1000ull; received < sent && now_us() < deadline; ) {
+    received += peer_read(peer, received, 1);
+    msghdr flush = {};
+    check(tls_sendmsg(fd, &flush, MSG_NOSIGNAL | MSG_DONTWAIT) >= 0 || errno == EAGAIN, "flush failed (%s)", strerror(errno));
+  }
+  check(received == sent && !tls_unsent(fd), "server got %llu of %llu bytes after the stall", (unsigned long long) received,
+    (unsigned long long) sent);
+  printf("Stall: %llu bytes taken, %d EAGAIN, slowest send %llu us, %s\n", (unsigned long long) sent, again,
+    (unsigned long long) slowest, cut ? "records cut short sent later" : "no record cut short");
+}
+
+// Full handshake, data both ways, a stall, then a second connection resuming with a ticket of the first
+static void against_openssl(TlsPeer &peer, const u8 *key) {
+  check(tls_configure(key, TLS_KEY_LENGTH, CRYPTO_CHACHA), "key refused");
+  int cancel = eventfd(0, 0);
+  int fd = peer_connect(peer, PEER_TIMEOUT);
+  check(tls_handshake(fd, cancel), "handshake with openssl s_server failed");
+  check(tls_handshakes == 1 && tls_resumed == 0, "first handshake counted as resumed");
+  client_to_server(peer, fd);
+  server_to_client(peer, fd);
+  check(tls_tickets > 0, "no ticket taken from openssl s_server");
+  printf("Handshake: %s, records sealed in %s, %d tickets\n", tls_suite(), tls_mode(fd), tls_tickets);
+  stalled(peer, fd);
+  close(fd);
+
+  fd = peer_connect(peer, PEER_TIMEOUT);
+  check(tls_handshake(fd, cancel), "resuming handshake with openssl s_server failed");
+  check(tls_handshakes == 2 && tls_resumed == 1, "second handshake not resumed");
+  client_to_server(peer, fd);
+  server_to_client(peer, fd);
+  printf("Resumption: %d of %d handshakes resumed\n", tls_resumed, tls_handshakes);
+  close(fd);
+  close(cancel);
+  tls_configure(nullptr, 0, CRYPTO_CHACHA);
+}
+
+// The primitives of the handshake and key schedule against their known answers, then the handshake,
+// resumption and record layer against openssl s_server (skipped without openssl)
+int main() {
+  check(known_answers(), "TLS key schedule known answers failed");
+  u8 key[TLS_KEY_LENGTH];
+  for (int i = 0; i < TLS_KEY_LENGTH; ++ i) {
+    key[i] = i;
+  }
+  TlsPeer peer;
+  if (!peer_start(peer, key, 2)) {
+    return HARNESS_SKIP;
+  }
+  against_openssl(peer, key);
+  peer_stop(peer);
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Writer test of 4over6 VPN client backend
+// 2020 Network Training, Tsinghua University
+// Chenggang Zhao & Yuxian Gu
+
+# include "harness.h"
+# include "packet.h"
+# include "queue.h"
+# include "shaper.h"
+# include "writer.h"
+
+// Native C++
+# include <atomic>
+# include <cstring>
+# include <sys/eventfd.h>
+# include <sys/socket.h>
+
+// Parameters
+# define DATA_FRAMES                  20000
+# define CONTROL_EVERY                37    // data frames per control frame
+# define SWITCH_AT                    8000  // data frames before the writer moves to a second connection
+# define SEND_BUFFER                  1     // bytes asked for SO_SNDBUF, the kernel takes its minimum
+# define READ_CHUNK                   997   // bytes, at most per read of the server
+# define DRAIN_TIMEOUT                20000 // ms
+
+// Stand-in server side, reads the first connection until it ends and then the second one, in small
+// reads with pauses so the writer keeps finding the socket full, and checks every frame it gets
+static int server_fds[2] = {-1, -1};
+static std::atomic<int> second_fd(-1);
+static std::atomic<u32> data_received, controls_received, partial_ends;
+static u32 data_last, control_next;
+static bool data_seen;
+
+static u32 frame_size(u32 sequence) {
+  return PACKET_SMALL_LENGTH + 1 + sequence * 7919 % (DATA_MAX_LENGTH - DATA_RESERVE - PACKET_SMALL_LENGTH);
+}
+
+// A complete frame: data frames are intact and in order (CoDel may drop some), control frames
+// all arrive and in order
+static void take(const Message &frame, int connection) {
+  if (frame.type == HEARTBEAT) {
+    check(frame.length == HEADER_LENGTH + 4, "control frame of %d bytes", frame.length);
+    check(load32(frame.data) == control_next, "control frame %d, expected %d (connection %d)", load32(frame.data), control_next, connection);
+    ++ control_next;
+    ++ controls_received;
+    return;
+  }
+  check(frame.type == NET_REQUEST, "frame of type %d on connection %d", frame.type, connection);
+  const u8 *packet = frame.data, *udp = packet + IPV4_MIN_HEADER;
+  u32 length = frame.length - HEADER_LENGTH, sequence = load32(udp + UDP_HEADER);
+  check(length == frame_size(sequence) && load16(packet + IPV4_TOTAL_LENGTH) == length, "frame %d torn (%d bytes)", sequence, length);
+  for (u32 i = UDP_HEADER + 4; i + IPV4_MIN_HEADER < length; ++ i) {
+    check(udp[i] == (u8) (sequence + i), "frame %d corrupted at byte %d", sequence, i);
+  }
+  check(!data_seen || sequence > data_last, "frame %d after frame %d", sequence, data_last);
+  data_seen = true;
+  data_last = sequence;
+  ++ data_received;
+}
+
+static void* server_thread(void *_) {
+  static u8 stream[sizeof(Message) * 2];
+  for (int connection = 0; connection < 2; ++ connection) {
+    while (connection == 1 && second_fd == -1) {
+      usleep(1000);
+    }
+    int fd = connection == 0 ? server_fds[1] : second_fd.load();
+    u32 buffered = 0;
+    for (u32 reads = 0; ; ++ reads) {
+      ssize_t single = recv(fd, stream + buffered, 1 + reads * 131 % READ_CHUNK, 0);
+      if (single <= 0) {
+        break;
+      }
+      buffered += single;
+      u32 offset = 0;
+      while (buffered - offset >= sizeof(u32)) {
+        const Message &frame = *(const Message *) (stream + offset);
+        check(frame.length >= HEADER_LENGTH && frame.length <= sizeof(Message), "bad frame length %d on connection %d", frame.length, connection);
+        if (buffered - offset < frame.length) {
+          break;
+        }
+        take(frame, connection);
+        offset += frame.length;
+      }
+      memmove(stream, stream + offset, buffered - offset);
+      buffered -= offset;
+      if (reads % 16 == 0) {
+        usleep(100);
+      }
+    }
+    // The frame cut by the move is restarted on the next connection, only the last may end early
+    check(connection == 0 || buffered == 0, "second connection ends with %d bytes of a frame", buffered);
+    partial_ends += buffered != 0;
+  }
+  return nullptr;
+}
+
+int main() {
+  int shutdown_fd = eventfd(0, EFD_CLOEXEC), source = eventfd(0, EFD_CLOEXEC);
+  socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, server_fds);
+  int size = SEND_BUFFER;
+  setsockopt(server_fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(int));
+  shaper_init();
+  writer_init(shutdown_fd, source);
+  writer_attach(server_fds[0]);
+  pthread_t writer, server;
+  pthread_create(&writer, nullptr, writer_thread, nullptr);
+  pthread_create(&server, nullptr, server_thread, nullptr);
+
+  // Producer, as send_thread, with control frames from the same thread in between
+  int next_fds[2];
+  u32 controls = 0;
+  for (u32 sequence = 0; sequence < DATA_FRAMES; ++ sequence) {
+    if (sequence == SWITCH_AT) {
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, next_fds);
+      setsockopt(next_fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(int));
+      writer_attach(next_fds[0]);
+      shutdown(server_fds[0], SHUT_WR);
+      second_fd = next_fds[1];
+    }
+    Message *message = writer_reserve();
+    u32 length = frame_size(sequence);
+    packet_udp(message -> data, length, sequence);
+    message -> type = NET_REQUEST;
+    message -> length = HEADER_LENGTH + length;
+    writer_commit(message);
+    if (sequence % CONTROL_EVERY == 0) {
+      Message control = {HEADER_LENGTH + 4, HEARTBEAT};
+      store32(control.data, controls);
+      while (!writer_control(control)) {
+        usleep(100);
+      }
+      ++ controls;
+    }
+  }
+
+  check(wait_for([=] { return data_received + queue_drops + queue_overflows == DATA_FRAMES && controls_received == controls; }, DRAIN_TIMEOUT),
+    "%d data frames received, %d dropped, %d overflowed of %d, %d of %d control frames", data_received.load(),
+    queue_drops, queue_overflows, DATA_FRAMES, controls_received.load(), controls);
+  printf("%d data frames received (%d dropped by CoDel, %d overflowed), %d control frames, %d partial writes, %d frames cut by the move\n",
+    data_received.load(), queue_drops, queue_overflows, controls_received.load(), writer_partial, partial_ends.load());
+  check(writer_partial > 0, "no partial write happened");
+
+  eventfd_write(shutdown_fd, 1);
+  pthread_join(writer, nullptr);
+  shutdown(next_fds[0], SHUT_WR);
+  pthread_join(server, nullptr);
+  return 0;
+}